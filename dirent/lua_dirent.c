@@ -1,18 +1,35 @@
 /*
- * Copyright (c) 2025 Ryan Moeller
+ * Copyright (c) 2025-2026 Ryan Moeller
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sys/param.h>
+#include <sys/acl.h>
+#include <sys/extattr.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "sys/stat/lua_stat.h"
 #include "utils.h"
 
 #define DIR_METATABLE "DIR"
+#define SCANNER_METATABLE "dirent.scanner"
+#define WALKER_METATABLE "dirent.walker"
+#define WALKER_BATCH_METATABLE "dirent.walker batch"
 
 int luaopen_dirent(lua_State *);
 
@@ -162,9 +179,918 @@ l_dttoif(lua_State *L)
 	return (1);
 }
 
+/*
+ * Bulk scanner: reads with large getdirentries(2) buffers and hands entries
+ * back in batches of parallel arrays, filtering in C.
+ */
+
+struct scanner {
+	int fd;
+	char *buf;
+	size_t bufsize;
+	size_t len;
+	size_t pos;
+	off_t base;
+	char *glob;
+	int fnmflags;
+	unsigned types;		/* bitmask of 1 << DT_*, or 0 for all */
+	bool dots;
+	bool eof;
+};
+
+static void
+scanner_free(struct scanner *sc)
+{
+	if (sc->fd != -1) {
+		close(sc->fd);
+	}
+	free(sc->buf);
+	free(sc->glob);
+	free(sc);
+}
+
+static inline bool
+scanner_match(struct scanner *sc, struct dirent *ent)
+{
+	if (ent->d_fileno == 0) {
+		return (false);
+	}
+	if (!sc->dots && ent->d_name[0] == '.' && (ent->d_namlen == 1 ||
+	    (ent->d_namlen == 2 && ent->d_name[1] == '.'))) {
+		return (false);
+	}
+	if (sc->types != 0) {
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat sb;
+
+			if (fstatat(sc->fd, ent->d_name, &sb,
+			    AT_SYMLINK_NOFOLLOW) == 0) {
+				ent->d_type = IFTODT(sb.st_mode);
+			}
+		}
+		if ((sc->types & (1u << ent->d_type)) == 0) {
+			return (false);
+		}
+	}
+	if (sc->glob != NULL &&
+	    fnmatch(sc->glob, ent->d_name, sc->fnmflags) != 0) {
+		return (false);
+	}
+	return (true);
+}
+
+static int
+l_scanner(lua_State *L)
+{
+	struct scanner *sc;
+	const char *glob;
+	lua_Integer bufsize;
+	unsigned types;
+	int fd, fnmflags;
+	bool dots;
+
+	if (!lua_isinteger(L, 1)) {
+		luaL_checkstring(L, 1);
+	}
+	bufsize = 256 * 1024;
+	glob = NULL;
+	fnmflags = 0;
+	types = 0;
+	dots = true;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "bufsize") != LUA_TNIL) {
+			bufsize = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "glob") != LUA_TNIL) {
+			glob = luaL_checkstring(L, -1);
+		}
+		if (lua_getfield(L, 2, "fnmflags") != LUA_TNIL) {
+			fnmflags = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "dots") != LUA_TNIL) {
+			dots = lua_toboolean(L, -1);
+		}
+		if (lua_getfield(L, 2, "types") != LUA_TNIL) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			for (lua_Integer i = 1;
+			    lua_rawgeti(L, -1, i) != LUA_TNIL; i++) {
+				lua_Integer dt = luaL_checkinteger(L, -1);
+
+				luaL_argcheck(L, dt >= 0 && dt < 32, 2,
+				    "invalid type");
+				types |= 1u << dt;
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	/* getdirentries(2) needs at least a block-sized buffer */
+	bufsize = MAX(bufsize, DEV_BSIZE);
+
+	if (lua_isinteger(L, 1)) {
+		fd = openat(lua_tointeger(L, 1), ".",
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		fd = open(lua_tostring(L, 1),
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (fd == -1) {
+		return (fail(L, errno));
+	}
+	if ((sc = calloc(1, sizeof(*sc))) == NULL) {
+		close(fd);
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	sc->fd = fd;
+	sc->bufsize = roundup2(bufsize, DEV_BSIZE);
+	sc->fnmflags = fnmflags;
+	sc->types = types;
+	sc->dots = dots;
+	if ((sc->buf = malloc(sc->bufsize)) == NULL ||
+	    (glob != NULL && (sc->glob = strdup(glob)) == NULL)) {
+		scanner_free(sc);
+		return (fatal(L, "malloc", ENOMEM));
+	}
+	return (new(L, sc, SCANNER_METATABLE));
+}
+
+static int
+l_scanner_close(lua_State *L)
+{
+	struct scanner *sc;
+
+	sc = checkcookie(L, 1, SCANNER_METATABLE);
+
+	scanner_free(sc);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
+static int
+l_scanner_gc(lua_State *L)
+{
+	struct scanner *sc;
+
+	sc = checkcookienull(L, 1, SCANNER_METATABLE);
+
+	if (sc != NULL) {
+		scanner_free(sc);
+	}
+	return (0);
+}
+
+static inline void
+opttable(lua_State *L, int idx)
+{
+	if (lua_isnoneornil(L, idx)) {
+		lua_newtable(L);
+		lua_replace(L, idx);
+	} else {
+		luaL_checktype(L, idx, LUA_TTABLE);
+	}
+}
+
+static int
+l_scanner_next(lua_State *L)
+{
+	struct scanner *sc;
+	struct dirent *ent;
+	lua_Integer max, n, len;
+	ssize_t nread;
+	int error;
+
+	sc = checkcookie(L, 1, SCANNER_METATABLE);
+	max = luaL_optinteger(L, 2, 4096);
+	luaL_argcheck(L, max > 0, 2, "invalid max");
+	lua_settop(L, 5);
+	opttable(L, 3);
+	opttable(L, 4);
+	opttable(L, 5);
+
+	error = 0;
+	for (n = 0; n < max;) {
+		if (sc->pos >= sc->len) {
+			if (sc->eof) {
+				break;
+			}
+			if ((nread = getdirentries(sc->fd, sc->buf,
+			    sc->bufsize, &sc->base)) == -1) {
+				error = errno;
+				break;
+			}
+			if (nread == 0) {
+				sc->eof = true;
+				break;
+			}
+			sc->len = nread;
+			sc->pos = 0;
+		}
+		ent = (struct dirent *)(sc->buf + sc->pos);
+		sc->pos += ent->d_reclen;
+		if (!scanner_match(sc, ent)) {
+			continue;
+		}
+		n++;
+		lua_pushlstring(L, ent->d_name, ent->d_namlen);
+		lua_rawseti(L, 3, n);
+		lua_pushinteger(L, ent->d_type);
+		lua_rawseti(L, 4, n);
+		lua_pushinteger(L, ent->d_fileno);
+		lua_rawseti(L, 5, n);
+	}
+	/* trim leftovers when the caller passed in tables to reuse */
+	for (int t = 3; t <= 5; t++) {
+		len = lua_rawlen(L, t);
+		for (lua_Integer i = len; i > n; i--) {
+			lua_pushnil(L);
+			lua_rawseti(L, t, i);
+		}
+	}
+	if (error != 0 && n == 0) {
+		return (fail(L, error));
+	}
+	lua_pushinteger(L, n);
+	lua_insert(L, 3);
+	if (error != 0) {
+		/* Keep what was read, followed by the error. */
+		fail(L, error);
+		lua_remove(L, -3);
+		return (6);
+	}
+	return (4);
+}
+
+static int
+l_scanner_rewind(lua_State *L)
+{
+	struct scanner *sc;
+
+	sc = checkcookie(L, 1, SCANNER_METATABLE);
+
+	if (lseek(sc->fd, 0, SEEK_SET) == -1) {
+		return (fail(L, errno));
+	}
+	sc->len = sc->pos = 0;
+	sc->base = 0;
+	sc->eof = false;
+	return (success(L));
+}
+
+static int
+l_scanner_fd(lua_State *L)
+{
+	struct scanner *sc;
+
+	sc = checkcookie(L, 1, SCANNER_METATABLE);
+
+	lua_pushinteger(L, sc->fd);
+	return (1);
+}
+
+/*
+ * Parallel tree walker: a pool of threads pulls directories off a shared
+ * queue, opens them with openat(2) relative to the root, reads them with
+ * fdopendir(3), optionally collects stat, extattr and ACL data, and queues
+ * subdirectories and results.  Lua drains the results in batches.
+ */
+
+#define WALK_FLUSH 64
+
+struct wentry;
+
+struct wdir {
+	STAILQ_ENTRY(wdir) link;
+	char *path;		/* relative to the root */
+	int depth;
+	struct wentry *entry;	/* reported when read, NULL for the root */
+};
+
+struct wentry {
+	STAILQ_ENTRY(wentry) link;
+	char *path;		/* relative to the root */
+	int depth;
+	int type;
+	int error;
+	bool hasstat;
+	struct stat sb;
+	char *xattrs;
+	ssize_t xattrlen;
+	char *acl;
+};
+
+STAILQ_HEAD(wentries, wentry);
+
+struct walker {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t results;
+	pthread_cond_t space;
+	STAILQ_HEAD(, wdir) dirs;
+	struct wentries entries;
+	size_t nentries;
+	size_t maxentries;
+	int busy;		/* directories queued or being read */
+	atomic_bool cancel;
+	int rootfd;
+	char *root;
+	dev_t rootdev;
+	int maxdepth;
+	char **exclude;
+	int nexclude;
+	bool xdev;
+	bool wantstat;
+	int xattrns;		/* -1 for none */
+	int acltype;		/* -1 for none */
+	int error;		/* first failure no entry could carry */
+	int nthreads;
+	pthread_t threads[];
+};
+
+static void
+wentry_free(struct wentry *e)
+{
+	free(e->path);
+	free(e->xattrs);
+	if (e->acl != NULL) {
+		acl_free(e->acl);
+	}
+	free(e);
+}
+
+static bool
+walker_excluded(struct walker *w, const char *name)
+{
+	for (int i = 0; i < w->nexclude; i++) {
+		if (fnmatch(w->exclude[i], name, 0) == 0) {
+			return (true);
+		}
+	}
+	return (false);
+}
+
+static void
+walker_flush(struct walker *w, struct wentries *batch, size_t *n)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->nentries >= w->maxentries && !atomic_load(&w->cancel)) {
+		pthread_cond_wait(&w->space, &w->lock);
+	}
+	STAILQ_CONCAT(&w->entries, batch);
+	w->nentries += *n;
+	pthread_cond_signal(&w->results);
+	pthread_mutex_unlock(&w->lock);
+	*n = 0;
+}
+
+/*
+ * Queue a directory to be read.  Its entry is held back and reported by the
+ * worker that reads it, so a directory that can't be opened is reported once,
+ * with the error.
+ */
+static bool
+walker_push(struct walker *w, const char *path, int depth, struct wentry *e)
+{
+	struct wdir *d;
+
+	if ((d = malloc(sizeof(*d))) == NULL ||
+	    (d->path = strdup(path)) == NULL) {
+		free(d);
+		return (false);
+	}
+	d->depth = depth;
+	d->entry = e;
+	pthread_mutex_lock(&w->lock);
+	STAILQ_INSERT_TAIL(&w->dirs, d, link);
+	w->busy++;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	return (true);
+}
+
+static void
+wdir_free(struct wdir *d)
+{
+	if (d->entry != NULL) {
+		wentry_free(d->entry);
+	}
+	free(d->path);
+	free(d);
+}
+
+/*
+ * Open the entry relative to the directory being read, as the extattr batch
+ * calls do, so a rename elsewhere in the tree can't redirect the lookups and
+ * deep paths don't run into PATH_MAX.
+ */
+static void
+walker_collect(struct walker *w, int dirfd, const char *name,
+    struct wentry *e)
+{
+	ssize_t len;
+	acl_t acl;
+	int fd;
+
+	if (w->xattrns == -1 && w->acltype == -1) {
+		return;
+	}
+	if ((fd = openat(dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC)) ==
+	    -1) {
+		e->error = errno;
+		return;
+	}
+	if (w->xattrns != -1) {
+		for (;;) {
+			len = extattr_list_fd(fd, w->xattrns, e->xattrs,
+			    e->xattrlen);
+			if (len == -1) {
+				if (errno != EOPNOTSUPP) {
+					e->error = errno;
+				}
+				free(e->xattrs);
+				e->xattrs = NULL;
+				e->xattrlen = 0;
+				break;
+			}
+			if (e->xattrs != NULL && len <= e->xattrlen) {
+				e->xattrlen = len;
+				break;
+			}
+			free(e->xattrs);
+			e->xattrlen = len * 2 + 1;
+			if ((e->xattrs = malloc(e->xattrlen)) == NULL) {
+				e->error = ENOMEM;
+				e->xattrlen = 0;
+				break;
+			}
+		}
+	}
+	if (w->acltype != -1 && e->type != DT_LNK) {
+		if ((acl = acl_get_fd_np(fd, w->acltype)) != NULL) {
+			e->acl = acl_to_text_np(acl, NULL,
+			    ACL_TEXT_NUMERIC_IDS);
+			acl_free(acl);
+		} else if (errno != EINVAL && errno != EOPNOTSUPP) {
+			e->error = errno;
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Report a directory once it has been read, with the error that cut reading
+ * it short, if any.  The root is only reported if it failed.  A failure that
+ * no entry can be allocated to carry is kept for next() to return at the end
+ * of the walk.
+ */
+static void
+walker_finish(struct walker *w, struct wdir *d, struct wentries *batch,
+    size_t *n, int error)
+{
+	struct wentry *e;
+
+	if ((e = d->entry) != NULL) {
+		d->entry = NULL;
+	} else if (error != 0) {
+		if ((e = calloc(1, sizeof(*e))) != NULL &&
+		    (e->path = strdup(d->path)) != NULL) {
+			e->depth = d->depth;
+			e->type = DT_DIR;
+		} else {
+			free(e);
+			e = NULL;
+			pthread_mutex_lock(&w->lock);
+			if (w->error == 0) {
+				w->error = error;
+			}
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+	if (e != NULL) {
+		if (error != 0) {
+			e->error = error;
+		}
+		STAILQ_INSERT_TAIL(batch, e, link);
+		(*n)++;
+	}
+	if (*n > 0) {
+		walker_flush(w, batch, n);
+	}
+}
+
+static void
+walker_scan(struct walker *w, struct wdir *d)
+{
+	struct wentries batch = STAILQ_HEAD_INITIALIZER(batch);
+	struct dirent *ent;
+	struct wentry *e;
+	DIR *dirp;
+	size_t n;
+	int fd, error;
+
+	STAILQ_INIT(&batch);
+	n = 0;
+	if ((fd = openat(w->rootfd, d->path,
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1 ||
+	    (dirp = fdopendir(fd)) == NULL) {
+		error = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		walker_finish(w, d, &batch, &n, error);
+		return;
+	}
+	error = 0;
+	while (!atomic_load(&w->cancel)) {
+		bool descend;
+
+		errno = 0;
+		if ((ent = readdir(dirp)) == NULL) {
+			error = errno;
+			break;
+		}
+		if (ent->d_name[0] == '.' && (ent->d_namlen == 1 ||
+		    (ent->d_namlen == 2 && ent->d_name[1] == '.'))) {
+			continue;
+		}
+		if (w->nexclude > 0 && walker_excluded(w, ent->d_name)) {
+			continue;
+		}
+		if ((e = calloc(1, sizeof(*e))) == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		if (d->depth == 0) {
+			e->path = strdup(ent->d_name);
+		} else {
+			asprintf(&e->path, "%s/%s", d->path, ent->d_name);
+		}
+		if (e->path == NULL) {
+			free(e);
+			error = ENOMEM;
+			break;
+		}
+		e->depth = d->depth + 1;
+		e->type = ent->d_type;
+		if (w->wantstat || w->xdev || e->type == DT_UNKNOWN) {
+			if (fstatat(dirfd(dirp), ent->d_name, &e->sb,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+				e->error = errno;
+			} else {
+				e->hasstat = w->wantstat;
+				e->type = IFTODT(e->sb.st_mode);
+			}
+		}
+		descend = e->type == DT_DIR && e->error == 0 &&
+		    (w->maxdepth < 0 || e->depth < w->maxdepth) &&
+		    (!w->xdev || e->sb.st_dev == w->rootdev);
+		if (e->error == 0) {
+			walker_collect(w, dirfd(dirp), ent->d_name, e);
+		}
+		if (descend && walker_push(w, e->path, e->depth, e)) {
+			continue;
+		}
+		STAILQ_INSERT_TAIL(&batch, e, link);
+		if (++n == WALK_FLUSH) {
+			walker_flush(w, &batch, &n);
+		}
+	}
+	closedir(dirp);
+	walker_finish(w, d, &batch, &n, error);
+}
+
+static void *
+walker_worker(void *arg)
+{
+	struct walker *w = arg;
+	struct wdir *d;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while ((d = STAILQ_FIRST(&w->dirs)) == NULL && w->busy > 0 &&
+		    !atomic_load(&w->cancel)) {
+			pthread_cond_wait(&w->work, &w->lock);
+		}
+		if (d == NULL || atomic_load(&w->cancel)) {
+			break;
+		}
+		STAILQ_REMOVE_HEAD(&w->dirs, link);
+		pthread_mutex_unlock(&w->lock);
+		walker_scan(w, d);
+		wdir_free(d);
+		pthread_mutex_lock(&w->lock);
+		if (--w->busy == 0) {
+			pthread_cond_broadcast(&w->work);
+			pthread_cond_broadcast(&w->results);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (NULL);
+}
+
+static void
+walker_free(struct walker *w, int nthreads)
+{
+	struct wentry *e;
+	struct wdir *d;
+
+	pthread_mutex_lock(&w->lock);
+	atomic_store(&w->cancel, true);
+	pthread_cond_broadcast(&w->work);
+	pthread_cond_broadcast(&w->space);
+	pthread_mutex_unlock(&w->lock);
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(w->threads[i], NULL);
+	}
+	while ((d = STAILQ_FIRST(&w->dirs)) != NULL) {
+		STAILQ_REMOVE_HEAD(&w->dirs, link);
+		wdir_free(d);
+	}
+	while ((e = STAILQ_FIRST(&w->entries)) != NULL) {
+		STAILQ_REMOVE_HEAD(&w->entries, link);
+		wentry_free(e);
+	}
+	for (int i = 0; i < w->nexclude; i++) {
+		free(w->exclude[i]);
+	}
+	free(w->exclude);
+	free(w->root);
+	if (w->rootfd != -1) {
+		close(w->rootfd);
+	}
+	pthread_cond_destroy(&w->space);
+	pthread_cond_destroy(&w->results);
+	pthread_cond_destroy(&w->work);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+static int
+l_walk(lua_State *L)
+{
+	struct stat sb;
+	struct walker *w;
+	const char *root;
+	lua_Integer nthreads, maxdepth, maxentries;
+	int xattrns, acltype, nexclude, error;
+	bool wantstat, xdev;
+
+	root = luaL_checkstring(L, 1);
+	nthreads = 4;
+	maxdepth = -1;
+	maxentries = 65536;
+	xattrns = acltype = -1;
+	nexclude = 0;
+	wantstat = xdev = false;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "maxdepth") != LUA_TNIL) {
+			maxdepth = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "maxpending") != LUA_TNIL) {
+			maxentries = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "extattr") != LUA_TNIL) {
+			xattrns = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "acl") != LUA_TNIL) {
+			acltype = luaL_checkinteger(L, -1);
+		}
+		wantstat = lua_getfield(L, 2, "stat") != LUA_TNIL &&
+		    lua_toboolean(L, -1);
+		xdev = lua_getfield(L, 2, "xdev") != LUA_TNIL &&
+		    lua_toboolean(L, -1);
+		lua_pop(L, 7);
+		if (lua_getfield(L, 2, "exclude") != LUA_TNIL) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			nexclude = luaL_len(L, -1);
+		}
+		/* exclude table stays on top of the stack */
+	}
+	luaL_argcheck(L, nthreads > 0 && nthreads <= 1024, 2,
+	    "invalid threads");
+	luaL_argcheck(L, maxentries > 0, 2, "invalid maxpending");
+	luaL_argcheck(L, maxdepth <= INT_MAX, 2, "invalid maxdepth");
+
+	if ((w = calloc(1, sizeof(*w) + nthreads * sizeof(pthread_t))) ==
+	    NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->results, NULL);
+	pthread_cond_init(&w->space, NULL);
+	STAILQ_INIT(&w->dirs);
+	STAILQ_INIT(&w->entries);
+	atomic_init(&w->cancel, false);
+	w->rootfd = -1;
+	w->maxentries = maxentries;
+	w->maxdepth = maxdepth;
+	w->xdev = xdev;
+	w->wantstat = wantstat;
+	w->xattrns = xattrns;
+	w->acltype = acltype;
+	if (nexclude > 0 &&
+	    (w->exclude = calloc(nexclude, sizeof(char *))) == NULL) {
+		walker_free(w, 0);
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	for (int i = 1; i <= nexclude; i++) {
+		const char *pattern;
+
+		lua_rawgeti(L, -1, i);
+		if ((pattern = lua_tostring(L, -1)) == NULL) {
+			walker_free(w, 0);
+			return (luaL_argerror(L, 2, "invalid exclude"));
+		}
+		if ((w->exclude[w->nexclude++] = strdup(pattern)) == NULL) {
+			walker_free(w, 0);
+			return (fatal(L, "strdup", ENOMEM));
+		}
+		lua_pop(L, 1);
+	}
+	if ((w->root = strdup(root)) == NULL) {
+		walker_free(w, 0);
+		return (fatal(L, "strdup", ENOMEM));
+	}
+	if ((w->rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) ==
+	    -1 || fstat(w->rootfd, &sb) == -1) {
+		error = errno;
+		walker_free(w, 0);
+		return (fail(L, error));
+	}
+	w->rootdev = sb.st_dev;
+	if (!walker_push(w, ".", 0, NULL)) {
+		walker_free(w, 0);
+		return (fatal(L, "malloc", ENOMEM));
+	}
+	for (int i = 0; i < nthreads; i++) {
+		if ((error = pthread_create(&w->threads[i], NULL,
+		    walker_worker, w)) != 0) {
+			walker_free(w, i);
+			return (fail(L, error));
+		}
+		w->nthreads++;
+	}
+	return (new(L, w, WALKER_METATABLE));
+}
+
+static int
+l_walker_close(lua_State *L)
+{
+	struct walker *w;
+
+	w = checkcookie(L, 1, WALKER_METATABLE);
+
+	walker_free(w, w->nthreads);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
+static int
+l_walker_gc(lua_State *L)
+{
+	struct walker *w;
+
+	w = checkcookienull(L, 1, WALKER_METATABLE);
+
+	if (w != NULL) {
+		walker_free(w, w->nthreads);
+	}
+	return (0);
+}
+
+static void
+pushxattrs(lua_State *L, const char *p, ssize_t len)
+{
+	const char *end = p + len;
+
+	lua_newtable(L);
+	for (int i = 1; p < end; i++) {
+		size_t n = (unsigned char)*p++;
+
+		lua_pushlstring(L, p, n);
+		lua_rawseti(L, -2, i);
+		p += n;
+	}
+}
+
+/* Entries taken from the walker but not yet converted, freed by the GC. */
+static int
+l_walker_batch_gc(lua_State *L)
+{
+	struct wentries *batch;
+	struct wentry *e;
+
+	batch = luaL_checkudata(L, 1, WALKER_BATCH_METATABLE);
+	while ((e = STAILQ_FIRST(batch)) != NULL) {
+		STAILQ_REMOVE_HEAD(batch, link);
+		wentry_free(e);
+	}
+	return (0);
+}
+
+static int
+l_walker_next(lua_State *L)
+{
+	struct wentries *batch;
+	struct walker *w;
+	struct wentry *e;
+	lua_Integer max, n;
+	int batchidx, error;
+
+	w = checkcookie(L, 1, WALKER_METATABLE);
+	max = luaL_optinteger(L, 2, 1024);
+	luaL_argcheck(L, max > 0, 2, "invalid max");
+
+	batch = lua_newuserdatauv(L, sizeof(*batch), 0);
+	STAILQ_INIT(batch);
+	luaL_setmetatable(L, WALKER_BATCH_METATABLE);
+	pthread_mutex_lock(&w->lock);
+	while (STAILQ_EMPTY(&w->entries) && w->busy > 0) {
+		pthread_cond_wait(&w->results, &w->lock);
+	}
+	for (n = 0; n < max && (e = STAILQ_FIRST(&w->entries)) != NULL;
+	    n++) {
+		STAILQ_REMOVE_HEAD(&w->entries, link);
+		STAILQ_INSERT_TAIL(batch, e, link);
+	}
+	w->nentries -= n;
+	error = n == 0 ? w->error : 0;
+	pthread_cond_broadcast(&w->space);
+	pthread_mutex_unlock(&w->lock);
+
+	if (error != 0) {
+		return (fail(L, error));
+	}
+	lua_pushinteger(L, n);
+	lua_createtable(L, 0, 7);
+	batchidx = lua_gettop(L);
+	for (int col = 0; col < 7; col++) {
+		lua_createtable(L, n, 0);
+	}
+	/* Entries are freed as they go; on a Lua error the GC frees the rest. */
+	for (lua_Integer i = 1; (e = STAILQ_FIRST(batch)) != NULL; i++) {
+		STAILQ_REMOVE_HEAD(batch, link);
+		lua_pushfstring(L, "%s/%s", w->root, e->path);
+		lua_rawseti(L, batchidx + 1, i);
+		lua_pushinteger(L, e->depth);
+		lua_rawseti(L, batchidx + 2, i);
+		lua_pushinteger(L, e->type);
+		lua_rawseti(L, batchidx + 3, i);
+		lua_pushinteger(L, e->error);
+		lua_rawseti(L, batchidx + 4, i);
+		if (e->hasstat) {
+			pushstat(L, &e->sb);
+		} else {
+			lua_pushboolean(L, false);
+		}
+		lua_rawseti(L, batchidx + 5, i);
+		if (e->xattrs != NULL) {
+			pushxattrs(L, e->xattrs, e->xattrlen);
+		} else {
+			lua_pushboolean(L, false);
+		}
+		lua_rawseti(L, batchidx + 6, i);
+		if (e->acl != NULL) {
+			lua_pushstring(L, e->acl);
+		} else {
+			lua_pushboolean(L, false);
+		}
+		lua_rawseti(L, batchidx + 7, i);
+		wentry_free(e);
+	}
+	if (w->acltype != -1) {
+		lua_setfield(L, batchidx, "acl");
+	} else {
+		lua_pop(L, 1);
+	}
+	if (w->xattrns != -1) {
+		lua_setfield(L, batchidx, "extattr");
+	} else {
+		lua_pop(L, 1);
+	}
+	if (w->wantstat) {
+		lua_setfield(L, batchidx, "stat");
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_setfield(L, batchidx, "errno");
+	lua_setfield(L, batchidx, "type");
+	lua_setfield(L, batchidx, "depth");
+	lua_setfield(L, batchidx, "path");
+	lua_remove(L, batchidx - 2);
+	return (2);
+}
+
 static const struct luaL_Reg l_dirent_funcs[] = {
 	{"opendir", l_opendir},
 	{"fdopendir", l_fdopendir},
+	{"scanner", l_scanner},
+	{"walk", l_walk},
 	/* scandir family seems a bit too C-specific */
 	{"iftodt", l_iftodt},
 	{"dttoif", l_dttoif},
@@ -182,6 +1108,24 @@ static const struct luaL_Reg l_dir_meta[] = {
 	{NULL, NULL}
 };
 
+static const struct luaL_Reg l_scanner_meta[] = {
+	{"__close", l_scanner_close},
+	{"__gc", l_scanner_gc},
+	{"close", l_scanner_close},
+	{"next", l_scanner_next},
+	{"rewind", l_scanner_rewind},
+	{"fd", l_scanner_fd},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_walker_meta[] = {
+	{"__close", l_walker_close},
+	{"__gc", l_walker_gc},
+	{"close", l_walker_close},
+	{"next", l_walker_next},
+	{NULL, NULL}
+};
+
 int
 luaopen_dirent(lua_State *L)
 {
@@ -190,6 +1134,20 @@ luaopen_dirent(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_dir_meta, 0);
 
+	luaL_newmetatable(L, SCANNER_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_scanner_meta, 0);
+
+	luaL_newmetatable(L, WALKER_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_walker_meta, 0);
+
+	luaL_newmetatable(L, WALKER_BATCH_METATABLE);
+	lua_pushcfunction(L, l_walker_batch_gc);
+	lua_setfield(L, -2, "__gc");
+
 	luaL_newlib(L, l_dirent_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushinteger(L, ident); \
@@ -204,6 +1162,10 @@ luaopen_dirent(lua_State *L)
 	DEFINE(DT_LNK);
 	DEFINE(DT_SOCK);
 	DEFINE(DT_WHT);
+	DEFINE(FNM_NOESCAPE);
+	DEFINE(FNM_PATHNAME);
+	DEFINE(FNM_PERIOD);
+	DEFINE(FNM_CASEFOLD);
 #undef DEFINE
 	return (1);
 }
@@ -17,4 +17,39 @@ do
 		end
 	until false
 end
-os.exit(result)
+if result ~= 0 then
+	os.exit(result)
+end
+
+do
+	local scanner <close> = assert(dirent.scanner('.', {
+		glob = '*.c',
+		types = {dirent.DT_REG},
+	}))
+	local n, names, types = assert(scanner:next())
+	assert(n == 1 and names[1] == 'lua_dirent.c')
+	assert(types[1] == dirent.DT_REG)
+	assert(scanner:next(nil, names, types) == 0)
+	assert(#names == 0 and #types == 0)
+end
+
+do
+	local walker <close> = assert(dirent.walk('..', {
+		maxdepth = 2,
+		stat = true,
+	}))
+	local found = false
+	repeat
+		local n, batch = walker:next()
+		for i = 1, n do
+			assert(batch.depth[i] <= 2)
+			if batch.path[i]:match('/dirent/lua_dirent%.c$') then
+				assert(batch.type[i] == dirent.DT_REG)
+				assert(batch.stat[i].size > 0)
+				found = true
+			end
+		end
+	until n == 0
+	assert(found)
+end
+os.exit(0)
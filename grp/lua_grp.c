@@ -5,12 +5,14 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <grp.h>
 #include <stdlib.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "lookupcache.h"
 #include "lua_grp.h"
 #include "utils.h"
 
@@ -52,12 +54,19 @@ l_getgrnam(lua_State *L)
 {
 	struct group grp;
 	struct group *result;
+	struct lookupcache *cache;
 	const char *name;
 	char *buffer;
 	size_t bufsize;
-	int error;
+	int key, n, error;
 
 	name = luaL_checkstring(L, 1);
+	cache = optlookupcache(L, 2);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "grnam:%s", name);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = GRP_INITIAL_BUFSIZE;
 retry:
@@ -74,10 +83,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushgroup(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -86,12 +97,20 @@ l_getgrgid(lua_State *L)
 {
 	struct group grp;
 	struct group *result;
+	struct lookupcache *cache;
 	char *buffer;
 	size_t bufsize;
 	gid_t gid;
-	int error;
+	int key, n, error;
 
 	gid = luaL_checkinteger(L, 1);
+	cache = optlookupcache(L, 2);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "grgid:%I",
+	    (lua_Integer)gid);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = GRP_INITIAL_BUFSIZE;
 retry:
@@ -108,10 +127,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushgroup(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -141,7 +162,107 @@ l_endgrent(lua_State *L __unused)
 	return (0);
 }
 
+/*
+ * Read the whole database in one pass, indexed by name and by gid, with the
+ * membership lists inverted into the groups of each member.  The first entry
+ * wins where names or gids are duplicated, as for getgrnam and getgrgid.  An
+ * error raised by the filter is rethrown after closing the database.
+ */
+static int
+l_grp_load(lua_State *L)
+{
+	struct group grp;
+	struct group *result;
+	char *buffer;
+	size_t bufsize;
+	int error;
+	bool filter;
+
+	filter = !lua_isnoneornil(L, 1);
+	if (filter) {
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+	}
+
+	lua_settop(L, 1);
+	lua_newtable(L); /* result */
+	lua_newtable(L); /* byname */
+	lua_newtable(L); /* bygid */
+	lua_newtable(L); /* bymember */
+	bufsize = GRP_INITIAL_BUFSIZE;
+	buffer = lua_newuserdatauv(L, bufsize, 0);
+	setgrent();
+	for (;;) {
+		error = getgrent_r(&grp, buffer, bufsize, &result);
+		if (error == ERANGE) {
+			lua_pop(L, 1);
+			bufsize *= 2;
+			buffer = lua_newuserdatauv(L, bufsize, 0);
+			continue;
+		}
+		if (error != 0) {
+			endgrent();
+			return (fail(L, error));
+		}
+		if (result == NULL) {
+			break;
+		}
+		pushgroup(L, result);
+		if (filter) {
+			bool keep;
+
+			lua_pushvalue(L, 1);
+			lua_pushvalue(L, -2);
+			if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+				endgrent();
+				return (lua_error(L));
+			}
+			keep = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			if (!keep) {
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		if (lua_getfield(L, 3, result->gr_name) == LUA_TNIL) {
+			lua_pushvalue(L, -2);
+			lua_setfield(L, 3, result->gr_name);
+		}
+		lua_pop(L, 1);
+		if (lua_rawgeti(L, 4, result->gr_gid) == LUA_TNIL) {
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, 4, result->gr_gid);
+		}
+		lua_pop(L, 1);
+		for (char **mem = result->gr_mem; *mem != NULL; mem++) {
+			if (lua_getfield(L, 5, *mem) == LUA_TNIL) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, 5, *mem);
+			}
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	endgrent();
+	lua_pop(L, 1);
+	lua_setfield(L, 2, "bymember");
+	lua_setfield(L, 2, "bygid");
+	lua_setfield(L, 2, "byname");
+	return (1);
+}
+
+static int
+l_grp_cache(lua_State *L)
+{
+	return (lookupcache_new(L, 1));
+}
+
 static const struct luaL_Reg l_grp_funcs[] = {
+	{"cache", l_grp_cache},
+	{"load", l_grp_load},
 	{"getgrent", l_getgrent},
 	{"getgrnam", l_getgrnam},
 	{"getgrgid", l_getgrgid},
@@ -154,6 +275,8 @@ static const struct luaL_Reg l_grp_funcs[] = {
 int
 luaopen_grp(lua_State *L)
 {
+	lookupcache_register(L);
+
 	luaL_newlib(L, l_grp_funcs);
 	return (1);
 }
@@ -3,3 +3,19 @@ local ucl = require('ucl')
 
 local wheel = assert(grp.getgrgid(0))
 print(ucl.to_json(wheel))
+
+local db = assert(grp.load())
+assert(db.bygid[0].name == wheel.name)
+for _, name in ipairs(wheel.mem) do
+	local found = false
+	for _, group in ipairs(db.bymember[name]) do
+		found = found or group == db.bygid[0]
+	end
+	assert(found)
+end
+db = assert(grp.load(function(group) return group.gid ~= 0 end))
+assert(db.bygid[0] == nil and db.byname[wheel.name] == nil)
+local first = assert(grp.getgrent())
+assert(not pcall(grp.load, function() error('stop') end))
+assert(grp.getgrent().name == first.name)
+grp.endgrent()
@@ -5,7 +5,11 @@
  */
 
 #include <sys/nv.h>
+#include <errno.h>
 #include <libcasper.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -14,6 +18,38 @@
 #include "lua_casper.h"
 #include "utils.h"
 
+#define CAP_PIPELINE_METATABLE "cap_channel_t * pipeline"
+
+/*
+ * Requests in flight at once on a channel, by default and at most.  send()
+ * doesn't read replies until a channel is full, so the requests and replies
+ * in flight must fit in the socket buffers or the client and the service both
+ * block writing.
+ */
+#define CAP_PIPELINE_DEPTH 16
+
+/*
+ * A casper service handles the requests on a channel one at a time and replies
+ * in order, so a channel can have several requests in flight as long as the
+ * replies are matched up in the same order.  Cloned channels are served by
+ * separate processes, so spreading requests over clones runs them in parallel.
+ */
+struct cap_pipe {
+	cap_channel_t *chan;
+	lua_Integer *ids;	/* ring of request ids awaiting replies */
+	int head;
+	int count;
+};
+
+struct cap_pipeline {
+	lua_Integer nextid;
+	int stash;		/* registry ref to replies not yet collected */
+	int nstashed;
+	int depth;
+	int nchans;
+	struct cap_pipe pipes[];
+};
+
 int luaopen_casper(lua_State *);
 
 static int
@@ -182,6 +218,240 @@ l_cap_service_open(lua_State *L)
 	return (new(L, serv, CAP_CHANNEL_METATABLE));
 }
 
+static void
+cap_pipeline_free(struct cap_pipeline *p)
+{
+	for (int i = 0; i < p->nchans; i++) {
+		if (p->pipes[i].chan != NULL) {
+			cap_close(p->pipes[i].chan);
+		}
+	}
+	if (p->nchans > 0) {
+		free(p->pipes[0].ids);
+	}
+	free(p);
+}
+
+static int
+l_cap_pipeline(lua_State *L)
+{
+	const cap_channel_t *chan;
+	struct cap_pipeline *p;
+	lua_Integer *ids;
+	lua_Integer nchans, depth;
+	int error;
+
+	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
+	nchans = 1;
+	depth = CAP_PIPELINE_DEPTH;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "channels") != LUA_TNIL) {
+			nchans = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "depth") != LUA_TNIL) {
+			depth = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 2);
+	}
+	luaL_argcheck(L, nchans > 0 && nchans <= 1024, 2, "invalid channels");
+	luaL_argcheck(L, depth > 0 && depth <= CAP_PIPELINE_DEPTH, 2,
+	    "invalid depth");
+
+	if ((p = calloc(1, sizeof(*p) + nchans * sizeof(*p->pipes))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	if ((ids = calloc(nchans * depth, sizeof(*ids))) == NULL) {
+		free(p);
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	p->depth = depth;
+	p->nchans = nchans;
+	for (int i = 0; i < nchans; i++) {
+		p->pipes[i].ids = &ids[i * depth];
+		if ((p->pipes[i].chan = cap_clone(chan)) == NULL) {
+			error = errno;
+			cap_pipeline_free(p);
+			return (fail(L, error));
+		}
+	}
+	lua_newtable(L);
+	p->stash = luaL_ref(L, LUA_REGISTRYINDEX);
+	return (new(L, p, CAP_PIPELINE_METATABLE));
+}
+
+static int
+l_cap_pipeline_close(lua_State *L)
+{
+	struct cap_pipeline *p;
+
+	if ((p = checkcookienull(L, 1, CAP_PIPELINE_METATABLE)) == NULL) {
+		return (0);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, p->stash);
+	cap_pipeline_free(p);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
+/* Receive the oldest outstanding reply on a channel into the stash. */
+static bool
+cap_pipe_recv(lua_State *L, struct cap_pipeline *p, struct cap_pipe *pipe)
+{
+	nvlist_t *nvl;
+	lua_Integer id;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p->stash);
+	new(L, NULL, NVLIST_METATABLE);
+	if ((nvl = cap_recv_nvlist(pipe->chan)) == NULL) {
+		lua_pop(L, 2);
+		return (false);
+	}
+	setcookie(L, -1, nvl);
+	id = pipe->ids[pipe->head];
+	pipe->head = (pipe->head + 1) % p->depth;
+	pipe->count--;
+	lua_rawseti(L, -2, id);
+	lua_pop(L, 1);
+	p->nstashed++;
+	return (true);
+}
+
+static int
+l_cap_pipeline_send(lua_State *L)
+{
+	struct cap_pipeline *p;
+	struct cap_pipe *pipe;
+	const nvlist_t *nvl;
+
+	p = checkcookie(L, 1, CAP_PIPELINE_METATABLE);
+	nvl = checkanynvlist(L, 2);
+
+	pipe = &p->pipes[0];
+	for (int i = 1; i < p->nchans; i++) {
+		if (p->pipes[i].count < pipe->count) {
+			pipe = &p->pipes[i];
+		}
+	}
+	if (pipe->count == p->depth && !cap_pipe_recv(L, p, pipe)) {
+		return (fail(L, errno));
+	}
+	if (cap_send_nvlist(pipe->chan, nvl) == -1) {
+		return (fail(L, errno));
+	}
+	p->nextid++;
+	pipe->ids[(pipe->head + pipe->count) % p->depth] = p->nextid;
+	pipe->count++;
+	lua_pushinteger(L, p->nextid);
+	return (1);
+}
+
+static int
+l_cap_pipeline_recv(lua_State *L)
+{
+	struct cap_pipeline *p;
+	struct pollfd *pfds;
+	struct cap_pipe **pipes;
+	int nfds;
+
+	p = checkcookie(L, 1, CAP_PIPELINE_METATABLE);
+
+	if (p->nstashed == 0) {
+		pfds = lua_newuserdatauv(L, p->nchans * sizeof(*pfds), 0);
+		pipes = lua_newuserdatauv(L, p->nchans * sizeof(*pipes), 0);
+		nfds = 0;
+		for (int i = 0; i < p->nchans; i++) {
+			if (p->pipes[i].count == 0) {
+				continue;
+			}
+			pfds[nfds].fd = cap_sock(p->pipes[i].chan);
+			pfds[nfds].events = POLLIN;
+			pipes[nfds] = &p->pipes[i];
+			nfds++;
+		}
+		if (nfds == 0) {
+			return (0);
+		}
+		while (poll(pfds, nfds, INFTIM) == -1) {
+			if (errno != EINTR) {
+				return (fail(L, errno));
+			}
+		}
+		for (int i = 0; i < nfds; i++) {
+			if (pfds[i].revents != 0 &&
+			    !cap_pipe_recv(L, p, pipes[i])) {
+				return (fail(L, errno));
+			}
+		}
+		lua_pop(L, 2);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p->stash);
+	lua_pushnil(L);
+	lua_next(L, -2);
+	lua_pushvalue(L, -2);
+	lua_pushnil(L);
+	lua_rawset(L, -5);
+	p->nstashed--;
+	return (2);
+}
+
+static int
+l_cap_pipeline_wait(lua_State *L)
+{
+	struct cap_pipeline *p;
+	struct cap_pipe *pipe;
+	lua_Integer id;
+
+	p = checkcookie(L, 1, CAP_PIPELINE_METATABLE);
+	id = luaL_checkinteger(L, 2);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p->stash);
+	if (lua_rawgeti(L, -1, id) == LUA_TNIL) {
+		lua_pop(L, 1);
+		pipe = NULL;
+		for (int i = 0; i < p->nchans && pipe == NULL; i++) {
+			struct cap_pipe *pp = &p->pipes[i];
+
+			for (int j = 0; j < pp->count; j++) {
+				if (pp->ids[(pp->head + j) % p->depth] == id) {
+					pipe = pp;
+					break;
+				}
+			}
+		}
+		luaL_argcheck(L, pipe != NULL, 2, "unknown request");
+		for (;;) {
+			if (!cap_pipe_recv(L, p, pipe)) {
+				return (fail(L, errno));
+			}
+			if (lua_rawgeti(L, -1, id) != LUA_TNIL) {
+				break;
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pushnil(L);
+	lua_rawseti(L, -3, id);
+	p->nstashed--;
+	return (1);
+}
+
+static int
+l_cap_pipeline_pending(lua_State *L)
+{
+	struct cap_pipeline *p;
+	lua_Integer n;
+
+	p = checkcookie(L, 1, CAP_PIPELINE_METATABLE);
+
+	n = p->nstashed;
+	for (int i = 0; i < p->nchans; i++) {
+		n += p->pipes[i].count;
+	}
+	lua_pushinteger(L, n);
+	return (1);
+}
+
 static const struct luaL_Reg l_casper_funcs[] = {
 	{"init", l_cap_init},
 	{"wrap", l_cap_wrap},
@@ -200,6 +470,18 @@ static const struct luaL_Reg l_cap_channel_meta[] = {
 	{"recv", l_cap_recv},
 	{"xfer", l_cap_xfer},
 	{"service_open", l_cap_service_open},
+	{"pipeline", l_cap_pipeline},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_cap_pipeline_meta[] = {
+	{"__close", l_cap_pipeline_close},
+	{"__gc", l_cap_pipeline_close},
+	{"close", l_cap_pipeline_close},
+	{"send", l_cap_pipeline_send},
+	{"recv", l_cap_pipeline_recv},
+	{"wait", l_cap_pipeline_wait},
+	{"pending", l_cap_pipeline_pending},
 	{NULL, NULL}
 };
 
@@ -216,6 +498,11 @@ luaopen_casper(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_cap_channel_meta, 0);
 
+	luaL_newmetatable(L, CAP_PIPELINE_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_cap_pipeline_meta, 0);
+
 	luaL_newlib(L, l_casper_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushinteger(L, CASPER_ ## ident); \
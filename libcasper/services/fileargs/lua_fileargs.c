@@ -4,8 +4,15 @@
  * SPDX-License-Identifer: BSD-2-Clause
  */
 
+#include <errno.h>
 #include <libcasper.h>
 #include <casper/cap_fileargs.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -17,6 +24,32 @@
 #include "utils.h"
 
 #define FILEARGS_METATABLE "fileargs_t *"
+#define FILEARGS_PREFETCH_METATABLE "fileargs_t * prefetch"
+
+#define FILEARGS_PREFETCH_WINDOW 8
+
+/*
+ * Opens a list of names on a thread, up to a window ahead of the consumer.
+ * The fileargs_t is not safe to share, so the prefetcher takes it from its
+ * userdata for as long as the prefetcher is open.
+ */
+struct prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool started;
+	bool stop;
+	fileargs_t *fa;
+	int window;
+	int nnames;
+	int nopened;	/* results ready, written by the thread */
+	int ntaken;	/* results returned to the consumer */
+	struct prefetch_slot {
+		int fd;
+		int error;
+	} *slots;
+	char *names[];
+};
 
 int luaopen_casper_fileargs(lua_State *);
 
@@ -193,6 +226,236 @@ l_fileargs_open(lua_State *L)
 	return (1);
 }
 
+static int
+l_fileargs_open_batch(lua_State *L)
+{
+	fileargs_t *fa;
+	const char *name;
+	lua_Integer n;
+	int fd;
+
+	fa = checkcookie(L, 1, FILEARGS_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	n = luaL_len(L, 2);
+	for (lua_Integer i = 1; i <= n; i++) {
+		luaL_argcheck(L, lua_geti(L, 2, i) == LUA_TSTRING, 2,
+		    "names must be strings");
+		lua_pop(L, 1);
+	}
+	lua_createtable(L, n, 0);
+	lua_newtable(L);
+	for (lua_Integer i = 1; i <= n; i++) {
+		lua_geti(L, 2, i);
+		name = lua_tostring(L, -1);
+		if ((fd = fileargs_open(fa, name)) == -1) {
+			lua_pushinteger(L, errno);
+			lua_seti(L, -3, i);
+			lua_pushboolean(L, false);
+		} else {
+			lua_pushinteger(L, fd);
+		}
+		lua_seti(L, -4, i);
+		lua_pop(L, 1);
+	}
+	return (2);
+}
+
+static int
+l_fileargs_lstat_batch(lua_State *L)
+{
+	struct stat sb;
+	fileargs_t *fa;
+	const char *name;
+	lua_Integer n;
+
+	fa = checkcookie(L, 1, FILEARGS_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	n = luaL_len(L, 2);
+	for (lua_Integer i = 1; i <= n; i++) {
+		luaL_argcheck(L, lua_geti(L, 2, i) == LUA_TSTRING, 2,
+		    "names must be strings");
+		lua_pop(L, 1);
+	}
+	lua_createtable(L, n, 0);
+	lua_newtable(L);
+	for (lua_Integer i = 1; i <= n; i++) {
+		lua_geti(L, 2, i);
+		name = lua_tostring(L, -1);
+		if (fileargs_lstat(fa, name, &sb) == -1) {
+			lua_pushinteger(L, errno);
+			lua_seti(L, -3, i);
+			lua_pushboolean(L, false);
+		} else {
+			pushstat(L, &sb);
+		}
+		lua_seti(L, -4, i);
+		lua_pop(L, 1);
+	}
+	return (2);
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *pf = arg;
+	int i, fd, error;
+
+	pthread_mutex_lock(&pf->lock);
+	for (;;) {
+		while (!pf->stop && pf->nopened < pf->nnames &&
+		    pf->nopened - pf->ntaken >= pf->window) {
+			pthread_cond_wait(&pf->cond, &pf->lock);
+		}
+		if (pf->stop || pf->nopened == pf->nnames) {
+			break;
+		}
+		i = pf->nopened;
+		pthread_mutex_unlock(&pf->lock);
+
+		fd = fileargs_open(pf->fa, pf->names[i]);
+		error = fd == -1 ? errno : 0;
+
+		pthread_mutex_lock(&pf->lock);
+		pf->slots[i].fd = fd;
+		pf->slots[i].error = error;
+		pf->nopened++;
+		pthread_cond_broadcast(&pf->cond);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return (NULL);
+}
+
+static void
+prefetch_free(struct prefetch *pf)
+{
+	if (pf->started) {
+		pthread_mutex_lock(&pf->lock);
+		pf->stop = true;
+		pthread_cond_broadcast(&pf->cond);
+		pthread_mutex_unlock(&pf->lock);
+		pthread_join(pf->thread, NULL);
+	}
+	/* Close whatever was opened ahead but never taken. */
+	for (int i = pf->ntaken; i < pf->nopened; i++) {
+		if (pf->slots[i].fd != -1) {
+			close(pf->slots[i].fd);
+		}
+	}
+	for (int i = 0; i < pf->nnames; i++) {
+		free(pf->names[i]);
+	}
+	free(pf->slots);
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	free(pf);
+}
+
+static int
+l_fileargs_prefetch(lua_State *L)
+{
+	struct prefetch *pf;
+	fileargs_t *fa;
+	const char *name;
+	lua_Integer n, window;
+	int error;
+
+	fa = checkcookie(L, 1, FILEARGS_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	window = luaL_optinteger(L, 3, FILEARGS_PREFETCH_WINDOW);
+	luaL_argcheck(L, window > 0 && window <= INT_MAX, 3, "invalid window");
+
+	n = luaL_len(L, 2);
+	luaL_argcheck(L, n >= 0 && n < INT_MAX, 2, "too many names");
+	for (lua_Integer i = 1; i <= n; i++) {
+		luaL_argcheck(L, lua_geti(L, 2, i) == LUA_TSTRING, 2,
+		    "names must be strings");
+		lua_pop(L, 1);
+	}
+	if ((pf = calloc(1, sizeof(*pf) + n * sizeof(*pf->names))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	if ((pf->slots = calloc(MAX(n, 1), sizeof(*pf->slots))) == NULL) {
+		prefetch_free(pf);
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	for (lua_Integer i = 0; i < n; i++) {
+		lua_geti(L, 2, i + 1);
+		name = lua_tostring(L, -1);
+		if ((pf->names[i] = strdup(name)) == NULL) {
+			prefetch_free(pf);
+			return (fatal(L, "strdup", ENOMEM));
+		}
+		pf->nnames++;
+		lua_pop(L, 1);
+	}
+	pf->fa = fa;
+	pf->window = window;
+	if ((error = pthread_create(&pf->thread, NULL, prefetch_thread,
+	    pf)) != 0) {
+		prefetch_free(pf);
+		return (fail(L, error));
+	}
+	pf->started = true;
+	setcookie(L, 1, NULL);
+	return (newref(L, 1, pf, FILEARGS_PREFETCH_METATABLE));
+}
+
+static int
+l_prefetch_close(lua_State *L)
+{
+	struct prefetch *pf;
+	fileargs_t *fa;
+
+	if ((pf = checkcookienull(L, 1, FILEARGS_PREFETCH_METATABLE)) ==
+	    NULL) {
+		return (0);
+	}
+	fa = pf->fa;
+	prefetch_free(pf);
+	setcookie(L, 1, NULL);
+	/* Give the fileargs_t back. */
+	getref(L, 1);
+	setcookie(L, -1, fa);
+	return (0);
+}
+
+static int
+l_prefetch_next(lua_State *L)
+{
+	struct prefetch *pf;
+	struct prefetch_slot slot;
+	int i;
+
+	pf = checkcookie(L, 1, FILEARGS_PREFETCH_METATABLE);
+
+	pthread_mutex_lock(&pf->lock);
+	if ((i = pf->ntaken) == pf->nnames) {
+		pthread_mutex_unlock(&pf->lock);
+		return (0);
+	}
+	while (pf->nopened == i) {
+		pthread_cond_wait(&pf->cond, &pf->lock);
+	}
+	slot = pf->slots[i];
+	pf->ntaken++;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+
+	lua_pushstring(L, pf->names[i]);
+	if (slot.fd == -1) {
+		lua_pushboolean(L, false);
+		lua_pushstring(L, strerror(slot.error));
+		lua_pushinteger(L, slot.error);
+		return (4);
+	}
+	lua_pushinteger(L, slot.fd);
+	return (2);
+}
+
 static int
 closestream(lua_State *L)
 {
@@ -271,6 +534,18 @@ static const struct luaL_Reg l_fileargs_meta[] = {
 	{"fopen", l_fileargs_fopen},
 	{"realpath", l_fileargs_realpath},
 	{"unwrap", l_fileargs_unwrap},
+	{"open_batch", l_fileargs_open_batch},
+	{"lstat_batch", l_fileargs_lstat_batch},
+	{"prefetch", l_fileargs_prefetch},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_prefetch_meta[] = {
+	{"__close", l_prefetch_close},
+	{"__gc", l_prefetch_close},
+	{"__call", l_prefetch_next},
+	{"close", l_prefetch_close},
+	{"next", l_prefetch_next},
 	{NULL, NULL}
 };
 
@@ -282,6 +557,11 @@ luaopen_casper_fileargs(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_fileargs_meta, 0);
 
+	luaL_newmetatable(L, FILEARGS_PREFETCH_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_prefetch_meta, 0);
+
 	luaL_newlib(L, l_fileargs_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushinteger(L, FA_ ## ident); \
@@ -1,6 +1,7 @@
 local cap = require('sys.capsicum')
 local fcntl = require('fcntl')
 local fileargs = require('casper.fileargs')
+local unistd = require('unistd')
 
 local args = {...}
 local fa = assert(fileargs.init(args, fcntl.O_RDONLY, 0,
@@ -10,3 +11,26 @@ for _, arg in ipairs(args) do
 	local f = assert(fa:fopen(arg, 'r'))
 	print(f:read('a*'))
 end
+
+local fds, errors = fa:open_batch(args)
+assert(next(errors) == nil)
+assert(#fds == #args)
+for _, fd in ipairs(fds) do
+	unistd.close(fd)
+end
+fds, errors = fa:open_batch({'/nonexistent'})
+assert(fds[1] == false and errors[1])
+assert(not pcall(fa.open_batch, fa, {args[1], true}))
+assert(not pcall(fa.lstat_batch, fa, {args[1], true}))
+do
+	local n = 0
+	local prefetch <close> = fa:prefetch(args, 2)
+	assert(not pcall(fa.open, fa, args[1]))
+	for name, fd in prefetch do
+		n = n + 1
+		assert(name == args[n] and fd)
+		unistd.close(fd)
+	end
+	assert(n == #args)
+end
+assert(fa:open(args[1]))
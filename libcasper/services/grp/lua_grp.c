@@ -16,6 +16,7 @@
 
 #include "grp/lua_grp.h"
 #include "libcasper/libcasper/lua_casper.h"
+#include "lookupcache.h"
 #include "utils.h"
 
 int luaopen_casper_grp(lua_State *);
@@ -60,14 +61,21 @@ l_cap_getgrnam(lua_State *L)
 {
 	struct group grp;
 	struct group *result;
+	struct lookupcache *cache;
 	cap_channel_t *chan;
 	const char *name;
 	char *buffer;
 	size_t bufsize;
-	int error;
+	int key, n, error;
 
 	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
 	name = luaL_checkstring(L, 2);
+	cache = optlookupcache(L, 3);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "grnam:%s", name);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = GRP_INITIAL_BUFSIZE;
 retry:
@@ -85,10 +93,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushgroup(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -97,14 +107,22 @@ l_cap_getgrgid(lua_State *L)
 {
 	struct group grp;
 	struct group *result;
+	struct lookupcache *cache;
 	cap_channel_t *chan;
 	char *buffer;
 	size_t bufsize;
 	gid_t gid;
-	int error;
+	int key, n, error;
 
 	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
 	gid = luaL_checkinteger(L, 2);
+	cache = optlookupcache(L, 3);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "grgid:%I",
+	    (lua_Integer)gid);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = GRP_INITIAL_BUFSIZE;
 retry:
@@ -122,10 +140,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushgroup(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -291,6 +311,8 @@ static const struct luaL_Reg l_grp_funcs[] = {
 int
 luaopen_casper_grp(lua_State *L)
 {
+	lookupcache_register(L);
+
 	luaL_newlib(L, l_grp_funcs);
 	return (1);
 }
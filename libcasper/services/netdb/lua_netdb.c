@@ -11,6 +11,7 @@
 #include <lauxlib.h>
 
 #include "libcasper/libcasper/lua_casper.h"
+#include "lookupcache.h"
 #include "netdb/lua_netdb.h"
 #include "utils.h"
 
@@ -22,15 +23,27 @@ l_cap_getprotobyname(lua_State *L)
 	cap_channel_t *capnetdb;
 	const char *name;
 	struct protoent *ent;
+	struct lookupcache *cache;
+	int key, n, error;
 
 	capnetdb = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
 	name = luaL_checkstring(L, 2);
+	cache = optlookupcache(L, 3);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "protonam:%s", name);
+	if (n != -1) {
+		return (n);
+	}
 
 	if ((ent = cap_getprotobyname(capnetdb, name)) == NULL) {
-		/* XXX: no reliable error info from cap_netdb, assume ENOENT */
+		/*
+		 * XXX: no reliable error info from cap_netdb, assume ENOENT.
+		 * A failed transfer looks the same, so don't cache it.
+		 */
 		return (0);
 	}
 	pushprotoent(L, ent);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -42,6 +55,8 @@ static const struct luaL_Reg l_netdb_funcs[] = {
 int
 luaopen_casper_netdb(lua_State *L)
 {
+	lookupcache_register(L);
+
 	luaL_newlib(L, l_netdb_funcs);
 	return (1);
 }
@@ -15,6 +15,7 @@
 #include <lauxlib.h>
 
 #include "libcasper/libcasper/lua_casper.h"
+#include "lookupcache.h"
 #include "pwd/lua_pwd.h"
 #include "utils.h"
 
@@ -60,14 +61,21 @@ l_cap_getpwnam(lua_State *L)
 {
 	struct passwd pwd;
 	struct passwd *result;
+	struct lookupcache *cache;
 	cap_channel_t *chan;
 	const char *name;
 	char *buffer;
 	size_t bufsize;
-	int error;
+	int key, n, error;
 
 	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
 	name = luaL_checkstring(L, 2);
+	cache = optlookupcache(L, 3);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "pwnam:%s", name);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = PWD_INITIAL_BUFSIZE;
 retry:
@@ -85,10 +93,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushpasswd(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -97,14 +107,22 @@ l_cap_getpwuid(lua_State *L)
 {
 	struct passwd pwd;
 	struct passwd *result;
+	struct lookupcache *cache;
 	cap_channel_t *chan;
 	char *buffer;
 	size_t bufsize;
 	uid_t uid;
-	int error;
+	int key, n, error;
 
 	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
 	uid = luaL_checkinteger(L, 2);
+	cache = optlookupcache(L, 3);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "pwuid:%I",
+	    (lua_Integer)uid);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = PWD_INITIAL_BUFSIZE;
 retry:
@@ -122,10 +140,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushpasswd(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -289,6 +309,8 @@ static const struct luaL_Reg l_pwd_funcs[] = {
 int
 luaopen_casper_pwd(lua_State *L)
 {
+	lookupcache_register(L);
+
 	luaL_newlib(L, l_pwd_funcs);
 	return (1);
 }
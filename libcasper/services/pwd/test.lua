@@ -8,5 +8,26 @@ assert(caph.enter_casper())
 local cappwd = assert(capcas:service_open('system.pwd'))
 capcas:close()
 local root = assert(pwd.getpwuid(cappwd, 0))
+do
+	local nv = require('nv')
+	assert(not pcall(cappwd.pipeline, cappwd, {depth=17}))
+	local pipeline <close> = assert(cappwd:pipeline({channels=2, depth=4}))
+	local ids = {}
+	for i = 1, 20 do
+		local nvl = nv.create()
+		nvl:add_string('cmd', 'getpwuid')
+		nvl:add_number('uid', 0)
+		ids[i] = assert(pipeline:send(nvl))
+	end
+	assert(pipeline:pending() == 20)
+	local reply = assert(pipeline:wait(ids[20]))
+	assert(reply:get_string('pw_name') == root.name)
+	local n = 1
+	for id, reply in pipeline.recv, pipeline do
+		assert(reply:get_string('pw_name') == root.name)
+		n = n + 1
+	end
+	assert(n == 20 and pipeline:pending() == 0)
+end
 cappwd:close()
 print(ucl.to_json(root))
@@ -5,9 +5,11 @@
  */
 
 #include <sys/param.h>
+#include <sys/dnv.h>
 #include <sys/nv.h>
 #include <sys/sysctl.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,18 +37,97 @@ struct cap_mib {
 	char *description;
 };
 
+/* Requests in flight at once in a batch, small enough not to fill a buffer. */
+#define CAP_SYSCTL_WINDOW 16
+
+/* Initial read size for strings and opaque values in a batch. */
+#define CAP_SYSCTL_GUESS 1024
+
 int luaopen_casper_sysctl(lua_State *);
 
+/*
+ * Names and formats are cached in the registry for the life of the Lua state,
+ * keyed by name and by oid respectively, so new mib objects for the same
+ * sysctl skip the lookups.
+ */
+static inline void
+cap_mib_pushoid(lua_State *L, const struct cap_mib *mib)
+{
+	lua_pushlstring(L, (const char *)mib->oid, mib->oidlen * sizeof(int));
+}
+
+static bool
+cap_sysctl_cachedmib(lua_State *L, const char *name, struct cap_mib *mib)
+{
+	size_t len;
+	const char *oid;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, cap_sysctl_cachedmib);
+	if (lua_getfield(L, -1, name) == LUA_TNIL) {
+		lua_pop(L, 2);
+		return (false);
+	}
+	oid = lua_tolstring(L, -1, &len);
+	memcpy(mib->oid, oid, len);
+	mib->oidlen = len / sizeof(int);
+	lua_pop(L, 2);
+	return (true);
+}
+
+static void
+cap_sysctl_cachemib(lua_State *L, const char *name, const struct cap_mib *mib)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, cap_sysctl_cachedmib);
+	cap_mib_pushoid(L, mib);
+	lua_setfield(L, -2, name);
+	lua_pop(L, 1);
+}
+
+static bool
+cap_mib_cachedformat(lua_State *L, struct cap_mib *mib)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, cap_mib_cachedformat);
+	cap_mib_pushoid(L, mib);
+	if (lua_rawget(L, -2) == LUA_TNIL) {
+		lua_pop(L, 2);
+		return (false);
+	}
+	lua_rawgeti(L, -1, 1);
+	mib->kind = lua_tointeger(L, -1);
+	lua_rawgeti(L, -2, 2);
+	mib->format = strdup(lua_tostring(L, -1));
+	lua_pop(L, 4);
+	if (mib->format == NULL) {
+		return (fatal(L, "strdup", errno));
+	}
+	return (true);
+}
+
+/* Set the format from a CTL_SYSCTL_OIDFMT reply and cache it. */
+static void
+cap_mib_setformat(lua_State *L, struct cap_mib *mib, const char *buf)
+{
+	mib->kind = *(const u_int *)buf;
+	mib->format = strdup(buf + sizeof(u_int));
+	if (mib->format == NULL) {
+		fatal(L, "strdup", errno);
+	}
+	lua_rawgetp(L, LUA_REGISTRYINDEX, cap_mib_cachedformat);
+	cap_mib_pushoid(L, mib);
+	lua_createtable(L, 2, 0);
+	lua_pushinteger(L, mib->kind);
+	lua_rawseti(L, -2, 1);
+	lua_pushstring(L, mib->format);
+	lua_rawseti(L, -2, 2);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+/* Push a new mib for name, or the root if NULL.  Returns an errno. */
 static int
-l_cap_sysctl(lua_State *L)
+cap_sysctl_newmib(lua_State *L, cap_channel_t *chan, const char *name)
 {
-	cap_channel_t *chan;
 	struct cap_mib *mib;
-	const char *name;
-	int error;
-
-	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
-	name = luaL_optstring(L, 2, NULL);
 
 	mib = lua_newuserdatauv(L, sizeof(*mib), 0);
 	memset(mib, 0, sizeof(*mib));
@@ -55,10 +136,15 @@ l_cap_sysctl(lua_State *L)
 		mib->oidlen = 1;
 		mib->prefix = 0;
 	} else {
-		mib->oidlen = nitems(mib->oid);
-		error = sysctlnametomib(name, mib->oid, &mib->oidlen);
-		if (error != 0) {
-			return (fail(L, errno));
+		if (!cap_sysctl_cachedmib(L, name, mib)) {
+			mib->oidlen = nitems(mib->oid);
+			if (sysctlnametomib(name, mib->oid, &mib->oidlen) != 0) {
+				int error = errno;
+
+				lua_pop(L, 1);
+				return (error);
+			}
+			cap_sysctl_cachemib(L, name, mib);
 		}
 		mib->prefix = mib->oidlen * sizeof(int);
 		mib->name = strdup(name);
@@ -68,9 +154,35 @@ l_cap_sysctl(lua_State *L)
 	}
 	mib->chan = chan;
 	luaL_setmetatable(L, CAP_MIB_METATABLE);
+	return (0);
+}
+
+static int
+l_cap_sysctl(lua_State *L)
+{
+	cap_channel_t *chan;
+	const char *name;
+	int error;
+
+	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
+	name = luaL_optstring(L, 2, NULL);
+
+	if ((error = cap_sysctl_newmib(L, chan, name)) != 0) {
+		return (fail(L, error));
+	}
 	return (1);
 }
 
+static int
+l_cap_sysctl_flush_cache(lua_State *L)
+{
+	lua_newtable(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, cap_sysctl_cachedmib);
+	lua_newtable(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, cap_mib_cachedformat);
+	return (0);
+}
+
 static int
 l_cap_mib_gc(lua_State *L)
 {
@@ -104,7 +216,7 @@ l_cap_mib_format(lua_State *L)
 	struct cap_mib *mib;
 
 	mib = luaL_checkudata(L, 1, CAP_MIB_METATABLE);
-	if (mib->format == NULL) {
+	if (mib->format == NULL && !cap_mib_cachedformat(L, mib)) {
 		char buf[BUFSIZ];
 		int qoid[CTL_MAXNAME+2];
 		size_t length;
@@ -120,11 +232,7 @@ l_cap_mib_format(lua_State *L)
 		if (error != 0) {
 			return (fail(L, errno));
 		}
-		mib->kind = *(u_int *)buf;
-		mib->format = strdup(buf + sizeof(u_int));
-		if (mib->format == NULL) {
-			return (fatal(L, "strdup", errno));
-		}
+		cap_mib_setformat(L, mib, buf);
 	}
 	lua_pushinteger(L, mib->kind);
 	lua_pushstring(L, mib->format);
@@ -197,6 +305,89 @@ l_cap_mib_description(lua_State *L)
 	return (1);
 }
 
+/* Read a value, growing the buffer as needed.  Returns an errno. */
+static int
+cap_mib_read(lua_State *L, struct cap_mib *mib, void **pp, size_t *sizep)
+{
+	void *p;
+	size_t size;
+	int error;
+
+	p = NULL;
+	size = 0;
+	for (;;) {
+		if (cap_sysctl(mib->chan, mib->oid, mib->oidlen, p, &size, NULL,
+		    0) == -1) {
+			if ((error = errno) != ENOMEM) {
+				free(p);
+				return (error);
+			}
+		} else if (p != NULL) {
+			break;
+		}
+		free(p);
+		size *= 2; /* in case it grows */
+		if ((p = malloc(size)) == NULL) {
+			return (fatal(L, "malloc", ENOMEM));
+		}
+	}
+	*pp = p;
+	*sizep = size;
+	return (0);
+}
+
+static bool
+pushctlvalue(lua_State *L, int ctltype, const void *p, size_t size)
+{
+	switch (ctltype) {
+	case CTLTYPE_INT:
+		lua_pushinteger(L, *(const int *)p);
+		break;
+	case CTLTYPE_UINT:
+		lua_pushinteger(L, *(const u_int *)p);
+		break;
+	case CTLTYPE_LONG:
+		lua_pushinteger(L, *(const long *)p);
+		break;
+	case CTLTYPE_ULONG:
+		lua_pushinteger(L, *(const u_long *)p);
+		break;
+	case CTLTYPE_S8:
+		lua_pushinteger(L, *(const int8_t *)p);
+		break;
+	case CTLTYPE_U8:
+		lua_pushinteger(L, *(const uint8_t *)p);
+		break;
+	case CTLTYPE_S16:
+		lua_pushinteger(L, *(const int16_t *)p);
+		break;
+	case CTLTYPE_U16:
+		lua_pushinteger(L, *(const uint16_t *)p);
+		break;
+	case CTLTYPE_S32:
+		lua_pushinteger(L, *(const int32_t *)p);
+		break;
+	case CTLTYPE_U32:
+		lua_pushinteger(L, *(const uint32_t *)p);
+		break;
+	case CTLTYPE_S64:
+		lua_pushinteger(L, *(const int64_t *)p);
+		break;
+	case CTLTYPE_U64:
+		lua_pushinteger(L, *(const uint64_t *)p);
+		break;
+	case CTLTYPE_STRING:
+		lua_pushlstring(L, p, size > 0 ? size - 1 : 0);
+		break;
+	case CTLTYPE_OPAQUE:
+		lua_pushlstring(L, p, size);
+		break;
+	default:
+		return (false);
+	}
+	return (true);
+}
+
 static int
 l_cap_mib_value(lua_State *L)
 {
@@ -216,68 +407,11 @@ l_cap_mib_value(lua_State *L)
 			lua_pushnil(L);
 			return (1);
 		}
-		p = NULL;
-		size = 0;
-		for (;;) {
-			if (cap_sysctl(mib->chan, mib->oid, mib->oidlen, p,
-			    &size, NULL, 0) == -1) {
-				if ((error = errno) != ENOMEM) {
-					free(p);
-					return (fail(L, error));
-				}
-			} else if (p != NULL) {
-				break;
-			}
-			free(p);
-			size *= 2; /* in case it grows */
-			if ((p = malloc(size)) == NULL) {
-				return (fatal(L, "malloc", ENOMEM));
-			}
+		if ((error = cap_mib_read(L, mib, &p, &size)) != 0) {
+			return (fail(L, error));
 		}
-		switch (ctltype) {
-		case CTLTYPE_INT:
-			lua_pushinteger(L, *(int *)p);
-			break;
-		case CTLTYPE_UINT:
-			lua_pushinteger(L, *(u_int *)p);
-			break;
-		case CTLTYPE_LONG:
-			lua_pushinteger(L, *(long *)p);
-			break;
-		case CTLTYPE_ULONG:
-			lua_pushinteger(L, *(u_long *)p);
-			break;
-		case CTLTYPE_S8:
-			lua_pushinteger(L, *(int8_t *)p);
-			break;
-		case CTLTYPE_U8:
-			lua_pushinteger(L, *(uint8_t *)p);
-			break;
-		case CTLTYPE_S16:
-			lua_pushinteger(L, *(int16_t *)p);
-			break;
-		case CTLTYPE_U16:
-			lua_pushinteger(L, *(uint16_t *)p);
-			break;
-		case CTLTYPE_S32:
-			lua_pushinteger(L, *(int32_t *)p);
-			break;
-		case CTLTYPE_U32:
-			lua_pushinteger(L, *(uint32_t *)p);
-			break;
-		case CTLTYPE_S64:
-			lua_pushinteger(L, *(int64_t *)p);
-			break;
-		case CTLTYPE_U64:
-			lua_pushinteger(L, *(uint64_t *)p);
-			break;
-		case CTLTYPE_STRING:
-			lua_pushlstring(L, p, size - 1);
-			break;
-		case CTLTYPE_OPAQUE:
-			lua_pushlstring(L, p, size);
-			break;
-		default:
+		if (!pushctlvalue(L, ctltype, p, size)) {
+			free(p);
 			return (luaL_error(L, "unknown ctltype: %d", ctltype));
 		}
 		free(p);
@@ -456,6 +590,239 @@ l_cap_mib_iter_noskip(lua_State *L)
 	return (3);
 }
 
+/*
+ * The service answers one request per message, so a batch keeps a window of
+ * reads in flight on the channel before collecting the replies in order.
+ */
+static void
+cap_sysctl_xfer(cap_channel_t *chan, nvlist_t **reqs, int n)
+{
+	int sent;
+
+	for (sent = 0; sent < n; sent++) {
+		if (cap_send_nvlist(chan, reqs[sent]) == -1) {
+			break;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		nvlist_destroy(reqs[i]);
+		reqs[i] = i < sent ? cap_recv_nvlist(chan) : NULL;
+	}
+}
+
+/*
+ * Build a read request in cap_sysctl's private wire format, which libcasper
+ * doesn't export: the nvlist that cap_sysctl(3) itself sends and that
+ * sysctl_command() in lib/libcasper/services/cap_sysctl/cap_sysctl.c takes,
+ * as of FreeBSD 13.0.  Replies carry "error", or "oldp" and "oldlen".  Check
+ * this against that file if the service changes.
+ */
+static nvlist_t *
+cap_sysctl_readreq(const int *oid, size_t oidlen, size_t oldlen)
+{
+	nvlist_t *nvl;
+
+	nvl = nvlist_create(0);
+	nvlist_add_string(nvl, "cmd", "sysctl");
+	nvlist_add_binary(nvl, "mib", oid, oidlen * sizeof(int));
+	nvlist_add_number(nvl, "operation", CAP_SYSCTL_READ);
+	nvlist_add_number(nvl, "oldlen", oldlen);
+	return (nvl);
+}
+
+/* Returns the reply data or sets *error, treating a lost reply as EIO. */
+static const void *
+cap_sysctl_reply(const nvlist_t *nvl, size_t *sizep, int *error)
+{
+	if (nvl == NULL) {
+		*error = EIO;
+		return (NULL);
+	}
+	if ((*error = dnvlist_get_number(nvl, "error", 0)) != 0) {
+		return (NULL);
+	}
+	if (!nvlist_exists_binary(nvl, "oldp")) {
+		*sizep = 0;
+		return ("");
+	}
+	return (nvlist_get_binary(nvl, "oldp", sizep));
+}
+
+static size_t
+cap_sysctl_guess(int ctltype)
+{
+	switch (ctltype) {
+	case CTLTYPE_INT:
+	case CTLTYPE_UINT:
+	case CTLTYPE_S32:
+	case CTLTYPE_U32:
+		return (sizeof(int32_t));
+	case CTLTYPE_LONG:
+	case CTLTYPE_ULONG:
+		return (sizeof(long));
+	case CTLTYPE_S8:
+	case CTLTYPE_U8:
+		return (sizeof(int8_t));
+	case CTLTYPE_S16:
+	case CTLTYPE_U16:
+		return (sizeof(int16_t));
+	case CTLTYPE_S64:
+	case CTLTYPE_U64:
+		return (sizeof(int64_t));
+	default:
+		return (CAP_SYSCTL_GUESS);
+	}
+}
+
+/* Fetch the formats not already known, a window at a time. */
+static void
+cap_sysctl_formats(lua_State *L, cap_channel_t *chan, struct cap_mib **mibs,
+    int *errors, int n)
+{
+	nvlist_t *reqs[CAP_SYSCTL_WINDOW];
+	int which[CAP_SYSCTL_WINDOW];
+	int i, nreqs;
+
+	i = 0;
+	while (i < n) {
+		for (nreqs = 0; i < n && nreqs < CAP_SYSCTL_WINDOW; i++) {
+			int qoid[CTL_MAXNAME+2];
+			struct cap_mib *mib = mibs[i];
+
+			if (mib == NULL || mib->format != NULL ||
+			    cap_mib_cachedformat(L, mib)) {
+				continue;
+			}
+			qoid[0] = CTL_SYSCTL;
+			qoid[1] = CTL_SYSCTL_OIDFMT;
+			memcpy(qoid + 2, mib->oid, mib->oidlen * sizeof(int));
+			reqs[nreqs] = cap_sysctl_readreq(qoid, mib->oidlen + 2,
+			    BUFSIZ);
+			which[nreqs++] = i;
+		}
+		cap_sysctl_xfer(chan, reqs, nreqs);
+		for (int j = 0; j < nreqs; j++) {
+			char buf[BUFSIZ];
+			const void *p;
+			size_t size;
+			int k = which[j];
+
+			p = cap_sysctl_reply(reqs[j], &size, &errors[k]);
+			if (p != NULL && size > sizeof(u_int)) {
+				memset(buf, 0, sizeof(buf));
+				memcpy(buf, p, MIN(size, sizeof(buf) - 1));
+				cap_mib_setformat(L, mibs[k], buf);
+			} else if (errors[k] == 0) {
+				errors[k] = EIO;
+			}
+			if (reqs[j] != NULL) {
+				nvlist_destroy(reqs[j]);
+			}
+		}
+	}
+}
+
+static int
+l_cap_sysctl_values(lua_State *L)
+{
+	nvlist_t *reqs[CAP_SYSCTL_WINDOW];
+	int which[CAP_SYSCTL_WINDOW];
+	cap_channel_t *chan;
+	struct cap_mib **mibs;
+	int *errors;
+	int i, n, nreqs;
+
+	chan = checkcookie(L, 1, CAP_CHANNEL_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	n = luaL_len(L, 2);
+	mibs = lua_newuserdatauv(L, n * sizeof(*mibs) + n * sizeof(*errors), 0);
+	errors = (int *)(mibs + n);
+	lua_createtable(L, n, 0); /* keeps the mibs for names alive */
+	for (i = 0; i < n; i++) {
+		errors[i] = 0;
+		mibs[i] = NULL;
+		if (lua_rawgeti(L, 2, i + 1) == LUA_TSTRING) {
+			errors[i] = cap_sysctl_newmib(L, chan,
+			    lua_tostring(L, -1));
+			if (errors[i] == 0) {
+				mibs[i] = lua_touserdata(L, -1);
+				lua_rawseti(L, -3, i + 1);
+			}
+		} else {
+			mibs[i] = luaL_testudata(L, -1, CAP_MIB_METATABLE);
+			luaL_argcheck(L, mibs[i] != NULL, 2,
+			    "expected names or mibs");
+			luaL_argcheck(L, mibs[i]->chan == chan, 2,
+			    "mib from another channel");
+		}
+		lua_pop(L, 1);
+	}
+
+	cap_sysctl_formats(L, chan, mibs, errors, n);
+
+	i = 0;
+	while (i < n) {
+		for (nreqs = 0; i < n && nreqs < CAP_SYSCTL_WINDOW; i++) {
+			struct cap_mib *mib = mibs[i];
+			int ctltype;
+
+			if (errors[i] != 0) {
+				continue;
+			}
+			ctltype = mib->kind & CTLTYPE;
+			if (ctltype == CTLTYPE_NODE) {
+				errors[i] = EISDIR;
+				continue;
+			}
+			reqs[nreqs] = cap_sysctl_readreq(mib->oid, mib->oidlen,
+			    cap_sysctl_guess(ctltype));
+			which[nreqs++] = i;
+		}
+		cap_sysctl_xfer(chan, reqs, nreqs);
+		for (int j = 0; j < nreqs; j++) {
+			struct cap_mib *mib;
+			const void *p;
+			void *buf;
+			size_t size;
+			int k = which[j];
+
+			mib = mibs[k];
+			buf = NULL;
+			p = cap_sysctl_reply(reqs[j], &size, &errors[k]);
+			if (errors[k] == ENOMEM) {
+				/* Outgrew the guess, fall back to probing. */
+				errors[k] = cap_mib_read(L, mib, &buf, &size);
+				p = buf;
+			}
+			if (errors[k] == 0) {
+				if (!pushctlvalue(L, mib->kind & CTLTYPE, p,
+				    size)) {
+					errors[k] = EINVAL;
+				} else {
+					lua_rawseti(L, -2, k + 1);
+				}
+			}
+			free(buf);
+			if (reqs[j] != NULL) {
+				nvlist_destroy(reqs[j]);
+			}
+		}
+	}
+
+	/* Reuse the table of mibs for the results. */
+	lua_createtable(L, 0, 0);
+	for (i = 0; i < n; i++) {
+		if (errors[i] != 0) {
+			lua_pushboolean(L, false);
+			lua_rawseti(L, -3, i + 1);
+			lua_pushstring(L, strerror(errors[i]));
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+	return (2);
+}
+
 static int
 l_cap_sysctl_limit_init(lua_State *L)
 {
@@ -532,6 +899,8 @@ l_cap_sysctl_limit(lua_State *L)
 
 static const struct luaL_Reg l_cap_sysctl_funcs[] = {
 	{"sysctl", l_cap_sysctl},
+	{"values", l_cap_sysctl_values},
+	{"flush_cache", l_cap_sysctl_flush_cache},
 	{NULL, NULL}
 };
 
@@ -569,6 +938,8 @@ luaopen_casper_sysctl(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_cap_sysctl_limit_meta, 0);
 
+	(void)l_cap_sysctl_flush_cache(L);
+
 	luaL_newlib(L, l_cap_sysctl_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushinteger(L, CAP_SYSCTL_ ## ident); \
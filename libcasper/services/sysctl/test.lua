@@ -15,4 +15,13 @@ for mib in sysctl.sysctl(capsysctl, 'kstat.zfs'):iter() do
 	print(mib:name(), mib:value())
 end
 
+local names = {'kern.ostype', 'kern.maxproc', 'kern', 'no.such.sysctl'}
+local values, errors = sysctl.values(capsysctl, names)
+assert(values[1] == sysctl.sysctl(capsysctl, 'kern.ostype'):value())
+assert(math.type(values[2]) == 'integer')
+assert(values[3] == false and errors[3])
+assert(values[4] == false and errors[4])
+assert(errors[1] == nil and errors[2] == nil)
+sysctl.flush_cache()
+
 capsysctl:close()
@@ -1,17 +1,32 @@
 /*
- * Copyright (c) 2025 Ryan Moeller
+ * Copyright (c) 2025-2026 Ryan Moeller
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
 #include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <fetch.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "parallel.h"
+#include "utils.h"
+
+#define DOWNLOADER_METATABLE "fetch.downloader"
+
 int luaopen_fetch(lua_State *);
 
 static int
@@ -34,26 +49,50 @@ newstream(lua_State *L, FILE *f)
 	stream->closef = closestream;
 }
 
+/*
+ * libfetch reports errors in process globals, and the downloader calls it from
+ * several threads.  Every call that can fail is made with fetch_lock held
+ * until its error has been copied out with fetcherr_save().
+ */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fetcherror {
+	int code;		/* FETCH_* */
+	char msg[MAXERRSTRING];
+};
+
+static void
+fetcherr_save(struct fetcherror *err)
+{
+	err->code = fetchLastErrCode;
+	strlcpy(err->msg, fetchLastErrString, sizeof(err->msg));
+}
+
 static int
-fetcherr(lua_State *L)
+fetcherr(lua_State *L, const struct fetcherror *err)
 {
 	luaL_pushfail(L);
-	lua_pushstring(L, fetchLastErrString);
-	lua_pushinteger(L, fetchLastErrCode);
+	lua_pushstring(L, err->msg);
+	lua_pushinteger(L, err->code);
 	return (3);
 }
 
 static int
 l_fetch_get(lua_State *L)
 {
+	struct fetcherror err;
 	const char *URL, *flags;
 	FILE *f;
 
 	URL = luaL_checkstring(L, 1);
 	flags = luaL_optstring(L, 2, NULL);
-	f = fetchGetURL(URL, flags);
+	pthread_mutex_lock(&fetch_lock);
+	if ((f = fetchGetURL(URL, flags)) == NULL) {
+		fetcherr_save(&err);
+	}
+	pthread_mutex_unlock(&fetch_lock);
 	if (f == NULL) {
-		return (fetcherr(L));
+		return (fetcherr(L, &err));
 	}
 	newstream(L, f);
 	return (1);
@@ -62,14 +101,19 @@ l_fetch_get(lua_State *L)
 static int
 l_fetch_put(lua_State *L)
 {
+	struct fetcherror err;
 	const char *URL, *flags;
 	FILE *f;
 
 	URL = luaL_checkstring(L, 1);
 	flags = luaL_optstring(L, 2, NULL);
-	f = fetchPutURL(URL, flags);
+	pthread_mutex_lock(&fetch_lock);
+	if ((f = fetchPutURL(URL, flags)) == NULL) {
+		fetcherr_save(&err);
+	}
+	pthread_mutex_unlock(&fetch_lock);
 	if (f == NULL) {
-		return (fetcherr(L));
+		return (fetcherr(L, &err));
 	}
 	newstream(L, f);
 	return (1);
@@ -93,15 +137,20 @@ newurlstat(lua_State *L, struct url_stat *stat)
 static int
 l_fetch_xget(lua_State *L)
 {
+	struct fetcherror err;
 	struct url_stat stat;
 	const char *URL, *flags;
 	FILE *f;
 
 	URL = luaL_checkstring(L, 1);
 	flags = luaL_optstring(L, 2, NULL);
-	f = fetchXGetURL(URL, &stat, flags);
+	pthread_mutex_lock(&fetch_lock);
+	if ((f = fetchXGetURL(URL, &stat, flags)) == NULL) {
+		fetcherr_save(&err);
+	}
+	pthread_mutex_unlock(&fetch_lock);
 	if (f == NULL) {
-		return (fetcherr(L));
+		return (fetcherr(L, &err));
 	}
 	newstream(L, f);
 	newurlstat(L, &stat);
@@ -111,15 +160,20 @@ l_fetch_xget(lua_State *L)
 static int
 l_fetch_stat(lua_State *L)
 {
+	struct fetcherror err;
 	struct url_stat stat;
 	const char *URL, *flags;
 	int res;
 
 	URL = luaL_checkstring(L, 1);
 	flags = luaL_optstring(L, 2, NULL);
-	res = fetchStatURL(URL, &stat, flags);
+	pthread_mutex_lock(&fetch_lock);
+	if ((res = fetchStatURL(URL, &stat, flags)) == -1) {
+		fetcherr_save(&err);
+	}
+	pthread_mutex_unlock(&fetch_lock);
 	if (res == -1) {
-		return (fetcherr(L));
+		return (fetcherr(L, &err));
 	}
 	newurlstat(L, &stat);
 	return (1);
@@ -144,14 +198,19 @@ newentlist(lua_State *L, struct url_ent *ents)
 static int
 l_fetch_list(lua_State *L)
 {
+	struct fetcherror err;
 	const char *URL, *flags;
 	struct url_ent *ents;
 
 	URL = luaL_checkstring(L, 1);
 	flags = luaL_optstring(L, 2, NULL);
-	ents = fetchListURL(URL, flags);
+	pthread_mutex_lock(&fetch_lock);
+	if ((ents = fetchListURL(URL, flags)) == NULL) {
+		fetcherr_save(&err);
+	}
+	pthread_mutex_unlock(&fetch_lock);
 	if (ents == NULL) {
-		return (fetcherr(L));
+		return (fetcherr(L, &err));
 	}
 	newentlist(L, ents);
 	free(ents);
@@ -161,6 +220,7 @@ l_fetch_list(lua_State *L)
 static int
 l_fetch_request(lua_State *L)
 {
+	struct fetcherror err;
 	const char *URL, *method, *flags, *content_type, *body;
 	struct url *u;
 	FILE *f;
@@ -170,19 +230,661 @@ l_fetch_request(lua_State *L)
 	flags = luaL_optstring(L, 3, NULL);
 	content_type = luaL_optstring(L, 4, NULL);
 	body = luaL_optstring(L, 5, NULL);
-	u = fetchParseURL(URL);
-	if (u == NULL) {
-		return (fetcherr(L));
+	pthread_mutex_lock(&fetch_lock);
+	if ((u = fetchParseURL(URL)) == NULL) {
+		f = NULL;
+	} else {
+		f = fetchReqHTTP(u, method, flags, content_type, body);
+		fetchFreeURL(u);
 	}
-	f = fetchReqHTTP(u, method, flags, content_type, body);
-	fetchFreeURL(u);
 	if (f == NULL) {
-		return (fetcherr(L));
+		fetcherr_save(&err);
+	}
+	pthread_mutex_unlock(&fetch_lock);
+	if (f == NULL) {
+		return (fetcherr(L, &err));
 	}
 	newstream(L, f);
 	return (1);
 }
 
+/*
+ * Download manager: a pool of worker threads pulls work items off a shared
+ * queue.  Each job begins with a probe item that stats the URL and opens the
+ * destination file, then splits the remaining bytes into segments which are
+ * fetched with restart offsets (HTTP Range requests) and written directly to
+ * the file with pwrite(2).  Lua only ever sees the bookkeeping.
+ */
+
+#define DL_BUFSIZE (64 * 1024)
+
+struct dljob;
+
+struct dlseg {
+	STAILQ_ENTRY(dlseg) link;
+	struct dljob *job;
+	off_t start;
+	off_t len;		/* -1 reads until EOF */
+	_Atomic(off_t) done;
+};
+
+struct dljob {
+	char *url;
+	char *path;
+	char *flags;
+	int maxsegs;
+	bool resume;
+	int fd;
+	struct url_stat stat;
+	off_t offset;		/* where this run started in the file */
+	_Atomic(off_t) bytes;	/* bytes present in the file */
+	struct dlseg probe;
+	struct dlseg *segs;
+	int nsegs;
+	int pending;
+	bool done;
+	int error;		/* errno, or 0 */
+	int errcode;		/* FETCH_*, or 0 */
+	char errmsg[MAXERRSTRING];
+};
+
+struct downloader {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	STAILQ_HEAD(, dlseg) queue;
+	struct dljob **jobs;
+	int njobs;
+	int maxjobs;
+	int active;
+	bool shutdown;
+	atomic_bool cancel;
+	off_t segsize;
+	int maxsegs;
+	int nthreads;
+	pthread_t threads[];
+};
+
+/* The following helpers must be called with dl->lock held. */
+
+static void
+dljob_seterror(struct dljob *job, int error)
+{
+	if (job->errmsg[0] != '\0') {
+		return;
+	}
+	job->error = error;
+	strerror_r(error, job->errmsg, sizeof(job->errmsg));
+}
+
+static void
+dljob_setfetcherr(struct dljob *job, int code, const char *msg)
+{
+	if (job->errmsg[0] != '\0') {
+		return;
+	}
+	job->errcode = code;
+	strlcpy(job->errmsg, msg, sizeof(job->errmsg));
+}
+
+static void
+dljob_finish(struct downloader *dl, struct dljob *job)
+{
+	if (job->fd != -1) {
+		if (job->errmsg[0] != '\0' && job->segs != NULL &&
+		    job->stat.size != -1) {
+			off_t end = job->offset;
+
+			/*
+			 * Keep only the contiguous prefix so the next run can
+			 * resume from the file size.
+			 */
+			for (int i = 0; i < job->nsegs; i++) {
+				struct dlseg *seg = &job->segs[i];
+				off_t done = atomic_load(&seg->done);
+
+				end = seg->start + done;
+				if (done != seg->len) {
+					break;
+				}
+			}
+			(void)ftruncate(job->fd, end);
+			atomic_store(&job->bytes, end);
+		}
+		if (job->stat.mtime > 0) {
+			struct timespec ts[2] = {
+				{ .tv_nsec = UTIME_OMIT },
+				{ .tv_sec = job->stat.mtime },
+			};
+
+			(void)futimens(job->fd, ts);
+		}
+		close(job->fd);
+		job->fd = -1;
+	}
+	job->done = true;
+	dl->active--;
+	pthread_cond_broadcast(&dl->idle);
+}
+
+static void
+dl_probe(struct downloader *dl, struct dljob *job)
+{
+	struct stat sb;
+	struct dlseg *segs;
+	off_t remain, segsize;
+	int nsegs, error;
+
+	if (atomic_load(&dl->cancel)) {
+		error = ECANCELED;
+		goto fail;
+	}
+	pthread_mutex_lock(&fetch_lock);
+	if (fetchStatURL(job->url, &job->stat, job->flags) == -1) {
+		struct fetcherror err;
+
+		fetcherr_save(&err);
+		pthread_mutex_unlock(&fetch_lock);
+		pthread_mutex_lock(&dl->lock);
+		dljob_setfetcherr(job, err.code, err.msg);
+		dljob_finish(dl, job);
+		pthread_mutex_unlock(&dl->lock);
+		return;
+	}
+	pthread_mutex_unlock(&fetch_lock);
+	if ((job->fd = open(job->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644))
+	    == -1 || fstat(job->fd, &sb) == -1) {
+		error = errno;
+		goto fail;
+	}
+	if (job->resume && job->stat.size != -1 && job->stat.mtime > 0 &&
+	    sb.st_mtime == job->stat.mtime && sb.st_size <= job->stat.size) {
+		job->offset = sb.st_size;
+	} else {
+		job->offset = 0;
+		if (ftruncate(job->fd, 0) == -1) {
+			error = errno;
+			goto fail;
+		}
+	}
+	atomic_store(&job->bytes, job->offset);
+
+	if (job->stat.size == -1) {
+		/* Unknown size, so no segmenting and no resuming. */
+		nsegs = 1;
+		remain = segsize = -1;
+	} else {
+		remain = job->stat.size - job->offset;
+		nsegs = MIN(howmany(remain, dl->segsize), job->maxsegs);
+		segsize = nsegs > 0 ? howmany(remain, nsegs) : 0;
+	}
+	if (nsegs == 0) {
+		pthread_mutex_lock(&dl->lock);
+		dljob_finish(dl, job);
+		pthread_mutex_unlock(&dl->lock);
+		return;
+	}
+	if ((segs = calloc(nsegs, sizeof(*segs))) == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+	for (int i = 0; i < nsegs; i++) {
+		segs[i].job = job;
+		segs[i].start = job->offset + i * segsize;
+		segs[i].len = segsize == -1 ? -1 :
+		    MIN(segsize, job->stat.size - segs[i].start);
+		atomic_init(&segs[i].done, 0);
+	}
+	pthread_mutex_lock(&dl->lock);
+	job->segs = segs;
+	job->nsegs = job->pending = nsegs;
+	for (int i = 0; i < nsegs; i++) {
+		STAILQ_INSERT_TAIL(&dl->queue, &segs[i], link);
+	}
+	pthread_cond_broadcast(&dl->work);
+	pthread_mutex_unlock(&dl->lock);
+	return;
+fail:
+	pthread_mutex_lock(&dl->lock);
+	dljob_seterror(job, error);
+	dljob_finish(dl, job);
+	pthread_mutex_unlock(&dl->lock);
+}
+
+static void
+dl_transfer(struct downloader *dl, struct dlseg *seg, char *buf)
+{
+	struct url_stat us;
+	struct fetcherror err;
+	struct dljob *job = seg->job;
+	struct url *u;
+	FILE *f = NULL;
+	const char *msg = NULL;
+	off_t pos, want;
+	size_t n;
+	ssize_t m;
+	int error = 0, code = 0;
+
+	if (atomic_load(&dl->cancel)) {
+		error = ECANCELED;
+		goto done;
+	}
+	pthread_mutex_lock(&fetch_lock);
+	if ((u = fetchParseURL(job->url)) == NULL) {
+		fetcherr_save(&err);
+		pthread_mutex_unlock(&fetch_lock);
+		code = err.code;
+		msg = err.msg;
+		goto done;
+	}
+	u->offset = seg->start;
+	if ((f = fetchXGet(u, &us, job->flags)) == NULL) {
+		fetcherr_save(&err);
+		pthread_mutex_unlock(&fetch_lock);
+		code = err.code;
+		msg = err.msg;
+		goto out;
+	}
+	pthread_mutex_unlock(&fetch_lock);
+	if (us.size != job->stat.size || us.mtime != job->stat.mtime) {
+		code = FETCH_UNAVAIL;
+		msg = "remote file changed during transfer";
+		goto out;
+	}
+	/* Skip ahead if the server ignored (part of) the requested range. */
+	for (pos = u->offset; pos < seg->start; pos += n) {
+		n = fread(buf, 1, MIN(DL_BUFSIZE, seg->start - pos), f);
+		if (n == 0) {
+			break;
+		}
+	}
+	for (want = seg->len; want != 0 && pos >= seg->start;) {
+		if (atomic_load(&dl->cancel)) {
+			error = ECANCELED;
+			goto out;
+		}
+		n = fread(buf, 1, want == -1 ? DL_BUFSIZE :
+		    MIN(DL_BUFSIZE, want), f);
+		if (n == 0) {
+			break;
+		}
+		for (size_t off = 0; off < n; off += m) {
+			if ((m = pwrite(job->fd, buf + off, n - off,
+			    pos + off)) == -1) {
+				error = errno;
+				goto out;
+			}
+		}
+		pos += n;
+		atomic_fetch_add(&seg->done, n);
+		atomic_fetch_add(&job->bytes, n);
+		if (want != -1) {
+			want -= n;
+		}
+	}
+	if (ferror(f)) {
+		error = errno != 0 ? errno : EIO;
+	} else if (want > 0 || pos < seg->start) {
+		code = FETCH_PROTO;
+		msg = "transfer ended prematurely";
+	}
+out:
+	if (f != NULL) {
+		fclose(f);
+	}
+	fetchFreeURL(u);
+done:
+	pthread_mutex_lock(&dl->lock);
+	if (error != 0) {
+		dljob_seterror(job, error);
+	} else if (msg != NULL) {
+		dljob_setfetcherr(job, code, msg);
+	}
+	if (--job->pending == 0) {
+		dljob_finish(dl, job);
+	}
+	pthread_mutex_unlock(&dl->lock);
+}
+
+static void *
+dl_worker(void *arg)
+{
+	struct downloader *dl = arg;
+	struct dlseg *seg;
+	char *buf;
+
+	buf = malloc(DL_BUFSIZE);
+	pthread_mutex_lock(&dl->lock);
+	for (;;) {
+		while ((seg = STAILQ_FIRST(&dl->queue)) == NULL &&
+		    !dl->shutdown) {
+			pthread_cond_wait(&dl->work, &dl->lock);
+		}
+		if (seg == NULL) {
+			break;
+		}
+		STAILQ_REMOVE_HEAD(&dl->queue, link);
+		pthread_mutex_unlock(&dl->lock);
+		if (seg == &seg->job->probe) {
+			dl_probe(dl, seg->job);
+		} else if (buf == NULL) {
+			pthread_mutex_lock(&dl->lock);
+			dljob_seterror(seg->job, ENOMEM);
+			if (--seg->job->pending == 0) {
+				dljob_finish(dl, seg->job);
+			}
+			pthread_mutex_unlock(&dl->lock);
+		} else {
+			dl_transfer(dl, seg, buf);
+		}
+		pthread_mutex_lock(&dl->lock);
+	}
+	pthread_mutex_unlock(&dl->lock);
+	free(buf);
+	return (NULL);
+}
+
+static void
+dljob_free(struct dljob *job)
+{
+	free(job->url);
+	free(job->path);
+	free(job->flags);
+	free(job->segs);
+	free(job);
+}
+
+static void
+dl_shutdown(struct downloader *dl, int nthreads)
+{
+	pthread_mutex_lock(&dl->lock);
+	dl->shutdown = true;
+	atomic_store(&dl->cancel, true);
+	pthread_cond_broadcast(&dl->work);
+	pthread_mutex_unlock(&dl->lock);
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(dl->threads[i], NULL);
+	}
+	for (int i = 0; i < dl->njobs; i++) {
+		dljob_free(dl->jobs[i]);
+	}
+	free(dl->jobs);
+	pthread_cond_destroy(&dl->idle);
+	pthread_cond_destroy(&dl->work);
+	pthread_mutex_destroy(&dl->lock);
+	free(dl);
+}
+
+static int
+l_fetch_downloader(lua_State *L)
+{
+	struct downloader *dl;
+	lua_Integer nthreads, segsize, maxsegs;
+	int error;
+
+	nthreads = 4;
+	segsize = 8 * 1024 * 1024;
+	maxsegs = 4;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (lua_getfield(L, 1, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 1, "segsize") != LUA_TNIL) {
+			segsize = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 1, "maxsegs") != LUA_TNIL) {
+			maxsegs = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 3);
+	}
+	luaL_argcheck(L, nthreads > 0 && nthreads <= 1024, 1,
+	    "invalid threads");
+	luaL_argcheck(L, segsize > 0, 1, "invalid segsize");
+	luaL_argcheck(L, maxsegs > 0 && maxsegs <= INT_MAX, 1,
+	    "invalid maxsegs");
+
+	if ((dl = calloc(1, sizeof(*dl) + nthreads * sizeof(pthread_t)))
+	    == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_mutex_init(&dl->lock, NULL);
+	pthread_cond_init(&dl->work, NULL);
+	pthread_cond_init(&dl->idle, NULL);
+	STAILQ_INIT(&dl->queue);
+	atomic_init(&dl->cancel, false);
+	dl->segsize = segsize;
+	dl->maxsegs = maxsegs;
+	dl->nthreads = nthreads;
+	for (int i = 0; i < nthreads; i++) {
+		if ((error = pthread_create(&dl->threads[i], NULL, dl_worker,
+		    dl)) != 0) {
+			dl_shutdown(dl, i);
+			return (fail(L, error));
+		}
+	}
+	return (new(L, dl, DOWNLOADER_METATABLE));
+}
+
+static int
+l_downloader_close(lua_State *L)
+{
+	struct downloader *dl;
+
+	dl = checkcookie(L, 1, DOWNLOADER_METATABLE);
+
+	dl_shutdown(dl, dl->nthreads);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
+static int
+l_downloader_gc(lua_State *L)
+{
+	struct downloader *dl;
+
+	dl = checkcookienull(L, 1, DOWNLOADER_METATABLE);
+
+	if (dl != NULL) {
+		dl_shutdown(dl, dl->nthreads);
+	}
+	return (0);
+}
+
+static int
+l_downloader_add(lua_State *L)
+{
+	struct downloader *dl;
+	struct dljob *job, **jobs;
+	const char *URL, *path, *flags;
+	int id, maxsegs;
+	bool resume;
+
+	dl = checkcookie(L, 1, DOWNLOADER_METATABLE);
+	URL = luaL_checkstring(L, 2);
+	path = luaL_checkstring(L, 3);
+	flags = NULL;
+	maxsegs = dl->maxsegs;
+	resume = true;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_getfield(L, 4, "flags") != LUA_TNIL) {
+			flags = luaL_checkstring(L, -1);
+		}
+		if (lua_getfield(L, 4, "maxsegs") != LUA_TNIL) {
+			maxsegs = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, maxsegs > 0, 4, "invalid maxsegs");
+		}
+		if (lua_getfield(L, 4, "resume") != LUA_TNIL) {
+			resume = lua_toboolean(L, -1);
+		}
+	}
+
+	if ((job = calloc(1, sizeof(*job))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	job->fd = -1;
+	job->maxsegs = maxsegs;
+	job->resume = resume;
+	job->probe.job = job;
+	atomic_init(&job->bytes, 0);
+	job->url = strdup(URL);
+	job->path = strdup(path);
+	if (flags != NULL) {
+		job->flags = strdup(flags);
+	}
+	if (job->url == NULL || job->path == NULL ||
+	    (flags != NULL && job->flags == NULL)) {
+		dljob_free(job);
+		return (fatal(L, "strdup", ENOMEM));
+	}
+
+	pthread_mutex_lock(&dl->lock);
+	if (dl->njobs == dl->maxjobs) {
+		int maxjobs = MAX(dl->maxjobs * 2, 16);
+
+		if ((jobs = reallocarray(dl->jobs, maxjobs, sizeof(*jobs)))
+		    == NULL) {
+			pthread_mutex_unlock(&dl->lock);
+			dljob_free(job);
+			return (fatal(L, "reallocarray", ENOMEM));
+		}
+		dl->jobs = jobs;
+		dl->maxjobs = maxjobs;
+	}
+	dl->jobs[dl->njobs++] = job;
+	id = dl->njobs;
+	dl->active++;
+	STAILQ_INSERT_TAIL(&dl->queue, &job->probe, link);
+	pthread_cond_signal(&dl->work);
+	pthread_mutex_unlock(&dl->lock);
+
+	lua_pushinteger(L, id);
+	return (1);
+}
+
+struct dlstatus {
+	const char *url;
+	const char *path;
+	struct url_stat stat;
+	off_t offset;
+	off_t bytes;
+	bool done;
+	int error;
+	int errcode;
+	char errmsg[MAXERRSTRING];
+};
+
+static void
+pushdlstatus(lua_State *L, struct downloader *dl, struct dljob *job)
+{
+	struct dlstatus st;
+
+	/* Snapshot under the lock, build the table without it. */
+	pthread_mutex_lock(&dl->lock);
+	st.url = job->url;
+	st.path = job->path;
+	st.stat = job->stat;
+	st.offset = job->offset;
+	st.bytes = atomic_load(&job->bytes);
+	st.done = job->done;
+	st.error = job->error;
+	st.errcode = job->errcode;
+	strlcpy(st.errmsg, job->errmsg, sizeof(st.errmsg));
+	pthread_mutex_unlock(&dl->lock);
+
+	lua_createtable(L, 0, 10);
+	lua_pushstring(L, st.url);
+	lua_setfield(L, -2, "url");
+	lua_pushstring(L, st.path);
+	lua_setfield(L, -2, "path");
+	lua_pushinteger(L, st.stat.size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, st.stat.mtime);
+	lua_setfield(L, -2, "mtime");
+	lua_pushinteger(L, st.offset);
+	lua_setfield(L, -2, "offset");
+	lua_pushinteger(L, st.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushboolean(L, st.done);
+	lua_setfield(L, -2, "done");
+	if (st.errmsg[0] != '\0') {
+		lua_pushstring(L, st.errmsg);
+		lua_setfield(L, -2, "errmsg");
+	}
+	if (st.errcode != 0) {
+		lua_pushinteger(L, st.errcode);
+		lua_setfield(L, -2, "errcode");
+	}
+	if (st.error != 0) {
+		lua_pushinteger(L, st.error);
+		lua_setfield(L, -2, "errno");
+	}
+}
+
+static int
+l_downloader_status(lua_State *L)
+{
+	struct downloader *dl;
+	int id, njobs;
+
+	dl = checkcookie(L, 1, DOWNLOADER_METATABLE);
+
+	pthread_mutex_lock(&dl->lock);
+	njobs = dl->njobs;
+	pthread_mutex_unlock(&dl->lock);
+
+	if (!lua_isnoneornil(L, 2)) {
+		id = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, id >= 1 && id <= njobs, 2, "invalid id");
+		pushdlstatus(L, dl, dl->jobs[id - 1]);
+		return (1);
+	}
+	lua_createtable(L, njobs, 0);
+	for (int i = 0; i < njobs; i++) {
+		pushdlstatus(L, dl, dl->jobs[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return (1);
+}
+
+static int
+l_downloader_wait(lua_State *L)
+{
+	struct downloader *dl;
+	lua_Number timeout;
+	int error, nfailed;
+
+	dl = checkcookie(L, 1, DOWNLOADER_METATABLE);
+	timeout = luaL_optnumber(L, 2, -1);
+
+	pthread_mutex_lock(&dl->lock);
+	error = parallel_wait(&dl->idle, &dl->lock, &dl->active, timeout);
+	nfailed = 0;
+	for (int i = 0; i < dl->njobs; i++) {
+		if (dl->jobs[i]->errmsg[0] != '\0') {
+			nfailed++;
+		}
+	}
+	pthread_mutex_unlock(&dl->lock);
+	if (error != 0) {
+		return (fail(L, error));
+	}
+	lua_pushinteger(L, nfailed);
+	return (1);
+}
+
+static int
+l_downloader_cancel(lua_State *L)
+{
+	struct downloader *dl;
+
+	dl = checkcookie(L, 1, DOWNLOADER_METATABLE);
+
+	atomic_store(&dl->cancel, true);
+	return (0);
+}
+
 static const struct luaL_Reg l_fetch_funcs[] = {
 	{"get", l_fetch_get},
 	{"put", l_fetch_put},
@@ -190,12 +892,29 @@ static const struct luaL_Reg l_fetch_funcs[] = {
 	{"stat", l_fetch_stat},
 	{"list", l_fetch_list},
 	{"request", l_fetch_request},
+	{"downloader", l_fetch_downloader},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_downloader_meta[] = {
+	{"__close", l_downloader_close},
+	{"__gc", l_downloader_gc},
+	{"close", l_downloader_close},
+	{"add", l_downloader_add},
+	{"status", l_downloader_status},
+	{"wait", l_downloader_wait},
+	{"cancel", l_downloader_cancel},
 	{NULL, NULL}
 };
 
 int
 luaopen_fetch(lua_State *L)
 {
+	luaL_newmetatable(L, DOWNLOADER_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_downloader_meta, 0);
+
 	luaL_newlib(L, l_fetch_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushinteger(L, FETCH_ ## ident); \
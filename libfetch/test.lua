@@ -0,0 +1,133 @@
+local fetch = require('fetch')
+local netdb = require('netdb')
+local pthread = require('pthread')
+local socket = require('sys.socket')
+
+-- Minimal HTTP/1.1 server with Range support, one request per connection.
+local function serve(s, data, lastmod)
+	local socket = require('sys.socket')
+	local unistd = require('unistd')
+
+	while true do
+		local c = assert(socket.accept(s))
+		local req = ''
+		repeat
+			local chunk = assert(socket.recv(c, 4096))
+			req = req .. chunk
+		until chunk == '' or req:find('\r\n\r\n', 1, true)
+		local method, target = req:match('^(%u+) (%S+)')
+		if target == '/quit' then
+			unistd.close(c)
+			break
+		end
+		local first, last = 0, #data - 1
+		local status = '200 OK'
+		local from, to = req:match('\r\n[Rr]ange: bytes=(%d*)-(%d*)')
+		if from and from ~= '' then
+			first = tonumber(from)
+			if to ~= '' then
+				last = math.min(tonumber(to), last)
+			end
+			status = '206 Partial Content'
+		end
+		local hdr = {
+			('HTTP/1.1 %s'):format(status),
+			'Connection: close',
+			('Last-Modified: %s'):format(lastmod),
+			('Content-Length: %d'):format(last - first + 1),
+		}
+		if status:match('^206') then
+			table.insert(hdr, ('Content-Range: bytes %d-%d/%d'):format(
+			    first, last, #data))
+		end
+		local msg = table.concat(hdr, '\r\n') .. '\r\n\r\n'
+		if method == 'GET' then
+			-- /short cuts off every range but the first halfway.
+			if target == '/short' and first > 0 then
+				last = first + (last - first) // 2
+			end
+			msg = msg .. data:sub(first + 1, last + 1)
+		end
+		-- Segmented clients hang up once they have their range.
+		local off = 1
+		while off <= #msg do
+			local n = socket.send(c, msg:sub(off, off + 65535),
+			    socket.MSG_NOSIGNAL)
+			if not n then
+				break
+			end
+			off = off + n
+		end
+		unistd.close(c)
+	end
+end
+
+local lines = {}
+for i = 1, 65536 do
+	lines[i] = ('%015d\n'):format(i)
+end
+local data = table.concat(lines)
+local mtime = 1700000000
+local lastmod = os.date('!%a, %d %b %Y %H:%M:%S GMT', mtime)
+
+local s = assert(socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0))
+local hints = {family=socket.AF_INET, socktype=socket.SOCK_STREAM}
+local ai = assert(netdb.getaddrinfo('127.0.0.1', '0', hints))[1]
+assert(socket.bind(s, ai.addr))
+assert(socket.listen(s))
+local flags = netdb.NI_NUMERICHOST | netdb.NI_NUMERICSERV
+local _, port = assert(netdb.getnameinfo(assert(socket.getsockname(s)), flags))
+local server = assert(pthread.create(serve, s, data, lastmod))
+
+local base = ('http://127.0.0.1:%s'):format(port)
+local dst = os.tmpname()
+do
+	local dl <close> = assert(fetch.downloader({segsize=64 * 1024}))
+	local id = dl:add(base .. '/data', dst)
+	assert(dl:wait() == 0, dl:status(id).errmsg)
+	local st = dl:status(id)
+	assert(st.done)
+	assert(st.size == #data)
+	assert(st.bytes == #data)
+	assert(st.mtime == mtime)
+
+	-- Already complete, so nothing is transferred.
+	id = dl:add(base .. '/data', dst)
+	assert(dl:wait() == 0, dl:status(id).errmsg)
+	assert(dl:status(id).offset == #data)
+end
+
+local f = assert(io.open(dst, 'rb'))
+assert(f:read('a') == data)
+f:close()
+os.remove(dst)
+
+do
+	local dl <close> = assert(fetch.downloader({segsize=64 * 1024}))
+	-- Only the first segment completes, so the file keeps just that.
+	local id = dl:add(base .. '/short', dst, {maxsegs=4})
+	assert(dl:wait() == 1)
+	local st = dl:status(id)
+	assert(st.errmsg)
+	assert(st.bytes == #data // 4)
+	f = assert(io.open(dst, 'rb'))
+	assert(f:read('a') == data:sub(1, #data // 4))
+	f:close()
+end
+do
+	-- The next run resumes from the prefix that was kept.
+	local dl <close> = assert(fetch.downloader({segsize=64 * 1024}))
+	local id = dl:add(base .. '/data', dst)
+	assert(dl:wait() == 0, dl:status(id).errmsg)
+	local st = dl:status(id)
+	assert(st.offset == #data // 4)
+	assert(st.bytes == #data)
+end
+
+f = assert(io.open(dst, 'rb'))
+assert(f:read('a') == data)
+f:close()
+os.remove(dst)
+
+fetch.get(base .. '/quit')
+assert(server:join())
@@ -4,22 +4,37 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sys/param.h>
 #include <sys/cnv.h>
 #include <sys/dnv.h>
+#include <sys/endian.h>
 #include <sys/nv.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
 
 #include "lua_nv.h"
 #include "utils.h"
 
 #define CNVLIST_METATABLE "nvlist_t cookie"
+#define NVSTREAM_METATABLE "nvlist_t stream"
+#define NVRPC_SERVER_METATABLE "nv rpc server"
+#define NVRPC_CLIENT_METATABLE "nv rpc client"
 
 #define NVLIST_TYPES(X) \
 	X(bool, BOOL) \
@@ -343,6 +358,401 @@ get_pararr(lua_State *L, const nvlist_t *nvl)
 	return (2);
 }
 
+/*
+ * Bulk conversion between nvlists and Lua tables.  The whole structure is
+ * walked in C, so marshalling a large message is one call instead of one per
+ * pair.
+ */
+
+static void
+totable(lua_State *L, const nvlist_t *nvl, int null)
+{
+	const char *name;
+	void *cookie;
+	size_t nitems;
+	int type;
+
+	luaL_checkstack(L, 3, NULL);
+	lua_newtable(L);
+	cookie = NULL;
+	while ((name = nvlist_next(nvl, &type, &cookie)) != NULL) {
+		switch (type) {
+		case NV_TYPE_NULL:
+			lua_pushvalue(L, null);
+			break;
+		case NV_TYPE_BOOL:
+			lua_pushboolean(L, cnvlist_get_bool(cookie));
+			break;
+		case NV_TYPE_NUMBER:
+			lua_pushinteger(L, cnvlist_get_number(cookie));
+			break;
+		case NV_TYPE_STRING:
+			lua_pushstring(L, cnvlist_get_string(cookie));
+			break;
+		case NV_TYPE_NVLIST:
+			totable(L, cnvlist_get_nvlist(cookie), null);
+			break;
+		case NV_TYPE_DESCRIPTOR:
+			lua_pushinteger(L, cnvlist_get_descriptor(cookie));
+			break;
+		case NV_TYPE_BINARY: {
+			const void *value;
+			size_t size;
+
+			value = cnvlist_get_binary(cookie, &size);
+			lua_pushlstring(L, value, size);
+			break;
+		}
+		case NV_TYPE_BOOL_ARRAY: {
+			const bool *value;
+
+			value = cnvlist_get_bool_array(cookie, &nitems);
+			lua_createtable(L, nitems, 0);
+			for (size_t i = 0; i < nitems; i++) {
+				lua_pushboolean(L, value[i]);
+				lua_rawseti(L, -2, i + 1);
+			}
+			break;
+		}
+		case NV_TYPE_NUMBER_ARRAY: {
+			const uint64_t *value;
+
+			value = cnvlist_get_number_array(cookie, &nitems);
+			lua_createtable(L, nitems, 0);
+			for (size_t i = 0; i < nitems; i++) {
+				lua_pushinteger(L, value[i]);
+				lua_rawseti(L, -2, i + 1);
+			}
+			break;
+		}
+		case NV_TYPE_STRING_ARRAY: {
+			const char * const *value;
+
+			value = cnvlist_get_string_array(cookie, &nitems);
+			lua_createtable(L, nitems, 0);
+			for (size_t i = 0; i < nitems; i++) {
+				lua_pushstring(L, value[i]);
+				lua_rawseti(L, -2, i + 1);
+			}
+			break;
+		}
+		case NV_TYPE_NVLIST_ARRAY: {
+			const nvlist_t * const *value;
+
+			value = cnvlist_get_nvlist_array(cookie, &nitems);
+			lua_createtable(L, nitems, 0);
+			for (size_t i = 0; i < nitems; i++) {
+				totable(L, value[i], null);
+				lua_rawseti(L, -2, i + 1);
+			}
+			break;
+		}
+		case NV_TYPE_DESCRIPTOR_ARRAY: {
+			const int *value;
+
+			value = cnvlist_get_descriptor_array(cookie, &nitems);
+			lua_createtable(L, nitems, 0);
+			for (size_t i = 0; i < nitems; i++) {
+				lua_pushinteger(L, value[i]);
+				lua_rawseti(L, -2, i + 1);
+			}
+			break;
+		}
+		default:
+			__unreachable();
+		}
+		lua_setfield(L, -2, name);
+	}
+}
+
+static inline int
+to_table(lua_State *L, const nvlist_t *nvl)
+{
+	if (lua_isnoneornil(L, 2)) {
+		lua_pushboolean(L, true);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "null") == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_pushboolean(L, true);
+		}
+	}
+	totable(L, nvl, lua_gettop(L));
+	return (1);
+}
+
+struct fromtable {
+	int types;	/* stack index of the name -> type policy, or 0 */
+	int seen;	/* stack index of the set of tables being converted */
+};
+
+static void fromtable(lua_State *, int, nvlist_t *, struct fromtable *);
+
+static int
+fromtable_policy(lua_State *L, const struct fromtable *ft, const char *name)
+{
+	int type;
+
+	if (ft->types == 0) {
+		return (NV_TYPE_NONE);
+	}
+	lua_getfield(L, ft->types, name);
+	type = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : NV_TYPE_NONE;
+	lua_pop(L, 1);
+	return (type);
+}
+
+static lua_Integer
+fromtable_integer(lua_State *L, int idx, const char *name)
+{
+	lua_Integer value;
+	int isnum;
+
+	value = lua_tointegerx(L, idx, &isnum);
+	if (!isnum) {
+		luaL_error(L, "%s: integer expected, got %s", name,
+		    luaL_typename(L, idx));
+	}
+	return (value);
+}
+
+/*
+ * Convert the table or nvlist at idx to a new nvlist owned by a userdata
+ * pushed onto the stack, so it is collected if conversion fails part way.
+ */
+static nvlist_t *
+fromtable_nvlist(lua_State *L, int idx, int flags, const char *name,
+    struct fromtable *ft)
+{
+	nvlist_t *nvl, *value;
+
+	idx = lua_absindex(L, idx);
+	if ((value = getanynvlist(L, idx)) != NULL) {
+		if (nvlist_error(value) != 0) {
+			luaL_error(L, "%s: nvlist has error", name);
+		}
+		if ((nvl = nvlist_clone(value)) == NULL) {
+			fatal(L, "nvlist_clone", errno);
+		}
+		new(L, nvl, NVLIST_METATABLE);
+	} else if (lua_istable(L, idx)) {
+		if ((nvl = nvlist_create(flags)) == NULL) {
+			fatal(L, "nvlist_create", ENOMEM);
+		}
+		new(L, nvl, NVLIST_METATABLE);
+		fromtable(L, idx, nvl, ft);
+	} else {
+		luaL_error(L, "%s: table or nvlist expected, got %s", name,
+		    luaL_typename(L, idx));
+		__unreachable();
+	}
+	return (nvl);
+}
+
+static void
+fromtable_array(lua_State *L, int idx, size_t nitems, nvlist_t *nvl,
+    const char *name, struct fromtable *ft)
+{
+	int type;
+
+	lua_rawgeti(L, idx, 1);
+	type = lua_type(L, -1);
+	lua_pop(L, 1);
+	switch (type) {
+	case LUA_TBOOLEAN: {
+		bool *value;
+
+		value = lua_newuserdatauv(L, nitems * sizeof(*value), 0);
+		for (size_t i = 0; i < nitems; i++) {
+			if (lua_rawgeti(L, idx, i + 1) != LUA_TBOOLEAN) {
+				luaL_error(L, "%s: mixed array", name);
+			}
+			value[i] = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+		nvlist_add_bool_array(nvl, name, value, nitems);
+		break;
+	}
+	case LUA_TNUMBER:
+		if (fromtable_policy(L, ft, name) == NV_TYPE_DESCRIPTOR_ARRAY) {
+			int *value;
+
+			value = lua_newuserdatauv(L, nitems * sizeof(*value),
+			    0);
+			for (size_t i = 0; i < nitems; i++) {
+				lua_rawgeti(L, idx, i + 1);
+				value[i] = fromtable_integer(L, -1, name);
+				lua_pop(L, 1);
+			}
+			nvlist_add_descriptor_array(nvl, name, value, nitems);
+		} else {
+			uint64_t *value;
+
+			value = lua_newuserdatauv(L, nitems * sizeof(*value),
+			    0);
+			for (size_t i = 0; i < nitems; i++) {
+				lua_rawgeti(L, idx, i + 1);
+				value[i] = fromtable_integer(L, -1, name);
+				lua_pop(L, 1);
+			}
+			nvlist_add_number_array(nvl, name, value, nitems);
+		}
+		break;
+	case LUA_TSTRING: {
+		const char **value;
+
+		/* The strings are kept alive by the table. */
+		value = lua_newuserdatauv(L, nitems * sizeof(*value), 0);
+		for (size_t i = 0; i < nitems; i++) {
+			size_t len;
+
+			if (lua_rawgeti(L, idx, i + 1) != LUA_TSTRING) {
+				luaL_error(L, "%s: mixed array", name);
+			}
+			value[i] = lua_tolstring(L, -1, &len);
+			if (strlen(value[i]) != len) {
+				luaL_error(L, "%s: string contains NUL", name);
+			}
+			lua_pop(L, 1);
+		}
+		nvlist_add_string_array(nvl, name, value, nitems);
+		break;
+	}
+	case LUA_TTABLE:
+	case LUA_TUSERDATA: {
+		nvlist_t **value;
+		int top;
+
+		luaL_checkstack(L, nitems + 1, name);
+		top = lua_gettop(L);
+		for (size_t i = 0; i < nitems; i++) {
+			lua_rawgeti(L, idx, i + 1);
+			fromtable_nvlist(L, -1, nvlist_flags(nvl), name, ft);
+			lua_remove(L, -2);
+		}
+		if ((value = malloc(nitems * sizeof(*value))) == NULL) {
+			fatal(L, "malloc", ENOMEM);
+		}
+		for (size_t i = 0; i < nitems; i++) {
+			value[i] = checkcookie(L, top + i + 1,
+			    NVLIST_METATABLE);
+			setcookie(L, top + i + 1, NULL);
+		}
+		nvlist_move_nvlist_array(nvl, name, value, nitems);
+		lua_settop(L, top);
+		return;
+	}
+	default:
+		luaL_error(L, "%s: unsupported array element type %s", name,
+		    lua_typename(L, type));
+	}
+	lua_pop(L, 1);
+}
+
+static void
+fromtable_value(lua_State *L, int idx, nvlist_t *nvl, const char *name,
+    struct fromtable *ft)
+{
+	idx = lua_absindex(L, idx);
+	switch (fromtable_policy(L, ft, name)) {
+	case NV_TYPE_NULL:
+		nvlist_add_null(nvl, name);
+		return;
+	case NV_TYPE_DESCRIPTOR:
+		nvlist_add_descriptor(nvl, name,
+		    fromtable_integer(L, idx, name));
+		return;
+	case NV_TYPE_BINARY: {
+		const void *value;
+		size_t len;
+
+		if ((value = lua_tolstring(L, idx, &len)) == NULL) {
+			luaL_error(L, "%s: string expected, got %s", name,
+			    luaL_typename(L, idx));
+		}
+		nvlist_add_binary(nvl, name, value, len);
+		return;
+	}
+	}
+	switch (lua_type(L, idx)) {
+	case LUA_TBOOLEAN:
+		nvlist_add_bool(nvl, name, lua_toboolean(L, idx));
+		break;
+	case LUA_TNUMBER:
+		nvlist_add_number(nvl, name, fromtable_integer(L, idx, name));
+		break;
+	case LUA_TSTRING: {
+		const char *value;
+		size_t len;
+
+		value = lua_tolstring(L, idx, &len);
+		if (strlen(value) != len) {
+			nvlist_add_binary(nvl, name, value, len);
+		} else {
+			nvlist_add_string(nvl, name, value);
+		}
+		break;
+	}
+	case LUA_TTABLE: {
+		size_t nitems, count;
+
+		if ((nitems = lua_rawlen(L, idx)) > 0) {
+			count = 0;
+			lua_pushnil(L);
+			while (lua_next(L, idx) != 0) {
+				count++;
+				lua_pop(L, 1);
+			}
+			if (count != nitems) {
+				luaL_error(L, "%s: mixed array and record",
+				    name);
+			}
+			fromtable_array(L, idx, nitems, nvl, name, ft);
+			break;
+		}
+	}
+		/* FALLTHROUGH */
+	case LUA_TUSERDATA: {
+		nvlist_t *value;
+
+		value = fromtable_nvlist(L, idx, nvlist_flags(nvl), name, ft);
+		nvlist_move_nvlist(nvl, name, value);
+		setcookie(L, -1, NULL);
+		lua_pop(L, 1);
+		break;
+	}
+	default:
+		luaL_error(L, "%s: unsupported type %s", name,
+		    luaL_typename(L, idx));
+	}
+}
+
+static void
+fromtable(lua_State *L, int idx, nvlist_t *nvl, struct fromtable *ft)
+{
+	luaL_checkstack(L, 4, NULL);
+	idx = lua_absindex(L, idx);
+	if (lua_rawgetp(L, ft->seen, lua_topointer(L, idx)) != LUA_TNIL) {
+		luaL_error(L, "table contains a cycle");
+	}
+	lua_pop(L, 1);
+	lua_pushboolean(L, true);
+	lua_rawsetp(L, ft->seen, lua_topointer(L, idx));
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		if (lua_type(L, -2) != LUA_TSTRING) {
+			luaL_error(L, "string keys expected, got %s",
+			    luaL_typename(L, -2));
+		}
+		fromtable_value(L, -1, nvl, lua_tostring(L, -2), ft);
+		lua_pop(L, 1);
+	}
+
+	lua_pushnil(L);
+	lua_rawsetp(L, ft->seen, lua_topointer(L, idx));
+}
+
 static int
 l_nv_create(lua_State *L)
 {
@@ -386,6 +796,46 @@ l_nv_unpack(lua_State *L)
 	return (new(L, nvl, NVLIST_METATABLE));
 }
 
+static int
+l_nv_from_table(lua_State *L)
+{
+	struct fromtable ft;
+	nvlist_t *nvl;
+	int flags, error;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	flags = 0;
+	ft.types = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "flags") != LUA_TNIL) {
+			luaL_argcheck(L, lua_isinteger(L, -1), 2,
+			    "flags must be an integer");
+			flags = lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+		if (lua_getfield(L, 2, "types") != LUA_TNIL) {
+			luaL_argcheck(L, lua_istable(L, -1), 2,
+			    "types must be a table");
+			ft.types = lua_gettop(L);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	lua_newtable(L);
+	ft.seen = lua_gettop(L);
+
+	if ((nvl = nvlist_create(flags)) == NULL) {
+		return (fatal(L, "nvlist_create", ENOMEM));
+	}
+	new(L, nvl, NVLIST_METATABLE);
+	fromtable(L, 1, nvl, &ft);
+	if ((error = nvlist_error(nvl)) != 0) {
+		return (fail(L, error));
+	}
+	return (1);
+}
+
 static int
 l_nvlist_gc(lua_State *L)
 {
@@ -556,6 +1006,16 @@ l_nvlist_xfer(lua_State *L)
 	return (new(L, recvd, NVLIST_METATABLE));
 }
 
+static int
+l_nvlist_to_table(lua_State *L)
+{
+	nvlist_t *nvl;
+
+	nvl = checknvlist(L, 1);
+
+	return (to_table(L, nvl));
+}
+
 static int
 l_nvlist_exists(lua_State *L)
 {
@@ -1468,6 +1928,16 @@ l_const_nvlist_send(lua_State *L)
 	return (success(L));
 }
 
+static int
+l_const_nvlist_to_table(lua_State *L)
+{
+	const nvlist_t *nvl;
+
+	nvl = checkconstnvlist(L, 1);
+
+	return (to_table(L, nvl));
+}
+
 static int
 l_const_nvlist_exists(lua_State *L)
 {
@@ -1940,118 +2410,1600 @@ NVLIST_TYPES(CNVLIST_FREE)
 
 #undef CNVLIST_FREE
 
-static const struct luaL_Reg l_nv_funcs[] = {
-	{"create", l_nv_create},
-	{"recv", l_nv_recv},
-	{"unpack", l_nv_unpack},
-	{NULL, NULL}
-};
+/*
+ * Framed nvlist streams.  Each frame is a 32-bit big-endian length followed
+ * by a packed nvlist.  Queued frames are written with as few writev calls as
+ * possible, and the receive buffer is reused and can hold many frames from a
+ * single read.
+ */
 
-static const struct luaL_Reg l_nvlist_meta[] = {
-	{"__gc", l_nvlist_gc},
-	{"error", l_nvlist_error},
-	{"set_error", l_nvlist_set_error},
-	{"empty", l_nvlist_empty},
-	{"flags", l_nvlist_flags},
-	{"in_array", l_nvlist_in_array},
-	{"clone", l_nvlist_clone},
-	{"dump", l_nvlist_dump},
-	{"fdump", l_nvlist_fdump},
-	{"size", l_nvlist_size},
-	{"pack", l_nvlist_pack},
-	{"send", l_nvlist_send},
-	{"xfer", l_nvlist_xfer},
-	{"exists", l_nvlist_exists},
-#define NVLIST_EXISTS(type, _) {"exists_"#type, l_nvlist_exists_##type},
-	NVLIST_TYPES_NULL(NVLIST_EXISTS)
-#undef NVLIST_EXISTS
-#define NVLIST_ADD(type, _) {"add_"#type, l_nvlist_add_##type},
-	NVLIST_TYPES_NULL(NVLIST_ADD)
-#undef NVLIST_ADD
-	{"move_nvlist", l_nvlist_move_nvlist},
-	{"move_descriptor", l_nvlist_move_descriptor},
-	{"move_nvlist_array", l_nvlist_move_nvlist_array},
-	{"move_descriptor_array", l_nvlist_move_descriptor_array},
-#define NVLIST_GET(type, _) {"get_"#type, l_nvlist_get_##type},
-	NVLIST_TYPES(NVLIST_GET)
-#undef NVLIST_GET
-#define NVLIST_TAKE(type, _) {"take_"#type, l_nvlist_take_##type},
-	NVLIST_TYPES(NVLIST_TAKE)
-#undef NVLIST_TAKE
-	{"append_bool_array", l_nvlist_append_bool_array},
-	{"append_number_array", l_nvlist_append_number_array},
-	{"append_string_array", l_nvlist_append_string_array},
-	{"append_nvlist_array", l_nvlist_append_nvlist_array},
-	{"append_descriptor_array", l_nvlist_append_descriptor_array},
-	{"free", l_nvlist_free},
-	{"free_type", l_nvlist_free_type},
-#define NVLIST_FREE(type, _) {"free_"#type, l_nvlist_free_##type},
-	NVLIST_TYPES_NULL(NVLIST_FREE)
-#undef NVLIST_FREE
-	{"next", l_nvlist_next},
-	{"get_parent", l_nvlist_get_parent},
-	{"get_array_next", l_nvlist_get_array_next},
-	{"get_pararr", l_nvlist_get_pararr},
-	{NULL, NULL}
-};
+#define NVSTREAM_FRAME_MAX (64 * 1024 * 1024)
+#define NVSTREAM_READ_SIZE (64 * 1024)
+#define NVSTREAM_IOV_MAX 1024
 
-static const struct luaL_Reg l_const_nvlist_meta[] = {
-	{"error", l_const_nvlist_error},
-	{"empty", l_const_nvlist_empty},
-	{"flags", l_const_nvlist_flags},
-	{"in_array", l_const_nvlist_in_array},
-	{"clone", l_const_nvlist_clone},
-	{"dump", l_const_nvlist_dump},
-	{"fdump", l_const_nvlist_fdump},
-	{"size", l_const_nvlist_size},
-	{"pack", l_const_nvlist_pack},
-	{"send", l_const_nvlist_send},
-	{"exists", l_const_nvlist_exists},
-#define NVLIST_EXISTS(type, _) {"exists_"#type, l_const_nvlist_exists_##type},
-	NVLIST_TYPES_NULL(NVLIST_EXISTS)
-#undef NVLIST_EXISTS
-#define NVLIST_GET(type, _) {"get_"#type, l_const_nvlist_get_##type},
-	NVLIST_TYPES(NVLIST_GET)
-#undef NVLIST_GET
-	{"next", l_const_nvlist_next},
-	{"get_parent", l_const_nvlist_get_parent},
-	{"get_array_next", l_const_nvlist_get_array_next},
-	{"get_pararr", l_const_nvlist_get_pararr},
-	{NULL, NULL}
+struct nvstream {
+	int fd;
+	int flags;
+	size_t maxframe;
+	/* send queue: packed nvlists and their encoded headers */
+	void **bufs;
+	uint32_t *hdrs;
+	size_t *lens;
+	size_t first, nframes, maxframes;
+	size_t offset;	/* bytes of the first frame already written */
+	size_t pending;
+	/* receive buffer */
+	char *rbuf;
+	size_t roff, rlen, rsize;
+	int rerror;	/* bad frame to report on the next read */
 };
 
-static const struct luaL_Reg l_cnvlist_meta[] = {
-	{"name", l_cnvlist_name},
-	{"type", l_cnvlist_type},
-#define CNVLIST_GET(type, _) {"get_"#type, l_cnvlist_get_##type},
-	NVLIST_TYPES(CNVLIST_GET)
-#undef CNVLIST_GET
-#define CNVLIST_TAKE(type, _) {"take_"#type, l_cnvlist_take_##type},
-	NVLIST_TYPES(CNVLIST_TAKE)
-#undef CNVLIST_TAKE
-#define CNVLIST_FREE(type, _) {"free_"#type, l_cnvlist_free_##type},
-	NVLIST_TYPES(CNVLIST_FREE)
-#undef CNVLIST_FREE
-	{NULL, NULL}
-};
+static inline struct nvstream *
+checknvstream(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, NVSTREAM_METATABLE));
+}
 
-int
-luaopen_nv(lua_State *L)
+static void
+nvstream_drop(struct nvstream *s)
 {
-	luaL_newmetatable(L, NVLIST_METATABLE);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, l_nvlist_meta, 0);
+	for (size_t i = s->first; i < s->nframes; i++) {
+		free(s->bufs[i]);
+	}
+	s->first = s->nframes = 0;
+	s->offset = 0;
+	s->pending = 0;
+}
 
-	luaL_newmetatable(L, CONST_NVLIST_METATABLE);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, l_const_nvlist_meta, 0);
+/* Consume n written bytes from the front of the send queue. */
+static void
+nvstream_advance(struct nvstream *s, size_t n)
+{
+	size_t framelen;
 
-	luaL_newmetatable(L, CNVLIST_METATABLE);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
-	luaL_setfuncs(L, l_cnvlist_meta, 0);
+	s->pending -= n;
+	while (n > 0) {
+		framelen = sizeof(uint32_t) + s->lens[s->first];
+		if (s->offset + n < framelen) {
+			s->offset += n;
+			break;
+		}
+		n -= framelen - s->offset;
+		free(s->bufs[s->first]);
+		s->first++;
+		s->offset = 0;
+	}
+	if (s->first == s->nframes) {
+		s->first = s->nframes = 0;
+	}
+}
+
+/* Slide the unwritten frames to the front of the send queue. */
+static void
+nvstream_compact(struct nvstream *s)
+{
+	size_t n = s->nframes - s->first;
+
+	memmove(s->bufs, s->bufs + s->first, n * sizeof(*s->bufs));
+	memmove(s->hdrs, s->hdrs + s->first, n * sizeof(*s->hdrs));
+	memmove(s->lens, s->lens + s->first, n * sizeof(*s->lens));
+	s->first = 0;
+	s->nframes = n;
+}
+
+/* Fill iov with the unwritten part of the send queue. */
+static int
+nvstream_iov(struct nvstream *s, struct iovec *iov, int iovmax)
+{
+	size_t skip;
+	int n;
+
+	n = 0;
+	skip = s->offset;
+	for (size_t i = s->first; i < s->nframes && n + 2 <= iovmax; i++) {
+		if (skip < sizeof(uint32_t)) {
+			iov[n].iov_base = (char *)&s->hdrs[i] + skip;
+			iov[n].iov_len = sizeof(uint32_t) - skip;
+			n++;
+			skip = 0;
+		} else {
+			skip -= sizeof(uint32_t);
+		}
+		iov[n].iov_base = (char *)s->bufs[i] + skip;
+		iov[n].iov_len = s->lens[i] - skip;
+		n++;
+		skip = 0;
+	}
+	return (n);
+}
+
+static int
+l_nv_stream(lua_State *L)
+{
+	struct nvstream *s;
+	int fd, flags;
+	lua_Integer maxframe;
+
+	fd = lua_isnoneornil(L, 1) ? -1 : checkfd(L, 1);
+	flags = 0;
+	maxframe = NVSTREAM_FRAME_MAX;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "flags") != LUA_TNIL) {
+			luaL_argcheck(L, lua_isinteger(L, -1), 2,
+			    "flags must be an integer");
+			flags = lua_tointeger(L, -1);
+		}
+		if (lua_getfield(L, 2, "maxframe") != LUA_TNIL) {
+			maxframe = lua_tointeger(L, -1);
+			luaL_argcheck(L, maxframe > 0 && maxframe <= UINT32_MAX,
+			    2, "maxframe out of range");
+		}
+		lua_pop(L, 2);
+	}
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	s->fd = fd;
+	s->flags = flags;
+	s->maxframe = maxframe;
+	return (new(L, s, NVSTREAM_METATABLE));
+}
+
+static int
+l_nvstream_close(lua_State *L)
+{
+	struct nvstream *s;
+
+	s = checkcookienull(L, 1, NVSTREAM_METATABLE);
+
+	if (s != NULL) {
+		nvstream_drop(s);
+		free(s->bufs);
+		free(s->hdrs);
+		free(s->lens);
+		free(s->rbuf);
+		free(s);
+		setcookie(L, 1, NULL);
+	}
+	return (0);
+}
+
+static int
+l_nvstream_put(lua_State *L)
+{
+	struct nvstream *s;
+	int top;
+
+	s = checknvstream(L, 1);
+	top = lua_gettop(L);
+
+	for (int i = 2; i <= top; i++) {
+		const nvlist_t *nvl;
+		void *buf;
+		size_t size;
+
+		nvl = checkanynvlist(L, i);
+		if (s->nframes == s->maxframes && s->first > 0) {
+			nvstream_compact(s);
+		}
+		if (s->nframes == s->maxframes) {
+			size_t n = s->maxframes == 0 ? 16 : s->maxframes * 2;
+			void **bufs;
+			uint32_t *hdrs;
+			size_t *lens;
+
+			if ((bufs = reallocarray(s->bufs, n, sizeof(*bufs)))
+			    == NULL) {
+				return (fatal(L, "reallocarray", ENOMEM));
+			}
+			s->bufs = bufs;
+			if ((hdrs = reallocarray(s->hdrs, n, sizeof(*hdrs)))
+			    == NULL) {
+				return (fatal(L, "reallocarray", ENOMEM));
+			}
+			s->hdrs = hdrs;
+			if ((lens = reallocarray(s->lens, n, sizeof(*lens)))
+			    == NULL) {
+				return (fatal(L, "reallocarray", ENOMEM));
+			}
+			s->lens = lens;
+			s->maxframes = n;
+		}
+		if ((buf = nvlist_pack(nvl, &size)) == NULL) {
+			return (fail(L, errno));
+		}
+		if (size > s->maxframe) {
+			free(buf);
+			return (fail(L, EMSGSIZE));
+		}
+		s->bufs[s->nframes] = buf;
+		s->hdrs[s->nframes] = htobe32(size);
+		s->lens[s->nframes] = size;
+		s->nframes++;
+		s->pending += sizeof(uint32_t) + size;
+	}
+	return (success(L));
+}
+
+static int
+l_nvstream_pending(lua_State *L)
+{
+	struct nvstream *s;
+
+	s = checknvstream(L, 1);
+
+	lua_pushinteger(L, s->pending);
+	return (1);
+}
+
+static int
+l_nvstream_flush(lua_State *L)
+{
+	struct iovec iov[NVSTREAM_IOV_MAX];
+	struct nvstream *s;
+	ssize_t n;
+	int iovcnt;
+
+	s = checknvstream(L, 1);
+	luaL_argcheck(L, s->fd != -1, 1, "stream has no descriptor");
+
+	while (s->pending > 0) {
+		iovcnt = nvstream_iov(s, iov, nitems(iov));
+		if ((n = writev(s->fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				lua_pushboolean(L, false);
+				return (1);
+			}
+			return (fail(L, errno));
+		}
+		nvstream_advance(s, n);
+	}
+	lua_pushboolean(L, true);
+	return (1);
+}
+
+static int
+l_nvstream_take(lua_State *L)
+{
+	struct iovec iov[NVSTREAM_IOV_MAX];
+	struct nvstream *s;
+	luaL_Buffer b;
+	size_t n;
+	int iovcnt;
+
+	s = checknvstream(L, 1);
+
+	luaL_buffinitsize(L, &b, s->pending);
+	while (s->pending > 0) {
+		iovcnt = nvstream_iov(s, iov, nitems(iov));
+		n = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			luaL_addlstring(&b, iov[i].iov_base, iov[i].iov_len);
+			n += iov[i].iov_len;
+		}
+		nvstream_advance(s, n);
+	}
+	luaL_pushresult(&b);
+	return (1);
+}
+
+/* Make room for at least size more bytes in the receive buffer. */
+static void
+nvstream_reserve(lua_State *L, struct nvstream *s, size_t size)
+{
+	char *rbuf;
+	size_t n;
+
+	if (s->roff > 0) {
+		memmove(s->rbuf, s->rbuf + s->roff, s->rlen - s->roff);
+		s->rlen -= s->roff;
+		s->roff = 0;
+	}
+	if (s->rsize - s->rlen >= size) {
+		return;
+	}
+	n = MAX(s->rsize * 2, s->rlen + size);
+	if ((rbuf = realloc(s->rbuf, n)) == NULL) {
+		fatal(L, "realloc", ENOMEM);
+	}
+	s->rbuf = rbuf;
+	s->rsize = n;
+}
+
+static int
+l_nvstream_fill(lua_State *L)
+{
+	struct nvstream *s;
+	lua_Integer size;
+	ssize_t n;
+
+	s = checknvstream(L, 1);
+	size = luaL_optinteger(L, 2, NVSTREAM_READ_SIZE);
+	luaL_argcheck(L, s->fd != -1, 1, "stream has no descriptor");
+	/* A single read never needs more room than the largest frame. */
+	luaL_argcheck(L, size > 0 &&
+	    (uint64_t)size <= sizeof(uint32_t) + s->maxframe, 2,
+	    "size out of range");
+
+	nvstream_reserve(L, s, size);
+	do {
+		n = read(s->fd, s->rbuf + s->rlen, size);
+	} while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		return (fail(L, errno));
+	}
+	s->rlen += n;
+	lua_pushinteger(L, n);
+	return (1);
+}
+
+static int
+l_nvstream_feed(lua_State *L)
+{
+	struct nvstream *s;
+	const char *data;
+	size_t len;
+
+	s = checknvstream(L, 1);
+	data = luaL_checklstring(L, 2, &len);
+
+	nvstream_reserve(L, s, len);
+	memcpy(s->rbuf + s->rlen, data, len);
+	s->rlen += len;
+	return (0);
+}
+
+/*
+ * Decode the next complete frame, if any.  Returns 1 with the nvlist pushed,
+ * 0 if more data is needed, or -1 with errno set.
+ */
+static int
+nvstream_next(lua_State *L, struct nvstream *s)
+{
+	nvlist_t *nvl;
+	size_t avail, len;
+	uint32_t hdr;
+
+	if (s->rerror != 0) {
+		errno = s->rerror;
+		s->rerror = 0;
+		return (-1);
+	}
+	avail = s->rlen - s->roff;
+	if (avail < sizeof(hdr)) {
+		return (0);
+	}
+	memcpy(&hdr, s->rbuf + s->roff, sizeof(hdr));
+	len = be32toh(hdr);
+	if (len > s->maxframe) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (avail < sizeof(hdr) + len) {
+		return (0);
+	}
+	nvl = nvlist_unpack(s->rbuf + s->roff + sizeof(hdr), len, s->flags);
+	s->roff += sizeof(hdr) + len;
+	if (nvl == NULL) {
+		return (-1);
+	}
+	new(L, nvl, NVLIST_METATABLE);
+	return (1);
+}
+
+static int
+l_nvstream_get(lua_State *L)
+{
+	struct nvstream *s;
+
+	s = checknvstream(L, 1);
+
+	switch (nvstream_next(L, s)) {
+	case 1:
+		return (1);
+	case 0:
+		lua_pushnil(L);
+		return (1);
+	default:
+		return (fail(L, errno));
+	}
+}
+
+static int
+l_nvstream_recv(lua_State *L)
+{
+	struct nvstream *s;
+	lua_Integer max, n;
+	ssize_t nread;
+	bool eof;
+	int error;
+
+	s = checknvstream(L, 1);
+	max = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+	luaL_argcheck(L, max > 0, 2, "must be positive");
+	luaL_argcheck(L, s->fd != -1, 1, "stream has no descriptor");
+
+	lua_newtable(L);
+	n = 0;
+	eof = false;
+	error = 0;
+	while (n < max && (error = nvstream_next(L, s)) == 1) {
+		lua_rawseti(L, -2, ++n);
+	}
+	if (n == 0 && error == 0) {
+		nvstream_reserve(L, s, NVSTREAM_READ_SIZE);
+		do {
+			nread = read(s->fd, s->rbuf + s->rlen,
+			    s->rsize - s->rlen);
+		} while (nread == -1 && errno == EINTR);
+		if (nread == -1) {
+			return (fail(L, errno));
+		}
+		s->rlen += nread;
+		eof = nread == 0;
+		while (n < max && (error = nvstream_next(L, s)) == 1) {
+			lua_rawseti(L, -2, ++n);
+		}
+	}
+	if (error == -1) {
+		if (n == 0) {
+			return (fail(L, errno));
+		}
+		/* Keep what was decoded and report the bad frame next time. */
+		s->rerror = errno;
+	}
+	lua_pushboolean(L, eof);
+	return (2);
+}
+
+static int
+l_nvstream_buffered(lua_State *L)
+{
+	struct nvstream *s;
+
+	s = checknvstream(L, 1);
+
+	lua_pushinteger(L, s->rlen - s->roff);
+	return (1);
+}
+
+/*
+ * RPC over nvlists.  A request is {id, method[, args]} and a response is
+ * {id, result} or {id, error[, errno]}.  Each connection has a reader thread
+ * blocking in nvlist_recv, which also receives any descriptors, and a writer
+ * thread blocking in nvlist_send, so a peer sending a partial frame or not
+ * reading its responses only stalls its own connection.  Requests are
+ * dispatched to a pool of worker threads, each with its own Lua state holding
+ * the handlers.  Workers queue each response for the writer as soon as the
+ * handler finishes, so responses may arrive out of order.
+ *
+ * Backpressure: a request is in flight until its response has been written,
+ * a connection is not read while it has the maximum number of requests in
+ * flight, and no connection is read while the queue is full.  Closing the
+ * server shuts down the sockets to stop the readers and writers.
+ */
+
+#define NVRPC_THREADS 4
+#define NVRPC_QUEUE 256
+#define NVRPC_INFLIGHT 64
+
+struct rpcserver;
+
+struct rpcjob {
+	STAILQ_ENTRY(rpcjob) link;
+	struct rpcconn *conn;
+	nvlist_t *request;	/* the response, once answered */
+};
+
+struct rpcconn {
+	TAILQ_ENTRY(rpcconn) link;
+	pthread_cond_t sendable;	/* a response queued, or done */
+	STAILQ_HEAD(, rpcjob) responses;
+	struct rpcserver *srv;
+	int fd;
+	int inflight;	/* requests read and not yet answered */
+	bool reading;	/* the reader is running */
+	bool writing;	/* the writer is running */
+};
+
+struct rpcstat {
+	char *method;
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+struct rpcworker {
+	pthread_t thread;
+	lua_State *L;
+	struct rpcserver *srv;
+};
+
+struct rpcserver {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t space;	/* room in the queue, or a reader exited */
+	TAILQ_HEAD(, rpcconn) conns;
+	STAILQ_HEAD(, rpcjob) queue;
+	int nconns;
+	int nthreads;	/* readers and writers running */
+	int queued;
+	int maxqueue;
+	int maxinflight;
+	struct rpcstat *stats;	/* one per handler, fixed at startup */
+	int nstats;
+	bool shutdown;
+	int nstates;
+	int nworkers;
+	struct rpcworker workers[];
+};
+
+/* The following helpers must be called with srv->lock held. */
+
+static void
+rpcconn_free(struct rpcserver *srv, struct rpcconn *conn)
+{
+	struct rpcjob *job, *tjob;
+
+	STAILQ_FOREACH_SAFE(job, &conn->responses, link, tjob) {
+		nvlist_destroy(job->request);
+		free(job);
+	}
+	TAILQ_REMOVE(&srv->conns, conn, link);
+	srv->nconns--;
+	if (conn->fd != -1) {
+		close(conn->fd);
+	}
+	pthread_cond_destroy(&conn->sendable);
+	free(conn);
+}
+
+/* Free the connection once nothing refers to it anymore. */
+static void
+rpcconn_release(struct rpcserver *srv, struct rpcconn *conn)
+{
+	if (!conn->reading && !conn->writing && conn->inflight == 0) {
+		rpcconn_free(srv, conn);
+	}
+}
+
+/* A request of conn has been answered, or its response dropped. */
+static void
+rpc_answered(struct rpcserver *srv, struct rpcconn *conn)
+{
+	if (conn->inflight-- == srv->maxinflight) {
+		pthread_cond_broadcast(&srv->space);
+	}
+	if (conn->inflight == 0) {
+		pthread_cond_signal(&conn->sendable);
+	}
+	rpcconn_release(srv, conn);
+}
+
+/*
+ * Queue the response in job for the writer of conn, or drop it if there is
+ * no response or no writer.  conn may be freed.
+ */
+static void
+rpc_reply(struct rpcserver *srv, struct rpcconn *conn, struct rpcjob *job)
+{
+	if (job->request == NULL || !conn->writing) {
+		nvlist_destroy(job->request);
+		free(job);
+		rpc_answered(srv, conn);
+		return;
+	}
+	STAILQ_INSERT_TAIL(&conn->responses, job, link);
+	pthread_cond_signal(&conn->sendable);
+}
+
+static void
+rpc_record(struct rpcserver *srv, int stat, uint64_t ns, bool failed)
+{
+	struct rpcstat *st;
+
+	/* Calls to methods that have no handler are not counted. */
+	if (stat < 0) {
+		return;
+	}
+	st = &srv->stats[stat];
+	st->calls++;
+	if (failed) {
+		st->errors++;
+	}
+	st->total_ns += ns;
+	st->max_ns = MAX(st->max_ns, ns);
+}
+
+static nvlist_t *
+rpc_error(uint64_t id, const char *errmsg, int error)
+{
+	nvlist_t *resp;
+
+	if ((resp = nvlist_create(0)) == NULL) {
+		return (NULL);
+	}
+	nvlist_add_number(resp, "id", id);
+	nvlist_add_string(resp, "error", errmsg);
+	if (error != 0) {
+		nvlist_add_number(resp, "errno", error);
+	}
+	return (resp);
+}
+
+/*
+ * Runs in the worker's Lua state, protected.  Stores the method's stats index
+ * through the second argument, then returns the result nvlist as a light
+ * userdata, or fail values from the handler.
+ */
+static int
+rpc_invoke(lua_State *L)
+{
+	struct fromtable ft;
+	nvlist_t *req, *nvl, *value;
+	const char *method;
+	int *stat;
+
+	req = lua_touserdata(L, 1);
+	stat = lua_touserdata(L, 2);
+	method = nvlist_get_string(req, "method");
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, rpc_record);
+	if (lua_getfield(L, -1, method) == LUA_TNUMBER) {
+		*stat = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 2);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, rpc_invoke);
+	if (lua_getfield(L, -1, method) != LUA_TFUNCTION) {
+		luaL_pushfail(L);
+		lua_pushstring(L, "no such method");
+		lua_pushinteger(L, EOPNOTSUPP);
+		return (3);
+	}
+	new(L, NULL, NVLIST_METATABLE);
+	if (nvlist_exists_nvlist(req, "args")) {
+		nvl = nvlist_take_nvlist(req, "args");
+	} else if ((nvl = nvlist_create(0)) == NULL) {
+		return (luaL_error(L, "nvlist_create: %s", strerror(ENOMEM)));
+	}
+	setcookie(L, -1, nvl);
+	lua_call(L, 1, 3);
+
+	if (lua_isnil(L, -3) && !lua_isnil(L, -2)) {
+		return (3);
+	}
+	lua_pop(L, 2);
+	if (lua_isnil(L, -1)) {
+		nvl = nvlist_create(0);
+	} else if ((value = getanynvlist(L, -1)) != NULL) {
+		nvl = nvlist_clone(value);
+	} else if (lua_istable(L, -1)) {
+		if ((nvl = nvlist_create(0)) != NULL) {
+			new(L, nvl, NVLIST_METATABLE);
+			ft.types = 0;
+			lua_newtable(L);
+			ft.seen = lua_gettop(L);
+			fromtable(L, -3, nvl, &ft);
+			lua_pop(L, 1);
+			setcookie(L, -1, NULL);
+		}
+	} else {
+		return (luaL_error(L, "handler returned %s",
+		    luaL_typename(L, -1)));
+	}
+	if (nvl == NULL) {
+		return (luaL_error(L, "%s", strerror(ENOMEM)));
+	}
+	lua_pushlightuserdata(L, nvl);
+	return (1);
+}
+
+static nvlist_t *
+rpc_handle(struct rpcworker *w, nvlist_t *req, int *stat, bool *failed)
+{
+	lua_State *L = w->L;
+	nvlist_t *resp, *result;
+	const char *errmsg;
+	uint64_t id;
+	int error;
+
+	id = nvlist_get_number(req, "id");
+	*stat = -1;
+	*failed = true;
+
+	lua_settop(L, 0);
+	lua_pushcfunction(L, rpc_invoke);
+	lua_pushlightuserdata(L, req);
+	lua_pushlightuserdata(L, stat);
+	if (lua_pcall(L, 2, 3, 0) != LUA_OK) {
+		errmsg = lua_type(L, -1) == LUA_TSTRING ?
+		    lua_tostring(L, -1) : "handler raised an error";
+		resp = rpc_error(id, errmsg, 0);
+	} else if (lua_islightuserdata(L, 1)) {
+		result = lua_touserdata(L, 1);
+		if ((resp = nvlist_create(0)) == NULL) {
+			nvlist_destroy(result);
+		} else {
+			nvlist_add_number(resp, "id", id);
+			nvlist_move_nvlist(resp, "result", result);
+			*failed = false;
+		}
+	} else {
+		errmsg = lua_type(L, 2) == LUA_TSTRING ?
+		    lua_tostring(L, 2) : "handler failed";
+		error = lua_isinteger(L, 3) ? lua_tointeger(L, 3) : 0;
+		resp = rpc_error(id, errmsg, error);
+	}
+	lua_settop(L, 0);
+	return (resp);
+}
+
+static void *
+rpc_worker(void *arg)
+{
+	struct rpcworker *w = arg;
+	struct rpcserver *srv = w->srv;
+	struct rpcjob *job;
+	struct timespec start, end;
+	nvlist_t *resp;
+	uint64_t ns;
+	int stat;
+	bool failed;
+
+	pthread_mutex_lock(&srv->lock);
+	for (;;) {
+		while (!srv->shutdown && STAILQ_EMPTY(&srv->queue)) {
+			pthread_cond_wait(&srv->work, &srv->lock);
+		}
+		if (srv->shutdown) {
+			break;
+		}
+		job = STAILQ_FIRST(&srv->queue);
+		STAILQ_REMOVE_HEAD(&srv->queue, link);
+		if (srv->queued-- == srv->maxqueue) {
+			pthread_cond_broadcast(&srv->space);
+		}
+		pthread_mutex_unlock(&srv->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		resp = rpc_handle(w, job->request, &stat, &failed);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		nvlist_destroy(job->request);
+		job->request = resp;
+		ns = (end.tv_sec - start.tv_sec) * 1000000000 +
+		    end.tv_nsec - start.tv_nsec;
+
+		pthread_mutex_lock(&srv->lock);
+		rpc_record(srv, stat, ns, failed);
+		rpc_reply(srv, job->conn, job);
+	}
+	pthread_mutex_unlock(&srv->lock);
+	return (NULL);
+}
+
+static void *
+rpc_reader(void *arg)
+{
+	struct rpcconn *conn = arg;
+	struct rpcserver *srv = conn->srv;
+	struct rpcjob *job;
+	nvlist_t *req;
+
+	pthread_mutex_lock(&srv->lock);
+	for (;;) {
+		while (!srv->shutdown && (srv->queued >= srv->maxqueue ||
+		    conn->inflight >= srv->maxinflight)) {
+			pthread_cond_wait(&srv->space, &srv->lock);
+		}
+		if (srv->shutdown) {
+			break;
+		}
+		pthread_mutex_unlock(&srv->lock);
+		if ((req = nvlist_recv(conn->fd, 0)) == NULL) {
+			pthread_mutex_lock(&srv->lock);
+			break;
+		}
+		if ((job = malloc(sizeof(*job))) == NULL) {
+			/* Hang up rather than leave the request unanswered. */
+			nvlist_destroy(req);
+			pthread_mutex_lock(&srv->lock);
+			break;
+		}
+		job->conn = conn;
+		if (!nvlist_exists_number(req, "id") ||
+		    !nvlist_exists_string(req, "method")) {
+			job->request = rpc_error(dnvlist_get_number(req, "id",
+			    0), "malformed request", EINVAL);
+			nvlist_destroy(req);
+			pthread_mutex_lock(&srv->lock);
+			conn->inflight++;
+			rpc_reply(srv, conn, job);
+			continue;
+		}
+		job->request = req;
+		pthread_mutex_lock(&srv->lock);
+		STAILQ_INSERT_TAIL(&srv->queue, job, link);
+		srv->queued++;
+		conn->inflight++;
+		pthread_cond_signal(&srv->work);
+	}
+	conn->reading = false;
+	pthread_cond_signal(&conn->sendable);
+	srv->nthreads--;
+	pthread_cond_broadcast(&srv->space);
+	rpcconn_release(srv, conn);
+	pthread_mutex_unlock(&srv->lock);
+	return (NULL);
+}
+
+/*
+ * Write the responses queued for the connection until the reader is gone and
+ * every request has been answered.  If a write fails, or the server is
+ * closing, the remaining responses are dropped.
+ */
+static void *
+rpc_writer(void *arg)
+{
+	struct rpcconn *conn = arg;
+	struct rpcserver *srv = conn->srv;
+	struct rpcjob *job;
+	bool ok;
+
+	ok = true;
+	pthread_mutex_lock(&srv->lock);
+	for (;;) {
+		while (ok && !srv->shutdown &&
+		    STAILQ_EMPTY(&conn->responses) &&
+		    (conn->reading || conn->inflight > 0)) {
+			pthread_cond_wait(&conn->sendable, &srv->lock);
+		}
+		if ((job = STAILQ_FIRST(&conn->responses)) == NULL) {
+			break;
+		}
+		STAILQ_REMOVE_HEAD(&conn->responses, link);
+		if (ok && !srv->shutdown) {
+			pthread_mutex_unlock(&srv->lock);
+			if (nvlist_send(conn->fd, job->request) == -1) {
+				/* Stop the reader too. */
+				(void)shutdown(conn->fd, SHUT_RDWR);
+				ok = false;
+			}
+			pthread_mutex_lock(&srv->lock);
+		}
+		nvlist_destroy(job->request);
+		free(job);
+		rpc_answered(srv, conn);
+	}
+	conn->writing = false;
+	srv->nthreads--;
+	pthread_cond_broadcast(&srv->space);
+	rpcconn_release(srv, conn);
+	pthread_mutex_unlock(&srv->lock);
+	return (NULL);
+}
+
+static void
+rpc_shutdown(struct rpcserver *srv)
+{
+	struct rpcconn *conn, *tconn;
+	struct rpcjob *job, *tjob;
+
+	pthread_mutex_lock(&srv->lock);
+	srv->shutdown = true;
+	pthread_cond_broadcast(&srv->work);
+	pthread_cond_broadcast(&srv->space);
+	TAILQ_FOREACH(conn, &srv->conns, link) {
+		(void)shutdown(conn->fd, SHUT_RDWR);
+		pthread_cond_signal(&conn->sendable);
+	}
+	while (srv->nthreads > 0) {
+		pthread_cond_wait(&srv->space, &srv->lock);
+	}
+	pthread_mutex_unlock(&srv->lock);
+	for (int i = 0; i < srv->nworkers; i++) {
+		pthread_join(srv->workers[i].thread, NULL);
+	}
+	for (int i = 0; i < srv->nstates; i++) {
+		lua_close(srv->workers[i].L);
+	}
+	STAILQ_FOREACH_SAFE(job, &srv->queue, link, tjob) {
+		nvlist_destroy(job->request);
+		free(job);
+	}
+	TAILQ_FOREACH_SAFE(conn, &srv->conns, link, tconn) {
+		rpcconn_free(srv, conn);
+	}
+	for (int i = 0; i < srv->nstats; i++) {
+		free(srv->stats[i].method);
+	}
+	free(srv->stats);
+	pthread_cond_destroy(&srv->space);
+	pthread_cond_destroy(&srv->work);
+	pthread_mutex_destroy(&srv->lock);
+	free(srv);
+}
+
+struct dumpbuf {
+	char *p;
+	size_t len;
+};
+
+static int
+dump_writer(lua_State *L __unused, const void *p, size_t sz, void *ud)
+{
+	struct dumpbuf *b = ud;
+	char *q;
+
+	if ((q = realloc(b->p, b->len + sz)) == NULL) {
+		return (ENOMEM);
+	}
+	memcpy(q + b->len, p, sz);
+	b->p = q;
+	b->len += sz;
+	return (0);
+}
+
+/*
+ * Load the setup chunk into a new worker state and store the handlers table
+ * it returns.  On failure the error message is left on the worker's stack.
+ */
+static bool
+rpc_setup(lua_State *l, const char *chunk, size_t len)
+{
+	luaL_openlibs(l);
+	luaL_requiref(l, "nv", luaopen_nv, 0);
+	lua_pop(l, 1);
+	if (luaL_loadbuffer(l, chunk, len, "=rpc setup") != LUA_OK ||
+	    lua_pcall(l, 0, 1, 0) != LUA_OK) {
+		return (false);
+	}
+	if (!lua_istable(l, -1)) {
+		lua_pushliteral(l, "setup must return a table of handlers");
+		return (false);
+	}
+	lua_rawsetp(l, LUA_REGISTRYINDEX, rpc_invoke);
+	return (true);
+}
+
+/*
+ * Take the method names from the handlers table of the first worker state.
+ * Returns false if out of memory.
+ */
+static bool
+rpc_stats_init(struct rpcserver *srv, lua_State *l)
+{
+	int n;
+
+	lua_rawgetp(l, LUA_REGISTRYINDEX, rpc_invoke);
+	n = 0;
+	lua_pushnil(l);
+	while (lua_next(l, -2) != 0) {
+		if (lua_type(l, -2) == LUA_TSTRING && lua_isfunction(l, -1)) {
+			n++;
+		}
+		lua_pop(l, 1);
+	}
+	if ((srv->stats = calloc(MAX(n, 1), sizeof(*srv->stats))) == NULL) {
+		lua_pop(l, 1);
+		return (false);
+	}
+	lua_pushnil(l);
+	while (lua_next(l, -2) != 0) {
+		if (lua_type(l, -2) == LUA_TSTRING && lua_isfunction(l, -1) &&
+		    srv->nstats < n) {
+			if ((srv->stats[srv->nstats].method =
+			    strdup(lua_tostring(l, -2))) == NULL) {
+				lua_pop(l, 3);
+				return (false);
+			}
+			srv->nstats++;
+		}
+		lua_pop(l, 1);
+	}
+	lua_pop(l, 1);
+	return (true);
+}
+
+/* Map method names to their stats index in a worker state. */
+static void
+rpc_stats_index(struct rpcserver *srv, lua_State *l)
+{
+	lua_createtable(l, 0, srv->nstats);
+	for (int i = 0; i < srv->nstats; i++) {
+		lua_pushinteger(l, i);
+		lua_setfield(l, -2, srv->stats[i].method);
+	}
+	lua_rawsetp(l, LUA_REGISTRYINDEX, rpc_record);
+}
+
+static int
+l_nv_rpc_server(lua_State *L)
+{
+	struct rpcserver *srv;
+	struct dumpbuf b;
+	lua_Integer nthreads, maxqueue, maxinflight;
+	int error;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	nthreads = NVRPC_THREADS;
+	maxqueue = NVRPC_QUEUE;
+	maxinflight = NVRPC_INFLIGHT;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "queue") != LUA_TNIL) {
+			maxqueue = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "inflight") != LUA_TNIL) {
+			maxinflight = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 3);
+	}
+	luaL_argcheck(L, nthreads > 0 && nthreads <= 1024, 2,
+	    "invalid threads");
+	luaL_argcheck(L, maxqueue > 0 && maxqueue <= INT_MAX, 2,
+	    "invalid queue");
+	luaL_argcheck(L, maxinflight > 0 && maxinflight <= INT_MAX, 2,
+	    "invalid inflight");
+
+	b.p = NULL;
+	b.len = 0;
+	lua_pushvalue(L, 1);
+	if (lua_dump(L, dump_writer, &b, 0) != 0) {
+		free(b.p);
+		return (luaL_argerror(L, 1, "unable to dump function"));
+	}
+	lua_pop(L, 1);
+
+	if ((srv = calloc(1, sizeof(*srv) +
+	    nthreads * sizeof(struct rpcworker))) == NULL) {
+		free(b.p);
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_cond_init(&srv->work, NULL);
+	pthread_cond_init(&srv->space, NULL);
+	TAILQ_INIT(&srv->conns);
+	STAILQ_INIT(&srv->queue);
+	srv->maxqueue = maxqueue;
+	srv->maxinflight = maxinflight;
+	for (int i = 0; i < nthreads; i++) {
+		struct rpcworker *w = &srv->workers[i];
+
+		if ((w->L = luaL_newstate()) == NULL) {
+			rpc_shutdown(srv);
+			free(b.p);
+			return (fatal(L, "luaL_newstate", ENOMEM));
+		}
+		w->srv = srv;
+		srv->nstates++;
+		if (!rpc_setup(w->L, b.p, b.len)) {
+			lua_pushstring(L, lua_type(w->L, -1) == LUA_TSTRING ?
+			    lua_tostring(w->L, -1) : "setup failed");
+			rpc_shutdown(srv);
+			free(b.p);
+			return (lua_error(L));
+		}
+		if (i == 0 && !rpc_stats_init(srv, w->L)) {
+			rpc_shutdown(srv);
+			free(b.p);
+			return (fatal(L, "strdup", ENOMEM));
+		}
+		rpc_stats_index(srv, w->L);
+	}
+	free(b.p);
+	for (int i = 0; i < nthreads; i++) {
+		if ((error = pthread_create(&srv->workers[i].thread, NULL,
+		    rpc_worker, &srv->workers[i])) != 0) {
+			rpc_shutdown(srv);
+			return (fail(L, error));
+		}
+		srv->nworkers++;
+	}
+	return (new(L, srv, NVRPC_SERVER_METATABLE));
+}
+
+static int
+l_rpcserver_close(lua_State *L)
+{
+	struct rpcserver *srv;
+
+	srv = checkcookienull(L, 1, NVRPC_SERVER_METATABLE);
+
+	if (srv != NULL) {
+		rpc_shutdown(srv);
+		setcookie(L, 1, NULL);
+	}
+	return (0);
+}
+
+static int
+l_rpcserver_add(lua_State *L)
+{
+	struct rpcserver *srv;
+	struct rpcconn *conn;
+	pthread_t reader, writer;
+	int fd, one, error;
+
+	srv = checkcookie(L, 1, NVRPC_SERVER_METATABLE);
+	fd = luaL_checkinteger(L, 2);
+
+	/*
+	 * A peer hanging up must not kill us with SIGPIPE.  This also checks
+	 * that fd is a socket, which closing the server relies on.
+	 */
+	one = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one))
+	    == -1) {
+		return (fail(L, errno));
+	}
+	if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_cond_init(&conn->sendable, NULL);
+	STAILQ_INIT(&conn->responses);
+	conn->srv = srv;
+	conn->fd = fd;
+	conn->reading = conn->writing = true;
+	pthread_mutex_lock(&srv->lock);
+	if ((error = pthread_create(&writer, NULL, rpc_writer, conn)) != 0) {
+		pthread_mutex_unlock(&srv->lock);
+		pthread_cond_destroy(&conn->sendable);
+		free(conn);
+		return (fail(L, error));
+	}
+	(void)pthread_detach(writer);
+	TAILQ_INSERT_TAIL(&srv->conns, conn, link);
+	srv->nconns++;
+	srv->nthreads++;
+	if ((error = pthread_create(&reader, NULL, rpc_reader, conn)) != 0) {
+		/* The writer frees the connection, but fd stays the caller's. */
+		conn->fd = -1;
+		conn->reading = false;
+		pthread_cond_signal(&conn->sendable);
+		pthread_mutex_unlock(&srv->lock);
+		return (fail(L, error));
+	}
+	(void)pthread_detach(reader);
+	srv->nthreads++;
+	pthread_mutex_unlock(&srv->lock);
+	return (success(L));
+}
+
+static int
+l_rpcserver_connections(lua_State *L)
+{
+	struct rpcserver *srv;
+
+	srv = checkcookie(L, 1, NVRPC_SERVER_METATABLE);
+
+	pthread_mutex_lock(&srv->lock);
+	lua_pushinteger(L, srv->nconns);
+	pthread_mutex_unlock(&srv->lock);
+	return (1);
+}
+
+static int
+l_rpcserver_stats(lua_State *L)
+{
+	struct rpcserver *srv;
+	struct rpcstat *stats;
+	int n;
+
+	srv = checkcookie(L, 1, NVRPC_SERVER_METATABLE);
+
+	/*
+	 * Snapshot the counters without holding the lock while allocating.
+	 * The set of methods is fixed when the server starts.
+	 */
+	n = srv->nstats;
+	stats = lua_newuserdatauv(L, MAX(n, 1) * sizeof(*stats), 0);
+	pthread_mutex_lock(&srv->lock);
+	memcpy(stats, srv->stats, n * sizeof(*stats));
+	pthread_mutex_unlock(&srv->lock);
+
+	lua_createtable(L, 0, n);
+	for (int i = 0; i < n; i++) {
+		if (stats[i].calls == 0) {
+			continue;
+		}
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, stats[i].calls);
+		lua_setfield(L, -2, "calls");
+		lua_pushinteger(L, stats[i].errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushnumber(L, stats[i].total_ns / 1e9);
+		lua_setfield(L, -2, "time");
+		lua_pushnumber(L, stats[i].max_ns / 1e9);
+		lua_setfield(L, -2, "max");
+		lua_setfield(L, -2, stats[i].method);
+	}
+	return (1);
+}
+
+struct rpcclient {
+	int fd;
+	uint64_t nextid;
+	int outstanding;
+	int maxinflight;
+	int stash;	/* registry ref to responses received out of order */
+};
+
+static inline struct rpcclient *
+checkrpcclient(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, NVRPC_CLIENT_METATABLE));
+}
+
+/* Receive one response into the stash.  Returns false with errno set. */
+static bool
+rpcclient_recv(lua_State *L, struct rpcclient *c)
+{
+	nvlist_t *resp;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->stash);
+	new(L, NULL, NVLIST_METATABLE);
+	if ((resp = nvlist_recv(c->fd, 0)) == NULL) {
+		lua_pop(L, 2);
+		return (false);
+	}
+	setcookie(L, -1, resp);
+	lua_rawseti(L, -2, dnvlist_get_number(resp, "id", 0));
+	lua_pop(L, 1);
+	c->outstanding--;
+	return (true);
+}
+
+static int
+rpcclient_wait(lua_State *L, struct rpcclient *c, lua_Integer id)
+{
+	nvlist_t *resp;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->stash);
+	while (lua_rawgeti(L, -1, id) == LUA_TNIL) {
+		lua_pop(L, 1);
+		if (!rpcclient_recv(L, c)) {
+			return (fail(L, errno));
+		}
+	}
+	resp = checknvlist(L, -1);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, id);
+	if (nvlist_exists_string(resp, "error")) {
+		luaL_pushfail(L);
+		lua_pushstring(L, nvlist_get_string(resp, "error"));
+		lua_pushinteger(L, dnvlist_get_number(resp, "errno", 0));
+		return (3);
+	}
+	new(L, NULL, NVLIST_METATABLE);
+	if (nvlist_exists_nvlist(resp, "result")) {
+		setcookie(L, -1, nvlist_take_nvlist(resp, "result"));
+	} else {
+		setcookie(L, -1, nvlist_create(0));
+	}
+	return (1);
+}
+
+static int
+l_nv_rpc_client(lua_State *L)
+{
+	struct rpcclient *c;
+	lua_Integer maxinflight;
+	int fd, one;
+
+	fd = luaL_checkinteger(L, 1);
+	maxinflight = NVRPC_INFLIGHT;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "inflight") != LUA_TNIL) {
+			maxinflight = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	luaL_argcheck(L, maxinflight > 0 && maxinflight <= INT_MAX, 2,
+	    "invalid inflight");
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	one = 1;
+	(void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+	c->fd = fd;
+	c->maxinflight = maxinflight;
+	lua_newtable(L);
+	c->stash = luaL_ref(L, LUA_REGISTRYINDEX);
+	return (new(L, c, NVRPC_CLIENT_METATABLE));
+}
+
+static int
+l_rpcclient_close(lua_State *L)
+{
+	struct rpcclient *c;
+
+	c = checkcookienull(L, 1, NVRPC_CLIENT_METATABLE);
+
+	if (c != NULL) {
+		luaL_unref(L, LUA_REGISTRYINDEX, c->stash);
+		free(c);
+		setcookie(L, 1, NULL);
+	}
+	return (0);
+}
+
+static int
+l_rpcclient_send(lua_State *L)
+{
+	struct fromtable ft;
+	struct rpcclient *c;
+	const char *method;
+	nvlist_t *req, *args;
+	int error;
+
+	c = checkrpcclient(L, 1);
+	method = luaL_checkstring(L, 2);
+	lua_settop(L, 3);
+
+	while (c->outstanding >= c->maxinflight) {
+		if (!rpcclient_recv(L, c)) {
+			return (fail(L, errno));
+		}
+	}
+	if ((req = nvlist_create(0)) == NULL) {
+		return (fatal(L, "nvlist_create", ENOMEM));
+	}
+	new(L, req, NVLIST_METATABLE);
+	nvlist_add_number(req, "id", c->nextid + 1);
+	nvlist_add_string(req, "method", method);
+	if ((args = getanynvlist(L, 3)) != NULL) {
+		luaL_argcheck(L, nvlist_error(args) == 0, 3,
+		    "nvlist has error");
+		nvlist_add_nvlist(req, "args", args);
+	} else if (lua_istable(L, 3)) {
+		if ((args = nvlist_create(0)) == NULL) {
+			return (fatal(L, "nvlist_create", ENOMEM));
+		}
+		new(L, args, NVLIST_METATABLE);
+		ft.types = 0;
+		lua_newtable(L);
+		ft.seen = lua_gettop(L);
+		fromtable(L, 3, args, &ft);
+		lua_pop(L, 1);
+		nvlist_move_nvlist(req, "args", args);
+		setcookie(L, -1, NULL);
+		lua_pop(L, 1);
+	} else {
+		luaL_argexpected(L, lua_isnil(L, 3), 3, "table or nvlist");
+	}
+	if ((error = nvlist_error(req)) != 0) {
+		return (fail(L, error));
+	}
+	if (nvlist_send(c->fd, req) == -1) {
+		return (fail(L, errno));
+	}
+	c->nextid++;
+	c->outstanding++;
+	lua_pushinteger(L, c->nextid);
+	return (1);
+}
+
+static int
+l_rpcclient_wait(lua_State *L)
+{
+	struct rpcclient *c;
+	lua_Integer id;
+
+	c = checkrpcclient(L, 1);
+	id = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, id > 0 && id <= c->nextid, 2, "unknown request");
+
+	return (rpcclient_wait(L, c, id));
+}
+
+static int
+l_rpcclient_call(lua_State *L)
+{
+	struct rpcclient *c;
+	lua_Integer id;
+	int nret;
+
+	c = checkrpcclient(L, 1);
+
+	if ((nret = l_rpcclient_send(L)) != 1) {
+		return (nret);
+	}
+	id = lua_tointeger(L, -1);
+	return (rpcclient_wait(L, c, id));
+}
+
+static int
+l_rpcclient_pending(lua_State *L)
+{
+	struct rpcclient *c;
+
+	c = checkrpcclient(L, 1);
+
+	lua_pushinteger(L, c->outstanding);
+	return (1);
+}
+
+static const struct luaL_Reg l_nv_funcs[] = {
+	{"create", l_nv_create},
+	{"recv", l_nv_recv},
+	{"unpack", l_nv_unpack},
+	{"from_table", l_nv_from_table},
+	{"stream", l_nv_stream},
+	{"rpc_server", l_nv_rpc_server},
+	{"rpc_client", l_nv_rpc_client},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_nvlist_meta[] = {
+	{"__gc", l_nvlist_gc},
+	{"error", l_nvlist_error},
+	{"set_error", l_nvlist_set_error},
+	{"empty", l_nvlist_empty},
+	{"flags", l_nvlist_flags},
+	{"in_array", l_nvlist_in_array},
+	{"clone", l_nvlist_clone},
+	{"dump", l_nvlist_dump},
+	{"fdump", l_nvlist_fdump},
+	{"size", l_nvlist_size},
+	{"pack", l_nvlist_pack},
+	{"send", l_nvlist_send},
+	{"xfer", l_nvlist_xfer},
+	{"to_table", l_nvlist_to_table},
+	{"exists", l_nvlist_exists},
+#define NVLIST_EXISTS(type, _) {"exists_"#type, l_nvlist_exists_##type},
+	NVLIST_TYPES_NULL(NVLIST_EXISTS)
+#undef NVLIST_EXISTS
+#define NVLIST_ADD(type, _) {"add_"#type, l_nvlist_add_##type},
+	NVLIST_TYPES_NULL(NVLIST_ADD)
+#undef NVLIST_ADD
+	{"move_nvlist", l_nvlist_move_nvlist},
+	{"move_descriptor", l_nvlist_move_descriptor},
+	{"move_nvlist_array", l_nvlist_move_nvlist_array},
+	{"move_descriptor_array", l_nvlist_move_descriptor_array},
+#define NVLIST_GET(type, _) {"get_"#type, l_nvlist_get_##type},
+	NVLIST_TYPES(NVLIST_GET)
+#undef NVLIST_GET
+#define NVLIST_TAKE(type, _) {"take_"#type, l_nvlist_take_##type},
+	NVLIST_TYPES(NVLIST_TAKE)
+#undef NVLIST_TAKE
+	{"append_bool_array", l_nvlist_append_bool_array},
+	{"append_number_array", l_nvlist_append_number_array},
+	{"append_string_array", l_nvlist_append_string_array},
+	{"append_nvlist_array", l_nvlist_append_nvlist_array},
+	{"append_descriptor_array", l_nvlist_append_descriptor_array},
+	{"free", l_nvlist_free},
+	{"free_type", l_nvlist_free_type},
+#define NVLIST_FREE(type, _) {"free_"#type, l_nvlist_free_##type},
+	NVLIST_TYPES_NULL(NVLIST_FREE)
+#undef NVLIST_FREE
+	{"next", l_nvlist_next},
+	{"get_parent", l_nvlist_get_parent},
+	{"get_array_next", l_nvlist_get_array_next},
+	{"get_pararr", l_nvlist_get_pararr},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_const_nvlist_meta[] = {
+	{"error", l_const_nvlist_error},
+	{"empty", l_const_nvlist_empty},
+	{"flags", l_const_nvlist_flags},
+	{"in_array", l_const_nvlist_in_array},
+	{"clone", l_const_nvlist_clone},
+	{"dump", l_const_nvlist_dump},
+	{"fdump", l_const_nvlist_fdump},
+	{"size", l_const_nvlist_size},
+	{"pack", l_const_nvlist_pack},
+	{"send", l_const_nvlist_send},
+	{"to_table", l_const_nvlist_to_table},
+	{"exists", l_const_nvlist_exists},
+#define NVLIST_EXISTS(type, _) {"exists_"#type, l_const_nvlist_exists_##type},
+	NVLIST_TYPES_NULL(NVLIST_EXISTS)
+#undef NVLIST_EXISTS
+#define NVLIST_GET(type, _) {"get_"#type, l_const_nvlist_get_##type},
+	NVLIST_TYPES(NVLIST_GET)
+#undef NVLIST_GET
+	{"next", l_const_nvlist_next},
+	{"get_parent", l_const_nvlist_get_parent},
+	{"get_array_next", l_const_nvlist_get_array_next},
+	{"get_pararr", l_const_nvlist_get_pararr},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_cnvlist_meta[] = {
+	{"name", l_cnvlist_name},
+	{"type", l_cnvlist_type},
+#define CNVLIST_GET(type, _) {"get_"#type, l_cnvlist_get_##type},
+	NVLIST_TYPES(CNVLIST_GET)
+#undef CNVLIST_GET
+#define CNVLIST_TAKE(type, _) {"take_"#type, l_cnvlist_take_##type},
+	NVLIST_TYPES(CNVLIST_TAKE)
+#undef CNVLIST_TAKE
+#define CNVLIST_FREE(type, _) {"free_"#type, l_cnvlist_free_##type},
+	NVLIST_TYPES(CNVLIST_FREE)
+#undef CNVLIST_FREE
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_nvstream_meta[] = {
+	{"__close", l_nvstream_close},
+	{"__gc", l_nvstream_close},
+	{"close", l_nvstream_close},
+	{"put", l_nvstream_put},
+	{"pending", l_nvstream_pending},
+	{"flush", l_nvstream_flush},
+	{"take", l_nvstream_take},
+	{"fill", l_nvstream_fill},
+	{"feed", l_nvstream_feed},
+	{"get", l_nvstream_get},
+	{"recv", l_nvstream_recv},
+	{"buffered", l_nvstream_buffered},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_rpcserver_meta[] = {
+	{"__close", l_rpcserver_close},
+	{"__gc", l_rpcserver_close},
+	{"close", l_rpcserver_close},
+	{"add", l_rpcserver_add},
+	{"connections", l_rpcserver_connections},
+	{"stats", l_rpcserver_stats},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_rpcclient_meta[] = {
+	{"__close", l_rpcclient_close},
+	{"__gc", l_rpcclient_close},
+	{"close", l_rpcclient_close},
+	{"send", l_rpcclient_send},
+	{"wait", l_rpcclient_wait},
+	{"call", l_rpcclient_call},
+	{"pending", l_rpcclient_pending},
+	{NULL, NULL}
+};
+
+int
+luaopen_nv(lua_State *L)
+{
+	luaL_newmetatable(L, NVLIST_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_nvlist_meta, 0);
+
+	luaL_newmetatable(L, CONST_NVLIST_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_const_nvlist_meta, 0);
+
+	luaL_newmetatable(L, CNVLIST_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_cnvlist_meta, 0);
+
+	luaL_newmetatable(L, NVSTREAM_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_nvstream_meta, 0);
+
+	luaL_newmetatable(L, NVRPC_SERVER_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_rpcserver_meta, 0);
+
+	luaL_newmetatable(L, NVRPC_CLIENT_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_rpcclient_meta, 0);
 
 	luaL_newlib(L, l_nv_funcs);
 
@@ -5,3 +5,155 @@ local nvl = nv.create()
 nvl:add_bool("simple", true)
 nvl:add_string("hello", "world")
 nvl:fdump(io.stdout)
+
+local t = {
+	flag = true,
+	count = 42,
+	name = "pool",
+	blob = "a\0b",
+	present = false,
+	sizes = {1, 2, 3},
+	names = {"a", "b"},
+	child = {depth = 1},
+	children = {{n = 1}, {n = 2}},
+}
+nvl = assert(nv.from_table(t, {types = {present = nv.TYPE_NULL}}))
+assert(nvl:get_number("count") == 42)
+assert(nvl:exists_binary("blob"))
+assert(nvl:exists_null("present"))
+assert(nvl:exists_nvlist_array("children"))
+local u = nvl:to_table()
+assert(u.flag == true and u.count == 42 and u.name == "pool")
+assert(u.blob == "a\0b")
+assert(u.present == true)
+assert(#u.sizes == 3 and u.sizes[3] == 3)
+assert(u.names[2] == "b")
+assert(u.child.depth == 1)
+assert(u.children[2].n == 2)
+assert(nvl:get_nvlist("child"):to_table({null = 0}).depth == 1)
+local cycle = {}
+cycle.self = cycle
+assert(not pcall(nv.from_table, cycle))
+assert(not pcall(nv.from_table, {mixed = {1, "a"}}))
+
+local unistd = require('unistd')
+
+local buf <close> = nv.stream()
+for i = 1, 100 do
+	assert(buf:put(nv.from_table({seq = i})))
+end
+local frames = buf:take()
+assert(buf:pending() == 0)
+buf:feed(frames:sub(1, 10))
+assert(buf:get() == nil)
+buf:feed(frames:sub(11))
+for i = 1, 100 do
+	assert(buf:get():get_number("seq") == i)
+end
+assert(buf:get() == nil)
+
+local r, w = assert(unistd.pipe())
+local tx <close> = nv.stream(w)
+local rx <close> = nv.stream(r)
+assert(tx:put(nv.from_table({hello = "world"}), nv.from_table({n = 2})))
+assert(tx:flush())
+local got, eof = assert(rx:recv())
+assert(#got == 2 and not eof)
+assert(got[1]:get_string("hello") == "world")
+assert(got[2]:get_number("n") == 2)
+assert(not pcall(rx.fill, rx, 0))
+assert(not pcall(rx.fill, rx, -1))
+assert(tx:put(nv.from_table({n = 1})))
+assert(tx:flush())
+assert(unistd.write(w, "\0\0\0\4junk"))
+assert(tx:put(nv.from_table({n = 3})))
+assert(tx:flush())
+got = assert(rx:recv())
+assert(#got == 1 and got[1]:get_number("n") == 1)
+assert(not rx:recv())
+got = assert(rx:recv())
+assert(#got == 1 and got[1]:get_number("n") == 3)
+unistd.close(w)
+got, eof = assert(rx:recv())
+assert(#got == 0 and eof)
+unistd.close(r)
+
+local socket = require('sys.socket')
+
+do
+	local server <close> = assert(nv.rpc_server(function()
+		local unistd = require('unistd')
+		return {
+			add = function(args)
+				return {
+					sum = args:get_number("a") +
+					    args:get_number("b"),
+				}
+			end,
+			fail = function()
+				return nil, "failed on purpose", 22
+			end,
+			raise = function()
+				error("raised on purpose")
+			end,
+			slow = function(args)
+				unistd.usleep(args:get_number("usec"))
+			end,
+			big = function()
+				return {data = string.rep("x", 1 << 20)}
+			end,
+		}
+	end, {threads = 2, inflight = 4}))
+	local s1, s2 = assert(socket.socketpair(socket.AF_UNIX,
+	    socket.SOCK_STREAM, 0))
+	assert(server:add(s1))
+	assert(server:connections() == 1)
+	local client <close> = nv.rpc_client(s2, {inflight = 8})
+	local ids = {}
+	for i = 1, 32 do
+		ids[i] = assert(client:send("add", {a = i, b = 1}))
+	end
+	for i = 32, 1, -1 do
+		local result = assert(client:wait(ids[i]))
+		assert(result:get_number("sum") == i + 1)
+	end
+	assert(client:pending() == 0)
+	local result = assert(client:call("slow", {usec = 1000}))
+	assert(result:empty())
+	local ok, errmsg, errcode = client:call("fail")
+	assert(not ok and errmsg == "failed on purpose" and errcode == 22)
+	ok, errmsg = client:call("raise")
+	assert(not ok and errmsg:find("raised on purpose", 1, true))
+	ok, errmsg, errcode = client:call("missing")
+	assert(not ok and errcode ~= 0)
+	local stats = server:stats()
+	assert(stats.add.calls == 32 and stats.add.errors == 0)
+	assert(stats.slow.time >= 0.001)
+	assert(stats.fail.errors == 1)
+	assert(stats.missing == nil)
+	-- A peer stuck in the middle of a frame must not stall the others.
+	local t1, t2 = assert(socket.socketpair(socket.AF_UNIX,
+	    socket.SOCK_STREAM, 0))
+	assert(server:add(t1))
+	assert(unistd.write(t2, "\x6c\x00"))
+	result = assert(client:call("add", {a = 1, b = 2}))
+	assert(result:get_number("sum") == 3)
+	-- Nor may a peer that doesn't read its responses hold the workers.
+	local u1, u2 = assert(socket.socketpair(socket.AF_UNIX,
+	    socket.SOCK_STREAM, 0))
+	assert(server:add(u1))
+	local lazy <close> = nv.rpc_client(u2)
+	for i = 1, 4 do
+		assert(lazy:send("big"))
+	end
+	unistd.usleep(10000)
+	result = assert(client:call("add", {a = 2, b = 2}))
+	assert(result:get_number("sum") == 4)
+	local r, w = assert(unistd.pipe())
+	assert(not server:add(r))
+	unistd.close(r)
+	unistd.close(w)
+	unistd.close(t2)
+	unistd.close(u2)
+	unistd.close(s2)
+end
@@ -7,6 +7,7 @@
 #include <sys/param.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
  * Solaris types not defined in system headers.
@@ -24,6 +25,9 @@ typedef uint64_t hrtime_t;
 #include "lua_nvpair.h"
 #include "utils.h"
 
+#define NVVIEW_METATABLE "nvlist_t* view"
+#define NVARRAY_METATABLE "nvpair_t* array view"
+
 int luaopen_nvpair(lua_State *);
 
 #define NVPAIR_SCALAR_TYPES(X) \
@@ -210,6 +214,491 @@ l_nvlist_pairs(lua_State *L)
 	return (3);
 }
 
+/*
+ * Views index into an nvlist in place.  Nested nvlists and arrays are pushed
+ * as further views, and only the leaves that are actually read get converted
+ * to Lua values.  A view holds no pointers into the list: it keeps its parent
+ * (the owning nvlist, a list view, or an array view) in its uservalue and
+ * looks its pair up again by name on each access, so a view whose pair has
+ * been removed or replaced by the owner goes stale instead of dangling.
+ */
+struct nvview {
+	lua_Integer index;	/* element of the parent array view, or 0 */
+	data_type_t type;	/* type of the pair when the view was made */
+	bool literal;		/* key is a single name rather than a path */
+	char key[];		/* path or name in the parent list */
+};
+
+static void
+pushview(lua_State *L, int parent, const char *metatable, const char *key,
+    bool literal, lua_Integer index, data_type_t type)
+{
+	struct nvview *v;
+	size_t len;
+
+	parent = lua_absindex(L, parent);
+	len = strlen(key);
+	v = lua_newuserdatauv(L, sizeof(*v) + len + 1, 1);
+	v->index = index;
+	v->type = type;
+	v->literal = literal;
+	memcpy(v->key, key, len + 1);
+	luaL_setmetatable(L, metatable);
+	lua_pushvalue(L, parent);
+	lua_setiuservalue(L, -2, 1);
+}
+
+static uint_t
+arrayelem(lua_State *L, int array, nvpair_t *nvp, lua_Integer i)
+{
+	uint_t len;
+	int error;
+
+	switch (nvpair_type(nvp)) {
+#define NVPAIR_ELEM(ftype, ctype, dtype, _lcheck, lpush) \
+	case DATA_TYPE_##dtype##_ARRAY: { \
+		ctype *values; \
+\
+		if ((error = nvpair_value_##ftype##_array(nvp, \
+		    &values, &len)) != 0) { \
+			fatal(L, "nvpair_value_"#ftype"_array", error); \
+		} \
+		if (i > 0 && i <= len) { \
+			lpush(L, values[i - 1]); \
+		} \
+		break; \
+	}
+	NVPAIR_ARRAY_LOOKUP_TYPES(NVPAIR_ELEM)
+#undef NVPAIR_ELEM
+	case DATA_TYPE_STRING_ARRAY: {
+		const char **values;
+
+		if ((error = nvpair_value_string_array(nvp, &values, &len))
+		    != 0) {
+			fatal(L, "nvpair_value_string_array", error);
+		}
+		if (i > 0 && i <= len) {
+			lua_pushstring(L, values[i - 1]);
+		}
+		break;
+	}
+	case DATA_TYPE_NVLIST_ARRAY: {
+		nvlist_t **values;
+
+		if ((error = nvpair_value_nvlist_array(nvp, &values, &len))
+		    != 0) {
+			fatal(L, "nvpair_value_nvlist_array", error);
+		}
+		if (i > 0 && i <= len) {
+			pushview(L, array, NVVIEW_METATABLE, "", false, i,
+			    DATA_TYPE_NVLIST);
+		}
+		break;
+	}
+	default:
+		return (luaL_error(L, "unexpected type"));
+	}
+	return (len);
+}
+
+static inline void
+pushlazy(lua_State *L, int parent, const char *key, bool literal,
+    nvpair_t *nvp)
+{
+	switch (nvpair_type(nvp)) {
+	case DATA_TYPE_NVLIST:
+		pushview(L, parent, NVVIEW_METATABLE, key, literal, 0,
+		    DATA_TYPE_NVLIST);
+		break;
+#define NVPAIR_ARRAY(_ftype, _ctype, dtype, _lcheck, _lpush) \
+	case DATA_TYPE_##dtype##_ARRAY:
+	NVPAIR_ARRAY_TYPES(NVPAIR_ARRAY)
+#undef NVPAIR_ARRAY
+		pushview(L, parent, NVARRAY_METATABLE, key, literal, 0,
+		    nvpair_type(nvp));
+		break;
+	default:
+		pushvalue(L, nvp);
+		break;
+	}
+}
+
+/*
+ * Walk a path like "vdev_tree.children[3].stats" from *nvlp.  Array indices
+ * count from 1, like Lua.  The walk ends on a pair in *nvpp, on an element of
+ * an nvlist array in *nvlp with *nvpp set to NULL, or on element *ip of the
+ * scalar array in *nvpp.  Returns false if the path does not exist.
+ */
+static bool
+view_walk(lua_State *L, const char *path, nvlist_t **nvlp, nvpair_t **nvpp,
+    lua_Integer *ip)
+{
+	nvlist_t *nvl;
+	nvpair_t *nvp;
+	const char *p;
+	char *end;
+	lua_Integer i;
+	size_t len;
+	int error;
+
+	nvl = *nvlp;
+	nvp = NULL;
+	p = path;
+	for (;;) {
+		if ((len = strcspn(p, ".[")) == 0) {
+			luaL_argerror(L, 2, "invalid path");
+		}
+		lua_pushlstring(L, p, len);
+		error = nvlist_lookup_nvpair(nvl, lua_tostring(L, -1), &nvp);
+		lua_pop(L, 1);
+		if (error != 0) {
+			return (false);
+		}
+		p += len;
+		while (*p == '[') {
+			i = strtoll(p + 1, &end, 10);
+			if (end == p + 1 || *end != ']') {
+				luaL_argerror(L, 2, "invalid path");
+			}
+			p = end + 1;
+			if (*p != '\0' && *p != '.' && *p != '[') {
+				luaL_argerror(L, 2, "invalid path");
+			}
+			if (nvp == NULL) {
+				return (false);
+			}
+			switch (nvpair_type(nvp)) {
+			case DATA_TYPE_NVLIST_ARRAY: {
+				nvlist_t **values;
+				uint_t n;
+
+				if ((error = nvpair_value_nvlist_array(nvp,
+				    &values, &n)) != 0) {
+					fatal(L, "nvpair_value_nvlist_array",
+					    error);
+				}
+				if (i < 1 || i > n) {
+					return (false);
+				}
+				nvl = values[i - 1];
+				nvp = NULL;
+				break;
+			}
+#define NVPAIR_ARRAY(_ftype, _ctype, dtype, _lcheck, _lpush) \
+			case DATA_TYPE_##dtype##_ARRAY:
+			NVPAIR_ARRAY_LOOKUP_TYPES(NVPAIR_ARRAY)
+#undef NVPAIR_ARRAY
+			case DATA_TYPE_STRING_ARRAY:
+				if (*p != '\0' || i < 1 ||
+				    i > arrayelem(L, 0, nvp, 0)) {
+					return (false);
+				}
+				*nvpp = nvp;
+				*ip = i;
+				return (true);
+			default:
+				return (false);
+			}
+		}
+		if (*p == '\0') {
+			break;
+		}
+		p++;
+		if (nvp != NULL) {
+			if (nvpair_type(nvp) != DATA_TYPE_NVLIST) {
+				return (false);
+			}
+			if ((error = nvpair_value_nvlist(nvp, &nvl)) != 0) {
+				fatal(L, "nvpair_value_nvlist", error);
+			}
+		}
+	}
+	*nvlp = nvl;
+	*nvpp = nvp;
+	*ip = 0;
+	return (true);
+}
+
+/*
+ * Find what the view v names in its parent list *nvlp, as for view_walk.
+ * Returns false if it is gone or now has a different type.
+ */
+static bool
+view_find(lua_State *L, struct nvview *v, nvlist_t **nvlp, nvpair_t **nvpp)
+{
+	lua_Integer i;
+
+	if (v->literal) {
+		if (nvlist_lookup_nvpair(*nvlp, v->key, nvpp) != 0) {
+			return (false);
+		}
+	} else if (v->key[0] == '\0') {
+		*nvpp = NULL;
+		return (true);
+	} else if (!view_walk(L, v->key, nvlp, nvpp, &i) || i != 0) {
+		return (false);
+	}
+	return (*nvpp == NULL || nvpair_type(*nvpp) == v->type);
+}
+
+static nvlist_t *view_list(lua_State *, int);
+
+/*
+ * Look up the array for the array view at idx, or return NULL if it is stale.
+ */
+static nvpair_t *
+view_array(lua_State *L, int idx)
+{
+	struct nvview *v;
+	nvlist_t *nvl;
+	nvpair_t *nvp;
+
+	v = lua_touserdata(L, idx);
+	luaL_checkstack(L, 1, NULL);
+	lua_getiuservalue(L, idx, 1);
+	nvl = view_list(L, -1);
+	lua_pop(L, 1);
+	if (nvl == NULL || !view_find(L, v, &nvl, &nvp) || nvp == NULL) {
+		return (NULL);
+	}
+	return (nvp);
+}
+
+/*
+ * Look up the list for the nvlist or list view at idx, or return NULL if the
+ * view is stale.
+ */
+static nvlist_t *
+view_list(lua_State *L, int idx)
+{
+	struct nvview *v;
+	nvlist_t *nvl, **values;
+	nvpair_t *nvp;
+	uint_t n;
+
+	if ((v = luaL_testudata(L, idx, NVVIEW_METATABLE)) == NULL) {
+		return (checknvlist(L, idx));
+	}
+	luaL_checkstack(L, 1, NULL);
+	lua_getiuservalue(L, idx, 1);
+	if (v->index != 0) {
+		nvp = view_array(L, -1);
+		lua_pop(L, 1);
+		if (nvp == NULL || nvpair_type(nvp) != DATA_TYPE_NVLIST_ARRAY ||
+		    nvpair_value_nvlist_array(nvp, &values, &n) != 0 ||
+		    v->index > n) {
+			return (NULL);
+		}
+		return (values[v->index - 1]);
+	}
+	nvl = view_list(L, -1);
+	lua_pop(L, 1);
+	if (nvl == NULL || !view_find(L, v, &nvl, &nvp)) {
+		return (NULL);
+	}
+	if (nvp != NULL && nvpair_value_nvlist(nvp, &nvl) != 0) {
+		return (NULL);
+	}
+	return (nvl);
+}
+
+static nvlist_t *
+checkview(lua_State *L, int idx)
+{
+	nvlist_t *nvl;
+
+	luaL_checkudata(L, idx, NVVIEW_METATABLE);
+	nvl = view_list(L, idx);
+	luaL_argcheck(L, nvl != NULL, idx, "view is stale");
+	return (nvl);
+}
+
+static nvpair_t *
+checkarray(lua_State *L, int idx)
+{
+	nvpair_t *nvp;
+
+	luaL_checkudata(L, idx, NVARRAY_METATABLE);
+	nvp = view_array(L, idx);
+	luaL_argcheck(L, nvp != NULL, idx, "view is stale");
+	return (nvp);
+}
+
+static int
+view_get(lua_State *L, int parent, nvlist_t *nvl, const char *path)
+{
+	nvpair_t *nvp;
+	lua_Integer i;
+
+	if (!view_walk(L, path, &nvl, &nvp, &i)) {
+		return (0);
+	}
+	if (nvp == NULL) {
+		pushview(L, parent, NVVIEW_METATABLE, path, false, 0,
+		    DATA_TYPE_NVLIST);
+		lua_pushinteger(L, DATA_TYPE_NVLIST);
+		return (2);
+	}
+	if (i != 0) {
+		arrayelem(L, 0, nvp, i);
+	} else {
+		pushlazy(L, parent, path, false, nvp);
+	}
+	lua_pushinteger(L, nvpair_type(nvp));
+	return (2);
+}
+
+static int
+l_nvlist_view(lua_State *L)
+{
+	checknvlist(L, 1);
+
+	pushview(L, 1, NVVIEW_METATABLE, "", false, 0, DATA_TYPE_NVLIST);
+	return (1);
+}
+
+static int
+l_nvlist_get(lua_State *L)
+{
+	nvlist_t *nvl;
+	const char *path;
+
+	nvl = checknvlist(L, 1);
+	path = luaL_checkstring(L, 2);
+
+	return (view_get(L, 1, nvl, path));
+}
+
+static int
+l_nvview_get(lua_State *L)
+{
+	nvlist_t *nvl;
+	const char *path;
+
+	nvl = checkview(L, 1);
+	path = luaL_checkstring(L, 2);
+
+	return (view_get(L, 1, nvl, path));
+}
+
+static int
+l_nvview_lookup(lua_State *L)
+{
+	nvlist_t *nvl;
+	const char *name;
+	nvpair_t *nvp;
+
+	nvl = checkview(L, 1);
+	name = luaL_checkstring(L, 2);
+
+	if (nvlist_lookup_nvpair(nvl, name, &nvp) != 0) {
+		return (0);
+	}
+	pushlazy(L, 1, name, true, nvp);
+	lua_pushinteger(L, nvpair_type(nvp));
+	return (2);
+}
+
+static int
+l_nvview_pairs_iter(lua_State *L)
+{
+	nvlist_t *nvl;
+	nvpair_t *nvp;
+
+	nvl = checkview(L, 1);
+	nvp = lua_touserdata(L, 2);
+
+	if (nvp == NULL) {
+		return (0);
+	}
+	lua_pushlightuserdata(L, nvlist_next_nvpair(nvl, nvp));
+	lua_pushstring(L, nvpair_name(nvp));
+	pushlazy(L, 1, nvpair_name(nvp), true, nvp);
+	lua_pushinteger(L, nvpair_type(nvp));
+	return (4);
+}
+
+static int
+l_nvview_pairs(lua_State *L)
+{
+	nvlist_t *nvl;
+
+	nvl = checkview(L, 1);
+
+	lua_pushcfunction(L, l_nvview_pairs_iter);
+	lua_pushvalue(L, 1);
+	lua_pushlightuserdata(L, nvlist_next_nvpair(nvl, NULL));
+	return (3);
+}
+
+static int
+l_nvview_dup(lua_State *L)
+{
+	nvlist_t *nvl, *dupnvl;
+	int error;
+
+	nvl = checkview(L, 1);
+	if ((error = nvlist_dup(nvl, &dupnvl, 0)) != 0) {
+		return (fatal(L, "nvlist_dup", error));
+	}
+	pushnvlist(L, dupnvl);
+	return (1);
+}
+
+static int
+l_nvarray_index(lua_State *L)
+{
+	nvpair_t *nvp;
+	lua_Integer i;
+
+	if (!lua_isinteger(L, 2)) {
+		luaL_checkudata(L, 1, NVARRAY_METATABLE);
+		luaL_getmetatable(L, NVARRAY_METATABLE);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		return (1);
+	}
+	nvp = checkarray(L, 1);
+	i = lua_tointeger(L, 2);
+	if (i < 1 || i > arrayelem(L, 1, nvp, i)) {
+		return (0);
+	}
+	return (1);
+}
+
+static int
+l_nvarray_len(lua_State *L)
+{
+	nvpair_t *nvp;
+
+	nvp = checkarray(L, 1);
+
+	lua_pushinteger(L, arrayelem(L, 1, nvp, 0));
+	return (1);
+}
+
+static int
+l_nvarray_name(lua_State *L)
+{
+	nvpair_t *nvp;
+
+	nvp = checkarray(L, 1);
+
+	lua_pushstring(L, nvpair_name(nvp));
+	return (1);
+}
+
+static int
+l_nvarray_type(lua_State *L)
+{
+	nvpair_t *nvp;
+
+	nvp = checkarray(L, 1);
+
+	lua_pushinteger(L, nvpair_type(nvp));
+	return (1);
+}
+
 static int
 l_nvlist_size(lua_State *L)
 {
@@ -466,6 +955,8 @@ static const struct luaL_Reg l_nvlist_meta[] = {
 	{"dup", l_nvlist_dup},
 	{"merge", l_nvlist_merge},
 	{"nvflag", l_nvlist_nvflag},
+	{"view", l_nvlist_view},
+	{"get", l_nvlist_get},
 	{"add_boolean", l_nvlist_add_boolean},
 #define NVLIST_ADD(ftype, _ctype, _dtype, _lcheck, _lpush) \
 	{"add_"#ftype, l_nvlist_add_##ftype},
@@ -489,6 +980,22 @@ static const struct luaL_Reg l_nvlist_meta[] = {
 	{NULL, NULL}
 };
 
+static const struct luaL_Reg l_nvview_meta[] = {
+	{"__pairs", l_nvview_pairs},
+	{"get", l_nvview_get},
+	{"lookup", l_nvview_lookup},
+	{"dup", l_nvview_dup},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_nvarray_meta[] = {
+	{"__index", l_nvarray_index},
+	{"__len", l_nvarray_len},
+	{"name", l_nvarray_name},
+	{"type", l_nvarray_type},
+	{NULL, NULL}
+};
+
 int
 luaopen_nvpair(lua_State *L)
 {
@@ -497,6 +1004,14 @@ luaopen_nvpair(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_nvlist_meta, 0);
 
+	luaL_newmetatable(L, NVVIEW_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_nvview_meta, 0);
+
+	luaL_newmetatable(L, NVARRAY_METATABLE);
+	luaL_setfuncs(L, l_nvarray_meta, 0);
+
 	luaL_newlib(L, l_nvpair_funcs);
 
 #define DEFINE(ident) ({ \
@@ -15,3 +15,40 @@ for cookie, name, value, type in pairs(nvl) do
 	print(cookie, name, value, type)
 end
 assert(#t == 2)
+
+child1 = nvpair.nvlist()
+child1:add_string("path", "/dev/da0")
+child1:add_uint64_array("stats", {10, 20, 30})
+child2 = nvpair.nvlist()
+child2:add_string("path", "/dev/da1")
+tree = nvpair.nvlist()
+tree:add_string("type", "root")
+tree:add_nvlist_array("children", {child1, child2})
+config = nvpair.nvlist()
+config:add_nvlist("vdev_tree", tree)
+view = config:view()
+assert(view:get("vdev_tree.type") == "root")
+assert(view:get("vdev_tree.children[2].path") == "/dev/da1")
+assert(view:get("vdev_tree.children[1].stats[3]") == 30)
+assert(view:get("vdev_tree.children[3].path") == nil)
+assert(view:get("vdev_tree.missing") == nil)
+children = config:get("vdev_tree.children")
+assert(#children == 2)
+assert(children:name() == "children")
+assert(children[1]:lookup("path") == "/dev/da0")
+assert(children[3] == nil)
+stats = children[1]:get("stats")
+assert(#stats == 3 and stats[2] == 20)
+assert(not pcall(view.get, view, "vdev_tree..type"))
+assert(not pcall(view.get, view, "vdev_tree.children[2]path"))
+tree = view:get("vdev_tree")
+paths = tree:lookup("children")
+child = paths[2]
+config:add_string("vdev_tree", "replaced")
+assert(not pcall(tree.get, tree, "type"))
+assert(not pcall(function() return #paths end))
+assert(not pcall(child.get, child, "path"))
+config:remove("vdev_tree")
+assert(not pcall(tree.lookup, tree, "type"))
+config:add_nvlist("vdev_tree", nvpair.nvlist())
+assert(tree:get("type") == nil)
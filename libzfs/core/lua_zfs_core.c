@@ -7,8 +7,14 @@
 #include <sys/param.h>
 #include <sys/zfs_context.h>
 #include <sys/zfs_ioctl.h>
+#include <errno.h>
 #include <libnvpair.h>
 #include <libzfs_core.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -930,6 +936,408 @@ l_lzc_channel_program_nosync(lua_State *L)
 	return (success(L));
 }
 
+/*
+ * Batched dataset operations.  Operations are collected into an nvlist
+ * array and run by a fixed channel program that dispatches on each entry, in
+ * chunks small enough to fit the instruction and memory limits.  Thousands
+ * of snapshots or property changes then take a few ioctls and txgs instead
+ * of one of each per dataset.
+ */
+
+#define	ZCP_BATCH_METATABLE "zcp_batch"
+
+/* Rough per-operation costs used to size chunks. */
+#define	ZCP_BATCH_OP_INSTRS	2000
+#define	ZCP_BATCH_OP_MEM	2048
+
+static const char zcp_batch_program[] =
+"local args = ...\n"
+"local ops, atomic = args.ops, args.atomic\n"
+"local errs, values, sources = {}, {}, {}\n"
+"local function run(op, how)\n"
+"	local o = op.op\n"
+"	if o == 'get_prop' then\n"
+"		if how == zfs.check then\n"
+"			return 0\n"
+"		end\n"
+"		local ok, v, src = pcall(zfs.get_prop, op.name, op.prop)\n"
+"		if not ok then\n"
+"			return 2\n" /* ENOENT */
+"		end\n"
+"		return 0, v, src\n"
+"	elseif o == 'snapshot' then\n"
+"		return how.snapshot(op.name)\n"
+"	elseif o == 'destroy' then\n"
+"		return how.destroy(op.name)\n"
+"	elseif o == 'set_prop' then\n"
+"		return how.set_prop(op.name, op.prop, op.value)\n"
+"	elseif o == 'inherit' then\n"
+"		return how.inherit(op.name, op.prop)\n"
+"	elseif o == 'promote' then\n"
+"		return how.promote(op.name)\n"
+"	elseif o == 'rollback' then\n"
+"		return how.rollback(op.name)\n"
+"	elseif o == 'bookmark' then\n"
+"		return how.bookmark(op.source, op.name)\n"
+"	end\n"
+"	return 22\n" /* EINVAL */
+"end\n"
+/* An error raised by one operation must not lose the others' results. */
+"local function try(op, how)\n"
+"	local ok, err, v, src = pcall(run, op, how)\n"
+"	if not ok then\n"
+"		return 22\n" /* EINVAL */
+"	end\n"
+"	return err, v, src\n"
+"end\n"
+"if atomic then\n"
+"	local failed = false\n"
+"	for i, op in ipairs(ops) do\n"
+"		local err = try(op, zfs.check)\n"
+"		if err ~= 0 then\n"
+"			errs[i] = err\n"
+"			failed = true\n"
+"		end\n"
+"	end\n"
+"	if failed then\n"
+"		return {checked = errs}\n"
+"	end\n"
+"end\n"
+"for i, op in ipairs(ops) do\n"
+"	local err, v, src = try(op, zfs.sync)\n"
+"	errs[i] = err\n"
+"	values[i] = v\n"
+"	sources[i] = src\n"
+"end\n"
+"return {errno = errs, value = values, source = sources}\n";
+
+struct zcp_batch {
+	char *pool;
+	uint64_t instrlimit;
+	uint64_t memlimit;
+	size_t chunk;
+	bool atomic;
+	bool nosync;
+	size_t nops, maxops;
+	nvlist_t **ops;
+};
+
+static inline struct zcp_batch *
+checkzcpbatch(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, ZCP_BATCH_METATABLE));
+}
+
+static int
+l_lzc_batch(lua_State *L)
+{
+	struct zcp_batch *b;
+	const char *pool;
+	uint64_t instrlimit, memlimit, maxchunk;
+	lua_Integer chunk;
+	bool atomic, nosync;
+
+	pool = luaL_checkstring(L, 1);
+	instrlimit = ZCP_DEFAULT_INSTRLIMIT;
+	memlimit = ZCP_DEFAULT_MEMLIMIT;
+	chunk = 0;
+	atomic = true;
+	nosync = false;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "instrlimit") != LUA_TNIL) {
+			instrlimit = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, instrlimit <= ZCP_MAX_INSTRLIMIT, 2,
+			    "instrlimit too large");
+		}
+		if (lua_getfield(L, 2, "memlimit") != LUA_TNIL) {
+			memlimit = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, memlimit <= ZCP_MAX_MEMLIMIT, 2,
+			    "memlimit too large");
+		}
+		if (lua_getfield(L, 2, "chunk") != LUA_TNIL) {
+			chunk = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, chunk > 0, 2, "invalid chunk");
+		}
+		if (lua_getfield(L, 2, "atomic") != LUA_TNIL) {
+			atomic = lua_toboolean(L, -1);
+		}
+		if (lua_getfield(L, 2, "nosync") != LUA_TNIL) {
+			nosync = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 5);
+	}
+	/* Fit the limits, even if a larger chunk was asked for. */
+	maxchunk = MAX(MIN(instrlimit / ZCP_BATCH_OP_INSTRS,
+	    memlimit / ZCP_BATCH_OP_MEM), 1);
+	if (chunk == 0 || (uint64_t)chunk > maxchunk) {
+		chunk = maxchunk;
+	}
+
+	if ((b = calloc(1, sizeof(*b))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	if ((b->pool = strdup(pool)) == NULL) {
+		free(b);
+		return (fatal(L, "strdup", ENOMEM));
+	}
+	b->instrlimit = instrlimit;
+	b->memlimit = memlimit;
+	b->chunk = chunk;
+	b->atomic = atomic;
+	b->nosync = nosync;
+	return (new(L, b, ZCP_BATCH_METATABLE));
+}
+
+static int
+zcp_batch_add(lua_State *L, const char *op, const char *prop, int valueidx,
+    const char *source)
+{
+	struct zcp_batch *b;
+	const char *name;
+	nvlist_t *nvl;
+
+	b = checkzcpbatch(L, 1);
+	name = luaL_checkstring(L, 2);
+	luaL_argcheck(L, !b->nosync || strcmp(op, "get_prop") == 0, 1,
+	    "batch is nosync");
+	if (valueidx != 0) {
+		luaL_argcheck(L, lua_type(L, valueidx) == LUA_TSTRING ||
+		    lua_isinteger(L, valueidx), valueidx,
+		    "string or integer expected");
+	}
+
+	if (b->nops == b->maxops) {
+		size_t maxops = MAX(b->maxops * 2, 64);
+		nvlist_t **ops;
+
+		if ((ops = reallocarray(b->ops, maxops, sizeof(*ops)))
+		    == NULL) {
+			return (fatal(L, "reallocarray", ENOMEM));
+		}
+		b->ops = ops;
+		b->maxops = maxops;
+	}
+	nvl = fnvlist_alloc();
+	fnvlist_add_string(nvl, "op", op);
+	fnvlist_add_string(nvl, "name", name);
+	if (prop != NULL) {
+		fnvlist_add_string(nvl, "prop", prop);
+	}
+	if (valueidx != 0) {
+		if (lua_type(L, valueidx) == LUA_TSTRING) {
+			fnvlist_add_string(nvl, "value",
+			    lua_tostring(L, valueidx));
+		} else {
+			fnvlist_add_int64(nvl, "value",
+			    lua_tointeger(L, valueidx));
+		}
+	}
+	if (source != NULL) {
+		fnvlist_add_string(nvl, "source", source);
+	}
+	b->ops[b->nops++] = nvl;
+	lua_pushinteger(L, b->nops);
+	return (1);
+}
+
+static int
+l_zcp_batch_snapshot(lua_State *L)
+{
+	return (zcp_batch_add(L, "snapshot", NULL, 0, NULL));
+}
+
+static int
+l_zcp_batch_destroy(lua_State *L)
+{
+	return (zcp_batch_add(L, "destroy", NULL, 0, NULL));
+}
+
+static int
+l_zcp_batch_set_prop(lua_State *L)
+{
+	return (zcp_batch_add(L, "set_prop", luaL_checkstring(L, 3), 4, NULL));
+}
+
+static int
+l_zcp_batch_inherit(lua_State *L)
+{
+	return (zcp_batch_add(L, "inherit", luaL_checkstring(L, 3), 0, NULL));
+}
+
+static int
+l_zcp_batch_promote(lua_State *L)
+{
+	return (zcp_batch_add(L, "promote", NULL, 0, NULL));
+}
+
+static int
+l_zcp_batch_rollback(lua_State *L)
+{
+	return (zcp_batch_add(L, "rollback", NULL, 0, NULL));
+}
+
+static int
+l_zcp_batch_bookmark(lua_State *L)
+{
+	return (zcp_batch_add(L, "bookmark", NULL, 0, luaL_checkstring(L, 3)));
+}
+
+static int
+l_zcp_batch_get_prop(lua_State *L)
+{
+	return (zcp_batch_add(L, "get_prop", luaL_checkstring(L, 3), 0, NULL));
+}
+
+static void
+zcp_batch_pushvalue(lua_State *L, nvlist_t *nvl, const char *key)
+{
+	nvpair_t *nvp;
+
+	if (nvl == NULL || nvlist_lookup_nvpair(nvl, key, &nvp) != 0) {
+		lua_pushboolean(L, false);
+		return;
+	}
+	switch (nvpair_type(nvp)) {
+	case DATA_TYPE_INT64:
+		lua_pushinteger(L, fnvpair_value_int64(nvp));
+		break;
+	case DATA_TYPE_UINT64:
+		lua_pushinteger(L, fnvpair_value_uint64(nvp));
+		break;
+	case DATA_TYPE_STRING:
+		lua_pushstring(L, fnvpair_value_string(nvp));
+		break;
+	case DATA_TYPE_BOOLEAN_VALUE:
+		lua_pushboolean(L, fnvpair_value_boolean_value(nvp));
+		break;
+	default:
+		lua_pushboolean(L, false);
+		break;
+	}
+}
+
+static int
+l_zcp_batch_run(lua_State *L)
+{
+	char key[32];
+	struct zcp_batch *b;
+	nvlist_t *args, *resultnvl, *ret, *errs, *values, *sources;
+	lua_Integer nfailed;
+	int error;
+
+	b = checkzcpbatch(L, 1);
+
+	lua_createtable(L, 0, 4);
+	lua_newtable(L);
+	lua_createtable(L, b->nops, 0);
+	lua_createtable(L, b->nops, 0);
+	lua_createtable(L, b->nops, 0);
+	nfailed = 0;
+	for (size_t start = 0; start < b->nops; start += b->chunk) {
+		size_t n = MIN(b->chunk, b->nops - start);
+		bool checked;
+
+		args = fnvlist_alloc();
+		fnvlist_add_nvlist_array(args, "ops",
+		    (const nvlist_t * const *)&b->ops[start], n);
+		fnvlist_add_boolean_value(args, "atomic", b->atomic);
+		resultnvl = NULL;
+		if (b->nosync) {
+			error = lzc_channel_program_nosync(b->pool,
+			    zcp_batch_program, b->instrlimit, b->memlimit, args,
+			    &resultnvl);
+		} else {
+			error = lzc_channel_program(b->pool, zcp_batch_program,
+			    b->instrlimit, b->memlimit, args, &resultnvl);
+		}
+		fnvlist_free(args);
+		ret = errs = values = sources = NULL;
+		checked = false;
+		if (error == 0 && resultnvl != NULL &&
+		    nvlist_lookup_nvlist(resultnvl, ZCP_RET_RETURN, &ret) == 0) {
+			if (nvlist_lookup_nvlist(ret, "checked", &errs) == 0) {
+				checked = true;
+			} else {
+				(void)nvlist_lookup_nvlist(ret, "errno", &errs);
+				(void)nvlist_lookup_nvlist(ret, "value",
+				    &values);
+				(void)nvlist_lookup_nvlist(ret, "source",
+				    &sources);
+			}
+		}
+		for (size_t i = 0; i < n; i++) {
+			lua_Integer op = start + i + 1;
+			int operror;
+
+			snprintf(key, sizeof(key), "%zu", i + 1);
+			if (error != 0) {
+				/*
+				 * The whole chunk failed and nothing came back.
+				 * A run that is cut short keeps the changes it
+				 * already made, so only reads are known to have
+				 * failed.
+				 */
+				operror = error;
+				if (strcmp(fnvlist_lookup_string(
+				    b->ops[start + i], "op"), "get_prop") != 0) {
+					lua_pushboolean(L, true);
+					lua_rawseti(L, -5, op);
+				}
+			} else if (checked) {
+				/* Nothing ran if any check failed. */
+				zcp_batch_pushvalue(L, errs, key);
+				operror = lua_isinteger(L, -1) ?
+				    lua_tointeger(L, -1) : ECANCELED;
+				lua_pop(L, 1);
+			} else {
+				zcp_batch_pushvalue(L, errs, key);
+				operror = lua_isinteger(L, -1) ?
+				    lua_tointeger(L, -1) : 0;
+				lua_pop(L, 1);
+			}
+			if (operror != 0) {
+				nfailed++;
+			}
+			lua_pushinteger(L, operror);
+			lua_rawseti(L, -4, op);
+			zcp_batch_pushvalue(L, values, key);
+			lua_rawseti(L, -3, op);
+			zcp_batch_pushvalue(L, sources, key);
+			lua_rawseti(L, -2, op);
+		}
+		if (resultnvl != NULL) {
+			fnvlist_free(resultnvl);
+		}
+	}
+	lua_setfield(L, -5, "source");
+	lua_setfield(L, -4, "value");
+	lua_setfield(L, -3, "errno");
+	lua_setfield(L, -2, "indeterminate");
+	lua_pushinteger(L, nfailed);
+	return (2);
+}
+
+static int
+l_zcp_batch_close(lua_State *L)
+{
+	struct zcp_batch *b;
+
+	b = checkcookienull(L, 1, ZCP_BATCH_METATABLE);
+
+	if (b == NULL) {
+		return (0);
+	}
+	for (size_t i = 0; i < b->nops; i++) {
+		fnvlist_free(b->ops[i]);
+	}
+	free(b->ops);
+	free(b->pool);
+	free(b);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
 static int
 l_lzc_sync(lua_State *L)
 {
@@ -1259,6 +1667,7 @@ static const struct luaL_Reg l_lzc_funcs[] = {
 	{"destroy", l_lzc_destroy},
 	{"channel_program", l_lzc_channel_program},
 	{"channel_program_nosync", l_lzc_channel_program_nosync},
+	{"batch", l_lzc_batch},
 	{"sync", l_lzc_sync},
 	{"reopen", l_lzc_reopen},
 	{"pool_checkpoint", l_lzc_pool_checkpoint},
@@ -1280,9 +1689,30 @@ static const struct luaL_Reg l_lzc_funcs[] = {
 	{NULL, NULL}
 };
 
+static const struct luaL_Reg l_zcp_batch_meta[] = {
+	{"__close", l_zcp_batch_close},
+	{"__gc", l_zcp_batch_close},
+	{"close", l_zcp_batch_close},
+	{"snapshot", l_zcp_batch_snapshot},
+	{"destroy", l_zcp_batch_destroy},
+	{"set_prop", l_zcp_batch_set_prop},
+	{"inherit", l_zcp_batch_inherit},
+	{"promote", l_zcp_batch_promote},
+	{"rollback", l_zcp_batch_rollback},
+	{"bookmark", l_zcp_batch_bookmark},
+	{"get_prop", l_zcp_batch_get_prop},
+	{"run", l_zcp_batch_run},
+	{NULL, NULL}
+};
+
 int
 luaopen_zfs_core(lua_State *L)
 {
+	luaL_newmetatable(L, ZCP_BATCH_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_zcp_batch_meta, 0);
+
 	luaL_newlib(L, l_lzc_funcs);
 
 #define DEFINE(ident) ({ \
@@ -10,3 +10,21 @@ for _, name, value, type in pairs(props) do
 	print(name, value, type)
 end
 lzc.fini()
+
+lzc.init()
+do
+	local pool = assert(os.getenv('ZFS_TEST_POOL') or 'zroot')
+	local batch <close> = lzc.batch(pool, {nosync=true, chunk=2})
+	assert(not pcall(batch.snapshot, batch, pool .. '@nope'))
+	assert(batch:get_prop(pool, 'guid') == 1)
+	assert(batch:get_prop(pool, 'mountpoint') == 2)
+	assert(batch:get_prop(pool .. '/nonexistent', 'guid') == 3)
+	local results, nfailed = batch:run()
+	assert(results.errno[1] == 0)
+	assert(math.type(results.value[1]) == 'integer')
+	assert(results.errno[2] == 0)
+	assert(results.errno[3] ~= 0)
+	assert(nfailed == 1)
+	assert(next(results.indeterminate) == nil)
+end
+lzc.fini()
@@ -5,23 +5,45 @@
  */
 
 #include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/zfs_context.h>
 #include <sys/mnttab.h>
 #include <sys/zfs_ioctl.h>
+#include <sys/fm/protocol.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <libnvpair.h>
 #include <libzfs.h>
+#include <libzfs_core.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "../libnvpair/lua_nvpair.h"
+#include "parallel.h"
 #include "utils.h"
 
 #define	ZFS_HANDLE_METATABLE "zfs_handle_t"
 #define	ZPOOL_HANDLE_METATABLE "zpool_handle_t"
 #define	LIBZFS_HANDLE_METATABLE "libzfs_handle_t"
 #define	ZFS_PROP_METATABLE "zfs_prop_t"
+#define	ZFS_ITER_METATABLE "zfs_iter"
+#define	ZPOOL_IOSTAT_METATABLE "zpool_iostat_sampler"
+#define	ZPOOL_CACHE_METATABLE "zpool_state_cache"
+#define	ZEVENT_SUB_METATABLE "zevent_subscription"
+#define	REPLICATOR_METATABLE "zfs_replicator"
+#define	SNAPINDEX_METATABLE "zfs_snapshot_index"
 
 int luaopen_zfs(lua_State *);
 
@@ -73,6 +95,21 @@ checkzpool(lua_State *L, int idx)
 	return (checkcookie(L, idx, ZPOOL_HANDLE_METATABLE));
 }
 
+/*
+ * The pool handle an object was made from (its ref) is closed by its own
+ * close method, so check that it is still open before using the raw handle.
+ */
+static void
+checkzpoolref(lua_State *L, int idx)
+{
+	bool open;
+
+	getref(L, idx);
+	open = testcookie(L, -1, ZPOOL_HANDLE_METATABLE) != NULL;
+	lua_pop(L, 1);
+	luaL_argcheck(L, open, idx, "pool handle closed");
+}
+
 static inline void
 pushprop(lua_State *L, zfs_prop_t prop)
 {
@@ -549,6 +586,351 @@ l_zpool_events_seek(lua_State *L)
 	return (success(L));
 }
 
+/*
+ * Event subscriptions.  The zfs device cannot be polled, so a helper thread
+ * with its own libzfs handle reads events without blocking the caller,
+ * filters them by class, and queues the matches.  A pipe is written when the
+ * queue becomes non-empty so the read end can be watched with kqueue(2) or
+ * poll(2) from an event loop.
+ *
+ * A blocking read could only be interrupted with a signal, so the helper
+ * reads with ZEVENT_NONBLOCK and waits on a condition variable when there is
+ * nothing new.  Closing the subscription signals it to stop right away.
+ */
+
+struct zevent {
+	STAILQ_ENTRY(zevent) link;
+	nvlist_t *nvl;
+};
+
+struct zevent_sub {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+	libzfs_handle_t *hdl;
+	int zevent_fd;
+	int pipefd[2];
+	STAILQ_HEAD(, zevent) events;
+	size_t npending, maxpending;
+	uint64_t dropped;
+	int error;
+	bool stop;
+	long interval;		/* milliseconds between empty reads */
+	size_t nclasses;
+	char *classes[];
+};
+
+static bool
+zevent_match(struct zevent_sub *sub, nvlist_t *nvl)
+{
+	const char *class;
+
+	if (sub->nclasses == 0) {
+		return (true);
+	}
+	if (nvlist_lookup_string(nvl, FM_CLASS, &class) != 0) {
+		return (false);
+	}
+	for (size_t i = 0; i < sub->nclasses; i++) {
+		if (fnmatch(sub->classes[i], class, 0) == 0) {
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/* Wait for close or for the next check for events. */
+static bool
+zevent_sleep(struct zevent_sub *sub)
+{
+	struct timespec abstime;
+	bool stop;
+
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += sub->interval / 1000;
+	abstime.tv_nsec += (sub->interval % 1000) * 1000000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&sub->lock);
+	if (!sub->stop) {
+		(void)pthread_cond_timedwait(&sub->wake, &sub->lock, &abstime);
+	}
+	stop = sub->stop;
+	pthread_mutex_unlock(&sub->lock);
+	return (!stop);
+}
+
+static void *
+zevent_run(void *arg)
+{
+	struct zevent_sub *sub = arg;
+	struct zevent *ev;
+	nvlist_t *nvl;
+	int dropped, error;
+	bool wake, stop;
+
+	for (;;) {
+		pthread_mutex_lock(&sub->lock);
+		stop = sub->stop;
+		pthread_mutex_unlock(&sub->lock);
+		if (stop) {
+			break;
+		}
+		nvl = NULL;
+		dropped = 0;
+		if ((error = zpool_events_next(sub->hdl, &nvl, &dropped,
+		    ZEVENT_NONBLOCK, sub->zevent_fd)) != 0) {
+			pthread_mutex_lock(&sub->lock);
+			sub->error = error;
+			pthread_mutex_unlock(&sub->lock);
+			(void)write(sub->pipefd[1], "", 1);
+			break;
+		}
+		if (nvl == NULL) {
+			if (dropped != 0) {
+				pthread_mutex_lock(&sub->lock);
+				sub->dropped += dropped;
+				pthread_mutex_unlock(&sub->lock);
+			}
+			if (!zevent_sleep(sub)) {
+				break;
+			}
+			continue;
+		}
+		if (!zevent_match(sub, nvl)) {
+			nvlist_free(nvl);
+			nvl = NULL;
+		}
+		ev = NULL;
+		if (nvl != NULL && (ev = malloc(sizeof(*ev))) == NULL) {
+			nvlist_free(nvl);
+			dropped++;
+		}
+		pthread_mutex_lock(&sub->lock);
+		sub->dropped += dropped;
+		wake = false;
+		if (ev != NULL) {
+			if (sub->npending < sub->maxpending) {
+				ev->nvl = nvl;
+				wake = STAILQ_EMPTY(&sub->events);
+				STAILQ_INSERT_TAIL(&sub->events, ev, link);
+				sub->npending++;
+				ev = NULL;
+			} else {
+				sub->dropped++;
+			}
+		}
+		pthread_mutex_unlock(&sub->lock);
+		if (ev != NULL) {
+			nvlist_free(ev->nvl);
+			free(ev);
+		}
+		if (wake) {
+			(void)write(sub->pipefd[1], "", 1);
+		}
+	}
+	return (NULL);
+}
+
+static void
+zevent_sub_free(struct zevent_sub *sub)
+{
+	struct zevent *ev, *tev;
+
+	STAILQ_FOREACH_SAFE(ev, &sub->events, link, tev) {
+		nvlist_free(ev->nvl);
+		free(ev);
+	}
+	for (size_t i = 0; i < sub->nclasses; i++) {
+		free(sub->classes[i]);
+	}
+	if (sub->pipefd[0] != -1) {
+		close(sub->pipefd[0]);
+		close(sub->pipefd[1]);
+	}
+	if (sub->zevent_fd != -1) {
+		close(sub->zevent_fd);
+	}
+	if (sub->hdl != NULL) {
+		libzfs_fini(sub->hdl);
+	}
+	pthread_cond_destroy(&sub->wake);
+	pthread_mutex_destroy(&sub->lock);
+	free(sub);
+}
+
+static inline struct zevent_sub *
+checkzeventsub(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, ZEVENT_SUB_METATABLE));
+}
+
+static int
+l_zpool_events_subscribe(lua_State *L)
+{
+	struct zevent_sub *sub;
+	uint64_t eid;
+	lua_Integer interval, maxpending;
+	size_t nclasses;
+	int error;
+
+	(void)checklibzfs(L, 1);
+	nclasses = 0;
+	eid = ZEVENT_SEEK_START;
+	interval = 10;
+	maxpending = 1024;
+	lua_settop(L, 2);
+	if (!lua_isnil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "seek") != LUA_TNIL) {
+			if (lua_type(L, -1) == LUA_TSTRING) {
+				luaL_argcheck(L, strcmp(lua_tostring(L, -1),
+				    "end") == 0, 2, "invalid seek");
+				eid = ZEVENT_SEEK_END;
+			} else {
+				eid = luaL_checkinteger(L, -1);
+			}
+		}
+		if (lua_getfield(L, 2, "interval") != LUA_TNIL) {
+			interval = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, interval > 0 && interval <= 1000, 2,
+			    "invalid interval");
+		}
+		if (lua_getfield(L, 2, "maxpending") != LUA_TNIL) {
+			maxpending = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, maxpending > 0, 2,
+			    "invalid maxpending");
+		}
+		if (lua_getfield(L, 2, "classes") != LUA_TNIL) {
+			(void)checkstringarray(L, -1, &nclasses);
+		}
+	}
+
+	if ((sub = calloc(1, sizeof(*sub) + nclasses * sizeof(char *)))
+	    == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_mutex_init(&sub->lock, NULL);
+	pthread_cond_init(&sub->wake, NULL);
+	STAILQ_INIT(&sub->events);
+	sub->zevent_fd = sub->pipefd[0] = sub->pipefd[1] = -1;
+	sub->interval = interval;
+	sub->maxpending = maxpending;
+	sub->nclasses = nclasses;
+	for (size_t i = 0; i < nclasses; i++) {
+		lua_rawgeti(L, -2, i + 1);
+		if ((sub->classes[i] = strdup(lua_tostring(L, -1))) == NULL) {
+			zevent_sub_free(sub);
+			return (fatal(L, "strdup", ENOMEM));
+		}
+		lua_pop(L, 1);
+	}
+	if ((sub->hdl = libzfs_init()) == NULL) {
+		error = errno;
+		zevent_sub_free(sub);
+		return (fail(L, error));
+	}
+	if ((sub->zevent_fd = open(ZFS_DEV, O_RDWR | O_CLOEXEC)) == -1 ||
+	    pipe2(sub->pipefd, O_CLOEXEC | O_NONBLOCK) == -1) {
+		error = errno;
+		zevent_sub_free(sub);
+		return (fail(L, error));
+	}
+	if (eid != ZEVENT_SEEK_START &&
+	    (error = zpool_events_seek(sub->hdl, eid, sub->zevent_fd)) != 0) {
+		zevent_sub_free(sub);
+		return (fail(L, error));
+	}
+	if ((error = pthread_create(&sub->thread, NULL, zevent_run, sub))
+	    != 0) {
+		zevent_sub_free(sub);
+		return (fail(L, error));
+	}
+	return (new(L, sub, ZEVENT_SUB_METATABLE));
+}
+
+static int
+l_zevent_sub_fd(lua_State *L)
+{
+	struct zevent_sub *sub;
+
+	sub = checkzeventsub(L, 1);
+
+	lua_pushinteger(L, sub->pipefd[0]);
+	return (1);
+}
+
+static int
+l_zevent_sub_drain(lua_State *L)
+{
+	STAILQ_HEAD(, zevent) events;
+	struct zevent_sub *sub;
+	struct zevent *ev;
+	lua_Integer max, n;
+	uint64_t dropped;
+	char buf[64];
+	int error;
+
+	sub = checkzeventsub(L, 1);
+	max = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+	luaL_argcheck(L, max > 0, 2, "invalid max");
+
+	while (read(sub->pipefd[0], buf, sizeof(buf)) > 0)
+		;
+	STAILQ_INIT(&events);
+	pthread_mutex_lock(&sub->lock);
+	for (n = 0; n < max && (ev = STAILQ_FIRST(&sub->events)) != NULL;
+	    n++) {
+		STAILQ_REMOVE_HEAD(&sub->events, link);
+		STAILQ_INSERT_TAIL(&events, ev, link);
+		sub->npending--;
+	}
+	if (!STAILQ_EMPTY(&sub->events)) {
+		/* Leave the fd readable for what we didn't take. */
+		(void)write(sub->pipefd[1], "", 1);
+	}
+	dropped = sub->dropped;
+	sub->dropped = 0;
+	error = sub->error;
+	pthread_mutex_unlock(&sub->lock);
+
+	lua_createtable(L, n, 0);
+	n = 0;
+	while ((ev = STAILQ_FIRST(&events)) != NULL) {
+		STAILQ_REMOVE_HEAD(&events, link);
+		pushnvlist(L, ev->nvl);
+		free(ev);
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_pushinteger(L, dropped);
+	if (error != 0 && n == 0) {
+		return (fail(L, error));
+	}
+	return (2);
+}
+
+static int
+l_zevent_sub_close(lua_State *L)
+{
+	struct zevent_sub *sub;
+
+	sub = checkcookienull(L, 1, ZEVENT_SUB_METATABLE);
+
+	if (sub == NULL) {
+		return (0);
+	}
+	pthread_mutex_lock(&sub->lock);
+	sub->stop = true;
+	pthread_cond_signal(&sub->wake);
+	pthread_mutex_unlock(&sub->lock);
+	pthread_join(sub->thread, NULL);
+	zevent_sub_free(sub);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
 static int
 l_zpool_explain_recover(lua_State *L)
 {
@@ -597,2973 +979,6214 @@ zfs_iter_cb(zfs_handle_t *zhp, void *arg)
 	return (0);
 }
 
+/*
+ * Collect a sequence of zfs handles into a C array for libzfs, leaving the
+ * array and a table mapping each zfs_handle_t pointer back to its Lua object
+ * on the stack.  The handles remain owned by the caller's table.
+ */
+static zfs_handle_t **
+checkzfshandles(lua_State *L, int idx, size_t *np)
+{
+	zfs_handle_t **handles;
+	size_t n;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	n = luaL_len(L, idx);
+	handles = lua_newuserdatauv(L, n * sizeof(*handles), 0);
+	lua_createtable(L, 0, n);
+	for (size_t i = 0; i < n; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		handles[i] = checkzfs(L, -1);
+		lua_rawsetp(L, -2, handles[i]);
+	}
+	*np = n;
+	return (handles);
+}
+
+struct mountpoint_iter {
+	lua_State *L;
+	pthread_mutex_t lock;
+	int map;
+	int func;
+	int nargs;
+	bool failed;
+};
+
+/*
+ * zfs_foreach_mountpoint may call us from several threads at once, but there
+ * is only the one Lua state, so callbacks are serialized.  The first error
+ * is left on the stack and stops any further callbacks.
+ */
+static int
+foreach_mountpoint_cb(zfs_handle_t *zhp, void *arg)
+{
+	struct mountpoint_iter *it = arg;
+	lua_State *L = it->L;
+	int error;
+
+	pthread_mutex_lock(&it->lock);
+	if (it->failed) {
+		pthread_mutex_unlock(&it->lock);
+		return (-1);
+	}
+	lua_pushvalue(L, it->func);
+	lua_rawgetp(L, it->map, zhp);
+	for (int i = 1; i <= it->nargs; i++) {
+		lua_pushvalue(L, it->func + i);
+	}
+	if ((error = lua_pcall(L, it->nargs + 1, 0, 0)) != LUA_OK) {
+		it->failed = true;
+	}
+	pthread_mutex_unlock(&it->lock);
+	return (error == LUA_OK ? 0 : -1);
+}
+
 static int
 l_zfs_foreach_mountpoint(lua_State *L)
 {
-	luaL_Buffer b;
+	struct mountpoint_iter it;
 	libzfs_handle_t *hdl;
 	zfs_handle_t **handles;
 	size_t num_handles;
 	uint_t nthr;
-	int ref, top;
 
 	hdl = checklibzfs(L, 1);
-	luaL_checktype(L, 2, LUA_TTABLE);
-	num_handles = luaL_len(L, 2);
 	nthr = luaL_checkinteger(L, 3);
 	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
 
-	/* Stash a reference to the handles table to protect it from GC. */
-	handles = lua_newuserdatauv(L, num_handles * sizeof(*handles), 1);
-	for (int i = 0; i < num_handles; i++) {
-		/* XXX */
-		lua_rawgeti(L, 2, i + 1);
-		handles[i] = checkzfs(L, -1);
+	it.L = L;
+	it.func = 4;
+	it.nargs = lua_gettop(L) - it.func;
+	it.failed = false;
+	handles = checkzfshandles(L, 2, &num_handles);
+	it.map = lua_gettop(L);
+	luaL_checkstack(L, it.nargs + 2, NULL);
+
+	pthread_mutex_init(&it.lock, NULL);
+	zfs_foreach_mountpoint(hdl, handles, num_handles, foreach_mountpoint_cb,
+	    &it, nthr);
+	pthread_mutex_destroy(&it.lock);
+	if (it.failed) {
+		luaL_pushfail(L);
+		lua_insert(L, -2);
+		return (2);
 	}
-	lua_pushvalue(L, 2);
-	lua_setiuservalue(L, -2, 1);
-	ref = luaL_ref(L, LUA_REGISTRYINDEX);
-
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_pop(L, num_handles);
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-
-	top = lua_gettop(L);
-	zfs_foreach_mountpoint(hdl, handles, num_handles, zfs_iter_cb, L, nthr);
-	luaL_unref(L, LUA_REGISTRYINDEX, ref);
-	return (lua_gettop(L) - top);
+	return (success(L));
 }
 
-static int
-l_zfs_open(lua_State *L)
-{
-	libzfs_handle_t *hdl;
-	const char *path;
+struct mountfail {
 	zfs_handle_t *zhp;
-	int types;
+	int error;		/* errno */
+	char errmsg[1024];
+};
 
-	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
-	types = luaL_checkinteger(L, 3);
+/*
+ * Record a failed mount or unmount.  The error state of the libzfs handle is
+ * shared by all the workers and written outside of any lock, so only the
+ * errno the worker saved right after the call is used.
+ */
+static void
+mountfail_set(struct mountfail *f, zfs_handle_t *zhp, const char *what,
+    int error)
+{
+	f->zhp = zhp;
+	f->error = error != 0 ? error : EIO;
+	snprintf(f->errmsg, sizeof(f->errmsg), "cannot %s '%s': %s", what,
+	    zfs_get_name(zhp), strerror(f->error));
+}
 
-	if ((zhp = zfs_open(hdl, path, types)) == NULL) {
-		return (libzfsfail(L, hdl, EZFS_UNKNOWN, "zfs_open"));
+/*
+ * Report failures collected by the native workers: call the optional onerror
+ * hook for each one and return the count and a sequence of failure records.
+ */
+static int
+pushmountfails(lua_State *L, int map, int onerror, struct mountfail *fails,
+    size_t nfails)
+{
+	lua_pushinteger(L, nfails);
+	lua_createtable(L, nfails, 0);
+	for (size_t i = 0; i < nfails; i++) {
+		lua_createtable(L, 0, 3);
+		lua_rawgetp(L, map, fails[i].zhp);
+		lua_setfield(L, -2, "handle");
+		lua_pushstring(L, fails[i].errmsg);
+		lua_setfield(L, -2, "errmsg");
+		lua_pushinteger(L, fails[i].error);
+		lua_setfield(L, -2, "errcode");
+		lua_rawseti(L, -2, i + 1);
 	}
-	return (new(L, zhp, ZFS_HANDLE_METATABLE));
+	if (onerror != 0) {
+		for (size_t i = 0; i < nfails; i++) {
+			lua_pushvalue(L, onerror);
+			lua_rawgetp(L, map, fails[i].zhp);
+			lua_pushstring(L, fails[i].errmsg);
+			lua_pushinteger(L, fails[i].error);
+			lua_call(L, 3, 0);
+		}
+	}
+	return (2);
 }
 
 static int
-l_zfs_iter_root(lua_State *L)
+checkmountopts(lua_State *L, int idx, const char **options, int *flags)
 {
-	libzfs_handle_t *hdl;
-	int top = lua_gettop(L);
-	int error;
+	int onerror = 0;
 
-	hdl = checklibzfs(L, 1);
-	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
-
-	if ((error = zfs_iter_root(hdl, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
-
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_root failed");
-		return (2);
+	if (lua_isnoneornil(L, idx)) {
+		return (0);
 	}
-	return (success(L));
+	luaL_checktype(L, idx, LUA_TTABLE);
+	if (options != NULL &&
+	    lua_getfield(L, idx, "options") != LUA_TNIL) {
+		*options = luaL_checkstring(L, -1);
+	}
+	if (lua_getfield(L, idx, "flags") != LUA_TNIL) {
+		*flags = luaL_checkinteger(L, -1);
+	}
+	if (lua_getfield(L, idx, "onerror") != LUA_TNIL) {
+		luaL_argcheck(L, lua_isfunction(L, -1), idx,
+		    "onerror must be a function");
+		onerror = lua_absindex(L, -1);
+	}
+	/* options and onerror stay referenced from the opts table */
+	return (onerror);
 }
 
+struct mountall {
+	const char *options;
+	int flags;
+	pthread_mutex_t lock;
+	struct mountfail *fails;
+	size_t nfails;
+};
+
 static int
-l_zfs_crypto_create(lua_State *L)
+mount_datasets_cb(zfs_handle_t *zhp, void *arg)
 {
-	libzfs_handle_t *hdl;
-	const char *parent_name;
-	nvlist_t *props, *pool_props;
-	uint8_t *wkeydata;
-	uint_t wkeylen;
-	boolean_t stdin_available;
+	struct mountall *ma = arg;
 	int error;
 
-	hdl = checklibzfs(L, 1);
-	parent_name = luaL_optstring(L, 2, NULL);
-	props = checknvlist(L, 3);
-	pool_props = checknvlist(L, 4);
-	stdin_available = lua_toboolean(L, 5);
-
-	if ((error = zfs_crypto_create(hdl, __DECONST(char *, parent_name),
-	    props, pool_props, stdin_available, &wkeydata, &wkeylen)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_crypto_create"));
+	if (zfs_mount(zhp, ma->options, ma->flags) == 0) {
+		return (0);
 	}
-	lua_pushlstring(L, (char *)wkeydata, wkeylen);
-	return (1);
+	error = errno;
+	pthread_mutex_lock(&ma->lock);
+	mountfail_set(&ma->fails[ma->nfails++], zhp, "mount", error);
+	pthread_mutex_unlock(&ma->lock);
+	/* Don't mount descendants over a failed parent. */
+	return (-1);
 }
 
 static int
-l_zfs_crypto_clone_check(lua_State *L)
+l_zfs_mount_datasets(lua_State *L)
 {
+	struct mountall ma;
 	libzfs_handle_t *hdl;
-	zfs_handle_t *origin_zhp;
-	nvlist_t *props;
-	int error;
+	zfs_handle_t **handles;
+	size_t num_handles;
+	uint_t nthr;
+	int onerror, map;
 
 	hdl = checklibzfs(L, 1);
-	origin_zhp = checkzfs(L, 2);
-	props = checknvlist(L, 3);
+	nthr = luaL_checkinteger(L, 3);
+	ma.options = NULL;
+	ma.flags = 0;
+	onerror = checkmountopts(L, 4, &ma.options, &ma.flags);
+	handles = checkzfshandles(L, 2, &num_handles);
+	map = lua_gettop(L);
+	ma.fails = lua_newuserdatauv(L, num_handles * sizeof(*ma.fails), 0);
+	ma.nfails = 0;
+
+	pthread_mutex_init(&ma.lock, NULL);
+	zfs_foreach_mountpoint(hdl, handles, num_handles, mount_datasets_cb,
+	    &ma, nthr);
+	pthread_mutex_destroy(&ma.lock);
+	return (pushmountfails(L, map, onerror, ma.fails, ma.nfails));
+}
+
+struct unmountent {
+	zfs_handle_t *zhp;
+	char *where;
+	int depth;
+};
 
-	if ((error = zfs_crypto_clone_check(hdl, origin_zhp, NULL, props))
-	    != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_crypto_clone_check"));
-	}
-	return (success(L));
-}
+struct unmountall {
+	struct unmountent *ents;
+	int flags;
+	pthread_mutex_t lock;
+	struct mountfail *fails;
+	size_t nfails;
+};
 
 static int
-l_zfs_crypto_attempt_load_keys(lua_State *L)
+unmountent_cmp(const void *a, const void *b)
 {
-	libzfs_handle_t *hdl;
-	const char *fsname;
-	int error;
+	const struct unmountent *ua = a, *ub = b;
 
-	hdl = checklibzfs(L, 1);
-	fsname = luaL_checkstring(L, 2);
+	return (ub->depth - ua->depth);
+}
 
-	if ((error = zfs_crypto_attempt_load_keys(hdl, fsname)) != 0) {
-		return (libzfsfail(L, hdl, error,
-		    "zfs_crypto_attempt_load_keys"));
+static void
+unmount_datasets_one(void *arg, size_t i)
+{
+	struct unmountall *ua = arg;
+	struct unmountent *ent = &ua->ents[i];
+	int error;
+
+	if (zfs_unmount(ent->zhp, ent->where, ua->flags) != 0) {
+		error = errno;
+		pthread_mutex_lock(&ua->lock);
+		mountfail_set(&ua->fails[ua->nfails++], ent->zhp, "unmount",
+		    error);
+		pthread_mutex_unlock(&ua->lock);
 	}
-	return (success(L));
 }
 
 static int
-l_zfs_valid_proplist(lua_State *L)
+l_zfs_unmount_datasets(lua_State *L)
 {
-	libzfs_handle_t *hdl;
-	zfs_handle_t *zhp;
-	zpool_handle_t *pool_hdl;
-	nvlist_t *props, *ret;
-	const char *errbuf;
-	zfs_type_t type;
-	boolean_t zoned, key_params_ok;
-
-	hdl = checklibzfs(L, 1);
-	type = luaL_checkinteger(L, 2);
-	props = checknvlist(L, 3);
-	zoned = lua_toboolean(L, 4);
-	zhp = luaL_opt(L, checkzfs, 5, NULL);
-	pool_hdl = luaL_opt(L, checkzpool, 6, NULL);
-	key_params_ok = lua_toboolean(L, 7);
-	errbuf = luaL_checkstring(L, 8);
+	struct unmountall ua;
+	struct unmountent *ents;
+	zfs_handle_t **handles;
+	size_t num_handles, n;
+	int nthr, onerror, map;
 
-	if ((ret = zfs_valid_proplist(hdl, type, props, zoned, zhp, pool_hdl,
-	    key_params_ok, errbuf)) == NULL) {
-		return (libzfsfail(L, hdl, EZFS_UNKNOWN, "zfs_valid_proplist"));
+	(void)checklibzfs(L, 1);
+	nthr = luaL_checkinteger(L, 3);
+	luaL_argcheck(L, nthr > 0, 3, "invalid nthreads");
+	ua.flags = 0;
+	onerror = checkmountopts(L, 4, NULL, &ua.flags);
+	handles = checkzfshandles(L, 2, &num_handles);
+	map = lua_gettop(L);
+	ents = lua_newuserdatauv(L, num_handles * sizeof(*ents), 0);
+	ua.fails = lua_newuserdatauv(L, num_handles * sizeof(*ua.fails), 0);
+	ua.nfails = 0;
+
+	n = 0;
+	for (size_t i = 0; i < num_handles; i++) {
+		struct unmountent *ent = &ents[n];
+		char *where;
+
+		if (!zfs_is_mounted(handles[i], &where)) {
+			continue;
+		}
+		ent->zhp = handles[i];
+		ent->where = where;
+		ent->depth = 0;
+		for (const char *p = where; *p != '\0'; p++) {
+			if (*p == '/') {
+				ent->depth++;
+			}
+		}
+		n++;
 	}
-	pushnvlist(L, ret);
-	return (1);
+	/*
+	 * Deepest first.  Mountpoints at the same depth cannot be nested, so
+	 * each depth is unmounted in parallel before moving up a level.
+	 */
+	qsort(ents, n, sizeof(*ents), unmountent_cmp);
+	pthread_mutex_init(&ua.lock, NULL);
+	for (size_t i = 0, j; i < n; i = j) {
+		for (j = i + 1; j < n && ents[j].depth == ents[i].depth; j++)
+			;
+		ua.ents = &ents[i];
+		parallel_for(nthr, j - i, unmount_datasets_one, &ua);
+	}
+	pthread_mutex_destroy(&ua.lock);
+	for (size_t i = 0; i < n; i++) {
+		free(ents[i].where);
+	}
+	return (pushmountfails(L, map, onerror, ua.fails, ua.nfails));
 }
 
-static int
-l_zfs_path_to_zhandle(lua_State *L)
-{
-	libzfs_handle_t *hdl;
-	const char *path;
-	zfs_type_t type;
-	zfs_handle_t *zhp;
-
-	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
-	type = luaL_checkinteger(L, 3);
+/*
+ * Bulk listing: walk datasets in C and collect the requested properties into
+ * column arrays, like `zfs list -H -o ...`, without creating a Lua handle
+ * object or calling back into Lua for each dataset.
+ */
 
-	if ((zhp = zfs_path_to_zhandle(hdl, path, type)) == NULL) {
-		return (libzfsfail(L, hdl, EZFS_UNKNOWN,
-		    "zfs_path_to_zhandle"));
-	}
-	return (new(L, zhp, ZFS_HANDLE_METATABLE));
-}
+struct zfslist {
+	lua_State *L;
+	int types;
+	int maxdepth;
+	int depth;
+	bool literal;
+	int nprops;
+	const char **propnames;
+	zfs_prop_t *props;
+	int result;	/* stack index of the result table */
+	int columns;	/* stack index of the first column */
+	int errors;	/* stack index of the errors sequence */
+	lua_Integer nrows;
+	lua_Integer nerrors;
+};
 
-static int
-l_zfs_dataset_exists(lua_State *L)
+static void
+zfslist_error(struct zfslist *zl, const char *name, libzfs_handle_t *hdl,
+    const char *what)
 {
-	libzfs_handle_t *hdl;
-	const char *path;
-	zfs_type_t type;
+	lua_State *L = zl->L;
 
-	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
-	type = luaL_checkinteger(L, 3);
+	lua_createtable(L, 0, 3);
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "name");
+	lua_pushfstring(L, "%s: %s", what, libzfs_error_description(hdl));
+	lua_setfield(L, -2, "errmsg");
+	lua_pushinteger(L, libzfs_errno(hdl));
+	lua_setfield(L, -2, "errno");
+	lua_rawseti(L, zl->errors, ++zl->nerrors);
+}
 
-	lua_pushboolean(L, zfs_dataset_exists(hdl, path, type));
-	return (1);
+static void
+zfslist_pushprop(struct zfslist *zl, zfs_handle_t *zhp, int i)
+{
+	char property[ZFS_MAXPROPLEN];
+	lua_State *L = zl->L;
+	zprop_source_t source;
+	zfs_prop_t prop = zl->props[i];
+	uint64_t value;
+	nvlist_t *userprop;
+	const char *str;
+
+	if (prop == ZPROP_USERPROP) {
+		if (nvlist_lookup_nvlist(zfs_get_user_props(zhp),
+		    zl->propnames[i], &userprop) == 0 &&
+		    nvlist_lookup_string(userprop, ZPROP_VALUE, &str) == 0) {
+			lua_pushstring(L, str);
+		} else {
+			lua_pushboolean(L, false);
+		}
+		return;
+	}
+	if (zl->literal && zfs_prop_get_type(prop) == PROP_TYPE_NUMBER &&
+	    zfs_prop_get_numeric(zhp, prop, &value, &source, NULL, 0) == 0) {
+		lua_pushinteger(L, value);
+		return;
+	}
+	if (zfs_prop_get(zhp, prop, property, sizeof(property), &source, NULL,
+	    0, zl->literal) == 0) {
+		lua_pushstring(L, property);
+	} else {
+		lua_pushboolean(L, false);
+	}
 }
 
 static int
-l_zfs_create(lua_State *L)
+zfslist_cb(zfs_handle_t *zhp, void *arg)
 {
-	libzfs_handle_t *hdl;
-	const char *path;
+	struct zfslist *zl = arg;
+	lua_State *L = zl->L;
 	zfs_type_t type;
-	nvlist_t *props;
+	const char *name;
 	int error;
 
-	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
-	type = luaL_checkinteger(L, 3);
-	props = optnvlist(L, 4, NULL);
-
-	if ((error = zfs_create(hdl, path, type, props)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_create"));
+	type = zfs_get_type(zhp);
+	name = zfs_get_name(zhp);
+	if ((type & zl->types) != 0) {
+		zl->nrows++;
+		lua_pushstring(L, name);
+		lua_rawseti(L, zl->columns, zl->nrows);
+		lua_pushstring(L, zfs_type_to_name(type));
+		lua_rawseti(L, zl->columns + 1, zl->nrows);
+		for (int i = 0; i < zl->nprops; i++) {
+			zfslist_pushprop(zl, zhp, i);
+			lua_rawseti(L, zl->columns + 2 + i, zl->nrows);
+		}
 	}
-	return (success(L));
+	if (zl->depth < zl->maxdepth && type != ZFS_TYPE_SNAPSHOT &&
+	    type != ZFS_TYPE_BOOKMARK) {
+		zl->depth++;
+		if (type == ZFS_TYPE_FILESYSTEM &&
+		    (error = zfs_iter_filesystems_v2(zhp, 0, zfslist_cb, zl))
+		    != 0) {
+			zfslist_error(zl, name, zfs_get_handle(zhp),
+			    "zfs_iter_filesystems_v2");
+		}
+		if ((zl->types & ZFS_TYPE_SNAPSHOT) != 0 &&
+		    (error = zfs_iter_snapshots_sorted_v2(zhp, 0, zfslist_cb,
+		    zl, 0, 0)) != 0) {
+			zfslist_error(zl, name, zfs_get_handle(zhp),
+			    "zfs_iter_snapshots_sorted_v2");
+		}
+		if ((zl->types & ZFS_TYPE_BOOKMARK) != 0 &&
+		    (error = zfs_iter_bookmarks_v2(zhp, 0, zfslist_cb, zl))
+		    != 0) {
+			zfslist_error(zl, name, zfs_get_handle(zhp),
+			    "zfs_iter_bookmarks_v2");
+		}
+		zl->depth--;
+	}
+	zfs_close(zhp);
+	return (0);
 }
 
 static int
-l_zfs_create_ancestors(lua_State *L)
+l_zfs_list_datasets(lua_State *L)
 {
+	struct zfslist zl;
 	libzfs_handle_t *hdl;
-	const char *path;
-	int error;
+	zfs_handle_t *zhp;
+	size_t nprops;
+	int nroots;
 
 	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
+	if (lua_isnoneornil(L, 2)) {
+		nroots = 0;
+	} else if (lua_type(L, 2) == LUA_TSTRING) {
+		nroots = 1;
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		nroots = luaL_len(L, 2);
+	}
+	zl.L = L;
+	zl.types = ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME;
+	zl.maxdepth = nroots == 0 ? INT_MAX : 0;
+	zl.depth = 0;
+	zl.literal = false;
+	nprops = 0;
+	lua_settop(L, 3);
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		if (lua_getfield(L, 3, "types") != LUA_TNIL) {
+			zl.types = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 3, "recursive") != LUA_TNIL) {
+			zl.maxdepth = lua_toboolean(L, -1) ? INT_MAX : 0;
+		}
+		if (lua_getfield(L, 3, "depth") != LUA_TNIL) {
+			zl.maxdepth = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, zl.maxdepth >= 0, 3, "invalid depth");
+		}
+		if (lua_getfield(L, 3, "literal") != LUA_TNIL) {
+			zl.literal = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 4);
+		if (lua_getfield(L, 3, "props") != LUA_TNIL) {
+			zl.propnames = checkstringarray(L, -1, &nprops);
+		}
+	}
+	zl.nprops = nprops;
+	/* The props sequence (if any) is 4 and its name array 5. */
+	lua_settop(L, zl.nprops > 0 ? 5 : 3);
+	zl.props = lua_newuserdatauv(L, zl.nprops * sizeof(*zl.props), 0);
+	for (int i = 0; i < zl.nprops; i++) {
+		if ((zl.props[i] = zfs_name_to_prop(zl.propnames[i]))
+		    == ZPROP_INVAL) {
+			luaL_argcheck(L, zfs_prop_user(zl.propnames[i]), 3,
+			    "invalid property");
+			zl.props[i] = ZPROP_USERPROP;
+		}
+	}
 
-	if ((error = zfs_create_ancestors(hdl, path)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_create_ancestors"));
+	lua_createtable(L, 0, zl.nprops + 3);
+	zl.result = lua_gettop(L);
+	zl.columns = zl.result + 1;
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, zl.result, "name");
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, zl.result, "type");
+	for (int i = 0; i < zl.nprops; i++) {
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, zl.result, zl.propnames[i]);
 	}
-	return (success(L));
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, zl.result, "errors");
+	zl.errors = lua_gettop(L);
+	zl.nrows = 0;
+	zl.nerrors = 0;
+
+	if (nroots == 0) {
+		if (zfs_iter_root(hdl, zfslist_cb, &zl) != 0) {
+			zfslist_error(&zl, "", hdl, "zfs_iter_root");
+		}
+	}
+	for (int i = 1; i <= nroots; i++) {
+		const char *name;
+
+		if (lua_type(L, 2) == LUA_TSTRING) {
+			name = lua_tostring(L, 2);
+		} else {
+			lua_rawgeti(L, 2, i);
+			name = luaL_checkstring(L, -1);
+			lua_pop(L, 1);
+		}
+		if ((zhp = zfs_open(hdl, name, ZFS_TYPE_DATASET |
+		    ZFS_TYPE_BOOKMARK)) == NULL) {
+			zfslist_error(&zl, name, hdl, "zfs_open");
+			continue;
+		}
+		zfslist_cb(zhp, &zl);
+	}
+	lua_pushvalue(L, zl.result);
+	return (1);
 }
 
-#if __FreeBSD_version > 1600013
-static int
-l_zfs_create_ancestors_props(lua_State *L)
-{
+/*
+ * Snapshot index: the snapshots under a root are loaded in one pass into an
+ * array sorted by dataset and createtxg, along with the properties retention
+ * policies look at, so range and bucket queries run in C without reopening
+ * anything.  History events from zpool_events_next() keep it current between
+ * walks.
+ */
+
+struct snapent {
+	char *name;
+	size_t dslen;		/* length of the dataset part of name */
+	uint64_t createtxg;
+	uint64_t creation;
+	uint64_t used;
+	uint64_t referenced;
+	uint64_t written;
+};
+
+struct snapindex {
 	libzfs_handle_t *hdl;
-	const char *path;
-	nvlist_t *props;
-	int error;
+	char root[ZFS_MAX_DATASET_NAME_LEN];
+	struct snapent *ents;
+	size_t nents, maxents;
+	int error;		/* errno, when not a libzfs error */
+	const char *what;	/* the libzfs call that failed */
+};
 
-	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
-	props = optnvlist(L, 3, 0);
+struct snapquery {
+	const char *dataset;
+	size_t dslen;
+	bool recursive;
+	const char *match;
+	uint64_t min_txg, max_txg;
+	uint64_t min_time, max_time;
+};
 
-	if ((error = zfs_create_ancestors_props(hdl, path, props)) != 0) {
-		return (libzfsfail(L, hdl, error,
-		    "zfs_create_ancestors_props"));
-	}
-	return (success(L));
+static inline struct snapindex *
+checksnapindex(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, SNAPINDEX_METATABLE));
 }
-#endif
 
 static int
-l_zfs_destroy_snaps_nvl(lua_State *L)
+snapent_cmp(const char *ds, size_t dslen, uint64_t txg,
+    const struct snapent *e)
 {
-	libzfs_handle_t *hdl;
-	nvlist_t *snaps;
-	boolean_t defer;
-	int error;
-
-	hdl = checklibzfs(L, 1);
-	snaps = checknvlist(L, 2);
-	defer = lua_toboolean(L, 3);
+	int cmp;
 
-	if ((error = zfs_destroy_snaps_nvl(hdl, snaps, defer)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_destroy_snaps_nvl"));
+	if ((cmp = memcmp(ds, e->name, MIN(dslen, e->dslen))) != 0) {
+		return (cmp);
 	}
-	return (success(L));
+	if (dslen != e->dslen) {
+		return (dslen < e->dslen ? -1 : 1);
+	}
+	if (txg != e->createtxg) {
+		return (txg < e->createtxg ? -1 : 1);
+	}
+	return (0);
 }
 
 static int
-l_zfs_snapshot(lua_State *L)
+snapent_sort(const void *a, const void *b)
 {
-	libzfs_handle_t *hdl;
-	const char *path;
-	nvlist_t *props;
-	boolean_t recursive;
-	int error;
-
-	hdl = checklibzfs(L, 1);
-	path = luaL_checkstring(L, 2);
-	recursive = lua_toboolean(L, 3);
-	props = optnvlist(L, 4, NULL);
+	const struct snapent *x = a;
 
-	if ((error = zfs_snapshot(hdl, path, recursive, props)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_snapshot"));
-	}
-	return (success(L));
+	return (snapent_cmp(x->name, x->dslen, x->createtxg, b));
 }
 
-static int
-l_zfs_snapshot_nvl(lua_State *L)
+/* Index of the first entry not ordered before (ds, txg). */
+static size_t
+snapindex_lower(struct snapindex *si, const char *ds, size_t dslen,
+    uint64_t txg)
 {
-	libzfs_handle_t *hdl;
-	nvlist_t *snaps, *props;
-	int error;
+	size_t lo = 0, hi = si->nents;
 
-	hdl = checklibzfs(L, 1);
-	snaps = checknvlist(L, 2);
-	props = optnvlist(L, 3, NULL);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
 
-	if ((error = zfs_snapshot_nvl(hdl, snaps, props)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_snapshot_nvl"));
+		if (snapent_cmp(ds, dslen, txg, &si->ents[mid]) > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	return (success(L));
+	return (lo);
 }
 
-static inline void
-checksendflags(lua_State *L, int idx, sendflags_t *flags)
+static inline bool
+snapent_in(const struct snapent *e, const char *ds, size_t dslen)
 {
-	luaL_checktype(L, idx, LUA_TTABLE);
-	lua_getfield(L, idx, "verbosity");
-	flags->verbosity = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-#define	FLAG(name) ({ \
-	lua_getfield(L, idx, #name); \
-	flags->name = lua_toboolean(L, -1); \
-	lua_pop(L, 1); \
-})
-	FLAG(replicate);
-	FLAG(skipmissing);
-	FLAG(doall);
-	FLAG(fromorigin);
-	FLAG(pad);
-	FLAG(props);
-	FLAG(dryrun);
-	FLAG(parsable);
-	FLAG(progress);
-	FLAG(progressastitle);
-	FLAG(largeblock);
-	FLAG(embed_data);
-	FLAG(compress);
-	FLAG(raw);
-	FLAG(backup);
-	FLAG(holds);
-	FLAG(saved);
-#if __FreeBSD_version > 1600013
-	FLAG(no_preserve_encryption);
-#endif
-#undef FLAG
+	return (e->dslen == dslen && memcmp(e->name, ds, dslen) == 0);
 }
 
 static int
-l_zfs_send_resume(lua_State *L)
+snapent_fill(struct snapent *e, zfs_handle_t *zhp)
 {
-	libzfs_handle_t *hdl;
-	sendflags_t flags;
-	const char *resume_token;
-	int outfd, error;
+	const char *name = zfs_get_name(zhp);
 
-	memset(&flags, 0, sizeof(flags));
+	if ((e->name = strdup(name)) == NULL) {
+		return (ENOMEM);
+	}
+	e->dslen = strcspn(name, "@");
+	e->createtxg = zfs_prop_get_int(zhp, ZFS_PROP_CREATETXG);
+	e->creation = zfs_prop_get_int(zhp, ZFS_PROP_CREATION);
+	e->used = zfs_prop_get_int(zhp, ZFS_PROP_USED);
+	e->referenced = zfs_prop_get_int(zhp, ZFS_PROP_REFERENCED);
+	e->written = zfs_prop_get_int(zhp, ZFS_PROP_WRITTEN);
+	return (0);
+}
 
-	hdl = checklibzfs(L, 1);
-	checksendflags(L, 2, &flags);
-	outfd = checkfd(L, 3);
-	resume_token = luaL_checkstring(L, 4);
+static struct snapent *
+snapindex_grow(struct snapindex *si)
+{
+	struct snapent *ents;
 
-	if ((error = zfs_send_resume(hdl, &flags, outfd, resume_token)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_send_resume"));
+	if (si->nents == si->maxents) {
+		size_t maxents = MAX(si->maxents * 2, 64);
+
+		if ((ents = reallocarray(si->ents, maxents, sizeof(*ents)))
+		    == NULL) {
+			si->error = ENOMEM;
+			return (NULL);
+		}
+		si->ents = ents;
+		si->maxents = maxents;
 	}
-	return (success(L));
+	return (&si->ents[si->nents]);
 }
 
 static int
-l_zfs_send_resume_token_to_nvlist(lua_State *L)
+snapindex_snap_cb(zfs_handle_t *zhp, void *arg)
 {
-	libzfs_handle_t *hdl;
-	const char *resume_token;
-	nvlist_t *nvl;
-
-	hdl = checklibzfs(L, 1);
-	resume_token = luaL_checkstring(L, 2);
+	struct snapindex *si = arg;
+	struct snapent *e;
 
-	if ((nvl = zfs_send_resume_token_to_nvlist(hdl, resume_token))
-	    == NULL) {
-		return (libzfsfail(L, hdl, EINVAL,
-		    "zfs_send_resume_token_to_nvlist"));
+	if ((e = snapindex_grow(si)) != NULL &&
+	    (si->error = snapent_fill(e, zhp)) == 0) {
+		si->nents++;
 	}
-	pushnvlist(L, nvl);
-	return (1);
+	zfs_close(zhp);
+	return (si->error);
 }
 
-static inline void
-checkrecvflags(lua_State *L, int idx, recvflags_t *flags)
+static int
+snapindex_fs_cb(zfs_handle_t *zhp, void *arg)
 {
-	luaL_checktype(L, idx, LUA_TTABLE);
-#define	FLAG(name) ({ \
-	lua_getfield(L, idx, #name); \
-	flags->name = lua_toboolean(L, -1); \
-	lua_pop(L, 1); \
-})
-	FLAG(verbose);
-	FLAG(isprefix);
-	FLAG(istail);
-	FLAG(dryrun);
-	FLAG(force);
-	FLAG(canmountoff);
-	FLAG(resumable);
-	FLAG(byteswap);
-	FLAG(nomount);
-	FLAG(holds);
-	FLAG(skipholds);
-	FLAG(domount);
-	FLAG(forceunmount);
-	FLAG(heal);
-#undef FLAG
+	struct snapindex *si = arg;
+	int error;
+
+	if ((error = zfs_iter_snapshots_v2(zhp, 0, snapindex_snap_cb, si, 0,
+	    0)) != 0) {
+		if (si->error == 0) {
+			si->what = "zfs_iter_snapshots_v2";
+		}
+	} else if ((error = zfs_iter_filesystems_v2(zhp, 0, snapindex_fs_cb,
+	    si)) != 0 && si->error == 0 && si->what == NULL) {
+		si->what = "zfs_iter_filesystems_v2";
+	}
+	zfs_close(zhp);
+	return (error);
+}
+
+/* Remove the entries in [start, end). */
+static void
+snapindex_cut(struct snapindex *si, size_t start, size_t end)
+{
+	for (size_t i = start; i < end; i++) {
+		free(si->ents[i].name);
+	}
+	memmove(&si->ents[start], &si->ents[end],
+	    (si->nents - end) * sizeof(*si->ents));
+	si->nents -= end - start;
+}
+
+static void
+snapindex_clear(struct snapindex *si, const char *ds, size_t dslen)
+{
+	size_t start, end;
+
+	start = snapindex_lower(si, ds, dslen, 0);
+	for (end = start; end < si->nents &&
+	    snapent_in(&si->ents[end], ds, dslen); end++)
+		;
+	snapindex_cut(si, start, end);
 }
 
+/*
+ * Walk the root, or a single dataset when ds is given, and sort what was
+ * appended.  Returns 0, or -1 with si->error or si->what set.
+ */
 static int
-l_zfs_receive(lua_State *L)
+snapindex_load(struct snapindex *si, const char *ds)
 {
-	libzfs_handle_t *hdl;
-	const char *tosnap;
-	nvlist_t *props;
-	recvflags_t flags;
-	int infd, error;
+	zfs_handle_t *zhp;
+	size_t first;
+	int error;
 
-	memset(&flags, 0, sizeof(flags));
+	si->error = 0;
+	si->what = NULL;
+	first = si->nents;
+	if ((zhp = zfs_open(si->hdl, ds != NULL ? ds : si->root,
+	    ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME)) == NULL) {
+		si->what = "zfs_open";
+		return (-1);
+	}
+	if (ds == NULL) {
+		error = snapindex_fs_cb(zhp, si);
+	} else {
+		if ((error = zfs_iter_snapshots_v2(zhp, 0, snapindex_snap_cb,
+		    si, 0, 0)) != 0 && si->error == 0) {
+			si->what = "zfs_iter_snapshots_v2";
+		}
+		zfs_close(zhp);
+	}
+	if (error != 0) {
+		snapindex_cut(si, first, si->nents);
+		return (-1);
+	}
+	qsort(si->ents, si->nents, sizeof(*si->ents), snapent_sort);
+	return (0);
+}
 
-	hdl = checklibzfs(L, 1);
-	tosnap = luaL_checkstring(L, 2);
-	props = optnvlist(L, 3, NULL);
-	checkrecvflags(L, 4, &flags);
-	infd = checkfd(L, 5);
+static int
+snapindex_rebuild(struct snapindex *si)
+{
+	snapindex_cut(si, 0, si->nents);
+	return (snapindex_load(si, NULL));
+}
 
-	if ((error = zfs_receive(hdl, tosnap, props, &flags, infd, NULL))
-	    != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_receive"));
+static int
+snapindex_fail(lua_State *L, struct snapindex *si)
+{
+	if (si->error != 0) {
+		return (fail(L, si->error));
 	}
-	return (success(L));
+	return (libzfsfail(L, si->hdl, EZFS_UNKNOWN, si->what));
+}
+
+static void
+snapindex_free(struct snapindex *si)
+{
+	snapindex_cut(si, 0, si->nents);
+	free(si->ents);
+	free(si);
 }
 
 static int
-l_is_mounted(lua_State *L)
+l_zfs_snapshot_index(lua_State *L)
 {
+	struct snapindex *si;
 	libzfs_handle_t *hdl;
-	const char *special;
-	char *where;
-	boolean_t mounted;
+	const char *root;
 
 	hdl = checklibzfs(L, 1);
-	special = luaL_checkstring(L, 2);
+	root = luaL_checkstring(L, 2);
+	luaL_argcheck(L, strlen(root) < ZFS_MAX_DATASET_NAME_LEN, 2,
+	    "name too long");
+
+	if ((si = calloc(1, sizeof(*si))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	si->hdl = hdl;
+	strlcpy(si->root, root, sizeof(si->root));
+	if (snapindex_rebuild(si) != 0) {
+		snapindex_fail(L, si);
+		snapindex_free(si);
+		return (3);
+	}
+	return (newref(L, 1, si, SNAPINDEX_METATABLE));
+}
 
-	mounted = is_mounted(hdl, special, &where);
-	lua_pushboolean(L, mounted);
-	if (mounted) {
-		lua_pushstring(L, where);
-		return (2);
+static int
+l_snapindex_close(lua_State *L)
+{
+	struct snapindex *si;
+
+	si = checkcookienull(L, 1, SNAPINDEX_METATABLE);
+
+	if (si != NULL) {
+		snapindex_free(si);
+		setcookie(L, 1, NULL);
 	}
+	return (0);
+}
+
+static int
+l_snapindex_len(lua_State *L)
+{
+	struct snapindex *si;
+
+	si = checksnapindex(L, 1);
+
+	lua_pushinteger(L, si->nents);
 	return (1);
 }
 
+static void
+checksnapquery(lua_State *L, int ds, int opts, struct snapquery *q)
+{
+	memset(q, 0, sizeof(*q));
+	q->max_txg = q->max_time = UINT64_MAX;
+	if (!lua_isnoneornil(L, ds)) {
+		q->dataset = luaL_checklstring(L, ds, &q->dslen);
+	}
+	if (lua_isnoneornil(L, opts)) {
+		return;
+	}
+	luaL_checktype(L, opts, LUA_TTABLE);
+	if (lua_getfield(L, opts, "recursive") != LUA_TNIL) {
+		q->recursive = lua_toboolean(L, -1);
+	}
+	if (lua_getfield(L, opts, "match") != LUA_TNIL) {
+		q->match = luaL_checkstring(L, -1);
+	}
+	if (lua_getfield(L, opts, "min_txg") != LUA_TNIL) {
+		q->min_txg = luaL_checkinteger(L, -1);
+	}
+	if (lua_getfield(L, opts, "max_txg") != LUA_TNIL) {
+		q->max_txg = luaL_checkinteger(L, -1);
+	}
+	if (lua_getfield(L, opts, "min_time") != LUA_TNIL) {
+		q->min_time = luaL_checkinteger(L, -1);
+	}
+	if (lua_getfield(L, opts, "max_time") != LUA_TNIL) {
+		q->max_time = luaL_checkinteger(L, -1);
+	}
+	/* The match string stays referenced by opts. */
+	lua_pop(L, 6);
+}
+
+static bool
+snapquery_match(const struct snapquery *q, const struct snapent *e)
+{
+	if (q->dataset != NULL && !snapent_in(e, q->dataset, q->dslen) &&
+	    !(q->recursive && e->dslen > q->dslen &&
+	    e->name[q->dslen] == '/' &&
+	    memcmp(e->name, q->dataset, q->dslen) == 0)) {
+		return (false);
+	}
+	if (e->createtxg < q->min_txg || e->createtxg > q->max_txg ||
+	    e->creation < q->min_time || e->creation > q->max_time) {
+		return (false);
+	}
+	if (q->match != NULL &&
+	    fnmatch(q->match, e->name + e->dslen + 1, 0) != 0) {
+		return (false);
+	}
+	return (true);
+}
+
+/* The entries a query can match are in [*start, *end). */
+static void
+snapquery_bounds(struct snapindex *si, const struct snapquery *q,
+    size_t *start, size_t *end)
+{
+	if (q->dataset == NULL || q->recursive) {
+		*start = 0;
+		*end = si->nents;
+		return;
+	}
+	*start = snapindex_lower(si, q->dataset, q->dslen, q->min_txg);
+	for (*end = *start; *end < si->nents &&
+	    snapent_in(&si->ents[*end], q->dataset, q->dslen) &&
+	    si->ents[*end].createtxg <= q->max_txg; (*end)++)
+		;
+}
+
 static int
-l_zfs_nicestrtonum(lua_State *L)
+l_snapindex_range(lua_State *L)
 {
-	libzfs_handle_t *hdl;
-	const char *value;
-	uint64_t num;
-	int error;
+	static const char *columns[] = {
+		"name", "createtxg", "creation", "used", "referenced",
+		"written",
+	};
+	struct snapquery q;
+	struct snapindex *si;
+	size_t start, end;
+	lua_Integer n;
+	int result;
 
-	hdl = checklibzfs(L, 1);
-	value = luaL_checkstring(L, 2);
+	si = checksnapindex(L, 1);
+	checksnapquery(L, 2, 3, &q);
 
-	if ((error = zfs_nicestrtonum(hdl, value, &num)) != 0) {
-		return (libzfsfail(L, hdl, error, "zfs_nicestrtonum"));
+	snapquery_bounds(si, &q, &start, &end);
+	lua_createtable(L, 0, nitems(columns));
+	result = lua_gettop(L);
+	for (size_t i = 0; i < nitems(columns); i++) {
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, result, columns[i]);
 	}
-	lua_pushinteger(L, num);
+	n = 0;
+	for (size_t i = start; i < end; i++) {
+		struct snapent *e = &si->ents[i];
+
+		if (!snapquery_match(&q, e)) {
+			continue;
+		}
+		n++;
+		lua_pushstring(L, e->name);
+		lua_rawseti(L, result + 1, n);
+		lua_pushinteger(L, e->createtxg);
+		lua_rawseti(L, result + 2, n);
+		lua_pushinteger(L, e->creation);
+		lua_rawseti(L, result + 3, n);
+		lua_pushinteger(L, e->used);
+		lua_rawseti(L, result + 4, n);
+		lua_pushinteger(L, e->referenced);
+		lua_rawseti(L, result + 5, n);
+		lua_pushinteger(L, e->written);
+		lua_rawseti(L, result + 6, n);
+	}
+	lua_settop(L, result);
+	return (1);
+}
+
+struct snaprule {
+	uint64_t period;	/* seconds, or 0 for every snapshot */
+	lua_Integer count;
+};
+
+/*
+ * Mark the snapshots to keep among the selected ones of one dataset,
+ * oldest first in sel[0, n): each rule keeps the newest snapshot in each
+ * of its count most recent periods that have one.
+ */
+static void
+snaprules_apply(struct snapindex *si, const size_t *sel, size_t n,
+    const struct snaprule *rules, size_t nrules, bool *keep)
+{
+	for (size_t r = 0; r < nrules; r++) {
+		uint64_t bucket, last = UINT64_MAX;
+		lua_Integer kept = 0;
+
+		for (size_t i = n; i > 0 && kept < rules[r].count; i--) {
+			struct snapent *e = &si->ents[sel[i - 1]];
+
+			bucket = rules[r].period == 0 ? i :
+			    e->creation / rules[r].period;
+			if (bucket != last) {
+				keep[i - 1] = true;
+				last = bucket;
+				kept++;
+			}
+		}
+	}
+}
+
+static int
+l_snapindex_keep(lua_State *L)
+{
+	struct snapquery q;
+	struct snapindex *si;
+	struct snaprule *rules;
+	size_t start, end, nrules, n, *sel;
+	lua_Integer nkeep, ndestroy;
+	bool *keep;
+	int result;
+
+	si = checksnapindex(L, 1);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	checksnapquery(L, 2, 4, &q);
+	nrules = luaL_len(L, 3);
+	rules = lua_newuserdatauv(L, nrules * sizeof(*rules), 0);
+	for (size_t r = 0; r < nrules; r++) {
+		lua_Integer period;
+
+		lua_rawgeti(L, 3, r + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+		lua_getfield(L, -1, "period");
+		period = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, -2, "count");
+		rules[r].count = luaL_checkinteger(L, -1);
+		luaL_argcheck(L, period >= 0 && rules[r].count >= 0, 3,
+		    "invalid rule");
+		rules[r].period = period;
+		lua_pop(L, 3);
+	}
+
+	snapquery_bounds(si, &q, &start, &end);
+	sel = lua_newuserdatauv(L, (end - start) * sizeof(*sel), 0);
+	keep = lua_newuserdatauv(L, (end - start) * sizeof(*keep), 0);
+	lua_createtable(L, 0, 2);
+	result = lua_gettop(L);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, result, "keep");
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, result, "destroy");
+	nkeep = ndestroy = 0;
+	/* Entries are grouped by dataset, so apply the rules per run. */
+	for (size_t i = start; i < end;) {
+		size_t j;
+
+		n = 0;
+		for (j = i; j < end && snapent_in(&si->ents[j],
+		    si->ents[i].name, si->ents[i].dslen); j++) {
+			if (snapquery_match(&q, &si->ents[j])) {
+				sel[n++] = j;
+			}
+		}
+		memset(keep, 0, n * sizeof(*keep));
+		snaprules_apply(si, sel, n, rules, nrules, keep);
+		for (size_t k = 0; k < n; k++) {
+			lua_pushstring(L, si->ents[sel[k]].name);
+			if (keep[k]) {
+				lua_rawseti(L, result + 1, ++nkeep);
+			} else {
+				lua_rawseti(L, result + 2, ++ndestroy);
+			}
+		}
+		i = j;
+	}
+	lua_settop(L, result);
 	return (1);
 }
 
+/* Is name the root or inside it? */
+static inline bool
+snapindex_covers(struct snapindex *si, const char *name)
+{
+	size_t len = strlen(si->root);
+
+	return (strncmp(name, si->root, len) == 0 && (name[len] == '\0' ||
+	    name[len] == '/' || name[len] == '@'));
+}
+
 static int
-l_zpool_in_use(lua_State *L)
+l_snapindex_update(lua_State *L)
 {
-	libzfs_handle_t *hdl;
-	char *namestr;
-	pool_state_t state;
-	boolean_t inuse;
-	int fd, error;
+	struct snapindex *si;
+	struct snapent e, *slot;
+	zfs_handle_t *zhp;
+	const char *op, *dsname, *at;
+	nvlist_t *nvl;
+	lua_Integer nchanged;
+	size_t pos, dslen;
+	bool rebuild;
+	int error;
 
-	hdl = checklibzfs(L, 1);
-	fd = checkfd(L, 2);
+	si = checksnapindex(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
 
-	if ((error = zpool_in_use(hdl, fd, &state, &namestr, &inuse)) != 0) {
-		return (libzfsfail(L, hdl, error, "zpool_in_use"));
+	nchanged = 0;
+	rebuild = false;
+	for (lua_Integer i = 1; i <= luaL_len(L, 2) && !rebuild; i++) {
+		lua_rawgeti(L, 2, i);
+		nvl = checknvlist(L, -1);
+		lua_pop(L, 1);
+		if (nvlist_lookup_string(nvl, ZFS_EV_HIST_INTERNAL_NAME, &op)
+		    != 0 ||
+		    nvlist_lookup_string(nvl, ZFS_EV_HIST_DSNAME, &dsname)
+		    != 0 ||
+		    !snapindex_covers(si, dsname)) {
+			continue;
+		}
+		at = strchr(dsname, '@');
+		dslen = at != NULL ? (size_t)(at - dsname) : strlen(dsname);
+		if (strcmp(op, "snapshot") == 0 && at != NULL) {
+			if ((zhp = zfs_open(si->hdl, dsname,
+			    ZFS_TYPE_SNAPSHOT)) == NULL) {
+				/* Already gone again. */
+				continue;
+			}
+			error = snapent_fill(&e, zhp);
+			zfs_close(zhp);
+			if (error != 0) {
+				return (fail(L, error));
+			}
+			if (snapindex_grow(si) == NULL) {
+				free(e.name);
+				return (fail(L, ENOMEM));
+			}
+			pos = snapindex_lower(si, e.name, e.dslen,
+			    e.createtxg);
+			if (pos < si->nents && snapent_sort(&e,
+			    &si->ents[pos]) == 0) {
+				free(e.name);
+				continue;
+			}
+			slot = &si->ents[pos];
+			memmove(slot + 1, slot,
+			    (si->nents - pos) * sizeof(*slot));
+			*slot = e;
+			si->nents++;
+			nchanged++;
+		} else if (strcmp(op, "destroy") == 0) {
+			if (at == NULL) {
+				snapindex_clear(si, dsname, dslen);
+				nchanged++;
+				continue;
+			}
+			pos = snapindex_lower(si, dsname, dslen, 0);
+			for (; pos < si->nents &&
+			    snapent_in(&si->ents[pos], dsname, dslen); pos++) {
+				if (strcmp(si->ents[pos].name, dsname) == 0) {
+					snapindex_cut(si, pos, pos + 1);
+					nchanged++;
+					break;
+				}
+			}
+		} else if (strcmp(op, "rename") == 0 && at != NULL) {
+			char ds[ZFS_MAX_DATASET_NAME_LEN];
+
+			strlcpy(ds, dsname, MIN(sizeof(ds), dslen + 1));
+			snapindex_clear(si, ds, dslen);
+			if (snapindex_load(si, ds) != 0) {
+				return (snapindex_fail(L, si));
+			}
+			nchanged++;
+		} else if (strcmp(op, "rename") == 0 ||
+		    strcmp(op, "promote") == 0 ||
+		    strcmp(op, "clone swap") == 0) {
+			/* Snapshots moved between datasets. */
+			rebuild = true;
+		}
 	}
-	lua_pushboolean(L, inuse);
-	lua_pushstring(L, namestr);
-	lua_pushinteger(L, state);
-	return (3);
+	if (rebuild) {
+		if (snapindex_rebuild(si) != 0) {
+			return (snapindex_fail(L, si));
+		}
+		nchanged++;
+	}
+	lua_pushinteger(L, nchanged);
+	return (1);
 }
 
 static int
-l_zpool_nextboot(lua_State *L)
+l_snapindex_refresh(lua_State *L)
 {
-	libzfs_handle_t *hdl;
-	const char *command;
-	uint64_t pool_guid, vdev_guid;
-	int error;
+	struct snapindex *si;
+	const char *ds;
+	size_t dslen;
 
-	hdl = checklibzfs(L, 1);
-	pool_guid = luaL_checkinteger(L, 2);
-	vdev_guid = luaL_checkinteger(L, 3);
-	command = luaL_checkstring(L, 4);
+	si = checksnapindex(L, 1);
+	ds = luaL_optlstring(L, 2, NULL, &dslen);
 
-	if ((error = zpool_nextboot(hdl, pool_guid, vdev_guid, command)) != 0) {
-		return (libzfsfail(L, hdl, error, "zpool_nextboot"));
+	if (ds == NULL) {
+		if (snapindex_rebuild(si) != 0) {
+			return (snapindex_fail(L, si));
+		}
+		return (success(L));
+	}
+	snapindex_clear(si, ds, dslen);
+	if (snapindex_load(si, ds) != 0) {
+		return (snapindex_fail(L, si));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_close(lua_State *L)
+l_zfs_open(lua_State *L)
 {
+	libzfs_handle_t *hdl;
+	const char *path;
 	zfs_handle_t *zhp;
+	int types;
 
-	zhp = checkcookienull(L, 1, ZFS_HANDLE_METATABLE);
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+	types = luaL_checkinteger(L, 3);
 
-	if (zhp != NULL) {
-		zfs_close(zhp);
-		setcookie(L, 1, NULL);
+	if ((zhp = zfs_open(hdl, path, types)) == NULL) {
+		return (libzfsfail(L, hdl, EZFS_UNKNOWN, "zfs_open"));
 	}
-	return (0);
+	return (new(L, zhp, ZFS_HANDLE_METATABLE));
 }
 
 static int
-l_zfs_handle_dup(lua_State *L)
+l_zfs_iter_root(lua_State *L)
 {
-	zfs_handle_t *zhp, *dupzhp;
+	libzfs_handle_t *hdl;
+	int top = lua_gettop(L);
+	int error;
 
-	zhp = checkzfs(L, 1);
+	hdl = checklibzfs(L, 1);
+	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
 
-	if ((dupzhp = zfs_handle_dup(zhp)) == NULL) {
-		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_handle_dup"));
+	if ((error = zfs_iter_root(hdl, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_root failed");
+		return (2);
 	}
-	return (new(L, dupzhp, ZFS_HANDLE_METATABLE));
+	return (success(L));
 }
 
 static int
-l_zfs_get_type(lua_State *L)
+l_zfs_crypto_create(lua_State *L)
 {
-	zfs_handle_t *zhp;
+	libzfs_handle_t *hdl;
+	const char *parent_name;
+	nvlist_t *props, *pool_props;
+	uint8_t *wkeydata;
+	uint_t wkeylen;
+	boolean_t stdin_available;
+	int error;
 
-	zhp = checkzfs(L, 1);
+	hdl = checklibzfs(L, 1);
+	parent_name = luaL_optstring(L, 2, NULL);
+	props = checknvlist(L, 3);
+	pool_props = checknvlist(L, 4);
+	stdin_available = lua_toboolean(L, 5);
 
-	lua_pushinteger(L, zfs_get_type(zhp));
+	if ((error = zfs_crypto_create(hdl, __DECONST(char *, parent_name),
+	    props, pool_props, stdin_available, &wkeydata, &wkeylen)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_crypto_create"));
+	}
+	lua_pushlstring(L, (char *)wkeydata, wkeylen);
 	return (1);
 }
 
 static int
-l_zfs_get_underlying_type(lua_State *L)
+l_zfs_crypto_clone_check(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	zfs_handle_t *origin_zhp;
+	nvlist_t *props;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	origin_zhp = checkzfs(L, 2);
+	props = checknvlist(L, 3);
+
+	if ((error = zfs_crypto_clone_check(hdl, origin_zhp, NULL, props))
+	    != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_crypto_clone_check"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_crypto_attempt_load_keys(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *fsname;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	fsname = luaL_checkstring(L, 2);
+
+	if ((error = zfs_crypto_attempt_load_keys(hdl, fsname)) != 0) {
+		return (libzfsfail(L, hdl, error,
+		    "zfs_crypto_attempt_load_keys"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_valid_proplist(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	zfs_handle_t *zhp;
+	zpool_handle_t *pool_hdl;
+	nvlist_t *props, *ret;
+	const char *errbuf;
+	zfs_type_t type;
+	boolean_t zoned, key_params_ok;
+
+	hdl = checklibzfs(L, 1);
+	type = luaL_checkinteger(L, 2);
+	props = checknvlist(L, 3);
+	zoned = lua_toboolean(L, 4);
+	zhp = luaL_opt(L, checkzfs, 5, NULL);
+	pool_hdl = luaL_opt(L, checkzpool, 6, NULL);
+	key_params_ok = lua_toboolean(L, 7);
+	errbuf = luaL_checkstring(L, 8);
+
+	if ((ret = zfs_valid_proplist(hdl, type, props, zoned, zhp, pool_hdl,
+	    key_params_ok, errbuf)) == NULL) {
+		return (libzfsfail(L, hdl, EZFS_UNKNOWN, "zfs_valid_proplist"));
+	}
+	pushnvlist(L, ret);
+	return (1);
+}
+
+static int
+l_zfs_path_to_zhandle(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *path;
+	zfs_type_t type;
+	zfs_handle_t *zhp;
+
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+	type = luaL_checkinteger(L, 3);
+
+	if ((zhp = zfs_path_to_zhandle(hdl, path, type)) == NULL) {
+		return (libzfsfail(L, hdl, EZFS_UNKNOWN,
+		    "zfs_path_to_zhandle"));
+	}
+	return (new(L, zhp, ZFS_HANDLE_METATABLE));
+}
+
+static int
+l_zfs_dataset_exists(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *path;
+	zfs_type_t type;
+
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+	type = luaL_checkinteger(L, 3);
+
+	lua_pushboolean(L, zfs_dataset_exists(hdl, path, type));
+	return (1);
+}
+
+static int
+l_zfs_create(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *path;
+	zfs_type_t type;
+	nvlist_t *props;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+	type = luaL_checkinteger(L, 3);
+	props = optnvlist(L, 4, NULL);
+
+	if ((error = zfs_create(hdl, path, type, props)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_create"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_create_ancestors(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *path;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+
+	if ((error = zfs_create_ancestors(hdl, path)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_create_ancestors"));
+	}
+	return (success(L));
+}
+
+#if __FreeBSD_version > 1600013
+static int
+l_zfs_create_ancestors_props(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *path;
+	nvlist_t *props;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+	props = optnvlist(L, 3, 0);
+
+	if ((error = zfs_create_ancestors_props(hdl, path, props)) != 0) {
+		return (libzfsfail(L, hdl, error,
+		    "zfs_create_ancestors_props"));
+	}
+	return (success(L));
+}
+#endif
+
+static int
+l_zfs_destroy_snaps_nvl(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	nvlist_t *snaps;
+	boolean_t defer;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	snaps = checknvlist(L, 2);
+	defer = lua_toboolean(L, 3);
+
+	if ((error = zfs_destroy_snaps_nvl(hdl, snaps, defer)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_destroy_snaps_nvl"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_snapshot(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *path;
+	nvlist_t *props;
+	boolean_t recursive;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	path = luaL_checkstring(L, 2);
+	recursive = lua_toboolean(L, 3);
+	props = optnvlist(L, 4, NULL);
+
+	if ((error = zfs_snapshot(hdl, path, recursive, props)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_snapshot"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_snapshot_nvl(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	nvlist_t *snaps, *props;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	snaps = checknvlist(L, 2);
+	props = optnvlist(L, 3, NULL);
+
+	if ((error = zfs_snapshot_nvl(hdl, snaps, props)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_snapshot_nvl"));
+	}
+	return (success(L));
+}
+
+static inline void
+checksendflags(lua_State *L, int idx, sendflags_t *flags)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "verbosity");
+	flags->verbosity = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+#define	FLAG(name) ({ \
+	lua_getfield(L, idx, #name); \
+	flags->name = lua_toboolean(L, -1); \
+	lua_pop(L, 1); \
+})
+	FLAG(replicate);
+	FLAG(skipmissing);
+	FLAG(doall);
+	FLAG(fromorigin);
+	FLAG(pad);
+	FLAG(props);
+	FLAG(dryrun);
+	FLAG(parsable);
+	FLAG(progress);
+	FLAG(progressastitle);
+	FLAG(largeblock);
+	FLAG(embed_data);
+	FLAG(compress);
+	FLAG(raw);
+	FLAG(backup);
+	FLAG(holds);
+	FLAG(saved);
+#if __FreeBSD_version > 1600013
+	FLAG(no_preserve_encryption);
+#endif
+#undef FLAG
+}
+
+static int
+l_zfs_send_resume(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	sendflags_t flags;
+	const char *resume_token;
+	int outfd, error;
+
+	memset(&flags, 0, sizeof(flags));
+
+	hdl = checklibzfs(L, 1);
+	checksendflags(L, 2, &flags);
+	outfd = checkfd(L, 3);
+	resume_token = luaL_checkstring(L, 4);
+
+	if ((error = zfs_send_resume(hdl, &flags, outfd, resume_token)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_send_resume"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_send_resume_token_to_nvlist(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *resume_token;
+	nvlist_t *nvl;
+
+	hdl = checklibzfs(L, 1);
+	resume_token = luaL_checkstring(L, 2);
+
+	if ((nvl = zfs_send_resume_token_to_nvlist(hdl, resume_token))
+	    == NULL) {
+		return (libzfsfail(L, hdl, EINVAL,
+		    "zfs_send_resume_token_to_nvlist"));
+	}
+	pushnvlist(L, nvl);
+	return (1);
+}
+
+static inline void
+checkrecvflags(lua_State *L, int idx, recvflags_t *flags)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+#define	FLAG(name) ({ \
+	lua_getfield(L, idx, #name); \
+	flags->name = lua_toboolean(L, -1); \
+	lua_pop(L, 1); \
+})
+	FLAG(verbose);
+	FLAG(isprefix);
+	FLAG(istail);
+	FLAG(dryrun);
+	FLAG(force);
+	FLAG(canmountoff);
+	FLAG(resumable);
+	FLAG(byteswap);
+	FLAG(nomount);
+	FLAG(holds);
+	FLAG(skipholds);
+	FLAG(domount);
+	FLAG(forceunmount);
+	FLAG(heal);
+#undef FLAG
+}
+
+static int
+l_zfs_receive(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *tosnap;
+	nvlist_t *props;
+	recvflags_t flags;
+	int infd, error;
+
+	memset(&flags, 0, sizeof(flags));
+
+	hdl = checklibzfs(L, 1);
+	tosnap = luaL_checkstring(L, 2);
+	props = optnvlist(L, 3, NULL);
+	checkrecvflags(L, 4, &flags);
+	infd = checkfd(L, 5);
+
+	if ((error = zfs_receive(hdl, tosnap, props, &flags, infd, NULL))
+	    != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_receive"));
+	}
+	return (success(L));
+}
+
+/*
+ * Replication engine: a pool of worker threads runs lzc_send(3) for each
+ * queued job, either into a caller's descriptor or into a socket pair drained
+ * by lzc_receive_one(3) on a helper thread, so whole trees replicate without
+ * Lua in the data path.  A monitor thread samples the progress of the running
+ * sends.  A job does not start until every job added before it for the same
+ * dataset or one of its ancestors has finished, and it is canceled if any of
+ * those failed.  Canceling shuts down the sending sockets, which stops running
+ * sends with EPIPE; the workers run with every signal blocked so that this
+ * never raises SIGPIPE.
+ */
+
+enum replstate {
+	REPL_QUEUED,
+	REPL_RUNNING,
+	REPL_DONE,
+};
+
+struct repljob {
+	STAILQ_ENTRY(repljob) link;
+	char *snapname;
+	char *from;
+	char *target;		/* NULL when sending to outfd */
+	char *key;		/* dataset used for ordering */
+	int outfd;
+	enum lzc_send_flags flags;
+	uint64_t resumeobj;
+	uint64_t resumeoff;
+	bool force;
+	bool resumable;
+	int waiting;		/* unfinished jobs this one must follow */
+	int deperror;		/* why it can no longer run, or 0 */
+	int *dependents;	/* indices of jobs that follow this one */
+	int ndependents;
+	int maxdependents;
+	enum replstate state;
+	int sendfd;		/* while sending, for progress and cancel */
+	int recvfd;
+	int recverror;
+	uint64_t received;
+	uint64_t bytes;
+	double rate;		/* bytes per second */
+	struct timespec started;
+	struct timespec sampled;
+	int error;
+};
+
+struct replicator {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	pthread_cond_t tick;
+	libzfs_handle_t *hdl;	/* only used by the Lua thread */
+	STAILQ_HEAD(, repljob) queue;
+	struct repljob **jobs;
+	int njobs;
+	int maxjobs;
+	int active;
+	bool shutdown;
+	atomic_bool cancel;
+	long interval;		/* milliseconds between progress samples */
+#if __FreeBSD_version <= 1600013
+	libzfs_handle_t *monhdl;	/* only used by the monitor */
+#endif
+	bool monitoring;
+	pthread_t monitor;
+	int nthreads;
+	pthread_t threads[];
+};
+
+static inline double
+repl_elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return ((to->tv_sec - from->tv_sec) +
+	    (to->tv_nsec - from->tv_nsec) / 1e9);
+}
+
+/* The following helpers must be called with rp->lock held. */
+
+static void repl_ready(struct replicator *, struct repljob *);
+
+static void
+repl_finish(struct replicator *rp, struct repljob *job, int error)
+{
+	struct timespec now;
+	double elapsed;
+
+	if (job->state == REPL_RUNNING) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = repl_elapsed(&job->started, &now);
+		job->rate = elapsed > 0 ? job->bytes / elapsed : 0;
+	}
+	job->state = REPL_DONE;
+	job->error = error;
+	rp->active--;
+	for (int i = 0; i < job->ndependents; i++) {
+		struct repljob *dep = rp->jobs[job->dependents[i]];
+
+		if (error != 0 && dep->deperror == 0) {
+			dep->deperror = ECANCELED;
+		}
+		if (--dep->waiting == 0) {
+			repl_ready(rp, dep);
+		}
+	}
+	pthread_cond_broadcast(&rp->idle);
+}
+
+static void
+repl_ready(struct replicator *rp, struct repljob *job)
+{
+	if (job->deperror != 0) {
+		repl_finish(rp, job, job->deperror);
+		return;
+	}
+	STAILQ_INSERT_TAIL(&rp->queue, job, link);
+	pthread_cond_signal(&rp->work);
+}
+
+/*
+ * Stop queued jobs and the running sends into our own socket pairs.  A send
+ * into a caller's descriptor is left to finish, since shutting it down would
+ * break a descriptor the replicator does not own.
+ */
+static void
+repl_cancel(struct replicator *rp)
+{
+	atomic_store(&rp->cancel, true);
+	for (int i = 0; i < rp->njobs; i++) {
+		struct repljob *job = rp->jobs[i];
+
+		if (job->target != NULL && job->sendfd != -1) {
+			(void)shutdown(job->sendfd, SHUT_WR);
+		}
+	}
+}
+
+static void *
+repl_receive(void *arg)
+{
+	struct repljob *job = arg;
+	dmu_replay_record_t drr;
+	nvlist_t *errors;
+	uint64_t read_bytes, errflags;
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < sizeof(drr); off += n) {
+		if ((n = read(job->recvfd, (char *)&drr + off,
+		    sizeof(drr) - off)) <= 0) {
+			job->recverror = n == 0 ? EIO : errno;
+			goto out;
+		}
+	}
+	errors = NULL;
+	read_bytes = 0;
+	job->recverror = lzc_receive_one(job->target, NULL, NULL, job->force,
+	    job->resumable, (job->flags & LZC_SEND_FLAG_RAW) != 0,
+	    job->recvfd, &drr, -1, &read_bytes, &errflags, NULL, &errors);
+	nvlist_free(errors);
+	job->received = sizeof(drr) + read_bytes;
+out:
+	/* Closing the read end makes a stuck sender fail with EPIPE. */
+	close(job->recvfd);
+	return (NULL);
+}
+
+static void
+repl_run(struct replicator *rp, struct repljob *job)
+{
+	pthread_t thread;
+	int fds[2], sendfd, one, error;
+
+	fds[0] = fds[1] = -1;
+	if (atomic_load(&rp->cancel)) {
+		error = ECANCELED;
+		goto done;
+	}
+	if (job->target != NULL) {
+		if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)
+		    == -1) {
+			error = errno;
+			goto done;
+		}
+		one = 1;
+		(void)setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &one,
+		    sizeof(one));
+		job->recvfd = fds[0];
+		if ((error = pthread_create(&thread, NULL, repl_receive, job))
+		    != 0) {
+			goto done;
+		}
+		fds[0] = -1;
+		sendfd = fds[1];
+	} else {
+		sendfd = job->outfd;
+	}
+	pthread_mutex_lock(&rp->lock);
+	if (atomic_load(&rp->cancel)) {
+		/* Canceled after the check above; don't start. */
+		pthread_mutex_unlock(&rp->lock);
+		error = ECANCELED;
+	} else {
+		job->sendfd = sendfd;
+		pthread_mutex_unlock(&rp->lock);
+		error = lzc_send_resume(job->snapname, job->from, sendfd,
+		    job->flags, job->resumeobj, job->resumeoff);
+		pthread_mutex_lock(&rp->lock);
+		job->sendfd = -1;
+		pthread_mutex_unlock(&rp->lock);
+	}
+	if (job->target != NULL) {
+		close(fds[1]);
+		fds[1] = -1;
+		pthread_join(thread, NULL);
+		if (job->recverror != 0 && (error == 0 || error == EPIPE)) {
+			error = job->recverror;
+		}
+	}
+	if (error != 0 && atomic_load(&rp->cancel)) {
+		error = ECANCELED;
+	}
+done:
+	if (fds[0] != -1) {
+		close(fds[0]);
+	}
+	if (fds[1] != -1) {
+		close(fds[1]);
+	}
+	pthread_mutex_lock(&rp->lock);
+	if (job->target != NULL && error == 0) {
+		job->bytes = job->received;
+	}
+	repl_finish(rp, job, error);
+	pthread_mutex_unlock(&rp->lock);
+}
+
+static void *
+repl_worker(void *arg)
+{
+	struct replicator *rp = arg;
+	struct repljob *job;
+
+	pthread_mutex_lock(&rp->lock);
+	for (;;) {
+		while ((job = STAILQ_FIRST(&rp->queue)) == NULL &&
+		    !rp->shutdown) {
+			pthread_cond_wait(&rp->work, &rp->lock);
+		}
+		if (job == NULL) {
+			break;
+		}
+		STAILQ_REMOVE_HEAD(&rp->queue, link);
+		job->state = REPL_RUNNING;
+		clock_gettime(CLOCK_MONOTONIC, &job->started);
+		job->sampled = job->started;
+		pthread_mutex_unlock(&rp->lock);
+		repl_run(rp, job);
+		pthread_mutex_lock(&rp->lock);
+	}
+	pthread_mutex_unlock(&rp->lock);
+	return (NULL);
+}
+
+static int
+repl_send_progress(struct replicator *rp, const char *snapname, int fd,
+    uint64_t *bytes, uint64_t *blocks)
+{
+#if __FreeBSD_version > 1600013
+	(void)rp;
+	return (lzc_send_progress(snapname, fd, bytes, blocks));
+#else
+	zfs_handle_t *zhp;
+	int error;
+
+	if ((zhp = zfs_open(rp->monhdl, snapname, ZFS_TYPE_SNAPSHOT))
+	    == NULL) {
+		return (-1);
+	}
+	error = zfs_send_progress(zhp, fd, bytes, blocks);
+	zfs_close(zhp);
+	return (error);
+#endif
+}
+
+static void *
+repl_monitor(void *arg)
+{
+	struct replicator *rp = arg;
+	struct timespec now, abstime;
+	uint64_t bytes, blocks;
+	double dt;
+	int fd, error;
+
+	pthread_mutex_lock(&rp->lock);
+	while (!rp->shutdown) {
+		for (int i = 0; i < rp->njobs; i++) {
+			struct repljob *job = rp->jobs[i];
+
+			if ((fd = job->sendfd) == -1) {
+				continue;
+			}
+			/* The ioctl can be slow; don't stall the workers. */
+			pthread_mutex_unlock(&rp->lock);
+			error = repl_send_progress(rp, job->snapname, fd,
+			    &bytes, &blocks);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			pthread_mutex_lock(&rp->lock);
+			if (error != 0 || job->sendfd != fd) {
+				continue;
+			}
+			dt = repl_elapsed(&job->sampled, &now);
+			if (dt > 0 && bytes >= job->bytes) {
+				job->rate = (bytes - job->bytes) / dt;
+			}
+			job->bytes = bytes;
+			job->sampled = now;
+		}
+		clock_gettime(CLOCK_REALTIME, &abstime);
+		abstime.tv_sec += rp->interval / 1000;
+		abstime.tv_nsec += (rp->interval % 1000) * 1000000;
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
+		(void)pthread_cond_timedwait(&rp->tick, &rp->lock, &abstime);
+	}
+	pthread_mutex_unlock(&rp->lock);
+	return (NULL);
+}
+
+static void
+repljob_free(struct repljob *job)
+{
+	free(job->snapname);
+	free(job->from);
+	free(job->target);
+	free(job->key);
+	free(job->dependents);
+	free(job);
+}
+
+static void
+repl_shutdown(struct replicator *rp, int nthreads)
+{
+	pthread_mutex_lock(&rp->lock);
+	rp->shutdown = true;
+	repl_cancel(rp);
+	pthread_cond_broadcast(&rp->work);
+	pthread_cond_broadcast(&rp->tick);
+	pthread_mutex_unlock(&rp->lock);
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(rp->threads[i], NULL);
+	}
+	if (rp->monitoring) {
+		pthread_join(rp->monitor, NULL);
+	}
+	for (int i = 0; i < rp->njobs; i++) {
+		repljob_free(rp->jobs[i]);
+	}
+	free(rp->jobs);
+#if __FreeBSD_version <= 1600013
+	if (rp->monhdl != NULL) {
+		libzfs_fini(rp->monhdl);
+	}
+#endif
+	pthread_cond_destroy(&rp->tick);
+	pthread_cond_destroy(&rp->idle);
+	pthread_cond_destroy(&rp->work);
+	pthread_mutex_destroy(&rp->lock);
+	free(rp);
+}
+
+static inline struct replicator *
+checkreplicator(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, REPLICATOR_METATABLE));
+}
+
+static int
+l_zfs_replicator(lua_State *L)
+{
+	struct replicator *rp;
+	libzfs_handle_t *hdl;
+	lua_Integer nthreads, interval;
+	sigset_t set, oset;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	nthreads = 4;
+	interval = 1000;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if (lua_getfield(L, 2, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 2, "interval") != LUA_TNIL) {
+			interval = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 2);
+	}
+	luaL_argcheck(L, nthreads > 0 && nthreads <= 1024, 2,
+	    "invalid threads");
+	luaL_argcheck(L, interval > 0 && interval <= 3600000, 2,
+	    "invalid interval");
+
+	if ((rp = calloc(1, sizeof(*rp) + nthreads * sizeof(pthread_t)))
+	    == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	pthread_mutex_init(&rp->lock, NULL);
+	pthread_cond_init(&rp->work, NULL);
+	pthread_cond_init(&rp->idle, NULL);
+	pthread_cond_init(&rp->tick, NULL);
+	STAILQ_INIT(&rp->queue);
+	atomic_init(&rp->cancel, false);
+	rp->hdl = hdl;
+	rp->interval = interval;
+	rp->nthreads = nthreads;
+#if __FreeBSD_version <= 1600013
+	/* zfs_send_progress needs a handle of the monitor's own. */
+	if ((rp->monhdl = libzfs_init()) == NULL) {
+		error = errno;
+		repl_shutdown(rp, 0);
+		return (fail(L, error));
+	}
+#endif
+	/* The threads inherit a mask blocking every signal. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oset);
+	for (int i = 0; i < nthreads; i++) {
+		if ((error = pthread_create(&rp->threads[i], NULL,
+		    repl_worker, rp)) != 0) {
+			pthread_sigmask(SIG_SETMASK, &oset, NULL);
+			repl_shutdown(rp, i);
+			return (fail(L, error));
+		}
+	}
+	error = pthread_create(&rp->monitor, NULL, repl_monitor, rp);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (error != 0) {
+		repl_shutdown(rp, nthreads);
+		return (fail(L, error));
+	}
+	rp->monitoring = true;
+	return (newref(L, 1, rp, REPLICATOR_METATABLE));
+}
+
+static int
+l_replicator_close(lua_State *L)
+{
+	struct replicator *rp;
+
+	rp = checkcookienull(L, 1, REPLICATOR_METATABLE);
+
+	if (rp != NULL) {
+		repl_shutdown(rp, rp->nthreads);
+		setcookie(L, 1, NULL);
+	}
+	return (0);
+}
+
+struct replguid {
+	uint64_t guid;
+	char name[ZFS_MAX_DATASET_NAME_LEN];
+};
+
+static int
+replguid_cb(zfs_handle_t *zhp, void *arg)
+{
+	struct replguid *rg = arg;
+	int found;
+
+	if ((found = zfs_prop_get_int(zhp, ZFS_PROP_GUID) == rg->guid)) {
+		strlcpy(rg->name, zfs_get_name(zhp), sizeof(rg->name));
+	}
+	zfs_close(zhp);
+	return (found);
+}
+
+/*
+ * Find the snapshot or bookmark of the dataset containing snapname that an
+ * incremental resume token refers to by guid.
+ */
+static bool
+repl_guid_to_name(libzfs_handle_t *hdl, const char *snapname, uint64_t guid,
+    struct replguid *rg)
+{
+	char fsname[ZFS_MAX_DATASET_NAME_LEN];
+	zfs_handle_t *zhp;
+
+	strlcpy(fsname, snapname, sizeof(fsname));
+	fsname[strcspn(fsname, "@")] = '\0';
+	if ((zhp = zfs_open(hdl, fsname,
+	    ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME)) == NULL) {
+		return (false);
+	}
+	rg->guid = guid;
+	rg->name[0] = '\0';
+	if (zfs_iter_snapshots_v2(zhp, 0, replguid_cb, rg, 0, 0) == 0 &&
+	    rg->name[0] == '\0') {
+		(void)zfs_iter_bookmarks_v2(zhp, 0, replguid_cb, rg);
+	}
+	zfs_close(zhp);
+	return (rg->name[0] != '\0');
+}
+
+/* Is a the same dataset as b or one of its ancestors? */
+static inline bool
+repl_follows(const char *a, const char *b)
+{
+	size_t len = strlen(a);
+
+	return (strncmp(a, b, len) == 0 && (b[len] == '\0' || b[len] == '/'));
+}
+
+static int
+l_replicator_add(lua_State *L)
+{
+	struct replguid rg;
+	struct replicator *rp;
+	struct repljob *job, **jobs;
+	const char *snapname, *target, *from, *token, *at;
+	nvlist_t *nvl;
+	uint64_t fromguid;
+	lua_Integer flags;
+	bool force, resumable;
+	int id, outfd, deperror, *deps;
+
+	rp = checkreplicator(L, 1);
+	snapname = luaL_optstring(L, 2, NULL);
+	if (lua_type(L, 3) == LUA_TSTRING) {
+		target = lua_tostring(L, 3);
+		outfd = -1;
+	} else {
+		target = NULL;
+		outfd = checkfd(L, 3);
+	}
+	from = token = NULL;
+	flags = 0;
+	force = resumable = false;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_getfield(L, 4, "from") != LUA_TNIL) {
+			from = luaL_checkstring(L, -1);
+		}
+		if (lua_getfield(L, 4, "resume_token") != LUA_TNIL) {
+			token = luaL_checkstring(L, -1);
+		}
+		if (lua_getfield(L, 4, "flags") != LUA_TNIL) {
+			flags = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 4, "force") != LUA_TNIL) {
+			force = lua_toboolean(L, -1);
+		}
+		if (lua_getfield(L, 4, "resumable") != LUA_TNIL) {
+			resumable = lua_toboolean(L, -1);
+		}
+	}
+	if (token == NULL && snapname == NULL) {
+		return (luaL_argerror(L, 2,
+		    "snapshot or resume_token required"));
+	}
+
+	if ((job = calloc(1, sizeof(*job))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	job->outfd = outfd;
+	job->sendfd = job->recvfd = -1;
+	job->flags = flags;
+	job->force = force;
+	job->resumable = resumable;
+	if (token != NULL) {
+		if ((nvl = zfs_send_resume_token_to_nvlist(rp->hdl, token))
+		    == NULL) {
+			repljob_free(job);
+			return (libzfsfail(L, rp->hdl, EINVAL,
+			    "zfs_send_resume_token_to_nvlist"));
+		}
+		if (nvlist_lookup_string(nvl, "toname", &snapname) != 0 ||
+		    nvlist_lookup_uint64(nvl, "object", &job->resumeobj) != 0 ||
+		    nvlist_lookup_uint64(nvl, "offset", &job->resumeoff)
+		    != 0) {
+			nvlist_free(nvl);
+			repljob_free(job);
+			return (fail(L, EINVAL));
+		}
+		if (nvlist_exists(nvl, "largeblockok")) {
+			job->flags |= LZC_SEND_FLAG_LARGE_BLOCK;
+		}
+		if (nvlist_exists(nvl, "embedok")) {
+			job->flags |= LZC_SEND_FLAG_EMBED_DATA;
+		}
+		if (nvlist_exists(nvl, "compressok")) {
+			job->flags |= LZC_SEND_FLAG_COMPRESS;
+		}
+		if (nvlist_exists(nvl, "rawok")) {
+			job->flags |= LZC_SEND_FLAG_RAW;
+		}
+		if (from == NULL &&
+		    nvlist_lookup_uint64(nvl, "fromguid", &fromguid) == 0) {
+			if (!repl_guid_to_name(rp->hdl, snapname, fromguid,
+			    &rg)) {
+				nvlist_free(nvl);
+				repljob_free(job);
+				return (fail(L, ENOENT));
+			}
+			from = rg.name;
+		}
+		job->snapname = strdup(snapname);
+		nvlist_free(nvl);
+		/* A resumed stream only applies to the partial state. */
+		job->resumable = true;
+	} else {
+		job->snapname = strdup(snapname);
+	}
+	if (job->snapname == NULL ||
+	    (from != NULL && (job->from = strdup(from)) == NULL)) {
+		repljob_free(job);
+		return (fatal(L, "strdup", ENOMEM));
+	}
+	if ((at = strchr(job->snapname, '@')) == NULL) {
+		repljob_free(job);
+		return (luaL_argerror(L, 2, "not a snapshot"));
+	}
+	if (target != NULL) {
+		/* Like zfs receive, a file system target keeps the snap name. */
+		if (strchr(target, '@') != NULL) {
+			job->target = strdup(target);
+		} else {
+			asprintf(&job->target, "%s%s", target, at);
+		}
+		if (job->target == NULL) {
+			repljob_free(job);
+			return (fatal(L, "strdup", ENOMEM));
+		}
+	}
+	if ((job->key = strdup(target != NULL ? job->target : job->snapname))
+	    == NULL) {
+		repljob_free(job);
+		return (fatal(L, "strdup", ENOMEM));
+	}
+	job->key[strcspn(job->key, "@")] = '\0';
+
+	pthread_mutex_lock(&rp->lock);
+	if (rp->njobs == rp->maxjobs) {
+		int maxjobs = MAX(rp->maxjobs * 2, 16);
+
+		if ((jobs = reallocarray(rp->jobs, maxjobs, sizeof(*jobs)))
+		    == NULL) {
+			pthread_mutex_unlock(&rp->lock);
+			repljob_free(job);
+			return (fatal(L, "reallocarray", ENOMEM));
+		}
+		rp->jobs = jobs;
+		rp->maxjobs = maxjobs;
+	}
+	id = rp->njobs;
+	deperror = 0;
+	for (int i = 0; i < id; i++) {
+		struct repljob *prev = rp->jobs[i];
+
+		if (!repl_follows(prev->key, job->key)) {
+			continue;
+		}
+		if (prev->state == REPL_DONE) {
+			if (prev->error != 0) {
+				deperror = ECANCELED;
+			}
+			continue;
+		}
+		if (prev->ndependents == prev->maxdependents) {
+			int maxdeps = MAX(prev->maxdependents * 2, 4);
+
+			if ((deps = reallocarray(prev->dependents, maxdeps,
+			    sizeof(*deps))) == NULL) {
+				deperror = ENOMEM;
+				break;
+			}
+			prev->dependents = deps;
+			prev->maxdependents = maxdeps;
+		}
+		prev->dependents[prev->ndependents++] = id;
+		job->waiting++;
+	}
+	job->deperror = deperror;
+	rp->jobs[rp->njobs++] = job;
+	rp->active++;
+	if (job->waiting == 0) {
+		repl_ready(rp, job);
+	}
+	pthread_mutex_unlock(&rp->lock);
+
+	lua_pushinteger(L, id + 1);
+	return (1);
+}
+
+static const char *
+repl_state_name(enum replstate state, int error)
+{
+	switch (state) {
+	case REPL_QUEUED:
+		return ("queued");
+	case REPL_RUNNING:
+		return ("running");
+	default:
+		return (error == 0 ? "done" : "failed");
+	}
+}
+
+static void
+pushreplstatus(lua_State *L, struct replicator *rp, struct repljob *job)
+{
+	enum replstate state;
+	uint64_t bytes;
+	double rate;
+	int error;
+
+	/* The names are immutable; snapshot the rest under the lock. */
+	pthread_mutex_lock(&rp->lock);
+	state = job->state;
+	bytes = job->bytes;
+	rate = job->rate;
+	error = job->error;
+	pthread_mutex_unlock(&rp->lock);
+
+	lua_createtable(L, 0, 8);
+	lua_pushstring(L, job->snapname);
+	lua_setfield(L, -2, "snapshot");
+	if (job->from != NULL) {
+		lua_pushstring(L, job->from);
+		lua_setfield(L, -2, "from");
+	}
+	if (job->target != NULL) {
+		lua_pushstring(L, job->target);
+		lua_setfield(L, -2, "target");
+	}
+	lua_pushstring(L, repl_state_name(state, error));
+	lua_setfield(L, -2, "state");
+	lua_pushinteger(L, bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, rate);
+	lua_setfield(L, -2, "rate");
+	if (error != 0) {
+		lua_pushstring(L, strerror(error));
+		lua_setfield(L, -2, "errmsg");
+		lua_pushinteger(L, error);
+		lua_setfield(L, -2, "errno");
+	}
+}
+
+static int
+l_replicator_status(lua_State *L)
+{
+	struct replicator *rp;
+	int id, njobs;
+
+	rp = checkreplicator(L, 1);
+
+	pthread_mutex_lock(&rp->lock);
+	njobs = rp->njobs;
+	pthread_mutex_unlock(&rp->lock);
+
+	if (!lua_isnoneornil(L, 2)) {
+		id = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, id >= 1 && id <= njobs, 2, "invalid id");
+		pushreplstatus(L, rp, rp->jobs[id - 1]);
+		return (1);
+	}
+	lua_createtable(L, njobs, 0);
+	for (int i = 0; i < njobs; i++) {
+		pushreplstatus(L, rp, rp->jobs[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return (1);
+}
+
+static int
+l_replicator_wait(lua_State *L)
+{
+	struct replicator *rp;
+	lua_Number timeout;
+	int error, nfailed;
+
+	rp = checkreplicator(L, 1);
+	timeout = luaL_optnumber(L, 2, -1);
+
+	pthread_mutex_lock(&rp->lock);
+	error = parallel_wait(&rp->idle, &rp->lock, &rp->active, timeout);
+	nfailed = 0;
+	for (int i = 0; i < rp->njobs; i++) {
+		if (rp->jobs[i]->state == REPL_DONE &&
+		    rp->jobs[i]->error != 0) {
+			nfailed++;
+		}
+	}
+	pthread_mutex_unlock(&rp->lock);
+	if (error != 0) {
+		return (fail(L, error));
+	}
+	lua_pushinteger(L, nfailed);
+	return (1);
+}
+
+static int
+l_replicator_cancel(lua_State *L)
+{
+	struct replicator *rp;
+
+	rp = checkreplicator(L, 1);
+
+	pthread_mutex_lock(&rp->lock);
+	repl_cancel(rp);
+	pthread_mutex_unlock(&rp->lock);
+	return (0);
+}
+
+static int
+l_is_mounted(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *special;
+	char *where;
+	boolean_t mounted;
+
+	hdl = checklibzfs(L, 1);
+	special = luaL_checkstring(L, 2);
+
+	mounted = is_mounted(hdl, special, &where);
+	lua_pushboolean(L, mounted);
+	if (mounted) {
+		lua_pushstring(L, where);
+		return (2);
+	}
+	return (1);
+}
+
+static int
+l_zfs_nicestrtonum(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *value;
+	uint64_t num;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	value = luaL_checkstring(L, 2);
+
+	if ((error = zfs_nicestrtonum(hdl, value, &num)) != 0) {
+		return (libzfsfail(L, hdl, error, "zfs_nicestrtonum"));
+	}
+	lua_pushinteger(L, num);
+	return (1);
+}
+
+static int
+l_zpool_in_use(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	char *namestr;
+	pool_state_t state;
+	boolean_t inuse;
+	int fd, error;
+
+	hdl = checklibzfs(L, 1);
+	fd = checkfd(L, 2);
+
+	if ((error = zpool_in_use(hdl, fd, &state, &namestr, &inuse)) != 0) {
+		return (libzfsfail(L, hdl, error, "zpool_in_use"));
+	}
+	lua_pushboolean(L, inuse);
+	lua_pushstring(L, namestr);
+	lua_pushinteger(L, state);
+	return (3);
+}
+
+static int
+l_zpool_nextboot(lua_State *L)
+{
+	libzfs_handle_t *hdl;
+	const char *command;
+	uint64_t pool_guid, vdev_guid;
+	int error;
+
+	hdl = checklibzfs(L, 1);
+	pool_guid = luaL_checkinteger(L, 2);
+	vdev_guid = luaL_checkinteger(L, 3);
+	command = luaL_checkstring(L, 4);
+
+	if ((error = zpool_nextboot(hdl, pool_guid, vdev_guid, command)) != 0) {
+		return (libzfsfail(L, hdl, error, "zpool_nextboot"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_close(lua_State *L)
+{
+	zfs_handle_t *zhp;
+
+	zhp = checkcookienull(L, 1, ZFS_HANDLE_METATABLE);
+
+	if (zhp != NULL) {
+		zfs_close(zhp);
+		setcookie(L, 1, NULL);
+	}
+	return (0);
+}
+
+static int
+l_zfs_handle_dup(lua_State *L)
+{
+	zfs_handle_t *zhp, *dupzhp;
+
+	zhp = checkzfs(L, 1);
+
+	if ((dupzhp = zfs_handle_dup(zhp)) == NULL) {
+		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_handle_dup"));
+	}
+	return (new(L, dupzhp, ZFS_HANDLE_METATABLE));
+}
+
+static int
+l_zfs_get_type(lua_State *L)
+{
+	zfs_handle_t *zhp;
+
+	zhp = checkzfs(L, 1);
+
+	lua_pushinteger(L, zfs_get_type(zhp));
+	return (1);
+}
+
+static int
+l_zfs_get_underlying_type(lua_State *L)
+{
+	zfs_handle_t *zhp;
+
+	zhp = checkzfs(L, 1);
+
+	lua_pushinteger(L, zfs_get_underlying_type(zhp));
+	return (1);
+}
+
+static int
+l_zfs_get_name(lua_State *L)
+{
+	zfs_handle_t *zhp;
+
+	zhp = checkzfs(L, 1);
+
+	lua_pushstring(L, zfs_get_name(zhp));
+	return (1);
+}
+
+#if 0
+static int
+l_zfs_get_pool_handle(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	zpool_handle_t *pool_hdl;
+
+	zhp = checkzfs(L, 1);
+
+	if ((pool_hdl = zfs_get_pool_handle(zhp)) == NULL) {
+		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_get_pool_handle"));
+	}
+	/* TODO: need a refcounted handle */
+	return (new(L, pool_hdl, ZPOOL_HANDLE_METATABLE));
+}
+#endif
+
+static int
+l_zfs_get_pool_name(lua_State *L)
+{
+	zfs_handle_t *zhp;
+
+	zhp = checkzfs(L, 1);
+
+	lua_pushstring(L, zfs_get_pool_name(zhp));
+	return (1);
+}
+
+static int
+l_zfs_prop_set(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	const char *propname, *propval;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+	propval = luaL_checkstring(L, 3);
+
+	if ((error = zfs_prop_set(zhp, propname, propval)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_set"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_prop_set_list(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	nvlist_t *props;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	props = checknvlist(L, 2);
+
+	if ((error = zfs_prop_set_list(zhp, props)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_set_list"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_prop_set_list_flags(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	nvlist_t *props;
+	int flags, error;
+
+	zhp = checkzfs(L, 1);
+	props = checknvlist(L, 2);
+	flags = luaL_optinteger(L, 3, 0);
+
+	if ((error = zfs_prop_set_list_flags(zhp, props, flags)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_set_list_flags"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_prop_get(lua_State *L)
+{
+	char property[ZFS_MAXPROPLEN];
+	char sourcename[ZFS_MAX_DATASET_NAME_LEN];
+	zfs_handle_t *zhp;
+	zfs_prop_t prop;
+	zprop_source_t source;
+	boolean_t literal;
+	int error;
+
+	property[0] = '\0';
+	sourcename[0] = '\0';
+
+	zhp = checkzfs(L, 1);
+	prop = checkprop(L, 2);
+	literal = lua_toboolean(L, 3);
+
+	if ((error = zfs_prop_get(zhp, prop, property, sizeof(property),
+	    &source, sourcename, sizeof(sourcename), literal)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get"));
+	}
+	lua_pushstring(L, property);
+	lua_pushinteger(L, source);
+	if (*sourcename == '\0') {
+		return (2);
+	}
+	lua_pushstring(L, sourcename);
+	return (3);
+}
+
+static int
+l_zfs_prop_get_recvd(lua_State *L)
+{
+	char property[ZFS_MAXPROPLEN];
+	zfs_handle_t *zhp;
+	const char *propname;
+	boolean_t literal;
+	int error;
+
+	property[0] = '\0';
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+	literal = lua_toboolean(L, 3);
+
+	if ((error = zfs_prop_get_recvd(zhp, propname, property,
+	    sizeof(property), literal)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get_recvd"));
+	}
+	lua_pushstring(L, property);
+	return (1);
+}
+
+static int
+l_zfs_prop_get_numeric(lua_State *L)
+{
+	char sourcename[ZFS_MAX_DATASET_NAME_LEN];
+	zfs_handle_t *zhp;
+	zfs_prop_t prop;
+	uint64_t value;
+	zprop_source_t source;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	prop = checkprop(L, 2);
+
+	if ((error = zfs_prop_get_numeric(zhp, prop, &value, &source,
+	    sourcename, sizeof(sourcename))) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get_numeric"));
+	}
+	lua_pushinteger(L, value);
+	lua_pushinteger(L, source);
+	if (*sourcename == '\0') {
+		return (2);
+	}
+	lua_pushstring(L, sourcename);
+	return (3);
+}
+
+static int
+l_zfs_prop_get_userquota_int(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	const char *propname;
+	uint64_t value;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+
+	if ((error = zfs_prop_get_userquota_int(zhp, propname, &value)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get_userquota_int"));
+	}
+	lua_pushinteger(L, value);
+	return (1);
+}
+
+static int
+l_zfs_prop_get_userquota(lua_State *L)
+{
+	char value[ZFS_MAXPROPLEN];
+	zfs_handle_t *zhp;
+	const char *propname;
+	boolean_t literal;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+	literal = lua_toboolean(L, 3);
+
+	if ((error = zfs_prop_get_userquota(zhp, propname, value, sizeof(value),
+	    literal)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get_userquota"));
+	}
+	lua_pushstring(L, value);
+	return (1);
+}
+
+static int
+l_zfs_prop_get_written_int(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	const char *propname;
+	uint64_t value;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+
+	if ((error = zfs_prop_get_written_int(zhp, propname, &value)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get_written_int"));
+	}
+	lua_pushinteger(L, value);
+	return (1);
+}
+
+static int
+l_zfs_prop_get_written(lua_State *L)
+{
+	char value[ZFS_MAXPROPLEN];
+	zfs_handle_t *zhp;
+	const char *propname;
+	boolean_t literal;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+	literal = lua_toboolean(L, 3);
+
+	if ((error = zfs_prop_get_written(zhp, propname, value, sizeof(value),
+	    literal)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_get_written"));
+	}
+	lua_pushstring(L, value);
+	return (1);
+}
+
+static int
+l_getprop_uint64(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	const char *source;
+	zfs_prop_t prop;
+
+	zhp = checkzfs(L, 1);
+	prop = checkprop(L, 2);
+
+	lua_pushinteger(L, getprop_uint64(zhp, prop, &source));
+	lua_pushstring(L, source);
+	return (2);
+}
+
+static int
+l_zfs_prop_get_int(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	zfs_prop_t prop;
+
+	zhp = checkzfs(L, 1);
+	prop = checkprop(L, 2);
+
+	lua_pushinteger(L, zfs_prop_get_int(zhp, prop));
+	return (1);
+}
+
+static int
+l_zfs_prop_inherit(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	const char *propname;
+	boolean_t received;
+	int error;
+
+	zhp = checkzfs(L, 1);
+	propname = luaL_checkstring(L, 2);
+	received = lua_toboolean(L, 3);
+
+	if ((error = zfs_prop_inherit(zhp, propname, received)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_prop_inherit"));
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_get_all_props(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	nvlist_t *props;
+	int error;
+
+	zhp = checkzfs(L, 1);
+
+	/* XXX: Need to dup to have sane lifetime. */
+	if ((error = nvlist_dup(zfs_get_all_props(zhp), &props, 0)) != 0) {
+		return (fatal(L, "nvlist_dup", error));
+	}
+	pushnvlist(L, props);
+	return (1);
+}
+
+static int
+l_zfs_get_user_props(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	nvlist_t *props;
+	int error;
+
+	zhp = checkzfs(L, 1);
+
+	/* XXX: Need to dup to have sane lifetime. */
+	if ((error = nvlist_dup(zfs_get_user_props(zhp), &props, 0)) != 0) {
+		return (fatal(L, "nvlist_dup", error));
+	}
+	pushnvlist(L, props);
+	return (1);
+}
+
+static int
+l_zfs_get_recvd_props(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	nvlist_t *props;
+	int error;
+
+	zhp = checkzfs(L, 1);
+
+	if ((props = zfs_get_recvd_props(zhp)) == NULL) {
+		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_get_recvd_props"));
+	}
+	/* XXX: Need to dup to have sane lifetime. */
+	if ((error = nvlist_dup(props, &props, 0)) != 0) {
+		return (fatal(L, "nvlist_dup", error));
+	}
+	pushnvlist(L, props);
+	return (1);
+}
+
+static int
+l_zfs_get_clones_nvl(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	nvlist_t *clones;
+
+	zhp = checkzfs(L, 1);
+
+	if ((clones = zfs_get_clones_nvl(zhp)) == NULL) {
+		/* XXX: We don't get useful error info back. */
+		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_get_clones_nvl"));
+	}
+	pushnvlist(L, clones);
+	return (1);
+}
+
+static int
+l_zfs_iter_children(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	int top = lua_gettop(L);
+	int error;
+
+	zhp = checkzfs(L, 1);
+	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
+
+	if ((error = zfs_iter_children(zhp, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_children failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_dependents(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	boolean_t allowrecursion;
+	int top, error;
+
+	zhp = checkzfs(L, 1);
+	allowrecursion = lua_toboolean(L, 2);
+	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_dependents(zhp, allowrecursion, zfs_iter_cb, L))
+	    != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_dependents failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_filesystems(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	int top = lua_gettop(L);
+	int error;
+
+	zhp = checkzfs(L, 1);
+	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
+
+	if ((error = zfs_iter_filesystems(zhp, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_filesystems failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_snapshots(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	uint64_t min_txg, max_txg;
+	boolean_t simple;
+	int top, error;
+
+	zhp = checkzfs(L, 1);
+	simple = lua_toboolean(L, 2);
+	min_txg = luaL_optinteger(L, 3, 0);
+	max_txg = luaL_optinteger(L, 4, 0);
+	luaL_argcheck(L, lua_isfunction(L, 5), 5, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	lua_remove(L, 3);
+	lua_remove(L, 4);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_snapshots(zhp, simple, zfs_iter_cb, L, min_txg,
+	    max_txg)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_snapshots failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_snapshots_sorted(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	uint64_t min_txg, max_txg;
+	int top, error;
+
+	zhp = checkzfs(L, 1);
+	min_txg = luaL_optinteger(L, 2, 0);
+	max_txg = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	lua_remove(L, 3);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_snapshots_sorted(zhp, zfs_iter_cb, L, min_txg,
+	    max_txg)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_snapshots_sorted failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+/* XXX: this shouldn't be externally visible, please break */
+extern char *zfs_strdup(libzfs_handle_t *, const char *);
+
+static int
+l_zfs_iter_snapspec(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	const char *snapspec;
+	char *snapspeccopy;
+	int top, error;
+
+	zhp = checkzfs(L, 1);
+	snapspec = luaL_checkstring(L, 2);
+	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	snapspeccopy = zfs_strdup(zfs_get_handle(zhp), snapspec);
+	lua_remove(L, 2);
+	top = lua_gettop(L);
+
+	error = zfs_iter_snapspec(zhp, snapspeccopy, zfs_iter_cb, L);
+	free(snapspeccopy);
+	if (error != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_snapspec failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_bookmarks(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	int top = lua_gettop(L);
+	int error;
+
+	zhp = checkzfs(L, 1);
+	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
+
+	if ((error = zfs_iter_bookmarks(zhp, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_bookmarks failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_children_v2(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	int flags, top, error;
+
+	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_children_v2(zhp, flags, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_children_v2 failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_dependents_v2(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	boolean_t allowrecursion;
+	int flags, top, error;
+
+	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	allowrecursion = lua_toboolean(L, 3);
+	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	lua_remove(L, 3);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_dependents_v2(zhp, flags, allowrecursion,
+	    zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_dependents_v2 failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_filesystems_v2(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	int flags, top, error;
+
+	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_filesystems_v2(zhp, flags, zfs_iter_cb, L))
+	    != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_filesystems_v2 failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_snapshots_v2(lua_State *L)
+{
+	zfs_handle_t *zhp;
+	uint64_t min_txg, max_txg;
+	int flags, top, error;
+
+	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	min_txg = luaL_optinteger(L, 3, 0);
+	max_txg = luaL_optinteger(L, 4, 0);
+	luaL_argcheck(L, lua_isfunction(L, 5), 5, "callback function required");
+
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	lua_remove(L, 3);
+	lua_remove(L, 4);
+	top = lua_gettop(L);
+
+	if ((error = zfs_iter_snapshots_v2(zhp, flags, zfs_iter_cb, L, min_txg,
+	    max_txg)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_snapshots_v2 failed");
+		return (2);
+	}
+	return (success(L));
+}
+
+static int
+l_zfs_iter_snapshots_sorted_v2(lua_State *L)
 {
 	zfs_handle_t *zhp;
+	uint64_t min_txg, max_txg;
+	int flags, top, error;
 
 	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	min_txg = luaL_optinteger(L, 3, 0);
+	max_txg = luaL_optinteger(L, 4, 0);
+	luaL_argcheck(L, lua_isfunction(L, 5), 5, "callback function required");
 
-	lua_pushinteger(L, zfs_get_underlying_type(zhp));
-	return (1);
-}
-
-static int
-l_zfs_get_name(lua_State *L)
-{
-	zfs_handle_t *zhp;
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	lua_remove(L, 3);
+	lua_remove(L, 4);
+	top = lua_gettop(L);
 
-	zhp = checkzfs(L, 1);
+	if ((error = zfs_iter_snapshots_sorted_v2(zhp, flags, zfs_iter_cb, L,
+	    min_txg, max_txg)) != 0) {
+		int nresults = lua_gettop(L) - top;
 
-	lua_pushstring(L, zfs_get_name(zhp));
-	return (1);
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_snapshots_sorted_v2 failed");
+		return (2);
+	}
+	return (success(L));
 }
 
-#if 0
 static int
-l_zfs_get_pool_handle(lua_State *L)
+l_zfs_iter_snapspec_v2(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	zpool_handle_t *pool_hdl;
+	const char *snapspec;
+	char *snapspeccopy;
+	int flags, top, error;
 
 	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	snapspec = luaL_checkstring(L, 3);
+	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
 
-	if ((pool_hdl = zfs_get_pool_handle(zhp)) == NULL) {
-		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_get_pool_handle"));
+	/* Massage the stack to fit zfs_iter_cb. */
+	snapspeccopy = zfs_strdup(zfs_get_handle(zhp), snapspec);
+	lua_remove(L, 2);
+	lua_remove(L, 3);
+	top = lua_gettop(L);
+
+	error = zfs_iter_snapspec_v2(zhp, flags, snapspeccopy, zfs_iter_cb, L);
+	free(snapspeccopy);
+	if (error != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_snapspec_v2 failed");
+		return (2);
 	}
-	/* TODO: need a refcounted handle */
-	return (new(L, pool_hdl, ZPOOL_HANDLE_METATABLE));
+	return (success(L));
 }
-#endif
 
 static int
-l_zfs_get_pool_name(lua_State *L)
+l_zfs_iter_bookmarks_v2(lua_State *L)
 {
 	zfs_handle_t *zhp;
+	int flags, top, error;
 
 	zhp = checkzfs(L, 1);
+	flags = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
 
-	lua_pushstring(L, zfs_get_pool_name(zhp));
-	return (1);
-}
-
-static int
-l_zfs_prop_set(lua_State *L)
-{
-	zfs_handle_t *zhp;
-	const char *propname, *propval;
-	int error;
+	/* Massage the stack to fit zfs_iter_cb. */
+	lua_remove(L, 2);
+	top = lua_gettop(L);
 
-	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
-	propval = luaL_checkstring(L, 3);
+	if ((error = zfs_iter_bookmarks_v2(zhp, flags, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
 
-	if ((error = zfs_prop_set(zhp, propname, propval)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_set"));
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_bookmarks_v2 failed");
+		return (2);
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_prop_set_list(lua_State *L)
+l_zfs_iter_mounted(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	nvlist_t *props;
+	int top = lua_gettop(L);
 	int error;
 
 	zhp = checkzfs(L, 1);
-	props = checknvlist(L, 2);
+	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
 
-	if ((error = zfs_prop_set_list(zhp, props)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_set_list"));
+	if ((error = zfs_iter_mounted(zhp, zfs_iter_cb, L)) != 0) {
+		int nresults = lua_gettop(L) - top;
+
+		if (nresults > 0) {
+			return (nresults);
+		}
+		/* XXX: We don't get useful error info back. */
+		luaL_pushfail(L);
+		lua_pushliteral(L, "zfs_iter_mounted failed");
+		return (2);
 	}
 	return (success(L));
 }
 
-static int
-l_zfs_prop_set_list_flags(lua_State *L)
-{
-	zfs_handle_t *zhp;
-	nvlist_t *props;
-	int flags, error;
+/*
+ * Pull-style iteration.  libzfs only offers push-style iterators, so each
+ * iterator object runs one on a helper thread in lockstep with the caller:
+ * the helper fills a batch of handles and then sleeps until the caller has
+ * consumed it and asks for more.  Only one of the two threads ever touches
+ * libzfs at a time, the number of open handles is bounded by the batch size,
+ * and closing the iterator stops the walk early.  The helper walks its own
+ * duplicate of the parent handle, so closing the parent does not pull the
+ * handle out from under a parked walk.
+ */
 
-	zhp = checkzfs(L, 1);
-	props = checknvlist(L, 2);
-	flags = luaL_optinteger(L, 3, 0);
+enum zfsiter_kind {
+	ZFSITER_CHILDREN,
+	ZFSITER_FILESYSTEMS,
+	ZFSITER_SNAPSHOTS,
+	ZFSITER_SNAPSHOTS_SORTED,
+	ZFSITER_SNAPSPEC,
+	ZFSITER_BOOKMARKS,
+	ZFSITER_DEPENDENTS,
+};
 
-	if ((error = zfs_prop_set_list_flags(zhp, props, flags)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_set_list_flags"));
-	}
-	return (success(L));
-}
+static const char *const zfsiter_kinds[] = {
+	"children",
+	"filesystems",
+	"snapshots",
+	"snapshots_sorted",
+	"snapspec",
+	"bookmarks",
+	"dependents",
+	NULL
+};
 
-static int
-l_zfs_prop_get(lua_State *L)
-{
-	char property[ZFS_MAXPROPLEN];
-	char sourcename[ZFS_MAX_DATASET_NAME_LEN];
+struct zfsiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	pthread_t thread;
 	zfs_handle_t *zhp;
-	zfs_prop_t prop;
-	zprop_source_t source;
-	boolean_t literal;
+	enum zfsiter_kind kind;
+	int flags;
+	uint64_t min_txg, max_txg;
+	char *snapspec;
+	boolean_t allowrecursion;
+	bool autoclose;
+	bool started;
+	bool want;
+	bool done;
+	bool cancel;
 	int error;
+	int prev;	/* registry ref to the last handle returned */
+	size_t count, pos, batchsize;
+	zfs_handle_t *batch[];
+};
 
-	property[0] = '\0';
-	sourcename[0] = '\0';
-
-	zhp = checkzfs(L, 1);
-	prop = checkprop(L, 2);
-	literal = lua_toboolean(L, 3);
+static int
+zfsiter_cb(zfs_handle_t *zhp, void *arg)
+{
+	struct zfsiter *it = arg;
 
-	if ((error = zfs_prop_get(zhp, prop, property, sizeof(property),
-	    &source, sourcename, sizeof(sourcename), literal)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get"));
+	pthread_mutex_lock(&it->lock);
+	if (it->cancel) {
+		pthread_mutex_unlock(&it->lock);
+		zfs_close(zhp);
+		return (-1);
 	}
-	lua_pushstring(L, property);
-	lua_pushinteger(L, source);
-	if (*sourcename == '\0') {
-		return (2);
+	it->batch[it->count++] = zhp;
+	if (it->count == it->batchsize) {
+		it->want = false;
+		pthread_cond_broadcast(&it->cv);
+		while (!it->want && !it->cancel) {
+			pthread_cond_wait(&it->cv, &it->lock);
+		}
 	}
-	lua_pushstring(L, sourcename);
-	return (3);
+	pthread_mutex_unlock(&it->lock);
+	return (0);
 }
 
-static int
-l_zfs_prop_get_recvd(lua_State *L)
+static void *
+zfsiter_run(void *arg)
 {
-	char property[ZFS_MAXPROPLEN];
-	zfs_handle_t *zhp;
-	const char *propname;
-	boolean_t literal;
+	struct zfsiter *it = arg;
+	zfs_handle_t *zhp = it->zhp;
 	int error;
 
-	property[0] = '\0';
-
-	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
-	literal = lua_toboolean(L, 3);
-
-	if ((error = zfs_prop_get_recvd(zhp, propname, property,
-	    sizeof(property), literal)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get_recvd"));
+	switch (it->kind) {
+	case ZFSITER_CHILDREN:
+		error = zfs_iter_children_v2(zhp, it->flags, zfsiter_cb, it);
+		break;
+	case ZFSITER_FILESYSTEMS:
+		error = zfs_iter_filesystems_v2(zhp, it->flags, zfsiter_cb, it);
+		break;
+	case ZFSITER_SNAPSHOTS:
+		error = zfs_iter_snapshots_v2(zhp, it->flags, zfsiter_cb, it,
+		    it->min_txg, it->max_txg);
+		break;
+	case ZFSITER_SNAPSHOTS_SORTED:
+		error = zfs_iter_snapshots_sorted_v2(zhp, it->flags,
+		    zfsiter_cb, it, it->min_txg, it->max_txg);
+		break;
+	case ZFSITER_SNAPSPEC:
+		error = zfs_iter_snapspec_v2(zhp, it->flags, it->snapspec,
+		    zfsiter_cb, it);
+		break;
+	case ZFSITER_BOOKMARKS:
+		error = zfs_iter_bookmarks_v2(zhp, it->flags, zfsiter_cb, it);
+		break;
+	case ZFSITER_DEPENDENTS:
+		error = zfs_iter_dependents_v2(zhp, it->flags,
+		    it->allowrecursion, zfsiter_cb, it);
+		break;
+	default:
+		__unreachable();
+	}
+	pthread_mutex_lock(&it->lock);
+	it->error = it->cancel ? 0 : error;
+	it->done = true;
+	it->want = false;
+	pthread_cond_broadcast(&it->cv);
+	pthread_mutex_unlock(&it->lock);
+	return (NULL);
+}
+
+static inline struct zfsiter *
+checkzfsiter(lua_State *L, int idx)
+{
+	return (checkcookie(L, idx, ZFS_ITER_METATABLE));
+}
+
+static void
+zfsiter_release_prev(lua_State *L, struct zfsiter *it)
+{
+	if (it->prev == LUA_NOREF) {
+		return;
+	}
+	if (it->autoclose) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, it->prev);
+		lua_pushcfunction(L, l_zfs_close);
+		lua_insert(L, -2);
+		lua_call(L, 1, 0);
 	}
-	lua_pushstring(L, property);
-	return (1);
+	luaL_unref(L, LUA_REGISTRYINDEX, it->prev);
+	it->prev = LUA_NOREF;
 }
 
 static int
-l_zfs_prop_get_numeric(lua_State *L)
+l_zfs_iter(lua_State *L)
 {
-	char sourcename[ZFS_MAX_DATASET_NAME_LEN];
+	struct zfsiter *it;
 	zfs_handle_t *zhp;
-	zfs_prop_t prop;
-	uint64_t value;
-	zprop_source_t source;
-	int error;
+	enum zfsiter_kind kind;
+	const char *snapspec;
+	lua_Integer batchsize;
+	uint64_t min_txg, max_txg;
+	boolean_t allowrecursion;
+	bool autoclose;
+	int flags;
 
 	zhp = checkzfs(L, 1);
-	prop = checkprop(L, 2);
+	kind = luaL_checkoption(L, 2, NULL, zfsiter_kinds);
+	flags = 0;
+	min_txg = max_txg = 0;
+	snapspec = NULL;
+	allowrecursion = B_FALSE;
+	autoclose = false;
+	batchsize = 64;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		if (lua_getfield(L, 3, "flags") != LUA_TNIL) {
+			flags = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 3, "min_txg") != LUA_TNIL) {
+			min_txg = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 3, "max_txg") != LUA_TNIL) {
+			max_txg = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 3, "snapspec") != LUA_TNIL) {
+			snapspec = luaL_checkstring(L, -1);
+		}
+		if (lua_getfield(L, 3, "allowrecursion") != LUA_TNIL) {
+			allowrecursion = lua_toboolean(L, -1);
+		}
+		if (lua_getfield(L, 3, "autoclose") != LUA_TNIL) {
+			autoclose = lua_toboolean(L, -1);
+		}
+		if (lua_getfield(L, 3, "batch") != LUA_TNIL) {
+			batchsize = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, batchsize > 0 && batchsize <= 65536, 3,
+			    "invalid batch");
+		}
+	}
+	luaL_argcheck(L, kind != ZFSITER_SNAPSPEC || snapspec != NULL, 3,
+	    "snapspec required");
 
-	if ((error = zfs_prop_get_numeric(zhp, prop, &value, &source,
-	    sourcename, sizeof(sourcename))) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get_numeric"));
+	if ((it = calloc(1, sizeof(*it) + batchsize * sizeof(*it->batch)))
+	    == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
 	}
-	lua_pushinteger(L, value);
-	lua_pushinteger(L, source);
-	if (*sourcename == '\0') {
-		return (2);
+	/* zfs_iter_snapspec_v2 modifies the spec */
+	if (snapspec != NULL && (it->snapspec = strdup(snapspec)) == NULL) {
+		free(it);
+		return (fatal(L, "strdup", ENOMEM));
 	}
-	lua_pushstring(L, sourcename);
-	return (3);
+	if ((it->zhp = zfs_handle_dup(zhp)) == NULL) {
+		free(it->snapspec);
+		free(it);
+		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_handle_dup"));
+	}
+	pthread_mutex_init(&it->lock, NULL);
+	pthread_cond_init(&it->cv, NULL);
+	it->kind = kind;
+	it->flags = flags;
+	it->min_txg = min_txg;
+	it->max_txg = max_txg;
+	it->allowrecursion = allowrecursion;
+	it->autoclose = autoclose;
+	it->prev = LUA_NOREF;
+	it->batchsize = batchsize;
+	new(L, it, ZFS_ITER_METATABLE);
+	/* it, nil, nil, it: a generic for closes the iterator on exit */
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_pushvalue(L, -3);
+	return (4);
 }
 
 static int
-l_zfs_prop_get_userquota_int(lua_State *L)
+l_zfs_iter_next(lua_State *L)
 {
+	struct zfsiter *it;
 	zfs_handle_t *zhp;
-	const char *propname;
-	uint64_t value;
 	int error;
 
-	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
-
-	if ((error = zfs_prop_get_userquota_int(zhp, propname, &value)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get_userquota_int"));
+	it = checkzfsiter(L, 1);
+
+	zfsiter_release_prev(L, it);
+	pthread_mutex_lock(&it->lock);
+	if (it->pos == it->count && !it->done) {
+		it->count = it->pos = 0;
+		it->want = true;
+		if (!it->started) {
+			if ((error = pthread_create(&it->thread, NULL,
+			    zfsiter_run, it)) != 0) {
+				it->want = false;
+				pthread_mutex_unlock(&it->lock);
+				return (fatal(L, "pthread_create", error));
+			}
+			it->started = true;
+		} else {
+			pthread_cond_broadcast(&it->cv);
+		}
+		while (it->want) {
+			pthread_cond_wait(&it->cv, &it->lock);
+		}
 	}
-	lua_pushinteger(L, value);
+	if (it->pos == it->count) {
+		error = it->error;
+		pthread_mutex_unlock(&it->lock);
+		if (error != 0) {
+			luaL_pushfail(L);
+			lua_pushfstring(L, "zfs_iter_%s_v2 failed",
+			    zfsiter_kinds[it->kind]);
+			return (2);
+		}
+		return (0);
+	}
+	zhp = it->batch[it->pos++];
+	pthread_mutex_unlock(&it->lock);
+	new(L, zhp, ZFS_HANDLE_METATABLE);
+	lua_pushvalue(L, -1);
+	it->prev = luaL_ref(L, LUA_REGISTRYINDEX);
 	return (1);
 }
 
 static int
-l_zfs_prop_get_userquota(lua_State *L)
+l_zfs_iter_call(lua_State *L)
 {
-	char value[ZFS_MAXPROPLEN];
-	zfs_handle_t *zhp;
-	const char *propname;
-	boolean_t literal;
-	int error;
+	int nresults;
 
-	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
-	literal = lua_toboolean(L, 3);
-
-	if ((error = zfs_prop_get_userquota(zhp, propname, value, sizeof(value),
-	    literal)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get_userquota"));
+	/* A for loop would silently stop on failure, so raise instead. */
+	if ((nresults = l_zfs_iter_next(L)) == 2) {
+		return (lua_error(L));
 	}
-	lua_pushstring(L, value);
-	return (1);
+	return (nresults);
+}
+
+static int
+l_zfs_iter_close(lua_State *L)
+{
+	struct zfsiter *it;
+
+	it = checkcookienull(L, 1, ZFS_ITER_METATABLE);
+
+	if (it == NULL) {
+		return (0);
+	}
+	zfsiter_release_prev(L, it);
+	if (it->started) {
+		pthread_mutex_lock(&it->lock);
+		it->cancel = true;
+		pthread_cond_broadcast(&it->cv);
+		pthread_mutex_unlock(&it->lock);
+		pthread_join(it->thread, NULL);
+	}
+	while (it->pos < it->count) {
+		zfs_close(it->batch[it->pos++]);
+	}
+	zfs_close(it->zhp);
+	pthread_cond_destroy(&it->cv);
+	pthread_mutex_destroy(&it->lock);
+	free(it->snapspec);
+	free(it);
+	setcookie(L, 1, NULL);
+	return (0);
 }
 
 static int
-l_zfs_prop_get_written_int(lua_State *L)
+l_zfs_wait_status(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *propname;
-	uint64_t value;
+	zfs_wait_activity_t activity;
+	boolean_t missing, waited;
 	int error;
 
 	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
+	activity = luaL_checkinteger(L, 2);
 
-	if ((error = zfs_prop_get_written_int(zhp, propname, &value)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get_written_int"));
+	if ((error = zfs_wait_status(zhp, activity, &missing, &waited)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_wait_status"));
 	}
-	lua_pushinteger(L, value);
-	return (1);
+	lua_pushboolean(L, missing);
+	lua_pushboolean(L, waited);
+	return (2);
 }
 
 static int
-l_zfs_prop_get_written(lua_State *L)
+l_zfs_crypto_get_encryption_root(lua_State *L)
 {
-	char value[ZFS_MAXPROPLEN];
+	char encroot[ZFS_MAX_DATASET_NAME_LEN];
 	zfs_handle_t *zhp;
-	const char *propname;
-	boolean_t literal;
+	boolean_t is_encroot;
 	int error;
 
 	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
-	literal = lua_toboolean(L, 3);
 
-	if ((error = zfs_prop_get_written(zhp, propname, value, sizeof(value),
-	    literal)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_get_written"));
+	if ((error = zfs_crypto_get_encryption_root(zhp, &is_encroot, encroot))
+	    != 0) {
+		return (zfsfail(L, zhp, error,
+		    "zfs_crypto_get_encryption_root"));
 	}
-	lua_pushstring(L, value);
-	return (1);
+	lua_pushboolean(L, is_encroot);
+	lua_pushstring(L, encroot);
+	return (2);
 }
 
 static int
-l_getprop_uint64(lua_State *L)
+l_zfs_crypto_load_key(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *source;
-	zfs_prop_t prop;
+	const char *alt_keylocation;
+	boolean_t noop;
+	int error;
 
 	zhp = checkzfs(L, 1);
-	prop = checkprop(L, 2);
+	noop = lua_toboolean(L, 2);
+	alt_keylocation = luaL_optstring(L, 3, NULL);
 
-	lua_pushinteger(L, getprop_uint64(zhp, prop, &source));
-	lua_pushstring(L, source);
-	return (2);
+	if ((error = zfs_crypto_load_key(zhp, noop, alt_keylocation)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_crypto_load_key"));
+	}
+	return (success(L));
 }
 
 static int
-l_zfs_prop_get_int(lua_State *L)
+l_zfs_crypto_unload_key(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	zfs_prop_t prop;
+	int error;
 
 	zhp = checkzfs(L, 1);
-	prop = checkprop(L, 2);
 
-	lua_pushinteger(L, zfs_prop_get_int(zhp, prop));
-	return (1);
+	if ((error = zfs_crypto_unload_key(zhp)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_crypto_unload_key"));
+	}
+	return (success(L));
 }
 
 static int
-l_zfs_prop_inherit(lua_State *L)
+l_zfs_crypto_rewrap(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *propname;
-	boolean_t received;
+	nvlist_t *raw_props;
+	boolean_t inherit_key;
 	int error;
 
 	zhp = checkzfs(L, 1);
-	propname = luaL_checkstring(L, 2);
-	received = lua_toboolean(L, 3);
+	raw_props = checknvlist(L, 2);
+	inherit_key = lua_toboolean(L, 3);
 
-	if ((error = zfs_prop_inherit(zhp, propname, received)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_prop_inherit"));
+	if ((error = zfs_crypto_rewrap(zhp, raw_props, inherit_key)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_crypto_rewrap"));
 	}
 	return (success(L));
 }
 
+#if __FreeBSD_version > 1500044
 static int
-l_zfs_get_all_props(lua_State *L)
+l_zfs_is_encrypted(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	nvlist_t *props;
-	int error;
 
 	zhp = checkzfs(L, 1);
 
-	/* XXX: Need to dup to have sane lifetime. */
-	if ((error = nvlist_dup(zfs_get_all_props(zhp), &props, 0)) != 0) {
-		return (fatal(L, "nvlist_dup", error));
-	}
-	pushnvlist(L, props);
+	lua_pushboolean(L, zfs_is_encrypted(zhp));
 	return (1);
 }
+#endif
 
 static int
-l_zfs_get_user_props(lua_State *L)
+l_zfs_destroy(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	nvlist_t *props;
+	boolean_t defer;
 	int error;
 
 	zhp = checkzfs(L, 1);
+	defer = lua_toboolean(L, 2);
 
-	/* XXX: Need to dup to have sane lifetime. */
-	if ((error = nvlist_dup(zfs_get_user_props(zhp), &props, 0)) != 0) {
-		return (fatal(L, "nvlist_dup", error));
+	if ((error = zfs_destroy(zhp, defer)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_destroy"));
 	}
-	pushnvlist(L, props);
-	return (1);
+	return (success(L));
 }
 
 static int
-l_zfs_get_recvd_props(lua_State *L)
+l_zfs_destroy_snaps(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	nvlist_t *props;
+	const char *snapname;
+	boolean_t defer;
 	int error;
 
 	zhp = checkzfs(L, 1);
+	snapname = luaL_checkstring(L, 2);
+	defer = lua_toboolean(L, 3);
 
-	if ((props = zfs_get_recvd_props(zhp)) == NULL) {
-		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_get_recvd_props"));
-	}
-	/* XXX: Need to dup to have sane lifetime. */
-	if ((error = nvlist_dup(props, &props, 0)) != 0) {
-		return (fatal(L, "nvlist_dup", error));
+	if ((error = zfs_destroy_snaps(zhp, __DECONST(char *, snapname), defer))
+	    != 0) {
+		return (zfsfail(L, zhp, error, "zfs_destroy_snaps"));
 	}
-	pushnvlist(L, props);
-	return (1);
+	return (success(L));
 }
 
 static int
-l_zfs_get_clones_nvl(lua_State *L)
+l_zfs_clone(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	nvlist_t *clones;
+	const char *target;
+	nvlist_t *props;
+	int error;
 
 	zhp = checkzfs(L, 1);
+	target = luaL_checkstring(L, 2);
+	props = optnvlist(L, 3, NULL);
 
-	if ((clones = zfs_get_clones_nvl(zhp)) == NULL) {
-		/* XXX: We don't get useful error info back. */
-		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_get_clones_nvl"));
+	if ((error = zfs_clone(zhp, target, props)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_clone"));
 	}
-	pushnvlist(L, clones);
-	return (1);
+	return (success(L));
 }
 
 static int
-l_zfs_iter_children(lua_State *L)
+l_zfs_rollback(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	int top = lua_gettop(L);
+	zfs_handle_t *zhp, *snap;
+	boolean_t force;
 	int error;
 
 	zhp = checkzfs(L, 1);
-	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
-
-	if ((error = zfs_iter_children(zhp, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	snap = checkzfs(L, 2);
+	force = lua_toboolean(L, 3);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_children failed");
-		return (2);
+	if ((error = zfs_rollback(zhp, snap, force)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_rollback"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_dependents(lua_State *L)
+l_zfs_rename(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	boolean_t allowrecursion;
-	int top, error;
+	const char *target;
+	renameflags_t flags;
+	int error;
+
+	memset(&flags, 0, sizeof(flags));
 
 	zhp = checkzfs(L, 1);
-	allowrecursion = lua_toboolean(L, 2);
-	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+	target = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+#define	FLAG(name) ({ \
+	lua_getfield(L, 3, #name); \
+	flags.name = lua_toboolean(L, -1); \
+	lua_pop(L, 1); \
+})
+	FLAG(forceunmount);
+	FLAG(nounmount);
+	FLAG(recursive);
+#undef FLAG
 
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	top = lua_gettop(L);
+	if ((error = zfs_rename(zhp, target, flags)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_rename"));
+	}
+	return (success(L));
+}
 
-	if ((error = zfs_iter_dependents(zhp, allowrecursion, zfs_iter_cb, L))
-	    != 0) {
-		int nresults = lua_gettop(L) - top;
+static boolean_t
+snapfilter_cb(zfs_handle_t *zhp, void *arg)
+{
+	lua_State *L = arg;
+	int nargs = lua_gettop(L) - 6;
+	boolean_t result;
+	int error;
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_dependents failed");
-		return (2);
+	/* Copy the function. */
+	lua_pushvalue(L, -nargs); /* hdl, cb, ..., cb */
+	new(L, zhp, ZFS_HANDLE_METATABLE); /* hdl, cb, ..., cb, zhp */
+	/* Copy any additional args. */
+	for (int i = 1; i < nargs; i++) {
+		lua_pushvalue(L, -nargs);
 	}
-	return (success(L));
+	if ((error = lua_pcall(L, nargs, 1, 0)) != LUA_OK) {
+		return (B_FALSE);
+	}
+	result = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return (result);
 }
 
 static int
-l_zfs_iter_filesystems(lua_State *L)
+l_zfs_send(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	int top = lua_gettop(L);
-	int error;
+	const char *fromsnap, *tosnap;
+	sendflags_t flags;
+	snapfilter_cb_t filter_func;
+	nvlist_t *dbg;
+	int outfd, error;
 
-	zhp = checkzfs(L, 1);
-	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
+	memset(&flags, 0, sizeof(flags));
+	dbg = NULL;
 
-	if ((error = zfs_iter_filesystems(zhp, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	zhp = checkzfs(L, 1);
+	fromsnap = luaL_optstring(L, 2, NULL);
+	tosnap = luaL_optstring(L, 3, NULL);
+	checksendflags(L, 4, &flags);
+	outfd = checkfd(L, 5);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_filesystems failed");
-		return (2);
+	if ((error = zfs_send(zhp, fromsnap, tosnap, &flags, outfd,
+	    lua_isfunction(L, 6) ? snapfilter_cb : NULL,
+	    lua_isfunction(L, 6) ? L : NULL,
+	    flags.verbosity >= 3 ? &dbg : NULL)) != 0) {
+		zfsfail(L, zhp, error, "zfs_send");
+		if (dbg != NULL) {
+			pushnvlist(L, dbg);
+			lua_replace(L, -3);
+		}
+		return (3);
+	}
+	if (dbg != NULL) {
+		pushnvlist(L, dbg);
+		return (1);
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_snapshots(lua_State *L)
+l_zfs_send_one(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	uint64_t min_txg, max_txg;
-	boolean_t simple;
-	int top, error;
-
-	zhp = checkzfs(L, 1);
-	simple = lua_toboolean(L, 2);
-	min_txg = luaL_optinteger(L, 3, 0);
-	max_txg = luaL_optinteger(L, 4, 0);
-	luaL_argcheck(L, lua_isfunction(L, 5), 5, "callback function required");
+	const char *fromsnap, *redactbook;
+	sendflags_t flags;
+	int outfd, error;
 
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-	lua_remove(L, 4);
-	top = lua_gettop(L);
+	memset(&flags, 0, sizeof(flags));
 
-	if ((error = zfs_iter_snapshots(zhp, simple, zfs_iter_cb, L, min_txg,
-	    max_txg)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	zhp = checkzfs(L, 1);
+	fromsnap = luaL_optstring(L, 2, NULL);
+	outfd = checkfd(L, 3);
+	checksendflags(L, 4, &flags);
+	redactbook = luaL_optstring(L, 5, NULL);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_snapshots failed");
-		return (2);
+	if ((error = zfs_send_one(zhp, fromsnap, outfd, &flags, redactbook))
+	    != 0) {
+		return (zfsfail(L, zhp, error, "zfs_send_one"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_snapshots_sorted(lua_State *L)
+l_zfs_send_progress(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	uint64_t min_txg, max_txg;
-	int top, error;
+	uint64_t bytes_written, blocks_visited;
+	int outfd, error;
 
 	zhp = checkzfs(L, 1);
-	min_txg = luaL_optinteger(L, 2, 0);
-	max_txg = luaL_optinteger(L, 3, 0);
-	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
-
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-	top = lua_gettop(L);
-
-	if ((error = zfs_iter_snapshots_sorted(zhp, zfs_iter_cb, L, min_txg,
-	    max_txg)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	outfd = checkfd(L, 2);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_snapshots_sorted failed");
-		return (2);
+	if ((error = zfs_send_progress(zhp, outfd, &bytes_written,
+	    &blocks_visited)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_send_progress"));
 	}
-	return (success(L));
+	lua_pushinteger(L, bytes_written);
+	lua_pushinteger(L, blocks_visited);
+	return (2);
 }
 
-/* XXX: this shouldn't be externally visible, please break */
-extern char *zfs_strdup(libzfs_handle_t *, const char *);
-
 static int
-l_zfs_iter_snapspec(lua_State *L)
+l_zfs_send_saved(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *snapspec;
-	char *snapspeccopy;
-	int top, error;
-
-	zhp = checkzfs(L, 1);
-	snapspec = luaL_checkstring(L, 2);
-	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+	sendflags_t flags;
+	const char *resume_token;
+	int outfd, error;
 
-	/* Massage the stack to fit zfs_iter_cb. */
-	snapspeccopy = zfs_strdup(zfs_get_handle(zhp), snapspec);
-	lua_remove(L, 2);
-	top = lua_gettop(L);
+	memset(&flags, 0, sizeof(flags));
 
-	error = zfs_iter_snapspec(zhp, snapspeccopy, zfs_iter_cb, L);
-	free(snapspeccopy);
-	if (error != 0) {
-		int nresults = lua_gettop(L) - top;
+	zhp = checkzfs(L, 1);
+	checksendflags(L, 2, &flags);
+	outfd = checkfd(L, 3);
+	resume_token = luaL_checkstring(L, 4);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_snapspec failed");
-		return (2);
+	if ((error = zfs_send_saved(zhp, &flags, outfd, resume_token)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_send_saved"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_bookmarks(lua_State *L)
+l_zfs_promote(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	int top = lua_gettop(L);
 	int error;
 
 	zhp = checkzfs(L, 1);
-	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
 
-	if ((error = zfs_iter_bookmarks(zhp, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
-
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_bookmarks failed");
-		return (2);
+	if ((error = zfs_promote(zhp)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_promote"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_children_v2(lua_State *L)
+l_zfs_hold(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	int flags, top, error;
+	const char *snapname, *tag;
+	boolean_t recursive;
+	int cleanup_fd, error;
 
 	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
-
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	top = lua_gettop(L);
-
-	if ((error = zfs_iter_children_v2(zhp, flags, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	snapname = luaL_checkstring(L, 2);
+	tag = luaL_checkstring(L, 3);
+	recursive = lua_toboolean(L, 4);
+	cleanup_fd = checkfd(L, 5);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_children_v2 failed");
-		return (2);
+	if ((error = zfs_hold(zhp, snapname, tag, recursive, cleanup_fd))
+	    != 0) {
+		return (zfsfail(L, zhp, error, "zfs_hold"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_dependents_v2(lua_State *L)
+l_zfs_hold_nvl(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	boolean_t allowrecursion;
-	int flags, top, error;
+	nvlist_t *nvl;
+	int cleanup_fd, error;
 
 	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	allowrecursion = lua_toboolean(L, 3);
-	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
-
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-	top = lua_gettop(L);
-
-	if ((error = zfs_iter_dependents_v2(zhp, flags, allowrecursion,
-	    zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	cleanup_fd = checkfd(L, 2);
+	nvl = checknvlist(L, 3);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_dependents_v2 failed");
-		return (2);
+	if ((error = zfs_hold_nvl(zhp, cleanup_fd, nvl)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_hold_nvl"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_filesystems_v2(lua_State *L)
+l_zfs_release(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	int flags, top, error;
+	const char *snapname, *tag;
+	boolean_t recursive;
+	int error;
 
 	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
-
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	top = lua_gettop(L);
-
-	if ((error = zfs_iter_filesystems_v2(zhp, flags, zfs_iter_cb, L))
-	    != 0) {
-		int nresults = lua_gettop(L) - top;
+	snapname = luaL_checkstring(L, 2);
+	tag = luaL_checkstring(L, 3);
+	recursive = lua_toboolean(L, 4);
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_filesystems_v2 failed");
-		return (2);
+	if ((error = zfs_release(zhp, snapname, tag, recursive)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_release"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_iter_snapshots_v2(lua_State *L)
+l_zfs_get_holds(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	uint64_t min_txg, max_txg;
-	int flags, top, error;
+	nvlist_t *holds;
+	int error;
 
 	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	min_txg = luaL_optinteger(L, 3, 0);
-	max_txg = luaL_optinteger(L, 4, 0);
-	luaL_argcheck(L, lua_isfunction(L, 5), 5, "callback function required");
 
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-	lua_remove(L, 4);
-	top = lua_gettop(L);
+	if ((error = zfs_get_holds(zhp, &holds)) != 0) {
+		ASSERT0P(holds);
+		return (zfsfail(L, zhp, error, "zfs_get_holds"));
+	}
+	ASSERT3P(holds, !=, NULL);
+	pushnvlist(L, holds);
+	return (1);
+}
 
-	if ((error = zfs_iter_snapshots_v2(zhp, flags, zfs_iter_cb, L, min_txg,
-	    max_txg)) != 0) {
-		int nresults = lua_gettop(L) - top;
+/*
+ * Quota reports: entries from zfs_userspace() are collected in C and
+ * optionally folded across a subtree before any of them reach Lua, so a
+ * dataset with many users costs one pass instead of a call per entry.
+ */
+
+struct uspace_entry {
+	zfs_userquota_prop_t type;
+	const char *domain;	/* interned in uspace.domains */
+	uid_t rid;
+	uint64_t value;
+	int dataset;		/* index into uspace.datasets, or -1 */
+};
+
+struct uspace {
+	lua_State *L;
+	int errors;	/* stack index of the errors sequence */
+	lua_Integer nerrors;
+	bool recursive;
+	bool fold;
+	zfs_userquota_prop_t type;
+	int dataset;
+	int error;
+	struct uspace_entry *entries;
+	size_t nentries, maxentries;
+	char **domains;
+	size_t ndomains, maxdomains;
+	char **datasets;
+	size_t ndatasets, maxdatasets;
+};
+
+static const char *
+uspace_intern(struct uspace *us, const char *domain)
+{
+	char **domains, *copy;
+
+	if (domain == NULL || domain[0] == '\0') {
+		return ("");
+	}
+	/* There are only ever a handful of SMB domains. */
+	for (size_t i = 0; i < us->ndomains; i++) {
+		if (strcmp(us->domains[i], domain) == 0) {
+			return (us->domains[i]);
+		}
+	}
+	if (us->ndomains == us->maxdomains) {
+		size_t maxdomains = MAX(us->maxdomains * 2, 4);
 
-		if (nresults > 0) {
-			return (nresults);
+		if ((domains = reallocarray(us->domains, maxdomains,
+		    sizeof(*domains))) == NULL) {
+			return (NULL);
 		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_snapshots_v2 failed");
-		return (2);
+		us->domains = domains;
+		us->maxdomains = maxdomains;
 	}
-	return (success(L));
+	if ((copy = strdup(domain)) == NULL) {
+		return (NULL);
+	}
+	us->domains[us->ndomains++] = copy;
+	return (copy);
 }
 
 static int
-l_zfs_iter_snapshots_sorted_v2(lua_State *L)
+uspace_cb(void *arg, const char *domain, uid_t rid, uint64_t space
+#if __FreeBSD_version > 1500039
+    , uint64_t default_quota __unused
+#endif
+    )
 {
-	zfs_handle_t *zhp;
-	uint64_t min_txg, max_txg;
-	int flags, top, error;
+	struct uspace *us = arg;
+	struct uspace_entry *entries, *ent;
 
-	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	min_txg = luaL_optinteger(L, 3, 0);
-	max_txg = luaL_optinteger(L, 4, 0);
-	luaL_argcheck(L, lua_isfunction(L, 5), 5, "callback function required");
+	if (us->nentries == us->maxentries) {
+		size_t maxentries = MAX(us->maxentries * 2, 64);
 
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-	lua_remove(L, 4);
-	top = lua_gettop(L);
+		if ((entries = reallocarray(us->entries, maxentries,
+		    sizeof(*entries))) == NULL) {
+			us->error = ENOMEM;
+			return (ENOMEM);
+		}
+		us->entries = entries;
+		us->maxentries = maxentries;
+	}
+	ent = &us->entries[us->nentries];
+	if ((ent->domain = uspace_intern(us, domain)) == NULL) {
+		us->error = ENOMEM;
+		return (ENOMEM);
+	}
+	ent->type = us->type;
+	ent->rid = rid;
+	ent->value = space;
+	ent->dataset = us->dataset;
+	us->nentries++;
+	return (0);
+}
 
-	if ((error = zfs_iter_snapshots_sorted_v2(zhp, flags, zfs_iter_cb, L,
-	    min_txg, max_txg)) != 0) {
-		int nresults = lua_gettop(L) - top;
+static void
+uspace_error(struct uspace *us, const char *name, libzfs_handle_t *hdl,
+    int error, const char *what)
+{
+	lua_State *L = us->L;
 
-		if (nresults > 0) {
-			return (nresults);
-		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_snapshots_sorted_v2 failed");
-		return (2);
+	lua_createtable(L, 0, 3);
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "name");
+	if (error == ENOMEM) {
+		lua_pushfstring(L, "%s: %s", what, strerror(error));
+	} else {
+		lua_pushfstring(L, "%s: %s", what,
+		    libzfs_error_description(hdl));
+		error = libzfs_errno(hdl);
 	}
-	return (success(L));
+	lua_setfield(L, -2, "errmsg");
+	lua_pushinteger(L, error);
+	lua_setfield(L, -2, "errno");
+	lua_rawseti(L, us->errors, ++us->nerrors);
 }
 
 static int
-l_zfs_iter_snapspec_v2(lua_State *L)
+uspace_collect(zfs_handle_t *zhp, void *arg)
 {
-	zfs_handle_t *zhp;
-	const char *snapspec;
-	char *snapspeccopy;
-	int flags, top, error;
-
-	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	snapspec = luaL_checkstring(L, 3);
-	luaL_argcheck(L, lua_isfunction(L, 4), 4, "callback function required");
-
-	/* Massage the stack to fit zfs_iter_cb. */
-	snapspeccopy = zfs_strdup(zfs_get_handle(zhp), snapspec);
-	lua_remove(L, 2);
-	lua_remove(L, 3);
-	top = lua_gettop(L);
-
-	error = zfs_iter_snapspec_v2(zhp, flags, snapspeccopy, zfs_iter_cb, L);
-	free(snapspeccopy);
-	if (error != 0) {
-		int nresults = lua_gettop(L) - top;
+	struct uspace *us = arg;
+	char **datasets;
+	const char *name;
+	int error;
 
-		if (nresults > 0) {
-			return (nresults);
+	name = zfs_get_name(zhp);
+	us->dataset = -1;
+	if (!us->fold) {
+		if (us->ndatasets == us->maxdatasets) {
+			size_t maxdatasets = MAX(us->maxdatasets * 2, 16);
+
+			if ((datasets = reallocarray(us->datasets,
+			    maxdatasets, sizeof(*datasets))) == NULL) {
+				us->error = ENOMEM;
+				goto out;
+			}
+			us->datasets = datasets;
+			us->maxdatasets = maxdatasets;
+		}
+		if ((us->datasets[us->ndatasets] = strdup(name)) == NULL) {
+			us->error = ENOMEM;
+			goto out;
+		}
+		us->dataset = us->ndatasets++;
+	}
+	for (int i = 1; i <= luaL_len(us->L, 2); i++) {
+		lua_rawgeti(us->L, 2, i);
+		us->type = lua_tointeger(us->L, -1);
+		lua_pop(us->L, 1);
+		if ((error = zfs_userspace(zhp, us->type, uspace_cb, us))
+		    != 0) {
+			uspace_error(us, name, zfs_get_handle(zhp), us->error,
+			    "zfs_userspace");
+			if (us->error != 0) {
+				goto out;
+			}
 		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_snapspec_v2 failed");
-		return (2);
 	}
-	return (success(L));
+	if (us->recursive &&
+	    zfs_iter_filesystems_v2(zhp, 0, uspace_collect, us) != 0 &&
+	    us->error == 0) {
+		uspace_error(us, name, zfs_get_handle(zhp), 0,
+		    "zfs_iter_filesystems_v2");
+	}
+out:
+	zfs_close(zhp);
+	/* Stop iterating once out of memory. */
+	return (us->error);
 }
 
 static int
-l_zfs_iter_bookmarks_v2(lua_State *L)
+uspace_compare(const void *a, const void *b)
 {
-	zfs_handle_t *zhp;
-	int flags, top, error;
-
-	zhp = checkzfs(L, 1);
-	flags = luaL_checkinteger(L, 2);
-	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+	const struct uspace_entry *x = a, *y = b;
+	int cmp;
 
-	/* Massage the stack to fit zfs_iter_cb. */
-	lua_remove(L, 2);
-	top = lua_gettop(L);
+	if (x->type != y->type) {
+		return (x->type < y->type ? -1 : 1);
+	}
+	if (x->domain != y->domain &&
+	    (cmp = strcmp(x->domain, y->domain)) != 0) {
+		return (cmp);
+	}
+	if (x->rid != y->rid) {
+		return (x->rid < y->rid ? -1 : 1);
+	}
+	return (0);
+}
 
-	if ((error = zfs_iter_bookmarks_v2(zhp, flags, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
+static inline bool
+uspace_isquota(zfs_userquota_prop_t type)
+{
+	switch (type) {
+	case ZFS_PROP_USERQUOTA:
+	case ZFS_PROP_GROUPQUOTA:
+	case ZFS_PROP_USEROBJQUOTA:
+	case ZFS_PROP_GROUPOBJQUOTA:
+	case ZFS_PROP_PROJECTQUOTA:
+	case ZFS_PROP_PROJECTOBJQUOTA:
+		return (true);
+	default:
+		return (false);
+	}
+}
 
-		if (nresults > 0) {
-			return (nresults);
+/*
+ * Merge entries for the same (type, domain, rid): usage adds up, and the
+ * smallest quota is the one that binds first.
+ */
+static void
+uspace_fold(struct uspace *us)
+{
+	struct uspace_entry *out, *ent;
+
+	if (us->nentries == 0) {
+		return;
+	}
+	qsort(us->entries, us->nentries, sizeof(*us->entries),
+	    uspace_compare);
+	out = us->entries;
+	for (size_t i = 1; i < us->nentries; i++) {
+		ent = &us->entries[i];
+		if (uspace_compare(out, ent) != 0) {
+			*++out = *ent;
+		} else if (!uspace_isquota(ent->type)) {
+			out->value += ent->value;
+		} else if (ent->value != 0 &&
+		    (out->value == 0 || ent->value < out->value)) {
+			out->value = ent->value;
 		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_bookmarks_v2 failed");
-		return (2);
 	}
-	return (success(L));
+	us->nentries = out - us->entries + 1;
+}
+
+static void
+uspace_free(struct uspace *us)
+{
+	for (size_t i = 0; i < us->ndomains; i++) {
+		free(us->domains[i]);
+	}
+	for (size_t i = 0; i < us->ndatasets; i++) {
+		free(us->datasets[i]);
+	}
+	free(us->domains);
+	free(us->datasets);
+	free(us->entries);
 }
 
 static int
-l_zfs_iter_mounted(lua_State *L)
+l_zfs_userspace(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	int top = lua_gettop(L);
-	int error;
+	struct uspace us;
+	zfs_handle_t *zhp, *dupzhp;
+	int result, columns, ncolumns;
 
 	zhp = checkzfs(L, 1);
-	luaL_argcheck(L, lua_isfunction(L, 2), 2, "callback function required");
-
-	if ((error = zfs_iter_mounted(zhp, zfs_iter_cb, L)) != 0) {
-		int nresults = lua_gettop(L) - top;
+	memset(&us, 0, sizeof(us));
+	us.L = L;
+	us.fold = true;
+	lua_settop(L, 3);
+	if (lua_isinteger(L, 2)) {
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, 2);
+		lua_rawseti(L, -2, 1);
+		lua_replace(L, 2);
+	}
+	luaL_checktype(L, 2, LUA_TTABLE);
+	for (int i = 1; i <= luaL_len(L, 2); i++) {
+		lua_Integer type;
+
+		lua_rawgeti(L, 2, i);
+		type = luaL_checkinteger(L, -1);
+		luaL_argcheck(L, type >= 0 && type < ZFS_NUM_USERQUOTA_PROPS,
+		    2, "invalid type");
+		lua_pop(L, 1);
+	}
+	if (!lua_isnil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		if (lua_getfield(L, 3, "recursive") != LUA_TNIL) {
+			us.recursive = lua_toboolean(L, -1);
+		}
+		if (lua_getfield(L, 3, "fold") != LUA_TNIL) {
+			us.fold = lua_toboolean(L, -1);
+		}
+		lua_pop(L, 2);
+	}
+	if (!us.recursive) {
+		/* Entries of a single dataset are already unique. */
+		us.fold = false;
+	}
 
-		if (nresults > 0) {
-			return (nresults);
+	if ((dupzhp = zfs_handle_dup(zhp)) == NULL) {
+		return (zfsfail(L, zhp, EZFS_UNKNOWN, "zfs_handle_dup"));
+	}
+	lua_createtable(L, 0, 6);
+	result = lua_gettop(L);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, result, "errors");
+	us.errors = lua_gettop(L);
+
+	/* uspace_collect() closes the handles it is given. */
+	(void)uspace_collect(dupzhp, &us);
+	if (us.fold) {
+		uspace_fold(&us);
+	}
+
+	ncolumns = us.fold || !us.recursive ? 4 : 5;
+	columns = lua_gettop(L) + 1;
+	for (int i = 0; i < ncolumns; i++) {
+		static const char *names[] = {
+			"type", "domain", "rid", "value", "dataset",
+		};
+
+		lua_createtable(L, us.nentries, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, result, names[i]);
+	}
+	for (size_t i = 0; i < us.nentries; i++) {
+		struct uspace_entry *ent = &us.entries[i];
+
+		lua_pushinteger(L, ent->type);
+		lua_rawseti(L, columns, i + 1);
+		lua_pushstring(L, ent->domain);
+		lua_rawseti(L, columns + 1, i + 1);
+		lua_pushinteger(L, ent->rid);
+		lua_rawseti(L, columns + 2, i + 1);
+		lua_pushinteger(L, ent->value);
+		lua_rawseti(L, columns + 3, i + 1);
+		if (ncolumns == 5) {
+			lua_pushstring(L, us.datasets[ent->dataset]);
+			lua_rawseti(L, columns + 4, i + 1);
 		}
-		/* XXX: We don't get useful error info back. */
-		luaL_pushfail(L);
-		lua_pushliteral(L, "zfs_iter_mounted failed");
-		return (2);
 	}
-	return (success(L));
+	uspace_free(&us);
+	lua_pushvalue(L, result);
+	return (1);
 }
 
 static int
-l_zfs_wait_status(lua_State *L)
+l_zfs_refresh_properties(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	zfs_wait_activity_t activity;
-	boolean_t missing, waited;
-	int error;
 
 	zhp = checkzfs(L, 1);
-	activity = luaL_checkinteger(L, 2);
 
-	if ((error = zfs_wait_status(zhp, activity, &missing, &waited)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_wait_status"));
-	}
-	lua_pushboolean(L, missing);
-	lua_pushboolean(L, waited);
-	return (2);
+	zfs_refresh_properties(zhp);
+	return (0);
 }
 
 static int
-l_zfs_crypto_get_encryption_root(lua_State *L)
+l_zfs_parent_name(lua_State *L)
 {
-	char encroot[ZFS_MAX_DATASET_NAME_LEN];
+	char parent[ZFS_MAX_DATASET_NAME_LEN];
 	zfs_handle_t *zhp;
-	boolean_t is_encroot;
 	int error;
 
+	parent[0] = '\0';
+
 	zhp = checkzfs(L, 1);
 
-	if ((error = zfs_crypto_get_encryption_root(zhp, &is_encroot, encroot))
-	    != 0) {
-		return (zfsfail(L, zhp, error,
-		    "zfs_crypto_get_encryption_root"));
+	if ((error = zfs_parent_name(zhp, parent, sizeof(parent))) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_parent_name"));
 	}
-	lua_pushboolean(L, is_encroot);
-	lua_pushstring(L, encroot);
-	return (2);
+	lua_pushstring(L, parent);
+	return (1);
 }
 
 static int
-l_zfs_crypto_load_key(lua_State *L)
+l_zfs_spa_version(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *alt_keylocation;
-	boolean_t noop;
-	int error;
+	int version, error;
 
 	zhp = checkzfs(L, 1);
-	noop = lua_toboolean(L, 2);
-	alt_keylocation = luaL_optstring(L, 3, NULL);
 
-	if ((error = zfs_crypto_load_key(zhp, noop, alt_keylocation)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_crypto_load_key"));
+	if ((error = zfs_spa_version(zhp, &version)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_spa_version"));
 	}
-	return (success(L));
+	lua_pushinteger(L, version);
+	return (1);
 }
 
 static int
-l_zfs_crypto_unload_key(lua_State *L)
+l_zfs_is_mounted(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	int error;
+	char *where;
 
 	zhp = checkzfs(L, 1);
 
-	if ((error = zfs_crypto_unload_key(zhp)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_crypto_unload_key"));
+	if (zfs_is_mounted(zhp, &where)) {
+		lua_pushboolean(L, B_TRUE);
+		lua_pushstring(L, where);
+		free(where);
+		return (2);
 	}
-	return (success(L));
+	lua_pushboolean(L, B_FALSE);
+	return (1);
 }
 
 static int
-l_zfs_crypto_rewrap(lua_State *L)
+l_zfs_mount(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	nvlist_t *raw_props;
-	boolean_t inherit_key;
-	int error;
+	const char *options;
+	int flags, error;
 
 	zhp = checkzfs(L, 1);
-	raw_props = checknvlist(L, 2);
-	inherit_key = lua_toboolean(L, 3);
+	options = luaL_optstring(L, 2, NULL);
+	flags = luaL_optinteger(L, 3, 0);
 
-	if ((error = zfs_crypto_rewrap(zhp, raw_props, inherit_key)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_crypto_rewrap"));
+	if ((error = zfs_mount(zhp, options, flags)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_mount"));
 	}
 	return (success(L));
 }
 
-#if __FreeBSD_version > 1500044
 static int
-l_zfs_is_encrypted(lua_State *L)
+l_zfs_mount_at(lua_State *L)
 {
 	zfs_handle_t *zhp;
+	const char *options, *mountpoint;
+	int flags, error;
 
 	zhp = checkzfs(L, 1);
+	options = luaL_optstring(L, 2, NULL);
+	flags = luaL_optinteger(L, 3, 0);
+	mountpoint = luaL_checkstring(L, 4);
 
-	lua_pushboolean(L, zfs_is_encrypted(zhp));
-	return (1);
+	if ((error = zfs_mount_at(zhp, options, flags, mountpoint)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_mount_at"));
+	}
+	return (success(L));
 }
-#endif
 
 static int
-l_zfs_destroy(lua_State *L)
+l_zfs_unmount(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	boolean_t defer;
-	int error;
+	const char *mountpoint;
+	int flags, error;
 
 	zhp = checkzfs(L, 1);
-	defer = lua_toboolean(L, 2);
+	mountpoint = luaL_optstring(L, 2, NULL);
+	flags = luaL_optinteger(L, 3, 0);
 
-	if ((error = zfs_destroy(zhp, defer)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_destroy"));
+	if ((error = zfs_unmount(zhp, mountpoint, flags)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_unmount"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_destroy_snaps(lua_State *L)
+l_zfs_unmountall(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *snapname;
-	boolean_t defer;
-	int error;
+	int flags, error;
 
 	zhp = checkzfs(L, 1);
-	snapname = luaL_checkstring(L, 2);
-	defer = lua_toboolean(L, 3);
+	flags = luaL_optinteger(L, 2, 0);
 
-	if ((error = zfs_destroy_snaps(zhp, __DECONST(char *, snapname), defer))
-	    != 0) {
-		return (zfsfail(L, zhp, error, "zfs_destroy_snaps"));
+	if ((error = zfs_unmountall(zhp, flags)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_unmountall"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_clone(lua_State *L)
+l_zfs_jail(lua_State *L)
 {
 	zfs_handle_t *zhp;
-	const char *target;
-	nvlist_t *props;
-	int error;
+	int jid, attach, error;
 
 	zhp = checkzfs(L, 1);
-	target = luaL_checkstring(L, 2);
-	props = optnvlist(L, 3, NULL);
+	jid = luaL_checkinteger(L, 2);
+	attach = lua_toboolean(L, 3);
 
-	if ((error = zfs_clone(zhp, target, props)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_clone"));
+	if ((error = zfs_jail(zhp, jid, attach)) != 0) {
+		return (zfsfail(L, zhp, error, "zfs_jail"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_rollback(lua_State *L)
+l_zpool_close(lua_State *L)
 {
-	zfs_handle_t *zhp, *snap;
-	boolean_t force;
-	int error;
+	zpool_handle_t *zhp;
 
-	zhp = checkzfs(L, 1);
-	snap = checkzfs(L, 2);
-	force = lua_toboolean(L, 3);
+	zhp = checkcookienull(L, 1, ZPOOL_HANDLE_METATABLE);
 
-	if ((error = zfs_rollback(zhp, snap, force)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_rollback"));
+	if (zhp != NULL) {
+		zpool_close(zhp);
+		setcookie(L, 1, NULL);
 	}
-	return (success(L));
+	return (0);
 }
 
 static int
-l_zfs_rename(lua_State *L)
+l_zpool_get_name(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *target;
-	renameflags_t flags;
-	int error;
-
-	memset(&flags, 0, sizeof(flags));
+	zpool_handle_t *zhp;
 
-	zhp = checkzfs(L, 1);
-	target = luaL_checkstring(L, 2);
-	luaL_checktype(L, 3, LUA_TTABLE);
-#define	FLAG(name) ({ \
-	lua_getfield(L, 3, #name); \
-	flags.name = lua_toboolean(L, -1); \
-	lua_pop(L, 1); \
-})
-	FLAG(forceunmount);
-	FLAG(nounmount);
-	FLAG(recursive);
-#undef FLAG
+	zhp = checkzpool(L, 1);
 
-	if ((error = zfs_rename(zhp, target, flags)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_rename"));
-	}
-	return (success(L));
+	lua_pushstring(L, zpool_get_name(zhp));
+	return (1);
 }
 
-static boolean_t
-snapfilter_cb(zfs_handle_t *zhp, void *arg)
+static int
+l_zpool_get_state(lua_State *L)
 {
-	lua_State *L = arg;
-	int nargs = lua_gettop(L) - 6;
-	boolean_t result;
-	int error;
+	zpool_handle_t *zhp;
 
-	/* Copy the function. */
-	lua_pushvalue(L, -nargs); /* hdl, cb, ..., cb */
-	new(L, zhp, ZFS_HANDLE_METATABLE); /* hdl, cb, ..., cb, zhp */
-	/* Copy any additional args. */
-	for (int i = 1; i < nargs; i++) {
-		lua_pushvalue(L, -nargs);
-	}
-	if ((error = lua_pcall(L, nargs, 1, 0)) != LUA_OK) {
-		return (B_FALSE);
-	}
-	result = lua_toboolean(L, -1);
-	lua_pop(L, 1);
-	return (result);
+	zhp = checkzpool(L, 1);
+
+	lua_pushinteger(L, zpool_get_state(zhp));
+	return (1);
 }
 
 static int
-l_zfs_send(lua_State *L)
+l_zpool_get_state_str(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *fromsnap, *tosnap;
-	sendflags_t flags;
-	snapfilter_cb_t filter_func;
-	nvlist_t *dbg;
-	int outfd, error;
-
-	memset(&flags, 0, sizeof(flags));
-	dbg = NULL;
+	zpool_handle_t *zhp;
 
-	zhp = checkzfs(L, 1);
-	fromsnap = luaL_optstring(L, 2, NULL);
-	tosnap = luaL_optstring(L, 3, NULL);
-	checksendflags(L, 4, &flags);
-	outfd = checkfd(L, 5);
+	zhp = checkzpool(L, 1);
 
-	if ((error = zfs_send(zhp, fromsnap, tosnap, &flags, outfd,
-	    lua_isfunction(L, 6) ? snapfilter_cb : NULL,
-	    lua_isfunction(L, 6) ? L : NULL,
-	    flags.verbosity >= 3 ? &dbg : NULL)) != 0) {
-		zfsfail(L, zhp, error, "zfs_send");
-		if (dbg != NULL) {
-			pushnvlist(L, dbg);
-			lua_replace(L, -3);
-		}
-		return (3);
-	}
-	if (dbg != NULL) {
-		pushnvlist(L, dbg);
-		return (1);
-	}
-	return (success(L));
+	lua_pushstring(L, zpool_get_state_str(zhp));
+	return (1);
 }
 
 static int
-l_zfs_send_one(lua_State *L)
+l_zpool_get_status(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *fromsnap, *redactbook;
-	sendflags_t flags;
-	int outfd, error;
-
-	memset(&flags, 0, sizeof(flags));
+	zpool_handle_t *zhp;
+	const char *msgid;
+	zpool_errata_t errata;
+	zpool_status_t status;
 
-	zhp = checkzfs(L, 1);
-	fromsnap = luaL_optstring(L, 2, NULL);
-	outfd = checkfd(L, 3);
-	checksendflags(L, 4, &flags);
-	redactbook = luaL_optstring(L, 5, NULL);
+	zhp = checkzpool(L, 1);
 
-	if ((error = zfs_send_one(zhp, fromsnap, outfd, &flags, redactbook))
-	    != 0) {
-		return (zfsfail(L, zhp, error, "zfs_send_one"));
+	status = zpool_get_status(zhp, &msgid, &errata);
+	lua_pushinteger(L, status);
+	if (msgid == NULL) {
+		lua_pushnil(L);
+	} else {
+		lua_pushstring(L, msgid);
 	}
-	return (success(L));
+	if (status == ZPOOL_STATUS_ERRATA) {
+		lua_pushinteger(L, errata);
+		return (3);
+	}
+	return (2);
 }
 
 static int
-l_zfs_send_progress(lua_State *L)
+l_zpool_wait(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	uint64_t bytes_written, blocks_visited;
-	int outfd, error;
+	zpool_handle_t *zhp;
+	zpool_wait_activity_t activity;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	outfd = checkfd(L, 2);
+	zhp = checkzpool(L, 1);
+	activity = luaL_checkinteger(L, 2);
 
-	if ((error = zfs_send_progress(zhp, outfd, &bytes_written,
-	    &blocks_visited)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_send_progress"));
+	if ((error = zpool_wait(zhp, activity)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_wait"));
 	}
-	lua_pushinteger(L, bytes_written);
-	lua_pushinteger(L, blocks_visited);
-	return (2);
+	return (success(L));
 }
 
 static int
-l_zfs_send_saved(lua_State *L)
+l_zpool_wait_status(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	sendflags_t flags;
-	const char *resume_token;
-	int outfd, error;
-
-	memset(&flags, 0, sizeof(flags));
+	zpool_handle_t *zhp;
+	zpool_wait_activity_t activity;
+	boolean_t missing, waited;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	checksendflags(L, 2, &flags);
-	outfd = checkfd(L, 3);
-	resume_token = luaL_checkstring(L, 4);
+	zhp = checkzpool(L, 1);
+	activity = luaL_checkinteger(L, 2);
 
-	if ((error = zfs_send_saved(zhp, &flags, outfd, resume_token)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_send_saved"));
+	if ((error = zpool_wait_status(zhp, activity, &missing, &waited))
+	    != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_wait_status"));
 	}
-	return (success(L));
+	lua_pushboolean(L, waited);
+	lua_pushboolean(L, missing);
+	return (2);
 }
 
 static int
-l_zfs_promote(lua_State *L)
+l_zpool_destroy(lua_State *L)
 {
-	zfs_handle_t *zhp;
+	zpool_handle_t *zhp;
+	const char *message;
 	int error;
 
-	zhp = checkzfs(L, 1);
+	zhp = checkzpool(L, 1);
+	message = luaL_checkstring(L, 2);
 
-	if ((error = zfs_promote(zhp)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_promote"));
+	if ((error = zpool_destroy(zhp, message)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_destroy"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_hold(lua_State *L)
+l_zpool_add(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *snapname, *tag;
-	boolean_t recursive;
-	int cleanup_fd, error;
+	zpool_handle_t *zhp;
+	nvlist_t *nvroot;
+	boolean_t check_ashift;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	snapname = luaL_checkstring(L, 2);
-	tag = luaL_checkstring(L, 3);
-	recursive = lua_toboolean(L, 4);
-	cleanup_fd = checkfd(L, 5);
+	zhp = checkzpool(L, 1);
+	nvroot = checknvlist(L, 2);
+	check_ashift = lua_toboolean(L, 3);
 
-	if ((error = zfs_hold(zhp, snapname, tag, recursive, cleanup_fd))
-	    != 0) {
-		return (zfsfail(L, zhp, error, "zfs_hold"));
+	if ((error = zpool_add(zhp, nvroot, check_ashift)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_add"));
 	}
 	return (success(L));
 }
 
 static int
-l_zfs_hold_nvl(lua_State *L)
+l_zpool_scan(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	nvlist_t *nvl;
-	int cleanup_fd, error;
-
-	zhp = checkzfs(L, 1);
-	cleanup_fd = checkfd(L, 2);
-	nvl = checknvlist(L, 3);
+	zpool_handle_t *zhp;
+	pool_scan_func_t func;
+	pool_scrub_cmd_t cmd;
+	int error;
 
-	if ((error = zfs_hold_nvl(zhp, cleanup_fd, nvl)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_hold_nvl"));
+	zhp = checkzpool(L, 1);
+	func = luaL_checkinteger(L, 2);
+	cmd = luaL_checkinteger(L, 3);
+
+	if ((error = zpool_scan(zhp, func, cmd)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_scan"));
 	}
 	return (success(L));
 }
 
+#if __FreeBSD_version > 1500056
 static int
-l_zfs_release(lua_State *L)
+l_zpool_scan_range(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *snapname, *tag;
-	boolean_t recursive;
+	zpool_handle_t *zhp;
+	pool_scan_func_t func;
+	pool_scrub_cmd_t cmd;
+	time_t date_start, date_end;
 	int error;
 
-	zhp = checkzfs(L, 1);
-	snapname = luaL_checkstring(L, 2);
-	tag = luaL_checkstring(L, 3);
-	recursive = lua_toboolean(L, 4);
+	zhp = checkzpool(L, 1);
+	func = luaL_checkinteger(L, 2);
+	cmd = luaL_checkinteger(L, 3);
+	date_start = luaL_optinteger(L, 4, 0);
+	date_end = luaL_optinteger(L, 5, 0);
 
-	if ((error = zfs_release(zhp, snapname, tag, recursive)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_release"));
+	if ((error = zpool_scan_range(zhp, func, cmd, date_start, date_end))
+	    != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_scan_range"));
 	}
 	return (success(L));
 }
+#endif
 
+#if __FreeBSD_version > 1500056
 static int
-l_zfs_get_holds(lua_State *L)
+l_zpool_initialize_one(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	nvlist_t *holds;
+	zpool_handle_t *zhp;
+	initialize_cbdata_t cbdata;
 	int error;
 
-	zhp = checkzfs(L, 1);
+	memset(&cbdata, 0, sizeof(cbdata));
 
-	if ((error = zfs_get_holds(zhp, &holds)) != 0) {
-		ASSERT0P(holds);
-		return (zfsfail(L, zhp, error, "zfs_get_holds"));
-	}
-	ASSERT3P(holds, !=, NULL);
-	pushnvlist(L, holds);
-	return (1);
-}
+	zhp = checkzpool(L, 1);
+	cbdata.cmd_type = luaL_checkinteger(L, 2);
+	cbdata.wait = lua_toboolean(L, 3);
 
-#if 0 /* TODO */
-static int
-l_zfs_userspace(lua_State *L)
-{
+	if ((error = zpool_initialize_one(zhp, &cbdata)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_initialize_one"));
+	}
+	return (success(L));
 }
 #endif
 
 static int
-l_zfs_refresh_properties(lua_State *L)
+l_zpool_initialize(lua_State *L)
 {
-	zfs_handle_t *zhp;
+	zpool_handle_t *zhp;
+	pool_initialize_func_t cmd_type;
+	nvlist_t *vdevs;
+	int error;
 
-	zhp = checkzfs(L, 1);
+	zhp = checkzpool(L, 1);
+	cmd_type = luaL_checkinteger(L, 2);
+	vdevs = checknvlist(L, 3);
 
-	zfs_refresh_properties(zhp);
-	return (0);
+	if ((error = zpool_initialize(zhp, cmd_type, vdevs)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_initialize"));
+	}
+	return (success(L));
 }
 
 static int
-l_zfs_parent_name(lua_State *L)
+l_zpool_initialize_wait(lua_State *L)
 {
-	char parent[ZFS_MAX_DATASET_NAME_LEN];
-	zfs_handle_t *zhp;
+	zpool_handle_t *zhp;
+	pool_initialize_func_t cmd_type;
+	nvlist_t *vdevs;
 	int error;
 
-	parent[0] = '\0';
-
-	zhp = checkzfs(L, 1);
+	zhp = checkzpool(L, 1);
+	cmd_type = luaL_checkinteger(L, 2);
+	vdevs = checknvlist(L, 3);
 
-	if ((error = zfs_parent_name(zhp, parent, sizeof(parent))) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_parent_name"));
+	if ((error = zpool_initialize_wait(zhp, cmd_type, vdevs)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_initialize_wait"));
 	}
-	lua_pushstring(L, parent);
-	return (1);
+	return (success(L));
+}
+
+static inline void
+checktrimflags(lua_State *L, int idx, trimflags_t *flags)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "rate");
+	flags->rate = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+#define	FLAG(name) ({ \
+	lua_getfield(L, idx, #name); \
+	flags->name = lua_toboolean(L, -1); \
+	lua_pop(L, 1); \
+})
+	FLAG(fullpool);
+	FLAG(secure);
+	FLAG(wait);
+#undef FLAG
 }
 
 static int
-l_zfs_spa_version(lua_State *L)
+l_zpool_trim(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	int version, error;
+	zpool_handle_t *zhp;
+	pool_trim_func_t cmd_type;
+	nvlist_t *vdevs;
+	trimflags_t flags;
+	int error;
 
-	zhp = checkzfs(L, 1);
+	memset(&flags, 0, sizeof(flags));
 
-	if ((error = zfs_spa_version(zhp, &version)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_spa_version"));
+	zhp = checkzpool(L, 1);
+	cmd_type = luaL_checkinteger(L, 2);
+	vdevs = checknvlist(L, 3);
+	checktrimflags(L, 4, &flags);
+
+	if ((error = zpool_trim(zhp, cmd_type, vdevs, &flags)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_trim"));
 	}
-	lua_pushinteger(L, version);
-	return (1);
+	return (success(L));
 }
 
 static int
-l_zfs_is_mounted(lua_State *L)
+l_zpool_clear(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	char *where;
+	zpool_handle_t *zhp;
+	const char *path;
+	nvlist_t *rewind;
+	int error;
 
-	zhp = checkzfs(L, 1);
+	zhp = checkzpool(L, 1);
+	path = luaL_optstring(L, 2, NULL);
+	rewind = optnvlist(L, 3, NULL);
 
-	if (zfs_is_mounted(zhp, &where)) {
-		lua_pushboolean(L, B_TRUE);
-		lua_pushstring(L, where);
-		free(where);
-		return (2);
+	if ((error = zpool_clear(zhp, path, rewind)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_clear"));
 	}
-	lua_pushboolean(L, B_FALSE);
-	return (1);
+	return (success(L));
 }
 
 static int
-l_zfs_mount(lua_State *L)
+l_zpool_reguid(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *options;
-	int flags, error;
+	zpool_handle_t *zhp;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	options = luaL_optstring(L, 2, NULL);
-	flags = luaL_optinteger(L, 3, 0);
+	zhp = checkzpool(L, 1);
 
-	if ((error = zfs_mount(zhp, options, flags)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_mount"));
+	if ((error = zpool_reguid(zhp)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_reguid"));
 	}
 	return (success(L));
 }
 
+#if __FreeBSD_version > 1500023
 static int
-l_zfs_mount_at(lua_State *L)
+l_zpool_set_guid(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *options, *mountpoint;
-	int flags, error;
+	zpool_handle_t *zhp;
+	uint64_t *guidp, guid;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	options = luaL_optstring(L, 2, NULL);
-	flags = luaL_optinteger(L, 3, 0);
-	mountpoint = luaL_checkstring(L, 4);
+	zhp = checkzpool(L, 1);
+	if (lua_isnoneornil(L, 2)) {
+		guidp = NULL;
+	} else {
+		guid = luaL_checkinteger(L, 2);
+		guidp = &guid;
+	}
 
-	if ((error = zfs_mount_at(zhp, options, flags, mountpoint)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_mount_at"));
+	if ((error = zpool_set_guid(zhp, guidp)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_set_guid"));
 	}
 	return (success(L));
 }
+#endif
 
 static int
-l_zfs_unmount(lua_State *L)
+l_zpool_reopen_one(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	const char *mountpoint;
-	int flags, error;
+	zpool_handle_t *zhp;
+	boolean_t scrub_restart;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	mountpoint = luaL_optstring(L, 2, NULL);
-	flags = luaL_optinteger(L, 3, 0);
+	zhp = checkzpool(L, 1);
+	scrub_restart = lua_toboolean(L, 2);
 
-	if ((error = zfs_unmount(zhp, mountpoint, flags)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_unmount"));
+	if ((error = zpool_reopen_one(zhp, &scrub_restart)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_reopen_one"));
 	}
 	return (success(L));
 }
 
+#if __FreeBSD_version > 1500056
 static int
-l_zfs_unmountall(lua_State *L)
+l_zpool_collect_leaves(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	int flags, error;
+	zpool_handle_t *zhp;
+	nvlist_t *nvroot, *vdevs;
 
-	zhp = checkzfs(L, 1);
-	flags = luaL_optinteger(L, 2, 0);
+	zhp = checkzpool(L, 1);
+	nvroot = checknvlist(L, 2);
 
-	if ((error = zfs_unmountall(zhp, flags)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_unmountall"));
-	}
-	return (success(L));
+	vdevs = fnvlist_alloc();
+	zpool_collect_leaves(zhp, nvroot, vdevs);
+	pushnvlist(L, vdevs);
+	return (1);
 }
+#endif
 
 static int
-l_zfs_jail(lua_State *L)
+l_zpool_sync_one(lua_State *L)
 {
-	zfs_handle_t *zhp;
-	int jid, attach, error;
+	zpool_handle_t *zhp;
+	boolean_t force;
+	int error;
 
-	zhp = checkzfs(L, 1);
-	jid = luaL_checkinteger(L, 2);
-	attach = lua_toboolean(L, 3);
+	zhp = checkzpool(L, 1);
+	force = lua_toboolean(L, 2);
 
-	if ((error = zfs_jail(zhp, jid, attach)) != 0) {
-		return (zfsfail(L, zhp, error, "zfs_jail"));
+	if ((error = zpool_sync_one(zhp, &force)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_sync_one"));
 	}
 	return (success(L));
 }
 
+#if __FreeBSD_version > 1500056
 static int
-l_zpool_close(lua_State *L)
+l_zpool_trim_one(lua_State *L)
 {
 	zpool_handle_t *zhp;
+	trim_cbdata_t cbdata;
+	int error;
 
-	zhp = checkcookienull(L, 1, ZPOOL_HANDLE_METATABLE);
+	memset(&cbdata, 0, sizeof(cbdata));
+
+	zhp = checkzpool(L, 1);
+	cbdata.cmd_type = luaL_checkinteger(L, 2);
+	checktrimflags(L, 3, &cbdata.trim_flags);
 
-	if (zhp != NULL) {
-		zpool_close(zhp);
-		setcookie(L, 1, NULL);
+	if ((error = zpool_trim_one(zhp, &cbdata)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_trim_one"));
 	}
-	return (0);
+	return (success(L));
 }
+#endif
 
+#if __FreeBSD_version > 1500023
 static int
-l_zpool_get_name(lua_State *L)
+l_zpool_ddt_prune(lua_State *L)
 {
 	zpool_handle_t *zhp;
+	zpool_ddt_prune_unit_t unit;
+	uint64_t amount;
+	int error;
 
 	zhp = checkzpool(L, 1);
+	unit = luaL_checkinteger(L, 2);
+	amount = luaL_checkinteger(L, 3);
 
-	lua_pushstring(L, zpool_get_name(zhp));
-	return (1);
+	if ((error = zpool_ddt_prune(zhp, unit, amount)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_ddt_prune"));
+	}
+	return (success(L));
 }
+#endif
 
 static int
-l_zpool_get_state(lua_State *L)
+l_zpool_vdev_online(lua_State *L)
 {
 	zpool_handle_t *zhp;
+	const char *path;
+	vdev_state_t newstate;
+	int flags, error;
 
 	zhp = checkzpool(L, 1);
+	path = luaL_checkstring(L, 2);
+	flags = luaL_checkinteger(L, 3);
 
-	lua_pushinteger(L, zpool_get_state(zhp));
+	if ((error = zpool_vdev_online(zhp, path, flags, &newstate)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_online"));
+	}
+	lua_pushinteger(L, newstate);
 	return (1);
 }
 
 static int
-l_zpool_get_state_str(lua_State *L)
+l_zpool_vdev_offline(lua_State *L)
 {
 	zpool_handle_t *zhp;
+	const char *path;
+	boolean_t istmp;
+	int error;
 
 	zhp = checkzpool(L, 1);
+	path = luaL_checkstring(L, 2);
+	istmp = lua_toboolean(L, 3);
 
-	lua_pushstring(L, zpool_get_state_str(zhp));
-	return (1);
+	if ((error = zpool_vdev_offline(zhp, path, istmp)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_offline"));
+	}
+	return (success(L));
 }
 
 static int
-l_zpool_get_status(lua_State *L)
+l_zpool_vdev_attach(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *msgid;
-	zpool_errata_t errata;
-	zpool_status_t status;
+	const char *old_disk, *new_disk;
+	nvlist_t *nvroot;
+	boolean_t replacing; /* XXX: integer in userspace, boolean in kernel */
+	boolean_t rebuild;
+	int error;
 
 	zhp = checkzpool(L, 1);
+	old_disk = luaL_checkstring(L, 2);
+	new_disk = luaL_checkstring(L, 3);
+	nvroot = checknvlist(L, 4);
+	replacing = lua_toboolean(L, 5);
+	rebuild = lua_toboolean(L, 6);
 
-	status = zpool_get_status(zhp, &msgid, &errata);
-	lua_pushinteger(L, status);
-	if (msgid == NULL) {
-		lua_pushnil(L);
-	} else {
-		lua_pushstring(L, msgid);
-	}
-	if (status == ZPOOL_STATUS_ERRATA) {
-		lua_pushinteger(L, errata);
-		return (3);
+	if ((error = zpool_vdev_attach(zhp, old_disk, new_disk, nvroot,
+	    replacing, rebuild)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_attach"));
 	}
-	return (2);
+	return (success(L));
 }
 
 static int
-l_zpool_wait(lua_State *L)
+l_zpool_vdev_detach(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	zpool_wait_activity_t activity;
+	const char *path;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	activity = luaL_checkinteger(L, 2);
+	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_wait(zhp, activity)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_wait"));
+	if ((error = zpool_vdev_detach(zhp, path)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_detach"));
 	}
 	return (success(L));
 }
 
 static int
-l_zpool_wait_status(lua_State *L)
+l_zpool_vdev_remove(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	zpool_wait_activity_t activity;
-	boolean_t missing, waited;
+	const char *path;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	activity = luaL_checkinteger(L, 2);
+	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_wait_status(zhp, activity, &missing, &waited))
-	    != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_wait_status"));
+	if ((error = zpool_vdev_remove(zhp, path)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_remove"));
 	}
-	lua_pushboolean(L, waited);
-	lua_pushboolean(L, missing);
-	return (2);
+	return (success(L));
 }
 
 static int
-l_zpool_destroy(lua_State *L)
+l_zpool_vdev_remove_cancel(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *message;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	message = luaL_checkstring(L, 2);
 
-	if ((error = zpool_destroy(zhp, message)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_destroy"));
+	if ((error = zpool_vdev_remove_cancel(zhp)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_remove_cancel"));
 	}
 	return (success(L));
 }
 
 static int
-l_zpool_add(lua_State *L)
+l_zpool_vdev_indirect_size(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	nvlist_t *nvroot;
-	boolean_t check_ashift;
+	const char *path;
+	uint64_t size;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	nvroot = checknvlist(L, 2);
-	check_ashift = lua_toboolean(L, 3);
+	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_add(zhp, nvroot, check_ashift)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_add"));
+	if ((error = zpool_vdev_indirect_size(zhp, path, &size)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_indirect_size"));
 	}
-	return (success(L));
+	lua_pushinteger(L, size);
+	return (1);
+}
+
+static inline void
+checksplitflags(lua_State *L, int idx, splitflags_t *flags)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "name_flags");
+	flags->name_flags = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+#define	FLAG(name) ({ \
+	lua_getfield(L, idx, #name); \
+	flags->name = lua_toboolean(L, -1); \
+	lua_pop(L, 1); \
+})
+	FLAG(dryrun);
+	FLAG(import);
+#undef FLAG
 }
 
 static int
-l_zpool_scan(lua_State *L)
+l_zpool_vdev_split(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	pool_scan_func_t func;
-	pool_scrub_cmd_t cmd;
+	const char *newname;
+	nvlist_t *newroot, *props;
+	splitflags_t flags;
 	int error;
 
+	memset(&flags, 0, sizeof(flags));
+
 	zhp = checkzpool(L, 1);
-	func = luaL_checkinteger(L, 2);
-	cmd = luaL_checkinteger(L, 3);
+	newname = luaL_checkstring(L, 2);
+	newroot = optnvlist(L, 3, NULL);
+	props = optnvlist(L, 4, NULL);
+	checksplitflags(L, 5, &flags);
 
-	if ((error = zpool_scan(zhp, func, cmd)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_scan"));
+	if ((error = zpool_vdev_split(zhp, __DECONST(char *, newname), &newroot,
+	    props, flags)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_split"));
 	}
 	return (success(L));
 }
 
-#if __FreeBSD_version > 1500056
 static int
-l_zpool_scan_range(lua_State *L)
+l_zpool_vdev_remove_wanted(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	pool_scan_func_t func;
-	pool_scrub_cmd_t cmd;
-	time_t date_start, date_end;
+	const char *path;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	func = luaL_checkinteger(L, 2);
-	cmd = luaL_checkinteger(L, 3);
-	date_start = luaL_optinteger(L, 4, 0);
-	date_end = luaL_optinteger(L, 5, 0);
+	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_scan_range(zhp, func, cmd, date_start, date_end))
-	    != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_scan_range"));
+	if ((error = zpool_vdev_remove_wanted(zhp, path)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_remove_wanted"));
 	}
 	return (success(L));
 }
-#endif
 
-#if __FreeBSD_version > 1500056
 static int
-l_zpool_initialize_one(lua_State *L)
+l_zpool_vdev_fault(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	initialize_cbdata_t cbdata;
+	uint64_t guid;
+	vdev_aux_t aux;
 	int error;
 
-	memset(&cbdata, 0, sizeof(cbdata));
-
 	zhp = checkzpool(L, 1);
-	cbdata.cmd_type = luaL_checkinteger(L, 2);
-	cbdata.wait = lua_toboolean(L, 3);
+	guid = luaL_checkinteger(L, 2);
+	aux = luaL_checkinteger(L, 3);
 
-	if ((error = zpool_initialize_one(zhp, &cbdata)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_initialize_one"));
+	if ((error = zpool_vdev_fault(zhp, guid, aux)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_fault"));
 	}
 	return (success(L));
 }
-#endif
 
 static int
-l_zpool_initialize(lua_State *L)
+l_zpool_vdev_degrade(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	pool_initialize_func_t cmd_type;
-	nvlist_t *vdevs;
+	uint64_t guid;
+	vdev_aux_t aux;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	cmd_type = luaL_checkinteger(L, 2);
-	vdevs = checknvlist(L, 3);
+	guid = luaL_checkinteger(L, 2);
+	aux = luaL_checkinteger(L, 3);
 
-	if ((error = zpool_initialize(zhp, cmd_type, vdevs)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_initialize"));
+	if ((error = zpool_vdev_degrade(zhp, guid, aux)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_degrade"));
 	}
 	return (success(L));
 }
 
 static int
-l_zpool_initialize_wait(lua_State *L)
+l_zpool_vdev_set_removed_state(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	pool_initialize_func_t cmd_type;
-	nvlist_t *vdevs;
+	uint64_t guid;
+	vdev_aux_t aux;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	cmd_type = luaL_checkinteger(L, 2);
-	vdevs = checknvlist(L, 3);
+	guid = luaL_checkinteger(L, 2);
+	aux = luaL_checkinteger(L, 3);
 
-	if ((error = zpool_initialize_wait(zhp, cmd_type, vdevs)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_initialize_wait"));
+	if ((error = zpool_vdev_set_removed_state(zhp, guid, aux)) != 0) {
+		return (zpoolfail(L, zhp, error,
+		    "zpool_vdev_set_removed_state"));
 	}
 	return (success(L));
 }
 
-static inline void
-checktrimflags(lua_State *L, int idx, trimflags_t *flags)
-{
-	luaL_checktype(L, idx, LUA_TTABLE);
-	lua_getfield(L, idx, "rate");
-	flags->rate = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-#define	FLAG(name) ({ \
-	lua_getfield(L, idx, #name); \
-	flags->name = lua_toboolean(L, -1); \
-	lua_pop(L, 1); \
-})
-	FLAG(fullpool);
-	FLAG(secure);
-	FLAG(wait);
-#undef FLAG
-}
-
 static int
-l_zpool_trim(lua_State *L)
+l_zpool_vdev_clear(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	pool_trim_func_t cmd_type;
-	nvlist_t *vdevs;
-	trimflags_t flags;
+	zpool_handle_t *zhp;
+	uint64_t guid;
 	int error;
 
-	memset(&flags, 0, sizeof(flags));
-
 	zhp = checkzpool(L, 1);
-	cmd_type = luaL_checkinteger(L, 2);
-	vdevs = checknvlist(L, 3);
-	checktrimflags(L, 4, &flags);
+	guid = luaL_checkinteger(L, 2);
 
-	if ((error = zpool_trim(zhp, cmd_type, vdevs, &flags)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_trim"));
+	if ((error = zpool_vdev_clear(zhp, guid)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_vdev_clear"));
 	}
 	return (success(L));
 }
 
 static int
-l_zpool_clear(lua_State *L)
+l_zpool_find_vdev(lua_State *L)
 {
 	zpool_handle_t *zhp;
 	const char *path;
-	nvlist_t *rewind;
-	int error;
+	boolean_t avail_spare, l2cache, log;
+	nvlist_t *vdev;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_optstring(L, 2, NULL);
-	rewind = optnvlist(L, 3, NULL);
+	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_clear(zhp, path, rewind)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_clear"));
+	if ((vdev = zpool_find_vdev(zhp, path, &avail_spare, &l2cache, &log))
+	    == NULL) {
+		return (zpoolfail(L, zhp, EZFS_UNKNOWN, "zpool_find_vdev"));
 	}
-	return (success(L));
+	pushnvlist(L, vdev);
+	lua_pushboolean(L, avail_spare);
+	lua_pushboolean(L, l2cache);
+	lua_pushboolean(L, log);
+	return (4);
 }
 
+#if __FreeBSD_version > 1500023
 static int
-l_zpool_reguid(lua_State *L)
+l_zpool_find_parent_vdev(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	int error;
+	const char *path;
+	boolean_t avail_spare, l2cache, log;
+	nvlist_t *vdev;
 
 	zhp = checkzpool(L, 1);
+	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_reguid(zhp)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_reguid"));
+	if ((vdev = zpool_find_parent_vdev(zhp, path, &avail_spare, &l2cache,
+	    &log)) == NULL) {
+		return (zpoolfail(L, zhp, EZFS_UNKNOWN,
+		    "zpool_find_parent_vdev"));
 	}
-	return (success(L));
+	pushnvlist(L, vdev);
+	lua_pushboolean(L, avail_spare);
+	lua_pushboolean(L, l2cache);
+	lua_pushboolean(L, log);
+	return (4);
 }
+#endif
 
-#if __FreeBSD_version > 1500023
 static int
-l_zpool_set_guid(lua_State *L)
+l_zpool_find_vdev_by_physpath(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	uint64_t *guidp, guid;
-	int error;
+	const char *physpath;
+	boolean_t avail_spare, l2cache, log;
+	nvlist_t *vdev;
 
 	zhp = checkzpool(L, 1);
-	if (lua_isnoneornil(L, 2)) {
-		guidp = NULL;
-	} else {
-		guid = luaL_checkinteger(L, 2);
-		guidp = &guid;
-	}
+	physpath = luaL_checkstring(L, 2);
 
-	if ((error = zpool_set_guid(zhp, guidp)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_set_guid"));
+	if ((vdev = zpool_find_vdev_by_physpath(zhp, physpath, &avail_spare,
+	    &l2cache, &log)) == NULL) {
+		return (zpoolfail(L, zhp, EZFS_UNKNOWN,
+		    "zpool_find_vdev_by_physpath"));
 	}
-	return (success(L));
+	pushnvlist(L, vdev);
+	lua_pushboolean(L, avail_spare);
+	lua_pushboolean(L, l2cache);
+	lua_pushboolean(L, log);
+	return (4);
 }
-#endif
 
 static int
-l_zpool_reopen_one(lua_State *L)
+l_zpool_prepare_disk(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	boolean_t scrub_restart;
-	int error;
+	nvlist_t *vdev;
+	const char *prepare_str;
+	char **lines;
+	int nlines, error;
+
+	lines = NULL;
 
 	zhp = checkzpool(L, 1);
-	scrub_restart = lua_toboolean(L, 2);
+	vdev = checknvlist(L, 2);
+	prepare_str = luaL_checkstring(L, 3);
 
-	if ((error = zpool_reopen_one(zhp, &scrub_restart)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_reopen_one"));
+	if ((error = zpool_prepare_disk(zhp, vdev, prepare_str, &lines,
+	    &nlines)) != 0) {
+		ASSERT0P(lines);
+		ASSERT0(nlines);
+		return (zpoolfail(L, zhp, error, "zpool_prepare_disk"));
 	}
-	return (success(L));
+	ASSERT3P(lines, !=, NULL);
+	lua_createtable(L, nlines, 0);
+	for (int i = 0; i < nlines; i++) {
+		lua_pushstring(L, lines[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	libzfs_free_str_array(lines, nlines);
+	return (1);
 }
 
-#if __FreeBSD_version > 1500056
 static int
-l_zpool_collect_leaves(lua_State *L)
+l_zpool_vdev_path_to_guid(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	nvlist_t *nvroot, *vdevs;
+	const char *path;
 
 	zhp = checkzpool(L, 1);
-	nvroot = checknvlist(L, 2);
+	path = luaL_checkstring(L, 2);
 
-	vdevs = fnvlist_alloc();
-	zpool_collect_leaves(zhp, nvroot, vdevs);
-	pushnvlist(L, vdevs);
+	lua_pushinteger(L, zpool_vdev_path_to_guid(zhp, path));
 	return (1);
 }
-#endif
 
 static int
-l_zpool_sync_one(lua_State *L)
+l_zpool_set_prop(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	boolean_t force;
+	const char *propname, *propval;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	force = lua_toboolean(L, 2);
+	propname = luaL_checkstring(L, 2);
+	propval = luaL_checkstring(L, 3);
 
-	if ((error = zpool_sync_one(zhp, &force)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_sync_one"));
+	if ((error = zpool_set_prop(zhp, propname, propval)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_set_prop"));
 	}
 	return (success(L));
 }
 
-#if __FreeBSD_version > 1500056
 static int
-l_zpool_trim_one(lua_State *L)
+l_zpool_get_prop(lua_State *L)
 {
+	char value[ZPOOL_MAXPROPLEN];
 	zpool_handle_t *zhp;
-	trim_cbdata_t cbdata;
+	zpool_prop_t prop;
+	zprop_source_t source;
+	boolean_t literal;
 	int error;
 
-	memset(&cbdata, 0, sizeof(cbdata));
+	value[0] = '\0';
 
 	zhp = checkzpool(L, 1);
-	cbdata.cmd_type = luaL_checkinteger(L, 2);
-	checktrimflags(L, 3, &cbdata.trim_flags);
+	prop = luaL_checkinteger(L, 2); /* XXX: wrap this prop type too? */
+	literal = lua_toboolean(L, 3);
 
-	if ((error = zpool_trim_one(zhp, &cbdata)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_trim_one"));
+	if ((error = zpool_get_prop(zhp, prop, value, sizeof(value), &source,
+	    literal)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_get_prop"));
 	}
-	return (success(L));
+	lua_pushstring(L, value);
+	lua_pushinteger(L, source);
+	return (2);
 }
-#endif
 
-#if __FreeBSD_version > 1500023
 static int
-l_zpool_ddt_prune(lua_State *L)
+l_zpool_get_userprop(lua_State *L)
 {
+	char value[ZPOOL_MAXPROPLEN];
 	zpool_handle_t *zhp;
-	zpool_ddt_prune_unit_t unit;
-	uint64_t amount;
+	const char *propname;
+	zprop_source_t source;
 	int error;
 
+	value[0] = '\0';
+
 	zhp = checkzpool(L, 1);
-	unit = luaL_checkinteger(L, 2);
-	amount = luaL_checkinteger(L, 3);
+	propname = luaL_checkstring(L, 2);
 
-	if ((error = zpool_ddt_prune(zhp, unit, amount)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_ddt_prune"));
+	if ((error = zpool_get_userprop(zhp, propname, value, sizeof(value),
+	    &source)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_get_userprop"));
 	}
-	return (success(L));
+	lua_pushstring(L, value);
+	lua_pushinteger(L, source);
+	return (2);
 }
-#endif
 
 static int
-l_zpool_vdev_online(lua_State *L)
+l_zpool_get_prop_int(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *path;
-	vdev_state_t newstate;
-	int flags, error;
+	zpool_prop_t prop;
+	zprop_source_t source;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
-	flags = luaL_checkinteger(L, 3);
+	prop = luaL_checkinteger(L, 2);
 
-	if ((error = zpool_vdev_online(zhp, path, flags, &newstate)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_online"));
-	}
-	lua_pushinteger(L, newstate);
-	return (1);
+	lua_pushinteger(L, zpool_get_prop_int(zhp, prop, &source));
+	lua_pushinteger(L, source);
+	return (2);
 }
 
 static int
-l_zpool_vdev_offline(lua_State *L)
+l_zpool_props_refresh(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *path;
-	boolean_t istmp;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
-	istmp = lua_toboolean(L, 3);
 
-	if ((error = zpool_vdev_offline(zhp, path, istmp)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_offline"));
+	if ((error = zpool_props_refresh(zhp)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_refresh_props"));
 	}
 	return (success(L));
 }
 
 static int
-l_zpool_vdev_attach(lua_State *L)
+l_zpool_get_vdev_prop(lua_State *L)
 {
+	char value[ZPOOL_MAXPROPLEN];
 	zpool_handle_t *zhp;
-	const char *old_disk, *new_disk;
-	nvlist_t *nvroot;
-	boolean_t replacing; /* XXX: integer in userspace, boolean in kernel */
-	boolean_t rebuild;
+	const char *vdevname, *propname;
+	vdev_prop_t prop;
+	zprop_source_t source;
+	boolean_t literal;
 	int error;
 
+	value[0] = '\0';
+
 	zhp = checkzpool(L, 1);
-	old_disk = luaL_checkstring(L, 2);
-	new_disk = luaL_checkstring(L, 3);
-	nvroot = checknvlist(L, 4);
-	replacing = lua_toboolean(L, 5);
-	rebuild = lua_toboolean(L, 6);
+	vdevname = luaL_checkstring(L, 2);
+	prop = luaL_optinteger(L, 3, 0);
+	propname = luaL_optstring(L, 4, NULL);
+	literal = lua_toboolean(L, 5);
 
-	if ((error = zpool_vdev_attach(zhp, old_disk, new_disk, nvroot,
-	    replacing, rebuild)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_attach"));
+	if ((error = zpool_get_vdev_prop(zhp, vdevname, prop,
+	    __DECONST(char *, propname), value, sizeof(value), &source,
+	    literal)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_get_vdev_prop"));
 	}
-	return (success(L));
+	lua_pushstring(L, value);
+	lua_pushinteger(L, source);
+	return (2);
 }
 
 static int
-l_zpool_vdev_detach(lua_State *L)
+l_zpool_get_all_vdev_props(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *path;
+	const char *vdevname;
+	nvlist_t *props;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
+	vdevname = luaL_checkstring(L, 2);
 
-	if ((error = zpool_vdev_detach(zhp, path)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_detach"));
+	if ((error = zpool_get_all_vdev_props(zhp, vdevname, &props)) != 0) {
+		ASSERT0P(props);
+		return (zpoolfail(L, zhp, error, "zpool_get_all_vdev_props"));
 	}
-	return (success(L));
+	ASSERT3P(props, !=, NULL);
+	pushnvlist(L, props);
+	return (1);
 }
 
 static int
-l_zpool_vdev_remove(lua_State *L)
+l_zpool_set_vdev_prop(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *path;
+	const char *vdevname, *propname, *propval;
 	int error;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
+	vdevname = luaL_checkstring(L, 2);
+	propname = luaL_checkstring(L, 3);
+	propval = luaL_checkstring(L, 4);
 
-	if ((error = zpool_vdev_remove(zhp, path)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_remove"));
+	if ((error = zpool_set_vdev_prop(zhp, vdevname, propname, propval))
+	    != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_set_vdev_prop"));
 	}
 	return (success(L));
 }
 
 static int
-l_zpool_vdev_remove_cancel(lua_State *L)
+l_zpool_get_config(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	int error;
+	nvlist_t *oldconfig, *config;
+
+	oldconfig = config = NULL;
 
 	zhp = checkzpool(L, 1);
 
-	if ((error = zpool_vdev_remove_cancel(zhp)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_remove_cancel"));
+	if ((config = zpool_get_config(zhp, &oldconfig)) == NULL) {
+		ASSERT0P(config);
+		ASSERT0P(oldconfig);
+		return (zpoolfail(L, zhp, EZFS_UNKNOWN, "zpool_get_config"));
 	}
-	return (success(L));
+	ASSERT3P(config, !=, NULL);
+	pushnvlist(L, config);
+	if (oldconfig != NULL) {
+		pushnvlist(L, oldconfig);
+		return (2);
+	}
+	return (1);
 }
 
 static int
-l_zpool_vdev_indirect_size(lua_State *L)
+l_zpool_get_features(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *path;
-	uint64_t size;
-	int error;
+	nvlist_t *features;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
 
-	if ((error = zpool_vdev_indirect_size(zhp, path, &size)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_indirect_size"));
+	if ((features = zpool_get_features(zhp)) == NULL) {
+		return (zpoolfail(L, zhp, EZFS_UNKNOWN, "zpool_get_features"));
 	}
-	lua_pushinteger(L, size);
+	pushnvlist(L, features);
 	return (1);
 }
 
-static inline void
-checksplitflags(lua_State *L, int idx, splitflags_t *flags)
-{
-	luaL_checktype(L, idx, LUA_TTABLE);
-	lua_getfield(L, idx, "name_flags");
-	flags->name_flags = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-#define	FLAG(name) ({ \
-	lua_getfield(L, idx, #name); \
-	flags->name = lua_toboolean(L, -1); \
-	lua_pop(L, 1); \
-})
-	FLAG(dryrun);
-	FLAG(import);
-#undef FLAG
-}
-
 static int
-l_zpool_vdev_split(lua_State *L)
+l_zpool_refresh_stats(lua_State *L)
 {
 	zpool_handle_t *zhp;
-	const char *newname;
-	nvlist_t *newroot, *props;
-	splitflags_t flags;
+	boolean_t missing;
 	int error;
 
-	memset(&flags, 0, sizeof(flags));
-
 	zhp = checkzpool(L, 1);
-	newname = luaL_checkstring(L, 2);
-	newroot = optnvlist(L, 3, NULL);
-	props = optnvlist(L, 4, NULL);
-	checksplitflags(L, 5, &flags);
 
-	if ((error = zpool_vdev_split(zhp, __DECONST(char *, newname), &newroot,
-	    props, flags)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_split"));
+	if ((error = zpool_refresh_stats(zhp, &missing)) != 0) {
+		return (zpoolfail(L, zhp, error, "zpool_refresh_stats"));
 	}
-	return (success(L));
+	lua_pushboolean(L, missing);
+	return (1);
 }
 
+#if __FreeBSD_version > 1600001
 static int
-l_zpool_vdev_remove_wanted(lua_State *L)
+l_zpool_refresh_stats_from_handle(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	const char *path;
-	int error;
+	zpool_handle_t *zhp, *fromzhp;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
+	fromzhp = checkzpool(L, 2);
 
-	if ((error = zpool_vdev_remove_wanted(zhp, path)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_remove_wanted"));
-	}
-	return (success(L));
+	zpool_refresh_stats_from_handle(zhp, fromzhp);
+	return (0);
 }
+#endif
 
-static int
-l_zpool_vdev_fault(lua_State *L)
-{
-	zpool_handle_t *zhp;
+/*
+ * iostat sampling: keep the previous vdev_stat_t and latency histograms per
+ * vdev guid and compute rates and histogram deltas in C, so monitoring does
+ * not need to convert the whole config nvlist on every interval.
+ */
+
+enum iostat_histo {
+	IOSTAT_TOT_R_LAT,
+	IOSTAT_TOT_W_LAT,
+	IOSTAT_DISK_R_LAT,
+	IOSTAT_DISK_W_LAT,
+	IOSTAT_NHISTOS
+};
+
+static const struct {
+	const char *config;
+	const char *field;
+} iostat_histos[IOSTAT_NHISTOS] = {
+	[IOSTAT_TOT_R_LAT] = {ZPOOL_CONFIG_VDEV_TOT_R_LAT_HISTO, "total_r_lat"},
+	[IOSTAT_TOT_W_LAT] = {ZPOOL_CONFIG_VDEV_TOT_W_LAT_HISTO, "total_w_lat"},
+	[IOSTAT_DISK_R_LAT] = {ZPOOL_CONFIG_VDEV_DISK_R_LAT_HISTO, "disk_r_lat"},
+	[IOSTAT_DISK_W_LAT] = {ZPOOL_CONFIG_VDEV_DISK_W_LAT_HISTO, "disk_w_lat"},
+};
+
+struct iostat_vdev {
 	uint64_t guid;
-	vdev_aux_t aux;
-	int error;
+	char *name;
+	bool seen;
+	bool baseline;	/* vs and histo hold a previous sample */
+	vdev_stat_t vs;
+	uint64_t histo[IOSTAT_NHISTOS][VDEV_L_HISTO_BUCKETS];
+};
 
-	zhp = checkzpool(L, 1);
-	guid = luaL_checkinteger(L, 2);
-	aux = luaL_checkinteger(L, 3);
+struct iostat_sampler {
+	zpool_handle_t *zhp;
+	bool histograms;
+	size_t nvdevs, maxvdevs;
+	struct iostat_vdev *vdevs;
+	lua_Integer nrows;
+	int rows;	/* stack index of the rows sequence */
+	double interval;
+};
 
-	if ((error = zpool_vdev_fault(zhp, guid, aux)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_fault"));
+static struct iostat_vdev *
+iostat_lookup(lua_State *L, struct iostat_sampler *sp, nvlist_t *nv,
+    uint64_t guid, int depth)
+{
+	struct iostat_vdev *vd;
+	libzfs_handle_t *hdl;
+
+	for (size_t i = 0; i < sp->nvdevs; i++) {
+		if (sp->vdevs[i].guid == guid) {
+			return (&sp->vdevs[i]);
+		}
 	}
-	return (success(L));
+	if (sp->nvdevs == sp->maxvdevs) {
+		size_t maxvdevs = MAX(sp->maxvdevs * 2, 8);
+
+		if ((vd = reallocarray(sp->vdevs, maxvdevs, sizeof(*vd)))
+		    == NULL) {
+			fatal(L, "reallocarray", ENOMEM);
+		}
+		sp->vdevs = vd;
+		sp->maxvdevs = maxvdevs;
+	}
+	vd = &sp->vdevs[sp->nvdevs];
+	memset(vd, 0, sizeof(*vd));
+	vd->guid = guid;
+	if (depth == 0) {
+		vd->name = strdup(zpool_get_name(sp->zhp));
+	} else {
+		hdl = zpool_get_handle(sp->zhp);
+		vd->name = zpool_vdev_name(hdl, sp->zhp, nv, 0);
+	}
+	if (vd->name == NULL) {
+		fatal(L, "zpool_vdev_name", ENOMEM);
+	}
+	sp->nvdevs++;
+	return (vd);
 }
 
-static int
-l_zpool_vdev_degrade(lua_State *L)
+static void
+iostat_setrate(lua_State *L, const char *field, uint64_t new, uint64_t old,
+    double scale)
 {
-	zpool_handle_t *zhp;
-	uint64_t guid;
-	vdev_aux_t aux;
-	int error;
+	/* Without a previous sample there is nothing to compute a rate from. */
+	if (scale > 0.0) {
+		lua_pushnumber(L, (double)(new - old) * scale);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_setfield(L, -2, field);
+}
 
-	zhp = checkzpool(L, 1);
-	guid = luaL_checkinteger(L, 2);
-	aux = luaL_checkinteger(L, 3);
+static void
+iostat_setint(lua_State *L, const char *field, uint64_t value)
+{
+	lua_pushinteger(L, value);
+	lua_setfield(L, -2, field);
+}
+
+static void
+iostat_vdev_row(lua_State *L, struct iostat_sampler *sp, nvlist_t *nv,
+    int depth)
+{
+	struct iostat_vdev *vd;
+	vdev_stat_t *vs;
+	nvlist_t *nvx, **child;
+	uint64_t guid, *histo;
+	uint_t c, nchildren;
+	double scale;
+
+	if (nvlist_lookup_uint64(nv, ZPOOL_CONFIG_GUID, &guid) != 0 ||
+	    nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
+	    (uint64_t **)&vs, &c) != 0) {
+		return;
+	}
+	vd = iostat_lookup(L, sp, nv, guid, depth);
+	vd->seen = true;
+	scale = 0.0;
+	if (vd->baseline && vs->vs_timestamp > vd->vs.vs_timestamp) {
+		scale = 1e9 / (double)(vs->vs_timestamp - vd->vs.vs_timestamp);
+	}
+	if (depth == 0 && scale > 0.0) {
+		sp->interval = 1.0 / scale;
+	}
+
+	/* Reuse the row table from a previous sample if there is one. */
+	if (lua_rawgeti(L, sp->rows, ++sp->nrows) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, 0, 16);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, sp->rows, sp->nrows);
+	}
+	lua_pushstring(L, vd->name);
+	lua_setfield(L, -2, "name");
+	iostat_setint(L, "guid", guid);
+	iostat_setint(L, "depth", depth);
+	iostat_setint(L, "state", vs->vs_state);
+	iostat_setint(L, "alloc", vs->vs_alloc);
+	iostat_setint(L, "space", vs->vs_space);
+	iostat_setrate(L, "read_ops", vs->vs_ops[ZIO_TYPE_READ],
+	    vd->vs.vs_ops[ZIO_TYPE_READ], scale);
+	iostat_setrate(L, "write_ops", vs->vs_ops[ZIO_TYPE_WRITE],
+	    vd->vs.vs_ops[ZIO_TYPE_WRITE], scale);
+	iostat_setrate(L, "read_bytes", vs->vs_bytes[ZIO_TYPE_READ],
+	    vd->vs.vs_bytes[ZIO_TYPE_READ], scale);
+	iostat_setrate(L, "write_bytes", vs->vs_bytes[ZIO_TYPE_WRITE],
+	    vd->vs.vs_bytes[ZIO_TYPE_WRITE], scale);
+	iostat_setint(L, "read_errors", vs->vs_read_errors);
+	iostat_setint(L, "write_errors", vs->vs_write_errors);
+	iostat_setint(L, "checksum_errors", vs->vs_checksum_errors);
+	if (sp->histograms &&
+	    nvlist_lookup_nvlist(nv, ZPOOL_CONFIG_VDEV_STATS_EX, &nvx) == 0) {
+		for (int h = 0; h < IOSTAT_NHISTOS; h++) {
+			if (nvlist_lookup_uint64_array(nvx,
+			    iostat_histos[h].config, &histo, &c) != 0) {
+				continue;
+			}
+			c = MIN(c, VDEV_L_HISTO_BUCKETS);
+			if (!vd->baseline) {
+				memcpy(vd->histo[h], histo, c * sizeof(*histo));
+				lua_pushnil(L);
+				lua_setfield(L, -2, iostat_histos[h].field);
+				continue;
+			}
+			if (lua_getfield(L, -1, iostat_histos[h].field)
+			    != LUA_TTABLE) {
+				lua_pop(L, 1);
+				lua_createtable(L, c, 0);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, -3, iostat_histos[h].field);
+			}
+			for (uint_t b = 0; b < c; b++) {
+				lua_pushinteger(L, histo[b] - vd->histo[h][b]);
+				lua_rawseti(L, -2, b + 1);
+				vd->histo[h][b] = histo[b];
+			}
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	vd->vs = *vs;
+	vd->baseline = true;
 
-	if ((error = zpool_vdev_degrade(zhp, guid, aux)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_degrade"));
+	if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN, &child,
+	    &nchildren) == 0) {
+		for (uint_t i = 0; i < nchildren; i++) {
+			iostat_vdev_row(L, sp, child[i], depth + 1);
+		}
+	}
+	if (depth == 0 && nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_L2CACHE,
+	    &child, &nchildren) == 0) {
+		for (uint_t i = 0; i < nchildren; i++) {
+			iostat_vdev_row(L, sp, child[i], depth + 1);
+		}
 	}
-	return (success(L));
 }
 
-static int
-l_zpool_vdev_set_removed_state(lua_State *L)
+static inline struct iostat_sampler *
+checkiostat(lua_State *L, int idx)
 {
-	zpool_handle_t *zhp;
-	uint64_t guid;
-	vdev_aux_t aux;
-	int error;
-
-	zhp = checkzpool(L, 1);
-	guid = luaL_checkinteger(L, 2);
-	aux = luaL_checkinteger(L, 3);
+	struct iostat_sampler *sp;
 
-	if ((error = zpool_vdev_set_removed_state(zhp, guid, aux)) != 0) {
-		return (zpoolfail(L, zhp, error,
-		    "zpool_vdev_set_removed_state"));
-	}
-	return (success(L));
+	sp = checkcookie(L, idx, ZPOOL_IOSTAT_METATABLE);
+	checkzpoolref(L, idx);
+	return (sp);
 }
 
 static int
-l_zpool_vdev_clear(lua_State *L)
+l_zpool_iostat_sampler(lua_State *L)
 {
+	struct iostat_sampler *sp;
 	zpool_handle_t *zhp;
-	uint64_t guid;
-	int error;
+	bool histograms;
 
 	zhp = checkzpool(L, 1);
-	guid = luaL_checkinteger(L, 2);
+	histograms = lua_toboolean(L, 2);
 
-	if ((error = zpool_vdev_clear(zhp, guid)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_vdev_clear"));
+	if ((sp = calloc(1, sizeof(*sp))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
 	}
-	return (success(L));
+	sp->zhp = zhp;
+	sp->histograms = histograms;
+	/* Keep the pool handle alive as long as the sampler. */
+	return (newref(L, 1, sp, ZPOOL_IOSTAT_METATABLE));
 }
 
 static int
-l_zpool_find_vdev(lua_State *L)
+l_zpool_iostat_sample(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	const char *path;
-	boolean_t avail_spare, l2cache, log;
-	nvlist_t *vdev;
+	struct iostat_sampler *sp;
+	nvlist_t *config, *nvroot;
+	boolean_t missing;
+	lua_Integer len;
+	size_t n;
+	int error;
 
-	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
+	sp = checkiostat(L, 1);
+	lua_settop(L, 2);
+	if (lua_isnil(L, 2)) {
+		lua_createtable(L, 0, 2);
+		lua_replace(L, 2);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+	}
 
-	if ((vdev = zpool_find_vdev(zhp, path, &avail_spare, &l2cache, &log))
-	    == NULL) {
-		return (zpoolfail(L, zhp, EZFS_UNKNOWN, "zpool_find_vdev"));
+	if ((error = zpool_refresh_stats(sp->zhp, &missing)) != 0) {
+		return (zpoolfail(L, sp->zhp, error, "zpool_refresh_stats"));
 	}
-	pushnvlist(L, vdev);
-	lua_pushboolean(L, avail_spare);
-	lua_pushboolean(L, l2cache);
-	lua_pushboolean(L, log);
-	return (4);
+	if (missing) {
+		return (fail(L, ENOENT));
+	}
+	if ((config = zpool_get_config(sp->zhp, NULL)) == NULL ||
+	    nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &nvroot)
+	    != 0) {
+		return (zpoolfail(L, sp->zhp, EZFS_UNKNOWN,
+		    "zpool_get_config"));
+	}
+	if (lua_getfield(L, 2, "vdevs") != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, 2, "vdevs");
+	}
+	sp->rows = lua_gettop(L);
+	sp->nrows = 0;
+	sp->interval = -1.0;
+	for (size_t i = 0; i < sp->nvdevs; i++) {
+		sp->vdevs[i].seen = false;
+	}
+	iostat_vdev_row(L, sp, nvroot, 0);
+
+	/* Trim rows left over from a larger previous sample. */
+	len = lua_rawlen(L, sp->rows);
+	for (lua_Integer i = sp->nrows + 1; i <= len; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, sp->rows, i);
+	}
+	/* Forget vdevs that have been removed. */
+	n = 0;
+	for (size_t i = 0; i < sp->nvdevs; i++) {
+		if (sp->vdevs[i].seen) {
+			sp->vdevs[n++] = sp->vdevs[i];
+		} else {
+			free(sp->vdevs[i].name);
+		}
+	}
+	sp->nvdevs = n;
+	if (sp->interval > 0.0) {
+		lua_pushnumber(L, sp->interval);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_setfield(L, 2, "interval");
+	lua_pushvalue(L, 2);
+	return (1);
 }
 
-#if __FreeBSD_version > 1500023
 static int
-l_zpool_find_parent_vdev(lua_State *L)
+l_zpool_iostat_close(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	const char *path;
-	boolean_t avail_spare, l2cache, log;
-	nvlist_t *vdev;
+	struct iostat_sampler *sp;
 
-	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
+	sp = checkcookienull(L, 1, ZPOOL_IOSTAT_METATABLE);
 
-	if ((vdev = zpool_find_parent_vdev(zhp, path, &avail_spare, &l2cache,
-	    &log)) == NULL) {
-		return (zpoolfail(L, zhp, EZFS_UNKNOWN,
-		    "zpool_find_parent_vdev"));
+	if (sp == NULL) {
+		return (0);
 	}
-	pushnvlist(L, vdev);
-	lua_pushboolean(L, avail_spare);
-	lua_pushboolean(L, l2cache);
-	lua_pushboolean(L, log);
-	return (4);
+	for (size_t i = 0; i < sp->nvdevs; i++) {
+		free(sp->vdevs[i].name);
+	}
+	free(sp->vdevs);
+	free(sp);
+	setcookie(L, 1, NULL);
+	return (0);
 }
-#endif
 
-static int
-l_zpool_find_vdev_by_physpath(lua_State *L)
-{
-	zpool_handle_t *zhp;
-	const char *physpath;
-	boolean_t avail_spare, l2cache, log;
-	nvlist_t *vdev;
+/*
+ * Pool state cache: keeps a private copy of the pool config and the status
+ * derived from it.  Each refresh replaces the copy so the vdev stats in it
+ * stay current, but the generation is only bumped, and the pool props only
+ * refreshed and memoized again, when the pool state, config txg, or status
+ * changes.  The copy is owned by an nvlist userdata so get() can hand out
+ * nvpair views into it, and frequent health checks don't rebuild whole
+ * tables.
+ */
 
-	zhp = checkzpool(L, 1);
-	physpath = luaL_checkstring(L, 2);
+struct zpool_cache {
+	zpool_handle_t *zhp;
+	nvlist_t *config;
+	uint64_t generation;
+	uint64_t txg;
+	int state;
+	zpool_status_t status;
+	const char *msgid;
+	zpool_errata_t errata;
+	int configref;	/* registry ref to the nvlist userdata owning config */
+	int memo;	/* registry ref to this generation's memoized props */
+};
 
-	if ((vdev = zpool_find_vdev_by_physpath(zhp, physpath, &avail_spare,
-	    &l2cache, &log)) == NULL) {
-		return (zpoolfail(L, zhp, EZFS_UNKNOWN,
-		    "zpool_find_vdev_by_physpath"));
-	}
-	pushnvlist(L, vdev);
-	lua_pushboolean(L, avail_spare);
-	lua_pushboolean(L, l2cache);
-	lua_pushboolean(L, log);
-	return (4);
+static inline struct zpool_cache *
+checkzpoolcache(lua_State *L, int idx)
+{
+	struct zpool_cache *zc;
+
+	zc = checkcookie(L, idx, ZPOOL_CACHE_METATABLE);
+	checkzpoolref(L, idx);
+	return (zc);
 }
 
+/*
+ * Replace the copy of the config, and forget the memoized properties if a new
+ * generation is taken.  Returns 1 if it was, 0 if not, or -1 on error.
+ */
 static int
-l_zpool_prepare_disk(lua_State *L)
+zpool_cache_update(lua_State *L, struct zpool_cache *zc, bool force)
 {
-	zpool_handle_t *zhp;
-	nvlist_t *vdev;
-	const char *prepare_str;
-	char **lines;
-	int nlines, error;
-
-	lines = NULL;
-
-	zhp = checkzpool(L, 1);
-	vdev = checknvlist(L, 2);
-	prepare_str = luaL_checkstring(L, 3);
+	nvlist_t *config, *copy;
+	const char *msgid;
+	zpool_errata_t errata;
+	zpool_status_t status;
+	uint64_t txg;
+	int state;
 
-	if ((error = zpool_prepare_disk(zhp, vdev, prepare_str, &lines,
-	    &nlines)) != 0) {
-		ASSERT0P(lines);
-		ASSERT0(nlines);
-		return (zpoolfail(L, zhp, error, "zpool_prepare_disk"));
+	if ((config = zpool_get_config(zc->zhp, NULL)) == NULL) {
+		return (-1);
 	}
-	ASSERT3P(lines, !=, NULL);
-	lua_createtable(L, nlines, 0);
-	for (int i = 0; i < nlines; i++) {
-		lua_pushstring(L, lines[i]);
-		lua_rawseti(L, -2, i + 1);
+	txg = 0;
+	(void)nvlist_lookup_uint64(config, ZPOOL_CONFIG_POOL_TXG, &txg);
+	state = zpool_get_state(zc->zhp);
+	status = zpool_get_status(zc->zhp, &msgid, &errata);
+	if (nvlist_dup(config, &copy, 0) != 0) {
+		return (-1);
 	}
-	libzfs_free_str_array(lines, nlines);
+	luaL_unref(L, LUA_REGISTRYINDEX, zc->configref);
+	pushnvlist(L, copy);
+	zc->configref = luaL_ref(L, LUA_REGISTRYINDEX);
+	zc->config = copy;
+	if (!force && zc->generation != 0 && txg == zc->txg &&
+	    state == zc->state && status == zc->status &&
+	    errata == zc->errata) {
+		return (0);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, zc->memo);
+	lua_newtable(L);
+	zc->memo = luaL_ref(L, LUA_REGISTRYINDEX);
+	zc->txg = txg;
+	zc->state = state;
+	zc->status = status;
+	zc->msgid = msgid;
+	zc->errata = errata;
+	zc->generation++;
 	return (1);
 }
 
 static int
-l_zpool_vdev_path_to_guid(lua_State *L)
+l_zpool_state_cache(lua_State *L)
 {
+	struct zpool_cache *zc;
 	zpool_handle_t *zhp;
-	const char *path;
 
 	zhp = checkzpool(L, 1);
-	path = luaL_checkstring(L, 2);
 
-	lua_pushinteger(L, zpool_vdev_path_to_guid(zhp, path));
-	return (1);
+	if ((zc = calloc(1, sizeof(*zc))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	zc->zhp = zhp;
+	zc->configref = LUA_NOREF;
+	zc->memo = LUA_NOREF;
+	if (zpool_cache_update(L, zc, true) == -1) {
+		free(zc);
+		return (zpoolfail(L, zhp, EZFS_NOMEM, "zpool_get_config"));
+	}
+	return (newref(L, 1, zc, ZPOOL_CACHE_METATABLE));
 }
 
 static int
-l_zpool_set_prop(lua_State *L)
+l_zpool_cache_close(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	const char *propname, *propval;
-	int error;
+	struct zpool_cache *zc;
 
-	zhp = checkzpool(L, 1);
-	propname = luaL_checkstring(L, 2);
-	propval = luaL_checkstring(L, 3);
+	zc = checkcookienull(L, 1, ZPOOL_CACHE_METATABLE);
 
-	if ((error = zpool_set_prop(zhp, propname, propval)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_set_prop"));
+	if (zc != NULL) {
+		luaL_unref(L, LUA_REGISTRYINDEX, zc->memo);
+		luaL_unref(L, LUA_REGISTRYINDEX, zc->configref);
+		free(zc);
+		setcookie(L, 1, NULL);
 	}
-	return (success(L));
+	return (0);
 }
 
 static int
-l_zpool_get_prop(lua_State *L)
+l_zpool_cache_refresh(lua_State *L)
 {
-	char value[ZPOOL_MAXPROPLEN];
-	zpool_handle_t *zhp;
-	zpool_prop_t prop;
-	zprop_source_t source;
-	boolean_t literal;
-	int error;
-
-	value[0] = '\0';
+	struct zpool_cache *zc;
+	boolean_t missing;
+	bool force;
+	int error, changed;
 
-	zhp = checkzpool(L, 1);
-	prop = luaL_checkinteger(L, 2); /* XXX: wrap this prop type too? */
-	literal = lua_toboolean(L, 3);
+	zc = checkzpoolcache(L, 1);
+	force = lua_toboolean(L, 2);
 
-	if ((error = zpool_get_prop(zhp, prop, value, sizeof(value), &source,
-	    literal)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_get_prop"));
+	if ((error = zpool_refresh_stats(zc->zhp, &missing)) != 0) {
+		return (zpoolfail(L, zc->zhp, error, "zpool_refresh_stats"));
 	}
-	lua_pushstring(L, value);
-	lua_pushinteger(L, source);
+	if ((changed = zpool_cache_update(L, zc, force)) == -1) {
+		return (zpoolfail(L, zc->zhp, EZFS_NOMEM, "zpool_get_config"));
+	}
+	if (changed && (error = zpool_props_refresh(zc->zhp)) != 0) {
+		return (zpoolfail(L, zc->zhp, error, "zpool_props_refresh"));
+	}
+	lua_pushboolean(L, changed);
+	lua_pushboolean(L, missing);
 	return (2);
 }
 
 static int
-l_zpool_get_userprop(lua_State *L)
+l_zpool_cache_generation(lua_State *L)
 {
-	char value[ZPOOL_MAXPROPLEN];
-	zpool_handle_t *zhp;
-	const char *propname;
-	zprop_source_t source;
-	int error;
-
-	value[0] = '\0';
+	struct zpool_cache *zc;
 
-	zhp = checkzpool(L, 1);
-	propname = luaL_checkstring(L, 2);
+	zc = checkzpoolcache(L, 1);
 
-	if ((error = zpool_get_userprop(zhp, propname, value, sizeof(value),
-	    &source)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_get_userprop"));
-	}
-	lua_pushstring(L, value);
-	lua_pushinteger(L, source);
-	return (2);
+	lua_pushinteger(L, zc->generation);
+	return (1);
 }
 
 static int
-l_zpool_get_prop_int(lua_State *L)
+l_zpool_cache_state(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	zpool_prop_t prop;
-	zprop_source_t source;
+	struct zpool_cache *zc;
 
-	zhp = checkzpool(L, 1);
-	prop = luaL_checkinteger(L, 2);
+	zc = checkzpoolcache(L, 1);
 
-	lua_pushinteger(L, zpool_get_prop_int(zhp, prop, &source));
-	lua_pushinteger(L, source);
-	return (2);
+	lua_pushinteger(L, zc->state);
+	return (1);
 }
 
 static int
-l_zpool_props_refresh(lua_State *L)
+l_zpool_cache_status(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	int error;
+	struct zpool_cache *zc;
 
-	zhp = checkzpool(L, 1);
+	zc = checkzpoolcache(L, 1);
 
-	if ((error = zpool_props_refresh(zhp)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_refresh_props"));
+	lua_pushinteger(L, zc->status);
+	if (zc->msgid == NULL) {
+		lua_pushnil(L);
+	} else {
+		lua_pushstring(L, zc->msgid);
 	}
-	return (success(L));
+	if (zc->status == ZPOOL_STATUS_ERRATA) {
+		lua_pushinteger(L, zc->errata);
+		return (3);
+	}
+	return (2);
 }
 
 static int
-l_zpool_get_vdev_prop(lua_State *L)
+l_zpool_cache_prop(lua_State *L)
 {
 	char value[ZPOOL_MAXPROPLEN];
-	zpool_handle_t *zhp;
-	const char *vdevname, *propname;
-	vdev_prop_t prop;
+	struct zpool_cache *zc;
+	zpool_prop_t prop;
 	zprop_source_t source;
 	boolean_t literal;
 	int error;
 
-	value[0] = '\0';
-
-	zhp = checkzpool(L, 1);
-	vdevname = luaL_checkstring(L, 2);
-	prop = luaL_optinteger(L, 3, 0);
-	propname = luaL_optstring(L, 4, NULL);
-	literal = lua_toboolean(L, 5);
+	zc = checkzpoolcache(L, 1);
+	prop = luaL_checkinteger(L, 2);
+	literal = lua_toboolean(L, 3);
 
-	if ((error = zpool_get_vdev_prop(zhp, vdevname, prop,
-	    __DECONST(char *, propname), value, sizeof(value), &source,
-	    literal)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_get_vdev_prop"));
+	lua_rawgeti(L, LUA_REGISTRYINDEX, zc->memo);
+	if (lua_rawgeti(L, -1, prop * 2 + literal) == LUA_TTABLE) {
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		return (2);
+	}
+	lua_pop(L, 1);
+	value[0] = '\0';
+	if ((error = zpool_get_prop(zc->zhp, prop, value, sizeof(value),
+	    &source, literal)) != 0) {
+		return (zpoolfail(L, zc->zhp, error, "zpool_get_prop"));
 	}
+	lua_createtable(L, 2, 0);
+	lua_pushstring(L, value);
+	lua_rawseti(L, -2, 1);
+	lua_pushinteger(L, source);
+	lua_rawseti(L, -2, 2);
+	lua_rawseti(L, -2, prop * 2 + literal);
 	lua_pushstring(L, value);
 	lua_pushinteger(L, source);
 	return (2);
 }
 
 static int
-l_zpool_get_all_vdev_props(lua_State *L)
+l_zpool_cache_feature(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	const char *vdevname;
-	nvlist_t *props;
-	int error;
+	struct zpool_cache *zc;
+	nvlist_t *features;
+	const char *guid;
+	uint64_t refcount;
 
-	zhp = checkzpool(L, 1);
-	vdevname = luaL_checkstring(L, 2);
+	zc = checkzpoolcache(L, 1);
+	guid = luaL_checkstring(L, 2);
 
-	if ((error = zpool_get_all_vdev_props(zhp, vdevname, &props)) != 0) {
-		ASSERT0P(props);
-		return (zpoolfail(L, zhp, error, "zpool_get_all_vdev_props"));
+	if (nvlist_lookup_nvlist(zc->config, ZPOOL_CONFIG_FEATURE_STATS,
+	    &features) != 0 ||
+	    nvlist_lookup_uint64(features, guid, &refcount) != 0) {
+		return (0);
 	}
-	ASSERT3P(props, !=, NULL);
-	pushnvlist(L, props);
+	lua_pushinteger(L, refcount);
 	return (1);
 }
 
+/*
+ * Call the nvlist method on the nvlist userdata owning the cached config with
+ * the arguments from idx on.  Views it returns keep that copy alive, so they
+ * go on describing the config as of the refresh that took it.
+ */
 static int
-l_zpool_set_vdev_prop(lua_State *L)
+zpool_cache_callconfig(lua_State *L, struct zpool_cache *zc,
+    const char *method, int idx)
 {
-	zpool_handle_t *zhp;
-	const char *vdevname, *propname, *propval;
-	int error;
-
-	zhp = checkzpool(L, 1);
-	vdevname = luaL_checkstring(L, 2);
-	propname = luaL_checkstring(L, 3);
-	propval = luaL_checkstring(L, 4);
+	int top;
 
-	if ((error = zpool_set_vdev_prop(zhp, vdevname, propname, propval))
-	    != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_set_vdev_prop"));
+	top = lua_gettop(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, zc->configref);
+	lua_getfield(L, -1, method);
+	lua_insert(L, -2);
+	for (int i = idx; i <= top; i++) {
+		lua_pushvalue(L, i);
 	}
-	return (success(L));
+	lua_call(L, top - idx + 2, LUA_MULTRET);
+	return (lua_gettop(L) - top);
 }
 
 static int
-l_zpool_get_config(lua_State *L)
+l_zpool_cache_view(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	nvlist_t *oldconfig, *config;
-
-	oldconfig = config = NULL;
+	struct zpool_cache *zc;
 
-	zhp = checkzpool(L, 1);
+	zc = checkzpoolcache(L, 1);
 
-	if ((config = zpool_get_config(zhp, &oldconfig)) == NULL) {
-		ASSERT0P(config);
-		ASSERT0P(oldconfig);
-		return (zpoolfail(L, zhp, EZFS_UNKNOWN, "zpool_get_config"));
-	}
-	ASSERT3P(config, !=, NULL);
-	pushnvlist(L, config);
-	if (oldconfig != NULL) {
-		pushnvlist(L, oldconfig);
-		return (2);
-	}
-	return (1);
+	return (zpool_cache_callconfig(L, zc, "view", 2));
 }
 
 static int
-l_zpool_get_features(lua_State *L)
+l_zpool_cache_get(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	nvlist_t *features;
+	struct zpool_cache *zc;
 
-	zhp = checkzpool(L, 1);
+	zc = checkzpoolcache(L, 1);
+	luaL_checkstring(L, 2);
+	lua_settop(L, 2);
 
-	if ((features = zpool_get_features(zhp)) == NULL) {
-		return (zpoolfail(L, zhp, EZFS_UNKNOWN, "zpool_get_features"));
-	}
-	pushnvlist(L, features);
-	return (1);
+	return (zpool_cache_callconfig(L, zc, "get", 2));
 }
 
 static int
-l_zpool_refresh_stats(lua_State *L)
+l_zpool_cache_config(lua_State *L)
 {
-	zpool_handle_t *zhp;
-	boolean_t missing;
+	struct zpool_cache *zc;
+	nvlist_t *copy;
 	int error;
 
-	zhp = checkzpool(L, 1);
+	zc = checkzpoolcache(L, 1);
 
-	if ((error = zpool_refresh_stats(zhp, &missing)) != 0) {
-		return (zpoolfail(L, zhp, error, "zpool_refresh_stats"));
+	if ((error = nvlist_dup(zc->config, &copy, 0)) != 0) {
+		return (fail(L, error));
 	}
-	lua_pushboolean(L, missing);
+	pushnvlist(L, copy);
 	return (1);
 }
 
-#if __FreeBSD_version > 1600001
-static int
-l_zpool_refresh_stats_from_handle(lua_State *L)
-{
-	zpool_handle_t *zhp, *fromzhp;
-
-	zhp = checkzpool(L, 1);
-	fromzhp = checkzpool(L, 2);
-
-	zpool_refresh_stats_from_handle(zhp, fromzhp);
-	return (0);
-}
-#endif
-
 static int
 l_zpool_get_errlog(lua_State *L)
 {
@@ -4009,6 +7632,7 @@ static const struct luaL_Reg l_zfs_meta[] = {
 	{"iter_snapspec_v2", l_zfs_iter_snapspec_v2},
 	{"iter_bookmarks_v2", l_zfs_iter_bookmarks_v2},
 	{"iter_mounted", l_zfs_iter_mounted},
+	{"iter", l_zfs_iter},
 	{"wait_status", l_zfs_wait_status},
 	{"crypto_get_encryption_root", l_zfs_crypto_get_encryption_root},
 	{"crypto_load_key", l_zfs_crypto_load_key},
@@ -4031,9 +7655,7 @@ static const struct luaL_Reg l_zfs_meta[] = {
 	{"hold_nvl", l_zfs_hold_nvl},
 	{"release", l_zfs_release},
 	{"get_holds", l_zfs_get_holds},
-#if 0 /* TODO */
 	{"userspace", l_zfs_userspace},
-#endif
 	/* TODO: fsacl methods */
 	{"refresh_properties", l_zfs_refresh_properties},
 	{"parent_name", l_zfs_parent_name},
@@ -4048,6 +7670,71 @@ static const struct luaL_Reg l_zfs_meta[] = {
 	{NULL, NULL}
 };
 
+static const struct luaL_Reg l_zfs_iter_meta[] = {
+	{"__call", l_zfs_iter_call},
+	{"__close", l_zfs_iter_close},
+	{"__gc", l_zfs_iter_close},
+	{"close", l_zfs_iter_close},
+	{"next", l_zfs_iter_next},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_zpool_iostat_meta[] = {
+	{"__close", l_zpool_iostat_close},
+	{"__gc", l_zpool_iostat_close},
+	{"close", l_zpool_iostat_close},
+	{"sample", l_zpool_iostat_sample},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_zpool_cache_meta[] = {
+	{"__close", l_zpool_cache_close},
+	{"__gc", l_zpool_cache_close},
+	{"close", l_zpool_cache_close},
+	{"refresh", l_zpool_cache_refresh},
+	{"generation", l_zpool_cache_generation},
+	{"state", l_zpool_cache_state},
+	{"status", l_zpool_cache_status},
+	{"prop", l_zpool_cache_prop},
+	{"feature", l_zpool_cache_feature},
+	{"view", l_zpool_cache_view},
+	{"get", l_zpool_cache_get},
+	{"config", l_zpool_cache_config},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_zevent_sub_meta[] = {
+	{"__close", l_zevent_sub_close},
+	{"__gc", l_zevent_sub_close},
+	{"close", l_zevent_sub_close},
+	{"drain", l_zevent_sub_drain},
+	{"fd", l_zevent_sub_fd},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_snapindex_meta[] = {
+	{"__close", l_snapindex_close},
+	{"__gc", l_snapindex_close},
+	{"__len", l_snapindex_len},
+	{"close", l_snapindex_close},
+	{"range", l_snapindex_range},
+	{"keep", l_snapindex_keep},
+	{"update", l_snapindex_update},
+	{"refresh", l_snapindex_refresh},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_replicator_meta[] = {
+	{"__close", l_replicator_close},
+	{"__gc", l_replicator_close},
+	{"close", l_replicator_close},
+	{"add", l_replicator_add},
+	{"status", l_replicator_status},
+	{"wait", l_replicator_wait},
+	{"cancel", l_replicator_cancel},
+	{NULL, NULL}
+};
+
 static const struct luaL_Reg l_zpool_meta[] = {
 	{"__close", l_zpool_close},
 	{"__gc", l_zpool_close},
@@ -4118,6 +7805,8 @@ static const struct luaL_Reg l_zpool_meta[] = {
 	{"get_config", l_zpool_get_config},
 	{"get_features", l_zpool_get_features},
 	{"refresh_stats", l_zpool_refresh_stats},
+	{"iostat_sampler", l_zpool_iostat_sampler},
+	{"state_cache", l_zpool_state_cache},
 #if __FreeBSD_version > 1600001
 	{"refresh_stats_from_handle", l_zpool_refresh_stats_from_handle},
 #endif
@@ -4171,10 +7860,15 @@ static const struct luaL_Reg l_libzfs_meta[] = {
 	{"events_next", l_zpool_events_next},
 	{"events_clear", l_zpool_events_clear},
 	{"events_seek", l_zpool_events_seek},
+	{"events_subscribe", l_zpool_events_subscribe},
 	{"explain_recover", l_zpool_explain_recover},
 	{"foreach_mountpoint", l_zfs_foreach_mountpoint},
+	{"mount_datasets", l_zfs_mount_datasets},
+	{"unmount_datasets", l_zfs_unmount_datasets},
 	{"open", l_zfs_open},
 	{"iter_root", l_zfs_iter_root},
+	{"list_datasets", l_zfs_list_datasets},
+	{"snapshot_index", l_zfs_snapshot_index},
 	{"crypto_create", l_zfs_crypto_create},
 	{"crypto_clone_check", l_zfs_crypto_clone_check},
 	{"crypto_attempt_load_keys", l_zfs_crypto_attempt_load_keys},
@@ -4193,6 +7887,7 @@ static const struct luaL_Reg l_libzfs_meta[] = {
 	{"send_resume", l_zfs_send_resume},
 	{"send_resume_token_to_nvlist", l_zfs_send_resume_token_to_nvlist},
 	{"receive", l_zfs_receive},
+	{"replicator", l_zfs_replicator},
 	{"is_mounted", l_is_mounted},
 	{"nicestrtonum", l_zfs_nicestrtonum},
 	{"pool_in_use", l_zpool_in_use},
@@ -4223,11 +7918,41 @@ luaopen_zfs(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_zfs_meta, 0);
 
+	luaL_newmetatable(L, ZFS_ITER_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_zfs_iter_meta, 0);
+
 	luaL_newmetatable(L, ZPOOL_HANDLE_METATABLE);
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, l_zpool_meta, 0);
 
+	luaL_newmetatable(L, ZPOOL_IOSTAT_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_zpool_iostat_meta, 0);
+
+	luaL_newmetatable(L, ZPOOL_CACHE_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_zpool_cache_meta, 0);
+
+	luaL_newmetatable(L, ZEVENT_SUB_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_zevent_sub_meta, 0);
+
+	luaL_newmetatable(L, SNAPINDEX_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_snapindex_meta, 0);
+
+	luaL_newmetatable(L, REPLICATOR_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_replicator_meta, 0);
+
 	luaL_newmetatable(L, LIBZFS_HANDLE_METATABLE);
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
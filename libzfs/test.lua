@@ -16,3 +16,200 @@ assert(hdl:iter_root(function(ds)
 	ds:close()
 end))
 hdl:fini()
+hdl = zfs.init()
+handles = {}
+assert(hdl:iter_root(function(ds)
+	table.insert(handles, ds)
+	assert(ds:iter_filesystems(function(child)
+		table.insert(handles, child)
+	end))
+end))
+seen = 0
+assert(hdl:foreach_mountpoint(handles, 4, function(ds, tag)
+	assert(tag == 'tag')
+	seen = seen + 1
+end, 'tag'))
+assert(seen == #handles)
+for _, ds in ipairs(handles) do
+	ds:close()
+end
+hdl:fini()
+hdl = zfs.init()
+list = hdl:list_datasets(nil, {props={'used', 'mountpoint'}, literal=true})
+assert(#list.name == #list.type)
+assert(#list.name == #list.used)
+for i, name in ipairs(list.name) do
+	print('list:', name, list.type[i], list.used[i], list.mountpoint[i])
+end
+list = hdl:list_datasets(nil, {props={'compression'}, literal=true})
+for i = 1, #list.name do
+	assert(list.compression[i] == false or
+	    type(list.compression[i]) == 'string')
+end
+list = hdl:list_datasets({'nonexistent/dataset'})
+assert(#list.name == 0)
+assert(#list.errors == 1)
+assert(list.errors[1].name == 'nonexistent/dataset')
+hdl:fini()
+hdl = zfs.init()
+assert(hdl:iter_root(function(ds)
+	local expected = {}
+	assert(ds:iter_children_v2(0, function(child)
+		table.insert(expected, child:get_name())
+		child:close()
+	end))
+	local names = {}
+	for child in ds:iter('children', {batch=2, autoclose=true}) do
+		table.insert(names, child:get_name())
+	end
+	assert(#names == #expected)
+	local it <close> = ds:iter('children', {batch=1})
+	if #expected > 0 then
+		local child = assert(it:next())
+		child:close()
+	end
+	-- The iterator owns its handle, so it outlives the parent.
+	ds:close()
+	if #expected > 1 then
+		local child = assert(it:next())
+		child:close()
+	end
+end))
+hdl:fini()
+hdl = zfs.init()
+assert(hdl:iter_pools(function(pool)
+	local sampler <close> = pool:iostat_sampler(true)
+	local sample = assert(sampler:sample())
+	local root = sample.vdevs[1]
+	assert(root.name == pool:get_name())
+	assert(root.depth == 0)
+	assert(sample.interval == nil)
+	assert(root.read_ops == nil)
+	assert(root.total_r_lat == nil)
+	local again = assert(sampler:sample(sample))
+	assert(again == sample)
+	assert(again.vdevs[1] == root)
+	assert(root.read_ops == nil or root.read_ops >= 0)
+	pool:close()
+end))
+hdl:fini()
+hdl = zfs.init()
+assert(hdl:iter_pools(function(pool)
+	local cache <close> = pool:state_cache()
+	local gen = cache:generation()
+	assert(cache:get('name') == pool:get_name())
+	assert(cache:get('vdev_tree.type') == 'root')
+	assert(cache:get('nonexistent.path') == nil)
+	local tree = cache:get('vdev_tree')
+	assert(tree:lookup('type') == 'root')
+	assert(cache:view():get('vdev_tree.type') == 'root')
+	assert(cache:prop(zfs.ZPOOL_PROP_NAME) == pool:get_name())
+	assert(cache:state() == pool:get_state())
+	assert(cache:status() == pool:get_status())
+	assert(cache:refresh(true))
+	assert(cache:generation() == gen + 1)
+	assert(not cache:refresh())
+	assert(cache:generation() == gen + 1)
+	pool:close()
+	assert(not pcall(cache.state, cache))
+end))
+hdl:fini()
+hdl = zfs.init()
+do
+	local sub <close> = assert(hdl:events_subscribe({
+		classes = {'sysevent.fs.zfs.*'},
+		seek = 'end',
+		interval = 5,
+	}))
+	assert(math.type(sub:fd()) == 'integer')
+	local events, dropped = assert(sub:drain())
+	assert(type(events) == 'table')
+	assert(dropped >= 0)
+	assert(not pcall(hdl.events_subscribe, hdl, {interval=0}))
+end
+hdl:fini()
+hdl = zfs.init()
+do
+	local repl <close> = assert(hdl:replicator({threads=2, interval=10}))
+	local id = repl:add('nonexistent/fs@snap', 'nonexistent/copy')
+	local child = repl:add('nonexistent/fs/child@snap',
+	    'nonexistent/copy/child')
+	assert(repl:wait() == 2)
+	assert(repl:status(id).state == 'failed')
+	assert(repl:status(child).errno ~= nil)
+	assert(not pcall(repl.add, repl, 'nonexistent/fs@snap', 'x', {from={}}))
+	assert(not pcall(repl.add, repl, 'nonexistent/fs@snap', 'x',
+	    {resume_token=true}))
+	repl:cancel()
+	id = repl:add('nonexistent/fs@snap2', 'nonexistent/copy')
+	assert(repl:wait() == 3)
+	assert(repl:status(id).state == 'failed')
+end
+hdl:fini()
+-- End to end between two file-backed pools, which needs root.
+if os.getenv('ZFS_TEST_FILEPOOLS') then
+	local dir = os.getenv('TMPDIR') or '/tmp'
+	local src, dst = 'flua_repl_src', 'flua_repl_dst'
+	for _, pool in ipairs({src, dst}) do
+		assert(os.execute(('truncate -s 128m %s/%s'):format(dir, pool)))
+		assert(os.execute(('zpool create %s %s/%s'):format(pool, dir,
+		    pool)))
+	end
+	assert(os.execute(('zfs create -p %s/a/b'):format(src)))
+	assert(os.execute(('zfs snapshot -r %s@1'):format(src)))
+	hdl = zfs.init()
+	do
+		local repl <close> = assert(hdl:replicator({threads=4}))
+		for _, fs in ipairs({'a', 'a/b'}) do
+			repl:add(('%s/%s@1'):format(src, fs),
+			    ('%s/%s'):format(dst, fs))
+		end
+		assert(repl:wait() == 0)
+		for _, st in ipairs(repl:status()) do
+			assert(st.state == 'done')
+			assert(st.bytes > 0)
+		end
+	end
+	assert(hdl:dataset_exists(dst .. '/a/b@1', zfs.ZFS_TYPE_SNAPSHOT))
+	hdl:fini()
+	for _, pool in ipairs({src, dst}) do
+		os.execute(('zpool destroy %s'):format(pool))
+		os.remove(('%s/%s'):format(dir, pool))
+	end
+end
+hdl = zfs.init()
+assert(hdl:iter_root(function(ds)
+	local report = assert(ds:userspace({zfs.ZFS_PROP_USERUSED,
+	    zfs.ZFS_PROP_GROUPUSED}, {recursive=true}))
+	assert(#report.type == #report.value)
+	assert(#report.rid == #report.domain)
+	assert(report.dataset == nil)
+	for i = 2, #report.type do
+		assert(report.type[i - 1] <= report.type[i])
+	end
+	local flat = assert(ds:userspace(zfs.ZFS_PROP_USERUSED,
+	    {recursive=true, fold=false}))
+	assert(#flat.dataset == #flat.value)
+	ds:close()
+end))
+hdl:fini()
+hdl = zfs.init()
+assert(hdl:iter_root(function(ds)
+	local name = ds:get_name()
+	local index <close> = assert(hdl:snapshot_index(name))
+	local all = index:range()
+	assert(#all.name == #index)
+	for i = 2, #all.name do
+		local prev = all.name[i - 1]:match('^[^@]*')
+		local cur = all.name[i]:match('^[^@]*')
+		assert(prev < cur or (prev == cur and
+		    all.createtxg[i - 1] < all.createtxg[i]))
+	end
+	local plan = index:keep(nil, {{count=1}})
+	assert(#plan.keep + #plan.destroy == #index)
+	assert(index:update({}) == 0)
+	assert(index:refresh(name))
+	assert(#index == #all.name)
+	ds:close()
+end))
+hdl:fini()
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2026 Ryan Moeller
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sys/param.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "utils.h"
+
+#define LOOKUPCACHE_METATABLE "lookup cache"
+
+#define LOOKUPCACHE_SIZE 1024
+#define LOOKUPCACHE_TTL 60.0
+#define LOOKUPCACHE_NEGATIVE_TTL 5.0
+
+/*
+ * A bounded LRU cache of lookup results, shared by the pwd, grp and netdb
+ * bindings and their casper counterparts.  Results are copied in and out of
+ * the cache, so callers are free to modify the tables they get back.
+ * LRU order and expiry are kept in C.  Keys and values are kept in a table
+ * referenced from the registry: key -> slot, -slot -> key, slot -> value.
+ */
+struct lookupcache_entry {
+	double expires;
+	int error;		/* for negative entries, 0 means not found */
+	bool negative;
+	int prev;		/* LRU list, most recent first */
+	int next;		/* also links the free list */
+};
+
+struct lookupcache {
+	int ref;
+	int size;
+	int count;
+	int head;
+	int tail;
+	int free;
+	double ttl;
+	double negttl;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t expirations;
+	struct lookupcache_entry entries[];
+};
+
+enum lookupcache_result {
+	LOOKUPCACHE_MISS,
+	LOOKUPCACHE_HIT,
+	LOOKUPCACHE_NEGATIVE,
+};
+
+static inline double
+lookupcache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static inline void
+lookupcache_unlink(struct lookupcache *c, int i)
+{
+	struct lookupcache_entry *e = &c->entries[i];
+
+	if (e->prev == -1) {
+		c->head = e->next;
+	} else {
+		c->entries[e->prev].next = e->next;
+	}
+	if (e->next == -1) {
+		c->tail = e->prev;
+	} else {
+		c->entries[e->next].prev = e->prev;
+	}
+}
+
+static inline void
+lookupcache_push(struct lookupcache *c, int i)
+{
+	struct lookupcache_entry *e = &c->entries[i];
+
+	e->prev = -1;
+	e->next = c->head;
+	if (c->head == -1) {
+		c->tail = i;
+	} else {
+		c->entries[c->head].prev = i;
+	}
+	c->head = i;
+}
+
+/*
+ * Push a copy of the value at idx.  Results are trees of plain tables, so
+ * nested tables are copied too.
+ */
+static inline void
+lookupcache_copy(lua_State *L, int idx)
+{
+	idx = lua_absindex(L, idx);
+	if (lua_type(L, idx) != LUA_TTABLE) {
+		lua_pushvalue(L, idx);
+		return;
+	}
+	luaL_checkstack(L, 3, NULL);
+	lua_createtable(L, lua_rawlen(L, idx), 0);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		lookupcache_copy(L, -1);
+		lua_remove(L, -2);
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+}
+
+/* Drop entry i.  The table must be at the top of the stack. */
+static inline void
+lookupcache_remove(lua_State *L, struct lookupcache *c, int i)
+{
+	lua_rawgeti(L, -1, -(i + 1));
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, -(i + 1));
+	lua_pushnil(L);
+	lua_rawseti(L, -2, i + 1);
+	lookupcache_unlink(c, i);
+	c->entries[i].next = c->free;
+	c->free = i;
+	c->count--;
+}
+
+/*
+ * Look up the string key at idx.  A hit pushes a copy of the cached value.  A
+ * negative hit pushes nothing and sets *error to what was recorded.
+ */
+static inline enum lookupcache_result
+lookupcache_get(lua_State *L, struct lookupcache *c, int idx, int *error)
+{
+	struct lookupcache_entry *e;
+	int i;
+
+	idx = lua_absindex(L, idx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, -2) == LUA_TNIL) {
+		lua_pop(L, 2);
+		c->misses++;
+		return (LOOKUPCACHE_MISS);
+	}
+	i = lua_tointeger(L, -1) - 1;
+	lua_pop(L, 1);
+	e = &c->entries[i];
+	if (e->expires <= lookupcache_now()) {
+		lookupcache_remove(L, c, i);
+		lua_pop(L, 1);
+		c->expirations++;
+		c->misses++;
+		return (LOOKUPCACHE_MISS);
+	}
+	lookupcache_unlink(c, i);
+	lookupcache_push(c, i);
+	c->hits++;
+	if (e->negative) {
+		lua_pop(L, 1);
+		*error = e->error;
+		return (LOOKUPCACHE_NEGATIVE);
+	}
+	lua_rawgeti(L, -1, i + 1);
+	lookupcache_copy(L, -1);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	return (LOOKUPCACHE_HIT);
+}
+
+/* Takes a slot for the key at idx, evicting the least recently used. */
+static inline struct lookupcache_entry *
+lookupcache_insert(lua_State *L, struct lookupcache *c, int idx, double ttl)
+{
+	struct lookupcache_entry *e;
+	int i;
+
+	idx = lua_absindex(L, idx);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, -2) != LUA_TNIL) {
+		i = lua_tointeger(L, -1) - 1;
+		lua_pop(L, 1);
+		lookupcache_remove(L, c, i);
+	} else {
+		lua_pop(L, 1);
+	}
+	if (c->free == -1) {
+		lookupcache_remove(L, c, c->tail);
+		c->evictions++;
+	}
+	i = c->free;
+	e = &c->entries[i];
+	c->free = e->next;
+	c->count++;
+	lookupcache_push(c, i);
+	e->expires = lookupcache_now() + ttl;
+	lua_pushvalue(L, idx);
+	lua_pushinteger(L, i + 1);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, -2, -(i + 1));
+	return (e);
+}
+
+/* Caches the value at the top of the stack under the key at idx. */
+static inline void
+lookupcache_put(lua_State *L, struct lookupcache *c, int idx)
+{
+	struct lookupcache_entry *e;
+
+	if (c == NULL || c->ttl <= 0) {
+		return;
+	}
+	idx = lua_absindex(L, idx);
+	e = lookupcache_insert(L, c, idx, c->ttl);
+	e->negative = false;
+	lookupcache_copy(L, -2);
+	lua_rawseti(L, -2, c->head + 1);
+	lua_pop(L, 1);
+}
+
+static inline void
+lookupcache_put_negative(lua_State *L, struct lookupcache *c, int idx,
+    int error)
+{
+	struct lookupcache_entry *e;
+
+	if (c == NULL || c->negttl <= 0) {
+		return;
+	}
+	e = lookupcache_insert(L, c, idx, c->negttl);
+	e->negative = true;
+	e->error = error;
+	lua_pop(L, 1);
+}
+
+/*
+ * Look up the key at idx in c.  Returns the number of values pushed for a
+ * hit, 1 for a result or 0 for a name that was not found with *error set, or
+ * -1 for a miss.
+ */
+static inline int
+lookupcache_lookupkey(lua_State *L, struct lookupcache *c, int idx,
+    int *error)
+{
+	switch (lookupcache_get(L, c, idx, error)) {
+	case LOOKUPCACHE_HIT:
+		return (1);
+	case LOOKUPCACHE_NEGATIVE:
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Like lookupcache_lookupkey with the key formatted from fmt, if there is a
+ * cache.  *key is set to the index of the key for lookupcache_put, or 0 if
+ * there is no cache.
+ */
+static inline int
+lookupcache_lookup(lua_State *L, struct lookupcache *c, int *key, int *error,
+    const char *fmt, ...)
+{
+	va_list ap;
+
+	*key = 0;
+	if (c == NULL) {
+		return (-1);
+	}
+	va_start(ap, fmt);
+	lua_pushvfstring(L, fmt, ap);
+	va_end(ap);
+	*key = lua_gettop(L);
+	return (lookupcache_lookupkey(L, c, *key, error));
+}
+
+static inline struct lookupcache *
+optlookupcache(lua_State *L, int idx)
+{
+	if (lua_isnoneornil(L, idx)) {
+		return (NULL);
+	}
+	return (checkcookie(L, idx, LOOKUPCACHE_METATABLE));
+}
+
+static inline void
+lookupcache_flush(lua_State *L, struct lookupcache *c)
+{
+	lua_newtable(L);
+	lua_rawseti(L, LUA_REGISTRYINDEX, c->ref);
+	c->count = 0;
+	c->head = c->tail = -1;
+	c->free = 0;
+	for (int i = 0; i < c->size; i++) {
+		c->entries[i].next = i + 1 < c->size ? i + 1 : -1;
+	}
+}
+
+static inline int
+lookupcache_new(lua_State *L, int idx)
+{
+	struct lookupcache *c;
+	lua_Integer size;
+	lua_Number ttl, negttl;
+
+	size = LOOKUPCACHE_SIZE;
+	ttl = LOOKUPCACHE_TTL;
+	negttl = LOOKUPCACHE_NEGATIVE_TTL;
+	if (!lua_isnoneornil(L, idx)) {
+		luaL_checktype(L, idx, LUA_TTABLE);
+		if (lua_getfield(L, idx, "size") != LUA_TNIL) {
+			size = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, idx, "ttl") != LUA_TNIL) {
+			ttl = luaL_checknumber(L, -1);
+		}
+		if (lua_getfield(L, idx, "negative_ttl") != LUA_TNIL) {
+			negttl = luaL_checknumber(L, -1);
+		}
+		lua_pop(L, 3);
+	}
+	luaL_argcheck(L, size > 0 && size <= INT_MAX / 2, idx, "invalid size");
+
+	if ((c = calloc(1, sizeof(*c) + size * sizeof(*c->entries))) == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	c->size = size;
+	c->ttl = ttl;
+	c->negttl = negttl;
+	lua_newtable(L);
+	c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lookupcache_flush(L, c);
+	return (new(L, c, LOOKUPCACHE_METATABLE));
+}
+
+static int
+l_lookupcache_close(lua_State *L)
+{
+	struct lookupcache *c;
+
+	if ((c = checkcookienull(L, 1, LOOKUPCACHE_METATABLE)) == NULL) {
+		return (0);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+	free(c);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
+static int
+l_lookupcache_flush(lua_State *L)
+{
+	struct lookupcache *c;
+
+	c = checkcookie(L, 1, LOOKUPCACHE_METATABLE);
+
+	lookupcache_flush(L, c);
+	return (0);
+}
+
+static int
+l_lookupcache_stats(lua_State *L)
+{
+	struct lookupcache *c;
+
+	c = checkcookie(L, 1, LOOKUPCACHE_METATABLE);
+
+	lua_createtable(L, 0, 6);
+#define FIELD(name) ({ \
+	lua_pushinteger(L, c->name); \
+	lua_setfield(L, -2, #name); \
+})
+	FIELD(size);
+	FIELD(count);
+	FIELD(hits);
+	FIELD(misses);
+	FIELD(evictions);
+	FIELD(expirations);
+#undef FIELD
+	return (1);
+}
+
+static const struct luaL_Reg l_lookupcache_meta[] = {
+	{"__close", l_lookupcache_close},
+	{"__gc", l_lookupcache_close},
+	{"close", l_lookupcache_close},
+	{"flush", l_lookupcache_flush},
+	{"stats", l_lookupcache_stats},
+	{NULL, NULL}
+};
+
+/* Every module that accepts a cache registers the metatable if needed. */
+static inline void
+lookupcache_register(lua_State *L)
+{
+	if (luaL_newmetatable(L, LOOKUPCACHE_METATABLE)) {
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+		luaL_setfuncs(L, l_lookupcache_meta, 0);
+	}
+	lua_pop(L, 1);
+}
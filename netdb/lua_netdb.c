@@ -4,16 +4,28 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sys/queue.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "sys/socket/lua_socket.h"
+#include "lookupcache.h"
 #include "lua_netdb.h"
 #include "utils.h"
 
+#define RESOLVER_METATABLE "netdb resolver"
+
+#define RESOLVER_THREADS 4
+
 int luaopen_netdb(lua_State *);
 
 static int
@@ -21,8 +33,9 @@ l_getaddrinfo(lua_State *L)
 {
 	struct addrinfo hints, *res;
 	const struct addrinfo *hintsp;
+	struct lookupcache *cache;
 	const char *hostname, *servname;
-	int error;
+	int key, n, error;
 
 	hostname = luaL_optstring(L, 1, NULL);
 	servname = luaL_optstring(L, 2, NULL);
@@ -32,8 +45,21 @@ l_getaddrinfo(lua_State *L)
 	} else {
 		hintsp = NULL;
 	}
+	cache = optlookupcache(L, 4);
+
+	key = 0;
+	if (cache != NULL) {
+		pushaikey(L, hostname, servname, hintsp);
+		key = lua_gettop(L);
+		if ((n = lookupcache_lookupkey(L, cache, key, &error)) != -1) {
+			return (n == 0 ? gai_fail(L, error) : n);
+		}
+	}
 
 	if ((error = getaddrinfo(hostname, servname, hintsp, &res)) != 0) {
+		if (error == EAI_NONAME || error == EAI_NODATA) {
+			lookupcache_put_negative(L, cache, key, error);
+		}
 		return (gai_fail(L, error));
 	}
 	lua_newtable(L);
@@ -42,6 +68,7 @@ l_getaddrinfo(lua_State *L)
 		lua_rawseti(L, -2, luaL_len(L, -2) + 1);
 	}
 	freeaddrinfo(res);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -74,18 +101,27 @@ l_getprotobyname(lua_State *L)
 	const char *name;
 	struct protoent result;
 	struct protoent *ent;
-	int error;
+	struct lookupcache *cache;
+	int key, n, error;
 
 	name = luaL_checkstring(L, 1);
+	cache = optlookupcache(L, 2);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "protonam:%s", name);
+	if (n != -1) {
+		return (n);
+	}
 
 	if ((error = getprotobyname_r(name, &result, buf, sizeof(buf), &ent))
 	    != 0) {
 		return (fail(L, error));
 	}
 	if (ent == NULL) {
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushprotoent(L, ent);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -110,17 +146,511 @@ l_getprotobynumber(lua_State *L)
 	return (1);
 }
 
+/*
+ * An asynchronous resolver runs getaddrinfo on a pool of threads.  Lookups are
+ * queued by the Lua thread and completed lookups are collected by it, so Lua
+ * state is only touched there.  A byte is written to a pipe for each completion
+ * to make the read end usable with kqueue or poll.
+ *
+ * Identical queries in flight share one lookup.  The Lua side state is kept in
+ * a table referenced from the registry:
+ *	inflight: key -> job id
+ *	waiters: job id -> {key = key, request id, ...}
+ *	results, errors: request id -> result, for the next collect
+ *	cache: the optional lookup cache
+ */
+struct gaijob {
+	STAILQ_ENTRY(gaijob) link;
+	lua_Integer id;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	const char *hostname;
+	const char *servname;
+	int error;
+	bool hashints;
+	char names[];
+};
+
+STAILQ_HEAD(gaijobs, gaijob);
+
+struct resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct gaijobs queue;
+	struct gaijobs done;
+	bool stopping;
+	int wakefds[2];
+	int ref;
+	lua_Integer nextid;
+	lua_Integer npending;	/* requests not yet collected */
+	lua_Integer nready;	/* of those, ready to be collected */
+	int nthreads;
+	pthread_t threads[];
+};
+
+static void *
+resolver_worker(void *arg)
+{
+	struct resolver *r = arg;
+	struct gaijob *job;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (!r->stopping && STAILQ_EMPTY(&r->queue)) {
+			pthread_cond_wait(&r->work, &r->lock);
+		}
+		if (r->stopping) {
+			break;
+		}
+		job = STAILQ_FIRST(&r->queue);
+		STAILQ_REMOVE_HEAD(&r->queue, link);
+		pthread_mutex_unlock(&r->lock);
+
+		job->error = getaddrinfo(job->hostname, job->servname,
+		    job->hashints ? &job->hints : NULL, &job->res);
+
+		pthread_mutex_lock(&r->lock);
+		STAILQ_INSERT_TAIL(&r->done, job, link);
+		/* A full pipe is readable already. */
+		(void)write(r->wakefds[1], "", 1);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return (NULL);
+}
+
+static void
+gaijobs_free(struct gaijobs *jobs)
+{
+	struct gaijob *job;
+
+	while ((job = STAILQ_FIRST(jobs)) != NULL) {
+		STAILQ_REMOVE_HEAD(jobs, link);
+		if (job->res != NULL) {
+			freeaddrinfo(job->res);
+		}
+		free(job);
+	}
+}
+
+static void
+resolver_shutdown(struct resolver *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->stopping = true;
+	pthread_cond_broadcast(&r->work);
+	pthread_mutex_unlock(&r->lock);
+	for (int i = 0; i < r->nthreads; i++) {
+		pthread_join(r->threads[i], NULL);
+	}
+	gaijobs_free(&r->queue);
+	gaijobs_free(&r->done);
+	pthread_cond_destroy(&r->work);
+	pthread_mutex_destroy(&r->lock);
+	close(r->wakefds[0]);
+	close(r->wakefds[1]);
+	free(r);
+}
+
+static int
+l_resolver(lua_State *L)
+{
+	struct resolver *r;
+	lua_Integer nthreads;
+	int error;
+
+	nthreads = RESOLVER_THREADS;
+	lua_settop(L, 1);
+	if (!lua_isnil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		if (lua_getfield(L, 1, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+		}
+		if (lua_getfield(L, 1, "cache") != LUA_TNIL) {
+			luaL_checkudata(L, -1, LOOKUPCACHE_METATABLE);
+		}
+		lua_remove(L, -2);
+	} else {
+		lua_pushnil(L);
+	}
+	luaL_argcheck(L, nthreads > 0 && nthreads <= 256, 1,
+	    "invalid threads");
+
+	if ((r = calloc(1, sizeof(*r) + nthreads * sizeof(pthread_t)))
+	    == NULL) {
+		return (fatal(L, "calloc", ENOMEM));
+	}
+	if (pipe2(r->wakefds, O_CLOEXEC | O_NONBLOCK) == -1) {
+		error = errno;
+		free(r);
+		return (fail(L, error));
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->work, NULL);
+	STAILQ_INIT(&r->queue);
+	STAILQ_INIT(&r->done);
+	r->nextid = 1;
+	for (; r->nthreads < nthreads; r->nthreads++) {
+		if ((error = pthread_create(&r->threads[r->nthreads], NULL,
+		    resolver_worker, r)) != 0) {
+			resolver_shutdown(r);
+			return (fail(L, error));
+		}
+	}
+
+	lua_createtable(L, 0, 6);
+	lua_insert(L, -2);
+	lua_setfield(L, -2, "cache");
+	lua_newtable(L);
+	lua_setfield(L, -2, "inflight");
+	lua_newtable(L);
+	lua_setfield(L, -2, "waiters");
+	lua_newtable(L);
+	lua_setfield(L, -2, "results");
+	lua_newtable(L);
+	lua_setfield(L, -2, "errors");
+	r->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return (new(L, r, RESOLVER_METATABLE));
+}
+
+static int
+l_resolver_close(lua_State *L)
+{
+	struct resolver *r;
+
+	if ((r = checkcookienull(L, 1, RESOLVER_METATABLE)) == NULL) {
+		return (0);
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, r->ref);
+	resolver_shutdown(r);
+	setcookie(L, 1, NULL);
+	return (0);
+}
+
+/* The cache from the state table at idx, if any and not closed. */
+static struct lookupcache *
+resolver_cache(lua_State *L, int idx)
+{
+	struct lookupcache *cache;
+
+	lua_getfield(L, idx, "cache");
+	cache = testcookie(L, -1, LOOKUPCACHE_METATABLE);
+	lua_pop(L, 1);
+	return (cache);
+}
+
+/* Record the result at the top of the stack, or an error, for a request. */
+static void
+resolver_ready(lua_State *L, struct resolver *r, int state, lua_Integer id,
+    int error)
+{
+	if (error != 0) {
+		lua_pop(L, 1);
+		lua_getfield(L, state, "errors");
+		lua_pushstring(L, gai_strerror(error));
+		lua_rawseti(L, -2, id);
+		lua_pop(L, 1);
+		lua_pushboolean(L, false);
+	}
+	lua_getfield(L, state, "results");
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, id);
+	lua_pop(L, 1);
+	r->nready++;
+}
+
+/*
+ * Queue one query.  The state table is at state and the query arguments are
+ * at args, in the order of getaddrinfo.
+ */
+static lua_Integer
+resolver_submit(lua_State *L, struct resolver *r, int state, int args)
+{
+	struct addrinfo hints;
+	const struct addrinfo *hintsp;
+	struct lookupcache *cache;
+	struct gaijob *job;
+	const char *hostname, *servname;
+	size_t hostlen, servlen;
+	lua_Integer id;
+	int key, error;
+
+	hostname = luaL_optlstring(L, args, NULL, &hostlen);
+	servname = luaL_optlstring(L, args + 1, NULL, &servlen);
+	if (lua_istable(L, args + 2)) {
+		hintsp = &hints;
+		checkai(L, args + 2, &hints);
+	} else {
+		hintsp = NULL;
+	}
+	id = r->nextid++;
+	r->npending++;
+
+	pushaikey(L, hostname, servname, hintsp);
+	key = lua_gettop(L);
+	if ((cache = resolver_cache(L, state)) != NULL) {
+		switch (lookupcache_get(L, cache, key, &error)) {
+		case LOOKUPCACHE_HIT:
+			resolver_ready(L, r, state, id, 0);
+			goto wake;
+		case LOOKUPCACHE_NEGATIVE:
+			lua_pushnil(L);
+			resolver_ready(L, r, state, id, error);
+			goto wake;
+		case LOOKUPCACHE_MISS:
+			break;
+		}
+	}
+
+	lua_getfield(L, state, "waiters");
+	lua_getfield(L, state, "inflight");
+	lua_pushvalue(L, key);
+	if (lua_rawget(L, -2) != LUA_TNIL) {
+		/* Join the lookup already in flight. */
+		lua_rawget(L, -3);
+		lua_pushinteger(L, id);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_settop(L, key - 1);
+		return (id);
+	}
+	lua_pop(L, 1);
+
+	if ((job = calloc(1, sizeof(*job) + hostlen + servlen + 2)) == NULL) {
+		fatal(L, "calloc", ENOMEM);
+	}
+	job->id = id;
+	if (hostname != NULL) {
+		job->hostname = memcpy(job->names, hostname, hostlen + 1);
+	}
+	if (servname != NULL) {
+		job->servname = memcpy(job->names + hostlen + 1, servname,
+		    servlen + 1);
+	}
+	if (hintsp != NULL) {
+		job->hints = hints;
+		job->hashints = true;
+	}
+	lua_pushvalue(L, key);
+	lua_pushinteger(L, id);
+	lua_rawset(L, -3);
+	lua_createtable(L, 1, 1);
+	lua_pushvalue(L, key);
+	lua_setfield(L, -2, "key");
+	lua_pushinteger(L, id);
+	lua_rawseti(L, -2, 1);
+	lua_rawseti(L, -3, id);
+	lua_settop(L, key - 1);
+
+	pthread_mutex_lock(&r->lock);
+	STAILQ_INSERT_TAIL(&r->queue, job, link);
+	pthread_cond_signal(&r->work);
+	pthread_mutex_unlock(&r->lock);
+	return (id);
+wake:
+	(void)write(r->wakefds[1], "", 1);
+	lua_settop(L, key - 1);
+	return (id);
+}
+
+static int
+l_resolver_submit(lua_State *L)
+{
+	struct resolver *r;
+
+	r = checkcookie(L, 1, RESOLVER_METATABLE);
+	lua_settop(L, 4);
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, r->ref);
+	lua_pushinteger(L, resolver_submit(L, r, 5, 2));
+	return (1);
+}
+
+static int
+l_resolver_submit_batch(lua_State *L)
+{
+	struct resolver *r;
+	lua_Integer n;
+
+	r = checkcookie(L, 1, RESOLVER_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	n = luaL_len(L, 2);
+	lua_settop(L, 2);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, r->ref);
+	lua_createtable(L, n, 0);
+	for (lua_Integer i = 1; i <= n; i++) {
+		luaL_argcheck(L, lua_rawgeti(L, 2, i) == LUA_TTABLE, 2,
+		    "expected an array of queries");
+		lua_rawgeti(L, 5, 1);
+		lua_rawgeti(L, 5, 2);
+		lua_rawgeti(L, 5, 3);
+		lua_pushinteger(L, resolver_submit(L, r, 3, 6));
+		lua_rawseti(L, 4, i);
+		lua_settop(L, 4);
+	}
+	return (1);
+}
+
+/* Deliver the completed lookups into the results of the state at idx. */
+static void
+resolver_complete(lua_State *L, struct resolver *r, int state)
+{
+	struct gaijobs done;
+	struct gaijob *job;
+	struct lookupcache *cache;
+	char buf[64];
+
+	while (read(r->wakefds[0], buf, sizeof(buf)) > 0) {
+	}
+	STAILQ_INIT(&done);
+	pthread_mutex_lock(&r->lock);
+	STAILQ_CONCAT(&done, &r->done);
+	pthread_mutex_unlock(&r->lock);
+
+	cache = resolver_cache(L, state);
+	lua_getfield(L, state, "waiters");
+	lua_getfield(L, state, "inflight");
+	while ((job = STAILQ_FIRST(&done)) != NULL) {
+		int waiters, key, n;
+
+		STAILQ_REMOVE_HEAD(&done, link);
+		lua_rawgeti(L, -2, job->id);
+		waiters = lua_gettop(L);
+		lua_getfield(L, waiters, "key");
+		key = lua_gettop(L);
+		lua_pushvalue(L, key);
+		lua_pushnil(L);
+		lua_rawset(L, waiters - 1);
+		lua_pushnil(L);
+		lua_rawseti(L, waiters - 2, job->id);
+
+		if (job->error == 0) {
+			lua_newtable(L);
+			for (const struct addrinfo *ai = job->res; ai != NULL;
+			    ai = ai->ai_next) {
+				pushai(L, ai);
+				lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+			}
+			freeaddrinfo(job->res);
+			lookupcache_put(L, cache, key);
+		} else {
+			if (job->error == EAI_NONAME ||
+			    job->error == EAI_NODATA) {
+				lookupcache_put_negative(L, cache, key,
+				    job->error);
+			}
+			lua_pushnil(L);
+		}
+		/* Duplicates share the result table. */
+		n = lua_rawlen(L, waiters);
+		for (int i = 1; i <= n; i++) {
+			lua_Integer id;
+
+			lua_rawgeti(L, waiters, i);
+			id = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			resolver_ready(L, r, state, id, job->error);
+		}
+		lua_settop(L, waiters - 1);
+		free(job);
+	}
+	lua_pop(L, 2);
+}
+
+static int
+l_resolver_collect(lua_State *L)
+{
+	struct resolver *r;
+	bool wait;
+
+	r = checkcookie(L, 1, RESOLVER_METATABLE);
+	wait = lua_toboolean(L, 2);
+
+	lua_settop(L, 2);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, r->ref);
+	resolver_complete(L, r, 3);
+	while (wait && r->nready == 0 && r->npending > 0) {
+		struct pollfd pfd = {
+			.fd = r->wakefds[0],
+			.events = POLLIN,
+		};
+
+		if (poll(&pfd, 1, INFTIM) == -1 && errno != EINTR) {
+			return (fail(L, errno));
+		}
+		resolver_complete(L, r, 3);
+	}
+	lua_getfield(L, 3, "results");
+	lua_getfield(L, 3, "errors");
+	lua_newtable(L);
+	lua_setfield(L, 3, "results");
+	lua_newtable(L);
+	lua_setfield(L, 3, "errors");
+	r->npending -= r->nready;
+	r->nready = 0;
+	return (2);
+}
+
+static int
+l_resolver_pending(lua_State *L)
+{
+	struct resolver *r;
+
+	r = checkcookie(L, 1, RESOLVER_METATABLE);
+
+	lua_pushinteger(L, r->npending);
+	return (1);
+}
+
+static int
+l_resolver_fileno(lua_State *L)
+{
+	struct resolver *r;
+
+	r = checkcookie(L, 1, RESOLVER_METATABLE);
+
+	lua_pushinteger(L, r->wakefds[0]);
+	return (1);
+}
+
+static int
+l_netdb_cache(lua_State *L)
+{
+	return (lookupcache_new(L, 1));
+}
+
 static const struct luaL_Reg l_netdb_funcs[] = {
+	{"cache", l_netdb_cache},
 	{"getaddrinfo", l_getaddrinfo},
 	{"getnameinfo", l_getnameinfo},
 	{"getprotobyname", l_getprotobyname},
 	{"getprotobynumber", l_getprotobynumber},
+	{"resolver", l_resolver},
+	{NULL, NULL}
+};
+
+static const struct luaL_Reg l_resolver_meta[] = {
+	{"__close", l_resolver_close},
+	{"__gc", l_resolver_close},
+	{"close", l_resolver_close},
+	{"collect", l_resolver_collect},
+	{"fileno", l_resolver_fileno},
+	{"pending", l_resolver_pending},
+	{"submit", l_resolver_submit},
+	{"submit_batch", l_resolver_submit_batch},
 	{NULL, NULL}
 };
 
 int
 luaopen_netdb(lua_State *L)
 {
+	lookupcache_register(L);
+
+	luaL_newmetatable(L, RESOLVER_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, l_resolver_meta, 0);
+
 	luaL_newlib(L, l_netdb_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushliteral(L, ident); \
@@ -51,6 +51,29 @@ checkai(lua_State *L, int idx, struct addrinfo *ai)
 	/* Other fields are not relevant to getaddrinfo. */
 }
 
+/* Key for caching getaddrinfo results, see lookupcache.h. */
+static inline void
+pushaikey(lua_State *L, const char *hostname, const char *servname,
+    const struct addrinfo *hints)
+{
+	luaL_Buffer b;
+
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "ai:");
+	if (hints != NULL) {
+		lua_pushfstring(L, "%d:%d:%d:%d", hints->ai_flags,
+		    hints->ai_family, hints->ai_socktype, hints->ai_protocol);
+		luaL_addvalue(&b);
+	}
+	/* NUL can't appear in either name, so it separates them. */
+	luaL_addchar(&b, hostname != NULL ? '+' : '-');
+	luaL_addstring(&b, hostname != NULL ? hostname : "");
+	luaL_addchar(&b, '\0');
+	luaL_addchar(&b, servname != NULL ? '+' : '-');
+	luaL_addstring(&b, servname != NULL ? servname : "");
+	luaL_pushresult(&b);
+}
+
 static inline void
 pushai(lua_State *L, const struct addrinfo *ai)
 {
@@ -8,3 +8,39 @@ for _, ai in ipairs(addrs) do
 	local host, port = assert(netdb.getnameinfo(ai.addr, flags))
 	print(('%s:%s'):format(host, port))
 end
+
+local cache <close> = netdb.cache()
+local tcp = assert(netdb.getprotobyname('tcp', cache))
+tcp.aliases[1] = 'changed'
+assert(netdb.getprotobyname('tcp', cache).aliases[1] ~= 'changed')
+assert(#netdb.getaddrinfo('localhost', 'http', hints, cache) ==
+    #netdb.getaddrinfo('localhost', 'http', hints, cache))
+assert(cache:stats().hits == 2)
+
+-- localhost and numeric hosts resolve without a name server.
+local event = require('sys.event')
+local resolver <close> = assert(netdb.resolver({threads=2, cache=cache}))
+local numeric = {flags=netdb.AI_NUMERICHOST, socktype=socket.SOCK_STREAM}
+local ids = resolver:submit_batch({
+	{'localhost', 'http', hints},
+	{'127.0.0.1', '80', numeric},
+	{'127.0.0.1', '80', numeric},
+	{'not an address', '80', numeric},
+})
+assert(resolver:pending() == 4)
+local kq <close> = event.kqueue()
+local ev = assert(kq:kevent({{ident=resolver:fileno(),
+    filter=event.EVFILT_READ, flags=event.EV_ADD}}))
+assert(ev.ident == resolver:fileno())
+local results, errors = {}, {}
+while resolver:pending() > 0 do
+	local r, e = resolver:collect(true)
+	for id, addrs in pairs(r) do
+		results[id] = addrs
+		errors[id] = e[id]
+	end
+end
+assert(#results[ids[1]] ==
+    #netdb.getaddrinfo('localhost', 'http', hints, cache))
+assert(#results[ids[2]] == 1 and results[ids[2]] == results[ids[3]])
+assert(results[ids[4]] == false and errors[ids[4]])
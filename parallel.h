@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 Ryan Moeller
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sys/param.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define PARALLEL_MAXTHREADS 64
+
+struct parallel_for {
+	void (*fn)(void *, size_t);
+	void *arg;
+	size_t n;
+	atomic_size_t next;
+};
+
+static inline void *
+parallel_for_worker(void *arg)
+{
+	struct parallel_for *pf = arg;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&pf->next, 1)) < pf->n) {
+		pf->fn(pf->arg, i);
+	}
+	return (NULL);
+}
+
+/*
+ * Call fn(arg, i) for each i in [0, n) using up to nthreads threads, the
+ * calling thread included.  If threads can't be created the caller does the
+ * remaining work itself.
+ */
+static inline void
+parallel_for(int nthreads, size_t n, void (*fn)(void *, size_t), void *arg)
+{
+	pthread_t threads[PARALLEL_MAXTHREADS];
+	struct parallel_for pf = {
+		.fn = fn,
+		.arg = arg,
+		.n = n,
+	};
+	int started;
+
+	atomic_init(&pf.next, 0);
+	nthreads = MIN(MIN(nthreads, PARALLEL_MAXTHREADS), (int)MIN(n, INT_MAX));
+	for (started = 0; started < nthreads - 1; started++) {
+		if (pthread_create(&threads[started], NULL,
+		    parallel_for_worker, &pf) != 0) {
+			break;
+		}
+	}
+	parallel_for_worker(&pf);
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/*
+ * Wait on cond, with lock held, until *active drops to zero or, if timeout is
+ * not negative, until that many seconds have passed.  This is the wait() of
+ * the worker pools that report completion through an idle condition.
+ * Returns 0 or ETIMEDOUT.
+ */
+static inline int
+parallel_wait(pthread_cond_t *cond, pthread_mutex_t *lock, const int *active,
+    double timeout)
+{
+	struct timespec abstime;
+	int error;
+
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &abstime);
+		abstime.tv_sec += (time_t)timeout;
+		abstime.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+		if (abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec++;
+			abstime.tv_nsec -= 1000000000;
+		}
+	}
+	error = 0;
+	while (*active > 0 && error == 0) {
+		if (timeout >= 0) {
+			error = pthread_cond_timedwait(cond, lock, &abstime);
+		} else {
+			error = pthread_cond_wait(cond, lock);
+		}
+	}
+	return (error);
+}
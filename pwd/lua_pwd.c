@@ -5,12 +5,14 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <pwd.h>
 #include <stdlib.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "lookupcache.h"
 #include "lua_pwd.h"
 #include "utils.h"
 
@@ -52,12 +54,19 @@ l_getpwnam(lua_State *L)
 {
 	struct passwd pwd;
 	struct passwd *result;
+	struct lookupcache *cache;
 	const char *name;
 	char *buffer;
 	size_t bufsize;
-	int error;
+	int key, n, error;
 
 	name = luaL_checkstring(L, 1);
+	cache = optlookupcache(L, 2);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "pwnam:%s", name);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = PWD_INITIAL_BUFSIZE;
 retry:
@@ -74,10 +83,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushpasswd(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -86,12 +97,20 @@ l_getpwuid(lua_State *L)
 {
 	struct passwd pwd;
 	struct passwd *result;
+	struct lookupcache *cache;
 	char *buffer;
 	size_t bufsize;
 	uid_t uid;
-	int error;
+	int key, n, error;
 
 	uid = luaL_checkinteger(L, 1);
+	cache = optlookupcache(L, 2);
+
+	n = lookupcache_lookup(L, cache, &key, &error, "pwuid:%I",
+	    (lua_Integer)uid);
+	if (n != -1) {
+		return (n);
+	}
 
 	bufsize = PWD_INITIAL_BUFSIZE;
 retry:
@@ -108,10 +127,12 @@ retry:
 	}
 	if (result == NULL) {
 		free(buffer);
+		lookupcache_put_negative(L, cache, key, 0);
 		return (0);
 	}
 	pushpasswd(L, result);
 	free(buffer);
+	lookupcache_put(L, cache, key);
 	return (1);
 }
 
@@ -141,7 +162,94 @@ l_endpwent(lua_State *L __unused)
 	return (0);
 }
 
+/*
+ * Read the whole database in one pass, indexed by name and by uid.  The first
+ * entry wins where names or uids are duplicated, as for getpwnam and getpwuid.
+ * The buffer is a userdata so it is not lost if the filter raises an error,
+ * which is rethrown after closing the database.
+ */
+static int
+l_pwd_load(lua_State *L)
+{
+	struct passwd pwd;
+	struct passwd *result;
+	char *buffer;
+	size_t bufsize;
+	int error;
+	bool filter;
+
+	filter = !lua_isnoneornil(L, 1);
+	if (filter) {
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+	}
+
+	lua_settop(L, 1);
+	lua_newtable(L); /* result */
+	lua_newtable(L); /* byname */
+	lua_newtable(L); /* byuid */
+	bufsize = PWD_INITIAL_BUFSIZE;
+	buffer = lua_newuserdatauv(L, bufsize, 0);
+	setpwent();
+	for (;;) {
+		error = getpwent_r(&pwd, buffer, bufsize, &result);
+		if (error == ERANGE) {
+			lua_pop(L, 1);
+			bufsize *= 2;
+			buffer = lua_newuserdatauv(L, bufsize, 0);
+			continue;
+		}
+		if (error != 0) {
+			endpwent();
+			return (fail(L, error));
+		}
+		if (result == NULL) {
+			break;
+		}
+		pushpasswd(L, result);
+		if (filter) {
+			bool keep;
+
+			lua_pushvalue(L, 1);
+			lua_pushvalue(L, -2);
+			if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+				endpwent();
+				return (lua_error(L));
+			}
+			keep = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			if (!keep) {
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		if (lua_getfield(L, 3, result->pw_name) == LUA_TNIL) {
+			lua_pushvalue(L, -2);
+			lua_setfield(L, 3, result->pw_name);
+		}
+		lua_pop(L, 1);
+		if (lua_rawgeti(L, 4, result->pw_uid) == LUA_TNIL) {
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, 4, result->pw_uid);
+		}
+		lua_pop(L, 1);
+		lua_pop(L, 1);
+	}
+	endpwent();
+	lua_pop(L, 1);
+	lua_setfield(L, 2, "byuid");
+	lua_setfield(L, 2, "byname");
+	return (1);
+}
+
+static int
+l_pwd_cache(lua_State *L)
+{
+	return (lookupcache_new(L, 1));
+}
+
 static const struct luaL_Reg l_pwd_funcs[] = {
+	{"cache", l_pwd_cache},
+	{"load", l_pwd_load},
 	{"getpwent", l_getpwent},
 	{"getpwnam", l_getpwnam},
 	{"getpwuid", l_getpwuid},
@@ -154,6 +262,8 @@ static const struct luaL_Reg l_pwd_funcs[] = {
 int
 luaopen_pwd(lua_State *L)
 {
+	lookupcache_register(L);
+
 	luaL_newlib(L, l_pwd_funcs);
 	return (1);
 }
@@ -3,3 +3,26 @@ local ucl = require('ucl')
 
 local root = assert(pwd.getpwuid(0))
 print(ucl.to_json(root))
+
+local cache <close> = pwd.cache({size=2})
+local cached = assert(pwd.getpwuid(0, cache))
+cached.name = 'changed'
+assert(pwd.getpwuid(0, cache).name == root.name)
+assert(pwd.getpwnam(root.name, cache).uid == 0)
+assert(not pwd.getpwnam('nonexistent user', cache))
+assert(not pwd.getpwnam('nonexistent user', cache))
+local stats = cache:stats()
+assert(stats.hits == 2 and stats.misses == 3)
+assert(stats.count == 2 and stats.evictions == 1)
+cache:flush()
+assert(cache:stats().count == 0)
+
+local db = assert(pwd.load())
+assert(db.byuid[0].name == root.name)
+assert(db.byname[root.name] == db.byuid[0])
+db = assert(pwd.load(function(passwd) return passwd.uid == 0 end))
+assert(db.byname[root.name] and next(db.byuid, next(db.byuid)) == nil)
+local first = assert(pwd.getpwent())
+assert(not pcall(pwd.load, function() error('stop') end))
+assert(pwd.getpwent().name == first.name)
+pwd.endpwent()
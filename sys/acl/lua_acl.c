@@ -8,13 +8,16 @@
 #include <sys/acl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "luaerror.h"
+#include "parallel.h"
 #include "utils.h"
 
 _Static_assert(sizeof(uid_t) == sizeof(gid_t), "fatal uid_t/gid_t");
@@ -220,6 +223,123 @@ l_acl_get_link(lua_State *L)
 	return (new(L, acl, ACL_METATABLE));
 }
 
+struct aclbatch {
+	int dirfd;
+	int oflags;
+	acl_type_t type;
+	bool text;
+	int textflags;
+	const char **names;
+	acl_t *acls;
+	char **texts;
+	ssize_t *lens;
+	int *errors;
+};
+
+static void
+aclbatch_one(void *arg, size_t i)
+{
+	struct aclbatch *b = arg;
+	acl_t acl;
+	int fd;
+
+	b->acls[i] = NULL;
+	b->texts[i] = NULL;
+	if ((fd = openat(b->dirfd, b->names[i], b->oflags)) == -1) {
+		b->errors[i] = errno;
+		return;
+	}
+	if ((acl = acl_get_fd_np(fd, b->type)) == NULL) {
+		b->errors[i] = errno;
+		close(fd);
+		return;
+	}
+	close(fd);
+	b->errors[i] = 0;
+	if (!b->text) {
+		b->acls[i] = acl;
+		return;
+	}
+	if ((b->texts[i] = acl_to_text_np(acl, &b->lens[i], b->textflags))
+	    == NULL) {
+		b->errors[i] = errno;
+	}
+	acl_free(acl);
+}
+
+static int
+l_acl_get_batch(lua_State *L)
+{
+	struct aclbatch b;
+	size_t n;
+	int nthreads, flag;
+
+	b.dirfd = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	b.type = luaL_optinteger(L, 3, ACL_TYPE_ACCESS);
+	b.text = false;
+	b.textflags = 0;
+	nthreads = 1;
+	flag = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_getfield(L, 4, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, nthreads > 0, 4, "invalid threads");
+		}
+		if (lua_getfield(L, 4, "flag") != LUA_TNIL) {
+			flag = luaL_checkinteger(L, -1);
+		}
+		switch (lua_getfield(L, 4, "text")) {
+		case LUA_TNIL:
+			break;
+		case LUA_TBOOLEAN:
+			b.text = lua_toboolean(L, -1);
+			break;
+		default:
+			b.text = true;
+			b.textflags = luaL_checkinteger(L, -1);
+			break;
+		}
+		lua_pop(L, 3);
+	}
+	/* Only a reference to the file is needed, not read access. */
+	b.oflags = O_PATH | O_CLOEXEC;
+	if ((flag & AT_SYMLINK_NOFOLLOW) != 0) {
+		b.oflags |= O_NOFOLLOW;
+	}
+	lua_settop(L, 4);
+
+	b.names = checkstringarray(L, 2, &n);
+	b.acls = lua_newuserdatauv(L, n * sizeof(*b.acls), 0);
+	b.texts = lua_newuserdatauv(L, n * sizeof(*b.texts), 0);
+	b.lens = lua_newuserdatauv(L, n * sizeof(*b.lens), 0);
+	b.errors = lua_newuserdatauv(L, n * sizeof(*b.errors), 0);
+	parallel_for(nthreads, n, aclbatch_one, &b);
+
+	lua_createtable(L, 0, 2);
+	lua_createtable(L, n, 0);
+	for (size_t i = 0; i < n; i++) {
+		if (b.acls[i] != NULL) {
+			new(L, b.acls[i], ACL_METATABLE);
+		} else if (b.texts[i] != NULL) {
+			lua_pushlstring(L, b.texts[i], b.lens[i]);
+			acl_free(b.texts[i]);
+		} else {
+			lua_pushboolean(L, false);
+		}
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "acl");
+	lua_createtable(L, n, 0);
+	for (size_t i = 0; i < n; i++) {
+		lua_pushinteger(L, b.errors[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "errno");
+	return (1);
+}
+
 static int
 l_acl_new(lua_State *L)
 {
@@ -896,6 +1016,7 @@ static const struct luaL_Reg l_acl_funcs[] = {
 	{"get_fd", l_acl_get_fd},
 	{"get_file", l_acl_get_file},
 	{"get_link", l_acl_get_link},
+	{"get_batch", l_acl_get_batch},
 	{"new", l_acl_new},
 	{NULL, NULL}
 };
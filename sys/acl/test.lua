@@ -2,3 +2,14 @@ local ACL = require('sys.acl')
 
 local mode = tonumber("755", 8) -- octal 755
 print(ACL.from_mode(mode):to_text())
+
+local fcntl = require('fcntl')
+-- ZFS has NFSv4 ACLs, UFS has POSIX.1e ACLs.
+local acltype = ACL.get_file('/COPYRIGHT', ACL.TYPE_NFS4) and ACL.TYPE_NFS4 or
+    ACL.TYPE_ACCESS
+local batch = ACL.get_batch(fcntl.AT_FDCWD, {'/COPYRIGHT', '/nonexistent'},
+    acltype, {threads=2, text=true})
+assert(type(batch.acl[1]) == 'string')
+assert(batch.errno[1] == 0)
+assert(batch.acl[2] == false)
+assert(batch.errno[2] ~= 0)
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2025 Ryan Moeller
+ * Copyright (c) 2025-2026 Ryan Moeller
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
@@ -7,13 +7,16 @@
 #include <sys/param.h>
 #include <sys/extattr.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libutil.h> /* XXX: prototypes for functions not actually in libutil */
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "parallel.h"
 #include "utils.h"
 
 int luaopen_sys_extattr(lua_State *);
@@ -504,6 +507,151 @@ l_extattr_string_to_namespace(lua_State *L)
 	return (1);
 }
 
+/*
+ * Batch variants: open each name with O_PATH relative to a directory fd and
+ * get or list its attributes, optionally on several threads.  Results come
+ * back as columns with per-entry errno values instead of raising.
+ */
+
+struct xattrbatch {
+	int dirfd;
+	int oflags;
+	int attrnamespace;
+	const char *attrname;	/* NULL to list */
+	const char **names;
+	char **data;
+	ssize_t *lens;
+	int *errors;
+};
+
+static void
+xattrbatch_one(void *arg, size_t i)
+{
+	struct xattrbatch *b = arg;
+	char *data;
+	ssize_t len, datalen;
+	int fd;
+
+	b->data[i] = NULL;
+	b->lens[i] = 0;
+	if ((fd = openat(b->dirfd, b->names[i], b->oflags)) == -1) {
+		b->errors[i] = errno;
+		return;
+	}
+	data = NULL;
+	datalen = 0;
+	for (;;) {
+		if (b->attrname != NULL) {
+			len = extattr_get_fd(fd, b->attrnamespace,
+			    b->attrname, data, datalen);
+		} else {
+			len = extattr_list_fd(fd, b->attrnamespace, data,
+			    datalen);
+		}
+		if (len == -1) {
+			b->errors[i] = errno;
+			free(data);
+			close(fd);
+			return;
+		}
+		if (data != NULL && len <= datalen) {
+			break;
+		}
+		free(data);
+		datalen = len * 2 + 1;
+		if ((data = malloc(datalen)) == NULL) {
+			b->errors[i] = ENOMEM;
+			close(fd);
+			return;
+		}
+	}
+	close(fd);
+	b->data[i] = data;
+	b->lens[i] = len;
+	b->errors[i] = 0;
+}
+
+static int
+xattrbatch(lua_State *L, const char *attrname, int optidx)
+{
+	struct xattrbatch b;
+	size_t n;
+	int nthreads, flag;
+
+	b.dirfd = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	b.attrnamespace = luaL_checkinteger(L, 3);
+	b.attrname = attrname;
+	nthreads = 1;
+	flag = 0;
+	if (!lua_isnoneornil(L, optidx)) {
+		luaL_checktype(L, optidx, LUA_TTABLE);
+		if (lua_getfield(L, optidx, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, nthreads > 0, optidx,
+			    "invalid threads");
+		}
+		if (lua_getfield(L, optidx, "flag") != LUA_TNIL) {
+			flag = luaL_checkinteger(L, -1);
+		}
+		lua_pop(L, 2);
+	}
+	/*
+	 * O_PATH needs no read permission and has no side effects on devices
+	 * or FIFOs, and with O_NOFOLLOW it opens the link itself, like the
+	 * *_link path variants.
+	 */
+	b.oflags = O_PATH | O_CLOEXEC;
+	if ((flag & AT_SYMLINK_NOFOLLOW) != 0) {
+		b.oflags |= O_NOFOLLOW;
+	}
+	lua_settop(L, optidx);
+
+	b.names = checkstringarray(L, 2, &n);
+	b.data = lua_newuserdatauv(L, n * sizeof(*b.data), 0);
+	b.lens = lua_newuserdatauv(L, n * sizeof(*b.lens), 0);
+	b.errors = lua_newuserdatauv(L, n * sizeof(*b.errors), 0);
+	parallel_for(nthreads, n, xattrbatch_one, &b);
+
+	lua_createtable(L, 0, 2);
+	lua_createtable(L, n, 0);
+	for (size_t i = 0; i < n; i++) {
+		if (b.data[i] == NULL) {
+			lua_pushboolean(L, false);
+		} else if (attrname != NULL) {
+			lua_pushlstring(L, b.data[i], b.lens[i]);
+		} else {
+			pushlist(L, b.data[i], b.data[i] + b.lens[i]);
+		}
+		free(b.data[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, attrname != NULL ? "value" : "names");
+	lua_createtable(L, n, 0);
+	for (size_t i = 0; i < n; i++) {
+		lua_pushinteger(L, b.errors[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "errno");
+	return (1);
+}
+
+static int
+l_extattr_get_batch(lua_State *L)
+{
+	const char *attrname;
+
+	attrname = luaL_checkstring(L, 4);
+
+	return (xattrbatch(L, attrname, 5));
+}
+
+static int
+l_extattr_list_batch(lua_State *L)
+{
+	return (xattrbatch(L, NULL, 4));
+}
+
 static const struct luaL_Reg l_extattr_funcs[] = {
 	{"delete", l_extattr_delete},
 	{"delete_fd", l_extattr_delete_fd},
@@ -513,10 +661,12 @@ static const struct luaL_Reg l_extattr_funcs[] = {
 	{"get_fd", l_extattr_get_fd},
 	{"get_file", l_extattr_get_file},
 	{"get_link", l_extattr_get_link},
+	{"get_batch", l_extattr_get_batch},
 	{"list", l_extattr_list},
 	{"list_fd", l_extattr_list_fd},
 	{"list_file", l_extattr_list_file},
 	{"list_link", l_extattr_list_link},
+	{"list_batch", l_extattr_list_batch},
 	{"set", l_extattr_set},
 	{"set_fd", l_extattr_set_fd},
 	{"set_file", l_extattr_set_file},
@@ -12,3 +12,16 @@ assert(names[1] == name)
 local v = assert(extattr.get(f, ns, name))
 assert(v == value)
 assert(extattr.delete(f, ns, name))
+
+local fcntl = require('fcntl')
+local path = os.tmpname()
+assert(extattr.set_file(path, ns, name, value))
+local batch = extattr.get_batch(fcntl.AT_FDCWD, {path, path .. '.missing'},
+    ns, name, {threads=2})
+assert(batch.value[1] == value)
+assert(batch.errno[1] == 0)
+assert(batch.value[2] == false)
+assert(batch.errno[2] ~= 0)
+batch = extattr.list_batch(fcntl.AT_FDCWD, {path}, ns)
+assert(batch.names[1][1] == name)
+os.remove(path)
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2025 Ryan Moeller
+ * Copyright (c) 2025-2026 Ryan Moeller
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
@@ -11,11 +11,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "lua_stat.h"
+#include "parallel.h"
 #include "utils.h"
 
 int luaopen_sys_stat(lua_State *);
@@ -86,7 +88,7 @@ l_chflagsat(lua_State *L)
 static int
 l_stat(lua_State *L)
 {
-	struct stat sb;
+	struct stat sb, *sbp;
 	const char *path;
 
 	path = luaL_checkstring(L, 1);
@@ -94,14 +96,19 @@ l_stat(lua_State *L)
 	if (stat(path, &sb) == -1) {
 		return (fail(L, errno));
 	}
-	pushstat(L, &sb);
+	if (lua_toboolean(L, 2)) {
+		sbp = newanonstat(L);
+		*sbp = sb;
+	} else {
+		pushstat(L, &sb);
+	}
 	return (1);
 }
 
 static int
 l_lstat(lua_State *L)
 {
-	struct stat sb;
+	struct stat sb, *sbp;
 	const char *path;
 
 	path = luaL_checkstring(L, 1);
@@ -109,14 +116,19 @@ l_lstat(lua_State *L)
 	if (lstat(path, &sb) == -1) {
 		return (fail(L, errno));
 	}
-	pushstat(L, &sb);
+	if (lua_toboolean(L, 2)) {
+		sbp = newanonstat(L);
+		*sbp = sb;
+	} else {
+		pushstat(L, &sb);
+	}
 	return (1);
 }
 
 static int
 l_fstat(lua_State *L)
 {
-	struct stat sb;
+	struct stat sb, *sbp;
 	int fd;
 
 	fd = checkfd(L, 1);
@@ -124,14 +136,19 @@ l_fstat(lua_State *L)
 	if (fstat(fd, &sb) == -1) {
 		return (fail(L, errno));
 	}
-	pushstat(L, &sb);
+	if (lua_toboolean(L, 2)) {
+		sbp = newanonstat(L);
+		*sbp = sb;
+	} else {
+		pushstat(L, &sb);
+	}
 	return (1);
 }
 
 static int
 l_fstatat(lua_State *L)
 {
-	struct stat sb;
+	struct stat sb, *sbp;
 	const char *path;
 	int fd, flag;
 
@@ -142,7 +159,191 @@ l_fstatat(lua_State *L)
 	if (fstatat(fd, path, &sb, flag) == -1) {
 		return (fail(L, errno));
 	}
-	pushstat(L, &sb);
+	if (lua_toboolean(L, 4)) {
+		sbp = newanonstat(L);
+		*sbp = sb;
+	} else {
+		pushstat(L, &sb);
+	}
+	return (1);
+}
+
+/*
+ * Columnar batch fstatat: one column per requested field, plus errno.
+ */
+
+#define STAT_INTFIELDS(X) \
+	X(dev) \
+	X(ino) \
+	X(nlink) \
+	X(mode) \
+	X(uid) \
+	X(gid) \
+	X(rdev) \
+	X(size) \
+	X(blocks) \
+	X(blksize) \
+	X(flags) \
+	X(gen)
+
+#define STAT_TIMEFIELDS(X) \
+	X(atim) \
+	X(mtim) \
+	X(ctim) \
+	X(birthtim)
+
+enum statfield {
+#define X(name) STF_##name,
+	STAT_INTFIELDS(X)
+#undef X
+#ifdef SFBSD_NAMEDATTR
+	STF_bsdflags,
+#endif
+#if __FreeBSD_version > 1402501
+	STF_filerev,
+#endif
+#define X(name) STF_##name, STF_##name##_nsec,
+	STAT_TIMEFIELDS(X)
+#undef X
+	STF_MAX
+};
+
+static const char *const statfields[] = {
+#define X(name) #name,
+	STAT_INTFIELDS(X)
+#undef X
+#ifdef SFBSD_NAMEDATTR
+	"bsdflags",
+#endif
+#if __FreeBSD_version > 1402501
+	"filerev",
+#endif
+#define X(name) #name, #name "_nsec",
+	STAT_TIMEFIELDS(X)
+#undef X
+	NULL
+};
+
+static void
+pushstatfield(lua_State *L, const struct stat *sb, enum statfield field)
+{
+	switch (field) {
+#define X(name) \
+	case STF_##name: \
+		lua_pushinteger(L, sb->st_##name); \
+		break;
+	STAT_INTFIELDS(X)
+#undef X
+#ifdef SFBSD_NAMEDATTR
+	case STF_bsdflags:
+		lua_pushinteger(L, sb->st_bsdflags);
+		break;
+#endif
+#if __FreeBSD_version > 1402501
+	case STF_filerev:
+		lua_pushinteger(L, sb->st_filerev);
+		break;
+#endif
+#define X(name) \
+	case STF_##name: \
+		lua_pushinteger(L, sb->st_##name.tv_sec); \
+		break; \
+	case STF_##name##_nsec: \
+		lua_pushinteger(L, sb->st_##name.tv_nsec); \
+		break;
+	STAT_TIMEFIELDS(X)
+#undef X
+	default:
+		__unreachable();
+	}
+}
+
+struct statbatch {
+	int fd;
+	int flag;
+	const char **names;
+	struct stat *sbs;
+	int *errors;
+};
+
+static void
+statbatch_one(void *arg, size_t i)
+{
+	struct statbatch *b = arg;
+
+	if (fstatat(b->fd, b->names[i], &b->sbs[i], b->flag) == -1) {
+		b->errors[i] = errno;
+	} else {
+		b->errors[i] = 0;
+	}
+}
+
+static int
+l_fstatat_batch(lua_State *L)
+{
+	enum statfield fields[STF_MAX];
+	struct statbatch b;
+	size_t n;
+	int nfields, nthreads, resultidx;
+
+	b.fd = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	b.flag = luaL_optinteger(L, 3, 0);
+	nthreads = 1;
+	nfields = 0;
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		if (lua_getfield(L, 4, "threads") != LUA_TNIL) {
+			nthreads = luaL_checkinteger(L, -1);
+			luaL_argcheck(L, nthreads > 0, 4, "invalid threads");
+		}
+		lua_pop(L, 1);
+		if (lua_getfield(L, 4, "fields") != LUA_TNIL) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			for (int i = 1; lua_rawgeti(L, -1, i) != LUA_TNIL;
+			    i++) {
+				luaL_argcheck(L, nfields < STF_MAX, 4,
+				    "too many fields");
+				fields[nfields++] = luaL_checkoption(L, -1,
+				    NULL, statfields);
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	if (nfields == 0) {
+		for (; nfields < STF_MAX; nfields++) {
+			fields[nfields] = nfields;
+		}
+	}
+	lua_settop(L, 4);
+
+	b.names = checkstringarray(L, 2, &n);
+	b.sbs = lua_newuserdatauv(L, n * sizeof(*b.sbs), 0);
+	b.errors = lua_newuserdatauv(L, n * sizeof(*b.errors), 0);
+	parallel_for(nthreads, n, statbatch_one, &b);
+
+	lua_createtable(L, 0, nfields + 1);
+	resultidx = lua_gettop(L);
+	lua_createtable(L, n, 0);
+	for (size_t i = 0; i < n; i++) {
+		lua_pushinteger(L, b.errors[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, resultidx, "errno");
+	for (int f = 0; f < nfields; f++) {
+		lua_createtable(L, n, 0);
+		for (size_t i = 0; i < n; i++) {
+			if (b.errors[i] == 0) {
+				pushstatfield(L, &b.sbs[i], fields[f]);
+			} else {
+				lua_pushboolean(L, false);
+			}
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, resultidx, statfields[fields[f]]);
+	}
 	return (1);
 }
 
@@ -172,6 +373,88 @@ S_TYPES(S_TYPE)
 
 #undef S_TYPE
 
+static int
+l_stat_index(lua_State *L)
+{
+	struct stat *sb;
+	const char *key;
+
+	sb = luaL_checkudata(L, 1, STAT_METATABLE);
+	key = luaL_checkstring(L, 2);
+
+	if (lua_getfield(L, lua_upvalueindex(1), key) != LUA_TNIL) {
+		return (1);
+	}
+#define INTFIELD(name) ({ \
+	if (strcmp(key, #name) == 0) { \
+		lua_pushinteger(L, sb->st_##name); \
+		return (1); \
+	} \
+})
+	INTFIELD(size);
+	INTFIELD(mode);
+	INTFIELD(ino);
+	INTFIELD(dev);
+	INTFIELD(nlink);
+#ifdef SFBSD_NAMEDATTR
+	INTFIELD(bsdflags);
+#endif
+	INTFIELD(uid);
+	INTFIELD(gid);
+	INTFIELD(rdev);
+	INTFIELD(blocks);
+	INTFIELD(blksize);
+	INTFIELD(flags);
+	INTFIELD(gen);
+#if __FreeBSD_version > 1402501
+	INTFIELD(filerev);
+#endif
+#undef INTFIELD
+#define TIMEFIELD(name) ({ \
+	if (strcmp(key, #name) == 0) { \
+		lua_createtable(L, 0, 2); \
+		lua_pushinteger(L, sb->st_##name.tv_sec); \
+		lua_setfield(L, -2, "sec"); \
+		lua_pushinteger(L, sb->st_##name.tv_nsec); \
+		lua_setfield(L, -2, "nsec"); \
+		return (1); \
+	} \
+})
+	TIMEFIELD(mtim);
+	TIMEFIELD(atim);
+	TIMEFIELD(ctim);
+	TIMEFIELD(birthtim);
+#undef TIMEFIELD
+	return (0);
+}
+
+static int
+l_stat_totable(lua_State *L)
+{
+	struct stat *sb;
+
+	sb = luaL_checkudata(L, 1, STAT_METATABLE);
+
+	pushstat(L, sb);
+	return (1);
+}
+
+#define S_TYPE(l, U) \
+static int \
+l_stat_is##l(lua_State *L) \
+{ \
+	struct stat *sb; \
+\
+	sb = luaL_checkudata(L, 1, STAT_METATABLE); \
+\
+	lua_pushboolean(L, S_IS##U(sb->st_mode)); \
+	return (1); \
+}
+
+S_TYPES(S_TYPE)
+
+#undef S_TYPE
+
 static const struct luaL_Reg l_stat_funcs[] = {
 	{"chflags", l_chflags},
 	{"lchflags", l_lchflags},
@@ -181,15 +464,30 @@ static const struct luaL_Reg l_stat_funcs[] = {
 	{"lstat", l_lstat},
 	{"fstat", l_fstat},
 	{"fstatat", l_fstatat},
+	{"fstatat_batch", l_fstatat_batch},
 #define S_TYPE(l, U) {"is"#l, l_s_is##l},
 	S_TYPES(S_TYPE)
 #undef S_TYPE
 	{NULL, NULL}
 };
 
+static const struct luaL_Reg l_stat_methods[] = {
+	{"totable", l_stat_totable},
+#define S_TYPE(l, U) {"is"#l, l_stat_is##l},
+	S_TYPES(S_TYPE)
+#undef S_TYPE
+	{NULL, NULL}
+};
+
 int
 luaopen_sys_stat(lua_State *L)
 {
+	luaL_newmetatable(L, STAT_METATABLE);
+	luaL_newlib(L, l_stat_methods);
+	lua_pushcclosure(L, l_stat_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	luaL_newlib(L, l_stat_funcs);
 #define DEFINE(ident) ({ \
 	lua_pushinteger(L, ident); \
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2025 Ryan Moeller
+ * Copyright (c) 2025-2026 Ryan Moeller
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
@@ -10,6 +10,9 @@
 #include <sys/stat.h>
 
 #include <lua.h>
+#include <lauxlib.h>
+
+#define STAT_METATABLE "struct stat"
 
 static inline void
 pushstat(lua_State *L, struct stat *sb)
@@ -52,3 +55,17 @@ pushstat(lua_State *L, struct stat *sb)
 	TIMEFIELD(birthtim);
 #undef TIMEFIELD
 }
+
+/*
+ * A struct stat wrapped in a single userdata.  Fields are converted on access
+ * (see sys.stat).
+ */
+static inline struct stat *
+newanonstat(lua_State *L)
+{
+	struct stat *sb;
+
+	sb = lua_newuserdatauv(L, sizeof(*sb), 0);
+	luaL_setmetatable(L, STAT_METATABLE);
+	return (sb);
+}
@@ -3,3 +3,19 @@ local stat = require('sys.stat')
 local st = assert(stat.stat('/COPYRIGHT'))
 assert(stat.chflags('/COPYRIGHT', stat.UF_ARCHIVE))
 print(assert(stat.chflags.fflagstostr(st.flags)))
+
+local lst = assert(stat.stat('/COPYRIGHT', true))
+assert(lst:isreg() and not lst:isdir())
+assert(lst.size == st.size)
+assert(lst.mtim.sec == st.mtim.sec)
+assert(lst:totable().ino == st.ino)
+
+local fcntl = require('fcntl')
+local batch = stat.fstatat_batch(fcntl.AT_FDCWD, {'/COPYRIGHT', '/nonexistent'},
+    0, {threads=2, fields={'size', 'mtim'}})
+assert(batch.errno[1] == 0)
+assert(batch.size[1] == st.size)
+assert(batch.mtim[1] == st.mtim.sec)
+assert(batch.errno[2] ~= 0)
+assert(batch.size[2] == false)
+assert(batch.ino == nil)
@@ -176,6 +176,32 @@ checkfd(lua_State *L, int idx)
 	return (fd);
 }
 
+/*
+ * Collect the strings in the array at idx.  The returned array is a userdata
+ * left on top of the stack, and the strings stay valid as long as the table
+ * isn't modified.
+ */
+static inline const char **
+checkstringarray(lua_State *L, int idx, size_t *np)
+{
+	const char **strs;
+	size_t n;
+
+	idx = lua_absindex(L, idx);
+	luaL_checktype(L, idx, LUA_TTABLE);
+	n = luaL_len(L, idx);
+	strs = lua_newuserdatauv(L, n * sizeof(*strs), 0);
+	for (size_t i = 0; i < n; i++) {
+		if (lua_rawgeti(L, idx, i + 1) != LUA_TSTRING) {
+			luaL_argerror(L, idx, "expected an array of strings");
+		}
+		strs[i] = lua_tostring(L, -1);
+		lua_pop(L, 1);
+	}
+	*np = n;
+	return (strs);
+}
+
 static inline void
 tpush(lua_State *L, int idx)
 {